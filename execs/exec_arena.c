@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2026 ldbox contributors.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Exec subsystem: Memory for the exec preparations.
+ *
+ * The preparations (environment setup, preprocessing, mapping,
+ * hashbang handling and postprocessing) build the new file, argv[]
+ * and envp[] from many small strings and vectors, which refer to
+ * each other and to the caller's vectors. Instead of tracking who
+ * owns what, everything is allocated from an arena that belongs to
+ * one exec or posix_spawn() call: The arena is made current for the
+ * thread with exec_arena_begin(), the exec_arena_*() allocators take
+ * memory from the current arena, and exec_arena_free() releases all
+ * of it at once. Memory from the arena is never released with free().
+ *
+ * execve() makes the arena disappear; it is freed if execve() returns.
+ * posix_spawn() frees it after the child has been started.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <mapping.h>
+#include <lb.h>
+#include "liblb.h"
+
+#include "lb_execs.h"
+
+#define EXEC_ARENA_CHUNK_SIZE	8192
+#define EXEC_ARENA_ALIGN	(sizeof(void *) > sizeof(double) ? \
+					sizeof(void *) : sizeof(double))
+
+typedef struct exec_arena_chunk_s {
+	struct exec_arena_chunk_s *eac_next;
+	size_t	eac_size;	/* size of data */
+	size_t	eac_used;
+	/* data follows */
+} exec_arena_chunk_t;
+
+struct exec_arena_s {
+	exec_arena_chunk_t	*ea_chunks;	/* newest first */
+};
+
+#define EXEC_ARENA_CHUNK_HDR_SIZE \
+	((sizeof(exec_arena_chunk_t) + EXEC_ARENA_ALIGN - 1) & \
+	 ~(EXEC_ARENA_ALIGN - 1))
+
+#define EXEC_ARENA_CHUNK_DATA(chunk) \
+	((char *)(chunk) + EXEC_ARENA_CHUNK_HDR_SIZE)
+
+/* Create an arena and make it current for this thread. Returns NULL
+ * if out of memory. */
+exec_arena_t *exec_arena_begin(void)
+{
+	exec_arena_t		*arena;
+	struct lbcontext	*lbctx;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena) return(NULL);
+	lbctx = get_lbcontext();
+	lbctx->exec_arena = arena;
+	release_lbcontext(lbctx);
+	return(arena);
+}
+
+/* The arena is not current anymore; the memory stays valid until
+ * the arena is freed. */
+void exec_arena_end(exec_arena_t *arena)
+{
+	struct lbcontext	*lbctx;
+
+	if (!arena) return;
+	lbctx = get_lbcontext();
+	if (lbctx->exec_arena == arena) lbctx->exec_arena = NULL;
+	release_lbcontext(lbctx);
+}
+
+void exec_arena_free(exec_arena_t *arena)
+{
+	exec_arena_chunk_t	*chunk;
+
+	if (!arena) return;
+	exec_arena_end(arena);
+	while ((chunk = arena->ea_chunks) != NULL) {
+		arena->ea_chunks = chunk->eac_next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/* Allocate zero-filled memory from the current arena. */
+void *exec_arena_alloc(size_t size)
+{
+	struct lbcontext	*lbctx;
+	exec_arena_t		*arena;
+	exec_arena_chunk_t	*chunk;
+	char			*ptr;
+
+	lbctx = get_lbcontext();
+	arena = lbctx->exec_arena;
+	release_lbcontext(lbctx);
+	if (!arena) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"%s: no exec arena (%u bytes)", __func__, (unsigned)size);
+		return(NULL);
+	}
+
+	size = (size + EXEC_ARENA_ALIGN - 1) & ~(EXEC_ARENA_ALIGN - 1);
+	chunk = arena->ea_chunks;
+	if (!chunk || (chunk->eac_size - chunk->eac_used < size)) {
+		size_t	data_size = (size > EXEC_ARENA_CHUNK_SIZE ?
+				size : EXEC_ARENA_CHUNK_SIZE);
+
+		chunk = malloc(EXEC_ARENA_CHUNK_HDR_SIZE + data_size);
+		if (!chunk) return(NULL);
+		chunk->eac_size = data_size;
+		chunk->eac_used = 0;
+		if (arena->ea_chunks && (size == data_size)) {
+			/* a big block: keep using the current chunk */
+			chunk->eac_next = arena->ea_chunks->eac_next;
+			arena->ea_chunks->eac_next = chunk;
+		} else {
+			chunk->eac_next = arena->ea_chunks;
+			arena->ea_chunks = chunk;
+		}
+	}
+	ptr = EXEC_ARENA_CHUNK_DATA(chunk) + chunk->eac_used;
+	chunk->eac_used += size;
+	memset(ptr, 0, size);
+	return(ptr);
+}
+
+char *exec_arena_strdup(const char *s)
+{
+	size_t	len = strlen(s) + 1;
+	char	*cp = exec_arena_alloc(len);
+
+	if (cp) memcpy(cp, s, len);
+	return(cp);
+}
+
+char *exec_arena_asprintf(const char *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+	char	*cp;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0) return(NULL);
+
+	cp = exec_arena_alloc(len + 1);
+	if (!cp) return(NULL);
+	va_start(ap, fmt);
+	vsnprintf(cp, len + 1, fmt, ap);
+	va_end(ap);
+	return(cp);
+}
+
+/* Move a malloc'ed string to the current arena. */
+char *exec_arena_take(char *s)
+{
+	char	*cp;
+
+	if (!s) return(NULL);
+	cp = exec_arena_strdup(s);
+	free(s);
+	return(cp);
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2026 ldbox contributors.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Exec subsystem: Session-wide cache for results of inspect_binary().
+ *
+ * Every exec inspects the file to be executed: Is it a script, a host
+ * binary (static or dynamic, with or without capabilities) or a target
+ * binary? That takes open, fstat, mmap, reading the ELF headers and
+ * fgetxattr, and scripts are read again by prepare_hashbang(). A build
+ * executes the same few programs (sh, gcc, cc1, as, ld, sed...) over
+ * and over, so the results are stored to a file in the session directory
+ * ("ExecCache.bin", created by lbrdbd), which is mmap'ed to every process
+ * of the session.
+ *
+ * Entries are keyed by (dev, ino, size, mtime, ctime) of the file, so
+ * a file which has been replaced or modified (including changes to the
+ * capabilities, which update ctime) is inspected again. An entry
+ * contains the binary type, the ELF machine and byte order, the
+ * capability flag, PT_INTERP of dynamic host binaries and the
+ * "#!" line of scripts.
+ *
+ * The slots are protected by sequence counters, in the same way as
+ * in the shared path cache (pathmapping/paths_shared_cache.c): Writers
+ * make the counter odd with compare-and-swap, readers accept a copy
+ * only if the counter was even and did not change.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <mapping.h>
+#include <lb.h>
+#include "liblb.h"
+#include "exported.h"
+
+#include "lb_execs.h"
+
+#define EXEC_INSPECT_CACHE_FILE_NAME	"ExecCache.bin"
+
+#define EXEC_INSPECT_CACHE_MAGIC	0x4345424CU	/* "LBEC" */
+#define EXEC_INSPECT_CACHE_VERSION	1
+
+/* must be a power of two */
+#define EXEC_INSPECT_CACHE_NUM_SLOTS	4096
+
+#define EXEC_INSPECT_CACHE_MAX_PROBES	8
+
+/* size of the string area of a slot; the whole slot is 512 bytes */
+#define EXEC_INSPECT_CACHE_DATA_SIZE	440
+
+typedef struct exec_inspect_cache_hdr_s {
+	uint32_t		eich_magic;
+	uint32_t		eich_version;
+	uint32_t		eich_num_slots;
+	uint32_t		eich_slot_size;
+} exec_inspect_cache_hdr_t;
+
+typedef struct exec_inspect_cache_slot_s {
+	/* 0 = never used, odd = being written */
+	volatile uint32_t	eics_seq;
+
+	uint32_t	eics_hash;
+	uint64_t	eics_dev;
+	uint64_t	eics_ino;
+	uint64_t	eics_size;
+	int64_t		eics_mtime_sec;
+	int64_t		eics_ctime_sec;
+	uint32_t	eics_mtime_nsec;
+	uint32_t	eics_ctime_nsec;
+
+	uint16_t	eics_binary_type;
+	uint16_t	eics_machine;
+	uint8_t		eics_elf_data;
+	uint8_t		eics_has_capabilities;
+	/* length of PT_INTERP including the '\0' (0 = none),
+	 * length of the "#!" line (0 = not stored) */
+	uint16_t	eics_pt_interp_len;
+	uint16_t	eics_hashbang_len;
+	uint16_t	eics_reserved;
+
+	/* PT_INTERP and the "#!" line */
+	char		eics_data[EXEC_INSPECT_CACHE_DATA_SIZE];
+} exec_inspect_cache_slot_t;
+
+#define EXEC_INSPECT_CACHE_SLOTS_OFFS	4096
+#define EXEC_INSPECT_CACHE_FILE_SIZE	(EXEC_INSPECT_CACHE_SLOTS_OFFS + \
+	EXEC_INSPECT_CACHE_NUM_SLOTS * sizeof(exec_inspect_cache_slot_t))
+
+static exec_inspect_cache_hdr_t	*exec_inspect_cache_hdr = NULL;
+static exec_inspect_cache_slot_t *exec_inspect_cache_slots = NULL;
+static int			exec_inspect_cache_attach_failed = 0;
+
+static pthread_mutex_t	exec_inspect_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex is needed only while attaching.
+ * NO logging while the mutex is locked! */
+static void exec_inspect_cache_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&exec_inspect_cache_mutex);
+}
+static void exec_inspect_cache_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&exec_inspect_cache_mutex);
+}
+
+/* For the server: Create the cache file. Clients attach to it
+ * when they need it for the first time. */
+int create_exec_inspect_cache_file(const char *session_dir)
+{
+	char			*path = NULL;
+	int			fd;
+	exec_inspect_cache_hdr_t hdr;
+
+	if (!session_dir) return(-1);
+	if (asprintf(&path, "%s/%s", session_dir,
+	    EXEC_INSPECT_CACHE_FILE_NAME) < 0) return(-1);
+
+	fd = open_nomap_nolog(path, O_CLOEXEC | O_RDWR | O_CREAT,
+		S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to create %s", path);
+		free(path);
+		return(-1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.eich_magic = EXEC_INSPECT_CACHE_MAGIC;
+	hdr.eich_version = EXEC_INSPECT_CACHE_VERSION;
+	hdr.eich_num_slots = EXEC_INSPECT_CACHE_NUM_SLOTS;
+	hdr.eich_slot_size = sizeof(exec_inspect_cache_slot_t);
+
+	/* the file is sparse; slots are zero (=unused) until written */
+	if ((ftruncate(fd, EXEC_INSPECT_CACHE_FILE_SIZE) < 0) ||
+	    (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to initialize %s", path);
+		close(fd);
+		unlink(path);
+		free(path);
+		return(-1);
+	}
+	close(fd);
+	LB_LOG(LB_LOGLEVEL_DEBUG, "Created exec inspection cache %s", path);
+	free(path);
+	return(0);
+}
+
+/* For clients: returns 0 if the cache is available. */
+static int attach_exec_inspect_cache(void)
+{
+	char			*path = NULL;
+	int			fd;
+	void			*p;
+	exec_inspect_cache_hdr_t *hdr;
+
+	if (exec_inspect_cache_hdr) return(0);
+	if (exec_inspect_cache_attach_failed) return(-1);
+
+	/* set this first; attach is not retried */
+	exec_inspect_cache_attach_failed = 1;
+
+	if (!ldbox_session_dir) return(-1);
+	if (asprintf(&path, "%s/%s", ldbox_session_dir,
+	    EXEC_INSPECT_CACHE_FILE_NAME) < 0) return(-1);
+	fd = open_nomap_nolog(path, O_CLOEXEC | O_RDWR);
+	if (fd < 0) {
+		LB_LOG(LB_LOGLEVEL_DEBUG, "No exec inspection cache (%s)", path);
+		free(path);
+		return(-1);
+	}
+	p = mmap(NULL, EXEC_INSPECT_CACHE_FILE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to mmap() %s", path);
+		free(path);
+		return(-1);
+	}
+	hdr = (exec_inspect_cache_hdr_t*)p;
+	if ((hdr->eich_magic != EXEC_INSPECT_CACHE_MAGIC) ||
+	    (hdr->eich_version != EXEC_INSPECT_CACHE_VERSION) ||
+	    (hdr->eich_num_slots != EXEC_INSPECT_CACHE_NUM_SLOTS) ||
+	    (hdr->eich_slot_size != sizeof(exec_inspect_cache_slot_t))) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Faulty exec inspection cache %s", path);
+		munmap(p, EXEC_INSPECT_CACHE_FILE_SIZE);
+		free(path);
+		return(-1);
+	}
+	free(path);
+
+	exec_inspect_cache_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		if (!exec_inspect_cache_hdr) {
+			exec_inspect_cache_slots = (exec_inspect_cache_slot_t*)
+				((char*)p + EXEC_INSPECT_CACHE_SLOTS_OFFS);
+			/* the header pointer is used without
+			 * the mutex, set it last */
+			__sync_synchronize();
+			exec_inspect_cache_hdr = hdr;
+			p = NULL;
+		}
+		exec_inspect_cache_attach_failed = 0;
+	}
+	exec_inspect_cache_mutex_unlock();
+
+	/* another thread was faster? */
+	if (p) munmap(p, EXEC_INSPECT_CACHE_FILE_SIZE);
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "Exec inspection cache attached");
+	return(0);
+}
+
+static uint32_t exec_inspect_cache_hash(const struct stat *st)
+{
+	uint64_t	key[3];
+
+	key[0] = st->st_dev;
+	key[1] = st->st_ino;
+	key[2] = st->st_size;
+	return(lb_fnv1a32(LB_FNV1A32_INIT, key, sizeof(key)));
+}
+
+static int exec_inspect_cache_key_matches(
+	const exec_inspect_cache_slot_t *sp,
+	const struct stat *st,
+	uint32_t hash)
+{
+	return ((sp->eics_hash == hash) &&
+		(sp->eics_dev == (uint64_t)st->st_dev) &&
+		(sp->eics_ino == (uint64_t)st->st_ino) &&
+		(sp->eics_size == (uint64_t)st->st_size) &&
+		(sp->eics_mtime_sec == (int64_t)st->st_mtim.tv_sec) &&
+		(sp->eics_mtime_nsec == (uint32_t)st->st_mtim.tv_nsec) &&
+		(sp->eics_ctime_sec == (int64_t)st->st_ctim.tv_sec) &&
+		(sp->eics_ctime_nsec == (uint32_t)st->st_ctim.tv_nsec));
+}
+
+/* Take a consistent copy of a slot. Returns 0 if the slot
+ * is unused or being written. */
+static int exec_inspect_cache_read_slot(
+	const exec_inspect_cache_slot_t *sp,
+	exec_inspect_cache_slot_t *copy)
+{
+	uint32_t	seq = sp->eics_seq;
+
+	if ((seq == 0) || (seq & 1)) return(0);
+	__sync_synchronize();
+	memcpy(copy, (const void*)sp, sizeof(*copy));
+	__sync_synchronize();
+	if (sp->eics_seq != seq) return(0);
+
+	/* the copy is consistent, but check the lengths anyway.
+	 * the file is writable by all processes of the session. */
+	if ((size_t)copy->eics_pt_interp_len + copy->eics_hashbang_len >
+	    EXEC_INSPECT_CACHE_DATA_SIZE) return(0);
+	if (copy->eics_pt_interp_len &&
+	    (copy->eics_data[copy->eics_pt_interp_len - 1] != '\0'))
+		return(0);
+	return(1);
+}
+
+/* Returns 1 and fills *ce if the file described by 'st' (from stat(),
+ * not virtualized) has been inspected before, 0 otherwise.
+ * ce->eice_pt_interp and ce->eice_hashbang are allocated buffers. */
+int exec_inspect_cache_find(
+	const struct stat *st,
+	exec_inspect_cache_entry_t *ce)
+{
+	uint32_t	hash;
+	int		i;
+
+	if (attach_exec_inspect_cache() < 0) return(0);
+
+	hash = exec_inspect_cache_hash(st);
+	for (i = 0; i < EXEC_INSPECT_CACHE_MAX_PROBES; i++) {
+		const exec_inspect_cache_slot_t *sp = &exec_inspect_cache_slots[
+			(hash + i) & (EXEC_INSPECT_CACHE_NUM_SLOTS - 1)];
+		exec_inspect_cache_slot_t	copy;
+
+		if (sp->eics_seq == 0) break;
+		if (!exec_inspect_cache_read_slot(sp, &copy)) continue;
+		if (!exec_inspect_cache_key_matches(&copy, st, hash)) continue;
+
+		memset(ce, 0, sizeof(*ce));
+		ce->eice_binary_type = copy.eics_binary_type;
+		ce->eice_machine = copy.eics_machine;
+		ce->eice_elf_data = copy.eics_elf_data;
+		ce->eice_has_capabilities = copy.eics_has_capabilities;
+		if (copy.eics_pt_interp_len)
+			ce->eice_pt_interp = strdup(copy.eics_data);
+		if (copy.eics_hashbang_len) {
+			ce->eice_hashbang = malloc(copy.eics_hashbang_len + 1);
+			if (ce->eice_hashbang) {
+				memcpy(ce->eice_hashbang,
+					copy.eics_data + copy.eics_pt_interp_len,
+					copy.eics_hashbang_len);
+				ce->eice_hashbang[copy.eics_hashbang_len] = '\0';
+				ce->eice_hashbang_len = copy.eics_hashbang_len;
+			}
+		}
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"exec inspection cache: hit (type=%d)",
+			ce->eice_binary_type);
+		return(1);
+	}
+	LB_LOG(LB_LOGLEVEL_NOISE, "exec inspection cache: miss");
+	return(0);
+}
+
+/* Store the result of inspecting the file described by 'st'.
+ * 'hashbang' is the first line of a script (may be NULL) */
+void exec_inspect_cache_add(
+	const struct stat *st,
+	int binary_type,
+	const struct binary_info *info,
+	const char *hashbang,
+	size_t hashbang_len)
+{
+	uint32_t	hash;
+	size_t		pt_interp_len = 0;
+	exec_inspect_cache_slot_t	*victim = NULL;
+	uint32_t	seq;
+	int		i;
+
+	if (!info) return;
+	if (attach_exec_inspect_cache() < 0) return;
+
+	if (info->pt_interp) pt_interp_len = strlen(info->pt_interp) + 1;
+	if (pt_interp_len > EXEC_INSPECT_CACHE_DATA_SIZE) return;
+	if (!hashbang ||
+	    (pt_interp_len + hashbang_len > EXEC_INSPECT_CACHE_DATA_SIZE)) {
+		/* prepare_hashbang() will read it from the file */
+		hashbang_len = 0;
+	}
+
+	hash = exec_inspect_cache_hash(st);
+
+	/* Select a slot: An unused one, or one which has the same key.
+	 * This peeks at slots without the sequence counter protocol;
+	 * a wrong guess only costs a slot. */
+	for (i = 0; i < EXEC_INSPECT_CACHE_MAX_PROBES; i++) {
+		exec_inspect_cache_slot_t *sp = &exec_inspect_cache_slots[
+			(hash + i) & (EXEC_INSPECT_CACHE_NUM_SLOTS - 1)];
+
+		if ((sp->eics_seq == 0) ||
+		    ((sp->eics_dev == (uint64_t)st->st_dev) &&
+		     (sp->eics_ino == (uint64_t)st->st_ino))) {
+			victim = sp;
+			break;
+		}
+	}
+	if (!victim) {
+		/* all slots of the probe window are in use,
+		 * replace one of them */
+		victim = &exec_inspect_cache_slots[
+			(hash + ((hash >> 16) % EXEC_INSPECT_CACHE_MAX_PROBES)) &
+			(EXEC_INSPECT_CACHE_NUM_SLOTS - 1)];
+	}
+
+	seq = victim->eics_seq;
+	if (seq & 1) return; /* someone else is writing it */
+	if (!__sync_bool_compare_and_swap(&victim->eics_seq, seq, seq + 1))
+		return;
+
+	victim->eics_hash = hash;
+	victim->eics_dev = st->st_dev;
+	victim->eics_ino = st->st_ino;
+	victim->eics_size = st->st_size;
+	victim->eics_mtime_sec = st->st_mtim.tv_sec;
+	victim->eics_mtime_nsec = st->st_mtim.tv_nsec;
+	victim->eics_ctime_sec = st->st_ctim.tv_sec;
+	victim->eics_ctime_nsec = st->st_ctim.tv_nsec;
+	victim->eics_binary_type = binary_type;
+	victim->eics_machine = info->machine;
+	victim->eics_elf_data = info->data;
+	victim->eics_has_capabilities = info->has_capabilities ? 1 : 0;
+	victim->eics_pt_interp_len = pt_interp_len;
+	victim->eics_hashbang_len = hashbang_len;
+	if (pt_interp_len)
+		memcpy(victim->eics_data, info->pt_interp, pt_interp_len);
+	if (hashbang_len)
+		memcpy(victim->eics_data + pt_interp_len, hashbang, hashbang_len);
+
+	__sync_synchronize();
+	victim->eics_seq = seq + 2;
+	LB_LOG(LB_LOGLEVEL_NOISE, "exec inspection cache: stored (type=%d)",
+		binary_type);
+}
@@ -73,10 +73,10 @@ int exec_map_script_interpreter(
 			LB_LOG(LB_LOGLEVEL_DEBUG, "%s: result path = '%s'", __func__, mapping_result);
 
 			if (new_exec_policy_p) *new_exec_policy_p = new_exec_policy;
-			*mapped_interpreter_p = mapping_result;
+			*mapped_interpreter_p = exec_arena_take(mapping_result);
 
 			if (EXEC_POLICY_GET_BOOLEAN(eph, script_set_argv0_to_mapped_interpreter)) {
-				argv[0] = strdup(mapping_result);
+				argv[0] = *mapped_interpreter_p;
 				return(0);
 			}
 			return(1);
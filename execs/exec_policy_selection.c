@@ -12,6 +12,11 @@
  *      { prefix = "/path/prefix", exec_policy_name = "policyname" }
  *      { path = "/exact/path/to/program", exec_policy_name = "policyname" }
  *      { dir = "/directory/path", exec_policy_name = "policyname" }
+ *
+ * The first matching rule is used. lbrdbd compiles the list to a prefix
+ * trie when the rules are loaded (the same index that is used for FS rules),
+ * so the selection is a walk of the path instead of a scan of the list.
+ * Results are also remembered per process (see exec_policy_memo below).
 */
 
 #include "mapping.h"
@@ -19,6 +24,8 @@
 #include "liblb.h"
 #include "exported.h"
 
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "lb_execs.h"
@@ -92,6 +99,92 @@ static int test_path_match(const char *full_path, size_t full_path_len,
 	return(result);
 }
 
+/* Per-process memo: mapped path => exec policy name (a pointer to the
+ * rule tree, or NULL if no rule matched). Direct-mapped by hash of
+ * the path; entries are not valid after the rule tree has been modified.
+*/
+#define EXEC_POLICY_MEMO_SIZE	64	/* must be a power of two */
+
+typedef struct exec_policy_memo_entry_s {
+	uint32_t	epm_hash;
+	uint32_t	epm_ruletree_generation;
+	char		*epm_mapped_path;
+	const char	*epm_exec_policy_name;
+} exec_policy_memo_entry_t;
+
+static exec_policy_memo_entry_t exec_policy_memo[EXEC_POLICY_MEMO_SIZE];
+
+static pthread_mutex_t	exec_policy_memo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* NO logging while the mutex is locked! */
+static void exec_policy_memo_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&exec_policy_memo_mutex);
+}
+static void exec_policy_memo_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&exec_policy_memo_mutex);
+}
+
+/* Returns true if mapped_path was found; *epnp is set to
+ * the memoized name (may be NULL) */
+static int exec_policy_memo_find(const char *mapped_path,
+	uint32_t hash, uint32_t generation, const char **epnp)
+{
+	exec_policy_memo_entry_t *ep;
+	int	found = 0;
+
+	exec_policy_memo_mutex_lock();
+	ep = &exec_policy_memo[hash & (EXEC_POLICY_MEMO_SIZE - 1)];
+	if (ep->epm_mapped_path && (ep->epm_hash == hash) &&
+	    (ep->epm_ruletree_generation == generation) &&
+	    !strcmp(ep->epm_mapped_path, mapped_path)) {
+		*epnp = ep->epm_exec_policy_name;
+		found = 1;
+	}
+	exec_policy_memo_mutex_unlock();
+	return(found);
+}
+
+static void exec_policy_memo_store(const char *mapped_path,
+	uint32_t hash, uint32_t generation, const char *epn)
+{
+	exec_policy_memo_entry_t *ep;
+	char	*new_path = strdup(mapped_path);
+	char	*old_path;
+
+	if (!new_path) return;
+	exec_policy_memo_mutex_lock();
+	ep = &exec_policy_memo[hash & (EXEC_POLICY_MEMO_SIZE - 1)];
+	old_path = ep->epm_mapped_path;
+	ep->epm_hash = hash;
+	ep->epm_ruletree_generation = generation;
+	ep->epm_mapped_path = new_path;
+	ep->epm_exec_policy_name = epn;
+	exec_policy_memo_mutex_unlock();
+	if (old_path) free(old_path);
+}
+
+static const char *get_exec_policy_name_of_rule(
+	ruletree_object_offset_t policy_selection_rules_offs,
+	uint32_t i, ruletree_exec_policy_selection_rule_t **rulep)
+{
+	ruletree_object_offset_t	rule_offs;
+	ruletree_exec_policy_selection_rule_t   *rule;
+
+	*rulep = NULL;
+	rule_offs = ruletree_objectlist_get_item(policy_selection_rules_offs, i);
+	if (!rule_offs) return(NULL);
+	rule = offset_to_ruletree_object_ptr(
+		rule_offs, LB_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE);
+	if (!rule) return(NULL);
+	*rulep = rule;
+	return(offset_to_ruletree_string_ptr(
+		rule->rtree_xps_exec_policy_name_offs, NULL));
+}
+
 const char *find_exec_policy_name(const char *mapped_path, const char *virtual_path)
 {
 	static ruletree_object_offset_t		policy_selection_rules_offs = 0;
@@ -99,6 +192,10 @@ const char *find_exec_policy_name(const char *mapped_path, const char *virtual_p
 	unsigned int	i;
 	int		mapped_path_len;
 	static const char	*modename = NULL;
+	uint32_t	hash;
+	uint32_t	generation;
+	int		rule_n;
+	const char	*epn;
 
 	(void)virtual_path; /* not used */
 
@@ -122,35 +219,61 @@ const char *find_exec_policy_name(const char *mapped_path, const char *virtual_p
 			return(NULL);
 		}
 	}
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: path='%s'", __func__, mapped_path);
+
+	hash = lb_fnv1a32(LB_FNV1A32_INIT, mapped_path, strlen(mapped_path));
+	generation = ruletree_get_generation();
+	if (exec_policy_memo_find(mapped_path, hash, generation, &epn)) {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"%s: exec policy found from memo, '%s'", __func__,
+			(epn ? epn : "<none>"));
+		return(epn);
+	}
+
+	/* The selection rules have been compiled to an index by lbrdbd;
+	 * the first candidate from the index is the first matching rule,
+	 * and if there are no candidates, no rule matches. */
+	rule_n = ruletree_find_first_selector_match(
+		policy_selection_rules_offs, mapped_path);
+	if (rule_n >= 0) {
+		ruletree_exec_policy_selection_rule_t   *rule;
+
+		epn = get_exec_policy_name_of_rule(policy_selection_rules_offs,
+			rule_n, &rule);
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"%s: exec policy found from index, #%d '%s'",
+			__func__, rule_n, (epn ? epn : "<none>"));
+		exec_policy_memo_store(mapped_path, hash, generation, epn);
+		return(epn);
+	}
+	if (rule_n == -1) goto not_found;
+
+	/* no index: check all rules */
 	list_size = ruletree_objectlist_get_list_size(policy_selection_rules_offs);
 	mapped_path_len = strlen(mapped_path);
 
-	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: path='%s'", __func__, mapped_path);
 	for (i = 0; i < list_size; i++) {
-		ruletree_object_offset_t	rule_offs;
-
-		rule_offs = ruletree_objectlist_get_item(policy_selection_rules_offs, i);
-		if (rule_offs) {
-			ruletree_exec_policy_selection_rule_t   *rule;
-
-			rule = offset_to_ruletree_object_ptr(
-				rule_offs, LB_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE);
-			if (rule) {
-				if (test_path_match(mapped_path, mapped_path_len,
-					rule->rtree_xps_type, rule->rtree_xps_selector_offs) >= 0) {
-					const char *epn = offset_to_ruletree_string_ptr(
-						rule->rtree_xps_exec_policy_name_offs, NULL);
-					LB_LOG(LB_LOGLEVEL_DEBUG,
-						"%s: exec policy found, #%u '%s'",
-						__func__, i, epn);
-					return(epn);
-				}
+		ruletree_exec_policy_selection_rule_t   *rule;
+
+		epn = get_exec_policy_name_of_rule(policy_selection_rules_offs,
+			i, &rule);
+		if (rule) {
+			if (test_path_match(mapped_path, mapped_path_len,
+				rule->rtree_xps_type, rule->rtree_xps_selector_offs) >= 0) {
+				LB_LOG(LB_LOGLEVEL_DEBUG,
+					"%s: exec policy found, #%u '%s'",
+					__func__, i, epn);
+				exec_policy_memo_store(mapped_path,
+					hash, generation, epn);
+				return(epn);
 			}
 		}
 	}
+    not_found:
+	exec_policy_memo_store(mapped_path, hash, generation, NULL);
 	LB_LOG(LB_LOGLEVEL_ERROR,
 		"%s: exec policy was not found (mode='%s'), default rule is missing?",
 		__func__, modename);
 	return(NULL);
 }
-
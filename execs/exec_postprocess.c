@@ -27,6 +27,8 @@ static int elem_count(const char **elems)
         return count;
 }
 
+static int matches_gconv_path_nlspath_or_locpath(const char *cp);
+
 /* used for building new argv[] and envp[] vectors */
 struct strv_s {
 	const char	*strv_name;
@@ -49,7 +51,8 @@ static void init_strv(struct strv_s *svp, const char *name,
 	svp->strv_orig_v = orig_v;
 	svp->strv_new_v_max_size = num_orig_elems + num_additional_elems;
 	/* add one to 'nmemb' for the terminating NULL */
-	svp->strv_new_v = calloc(svp->strv_new_v_max_size + 1, sizeof(char*));
+	svp->strv_new_v = exec_arena_alloc(
+		(svp->strv_new_v_max_size + 1) * sizeof(char*));
 	svp->strv_first_free_idx = 0;
 }
 
@@ -121,6 +124,385 @@ static const char *get_users_ld_library_path(const char **orig_env)
 	return(NULL);
 }
 
+/* ------------ Exec plan cache ------------
+ *
+ * The postprocessing functions below compute the same new argv[]
+ * and envp[] prefixes again and again when a process (make, a compiler
+ * driver) starts the same programs repeatedly. The transformation
+ * does not depend on the user's arguments or on most of the
+ * environment, so it is remembered per process as a "plan":
+ *
+ *  argv = argv_head + ["-E", LD_TRACE_* var]... + argv_tail
+ *		+ orig_argv[first_orig_argv...]
+ *  envp = env_head + filtered orig_env + env_tail
+ *
+ * Strings of the head and tail parts are stored to one block, and
+ * elements of the head and tail are offsets to it (EXEC_PLAN_ARGV0
+ * refers to the user's argv[0], it may be in the argv head). A cached plan is applied by
+ * copying the string block and building both vectors in a single
+ * allocation.
+ *
+ * Plans are keyed by the kind of postprocessing, exec policy, the
+ * binary, and values of the environment variables that were used
+ * for computing the plan (__LB_LD_PRELOAD, __LB_LD_LIBRARY_PATH).
+ * They are not valid after the rule tree has been modified.
+*/
+#define EXEC_PLAN_CACHE_SIZE	32	/* must be a power of two */
+
+#define EXEC_PLAN_ARGV0		0xFFFFFFFFU
+
+/* Filters for the original environment: */
+#define EXEC_PLAN_ENV_DROP_LD_VARS	0x1	/* LD_PRELOAD, LD_LIBRARY_PATH */
+#define EXEC_PLAN_ENV_DROP_LOCALE_VARS	0x2	/* GCONV_PATH, NLSPATH, LOCPATH */
+#define EXEC_PLAN_ENV_DROP_LB_LD_PRELOAD 0x4	/* __LB_LD_PRELOAD */
+#define EXEC_PLAN_ENV_MOVE_LD_TRACE	0x8	/* LD_TRACE_* => argv "-E" */
+
+typedef struct exec_plan_key_s {
+	char		*epk_key;
+	size_t		epk_key_len;
+	uint32_t	epk_hash;
+	uint32_t	epk_ruletree_generation;
+} exec_plan_key_t;
+
+/* Positions in the new vectors, recorded while a plan is computed */
+struct exec_plan_layout_s {
+	int	epl_argv0_idx;		/* user's argv[0] in argv head, or -1 */
+	int	epl_argv_head_end;
+	int	epl_argv_tail_start;
+	int	epl_argv_tail_end;
+	int	epl_env_head_end;
+	int	epl_env_tail_start;
+	int	epl_env_tail_end;
+	int	epl_first_orig_argv;
+	int	epl_env_filter;
+};
+
+typedef struct exec_plan_s {
+	int		ep_refcount;	/* protected by the mutex */
+	uint32_t	ep_hash;
+	uint32_t	ep_ruletree_generation;
+	size_t		ep_key_len;
+	char		*ep_key;
+
+	int		ep_log_level;	/* message from the exec policy */
+	const char	*ep_log_message; /* (points to the rule tree) */
+
+	int		ep_env_filter;
+	int		ep_first_orig_argv;
+	uint32_t	ep_num_argv_head;
+	uint32_t	ep_num_argv_tail;
+	uint32_t	ep_num_env_head;
+	uint32_t	ep_num_env_tail;
+	uint32_t	*ep_elems;	/* argv head, argv tail, env head, env tail */
+	uint32_t	ep_mapped_file;	/* offset to ep_strings */
+	size_t		ep_strings_size;
+	char		*ep_strings;
+} exec_plan_t;
+
+static exec_plan_t *exec_plan_cache[EXEC_PLAN_CACHE_SIZE];
+
+static pthread_mutex_t	exec_plan_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* NO logging while the mutex is locked! */
+static void exec_plan_cache_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&exec_plan_cache_mutex);
+}
+static void exec_plan_cache_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&exec_plan_cache_mutex);
+}
+
+/* Build the key from "fieldv" (NULL elements are allowed). */
+static int exec_plan_make_key(exec_plan_key_t *kp,
+	const char **fieldv, int num_fields)
+{
+	size_t		len = 0;
+	char		*cp;
+	int		i;
+
+	for (i = 0; i < num_fields; i++)
+		len += 2 + (fieldv[i] ? strlen(fieldv[i]) : 0);
+	kp->epk_key = cp = malloc(len);
+	if (!cp) return(-1);
+	for (i = 0; i < num_fields; i++) {
+		/* type + value + '\0'; NULL and "" are different */
+		if (fieldv[i]) {
+			size_t	flen = strlen(fieldv[i]);
+
+			*cp++ = 'v';
+			memcpy(cp, fieldv[i], flen + 1);
+			cp += flen + 1;
+		} else {
+			*cp++ = '-';
+			*cp++ = '\0';
+		}
+	}
+	kp->epk_key_len = len;
+	kp->epk_hash = lb_fnv1a32(LB_FNV1A32_INIT, kp->epk_key, len);
+	kp->epk_ruletree_generation = ruletree_get_generation();
+	return(0);
+}
+
+static exec_plan_t *exec_plan_find(const exec_plan_key_t *kp)
+{
+	exec_plan_t	*ep;
+
+	exec_plan_cache_mutex_lock();
+	ep = exec_plan_cache[kp->epk_hash & (EXEC_PLAN_CACHE_SIZE - 1)];
+	if (ep && (ep->ep_hash == kp->epk_hash) &&
+	    (ep->ep_ruletree_generation == kp->epk_ruletree_generation) &&
+	    (ep->ep_key_len == kp->epk_key_len) &&
+	    !memcmp(ep->ep_key, kp->epk_key, kp->epk_key_len)) {
+		ep->ep_refcount++;
+	} else {
+		ep = NULL;
+	}
+	exec_plan_cache_mutex_unlock();
+	return(ep);
+}
+
+static void exec_plan_release(exec_plan_t *ep)
+{
+	int	unused;
+
+	exec_plan_cache_mutex_lock();
+	unused = (--ep->ep_refcount == 0);
+	exec_plan_cache_mutex_unlock();
+	if (unused) free(ep);
+}
+
+static int exec_plan_env_var_is_dropped(const char *var, int env_filter)
+{
+	const char *n_ld_library_path = "LD_LIBRARY_PATH=";
+	const char *n_ld_preload = "LD_PRELOAD=";
+	const char *n_lb_ld_preload = "__LB_LD_PRELOAD=";
+
+	switch (*var) {
+	case 'G':
+	case 'N':
+	case 'L':
+		if ((env_filter & EXEC_PLAN_ENV_DROP_LOCALE_VARS) &&
+		    matches_gconv_path_nlspath_or_locpath(var))
+			return(1);
+		if ((env_filter & EXEC_PLAN_ENV_DROP_LD_VARS) &&
+		    (!strncmp(var, n_ld_library_path, strlen(n_ld_library_path)) ||
+		     !strncmp(var, n_ld_preload, strlen(n_ld_preload))))
+			return(1);
+		break;
+	case '_':
+		if ((env_filter & EXEC_PLAN_ENV_DROP_LB_LD_PRELOAD) &&
+		    !strncmp(var, n_lb_ld_preload, strlen(n_lb_ld_preload)))
+			return(1);
+		break;
+	}
+	return(0);
+}
+
+static int exec_plan_env_var_is_ld_trace(const char *var, int env_filter)
+{
+	return((env_filter & EXEC_PLAN_ENV_MOVE_LD_TRACE) &&
+		(*var == 'L') && !strncmp(var, "LD_TRACE_", 9));
+}
+
+/* Store a plan, made from the new vectors. The key is consumed. */
+static void exec_plan_store(exec_plan_key_t *kp, exec_policy_handle_t eph,
+	const struct strv_s *new_argv, const struct strv_s *new_envp,
+	const struct exec_plan_layout_s *lp, const char *new_mapped_file)
+{
+	exec_plan_t	*ep;
+	exec_plan_t	*old_ep = NULL;
+	const char	*elemv[64];
+	uint32_t	num_elems = 0;
+	uint32_t	argv0_elem = EXEC_PLAN_ARGV0; /* = none */
+	size_t		strings_size;
+	size_t		size;
+	char		*cp;
+	uint32_t	i;
+	int		j;
+	const char	*log_level;
+
+	if (lp->epl_argv0_idx >= 0) {
+		if (!new_argv->strv_orig_v[0]) goto no_store;
+		argv0_elem = lp->epl_argv0_idx;
+	}
+
+	/* collect elements of the head and tail parts */
+#define EXEC_PLAN_COLLECT(svp, first, end) \
+	for (j = (first); j < (end); j++) { \
+		if (num_elems >= sizeof(elemv)/sizeof(elemv[0])) goto no_store; \
+		elemv[num_elems++] = (svp)->strv_new_v[j]; \
+	}
+	EXEC_PLAN_COLLECT(new_argv, 0, lp->epl_argv_head_end)
+	EXEC_PLAN_COLLECT(new_argv, lp->epl_argv_tail_start, lp->epl_argv_tail_end)
+	EXEC_PLAN_COLLECT(new_envp, 0, lp->epl_env_head_end)
+	EXEC_PLAN_COLLECT(new_envp, lp->epl_env_tail_start, lp->epl_env_tail_end)
+#undef EXEC_PLAN_COLLECT
+
+	strings_size = strlen(new_mapped_file) + 1;
+	for (i = 0; i < num_elems; i++) {
+		if (i != argv0_elem)
+			strings_size += strlen(elemv[i]) + 1;
+	}
+
+	/* the plan, key, elements and strings in one block */
+	size = sizeof(exec_plan_t) + num_elems * sizeof(uint32_t) +
+		kp->epk_key_len + strings_size;
+	ep = calloc(1, size);
+	if (!ep) goto no_store;
+	ep->ep_refcount = 1; /* the reference from the cache */
+	ep->ep_hash = kp->epk_hash;
+	ep->ep_ruletree_generation = kp->epk_ruletree_generation;
+	ep->ep_elems = (uint32_t *)(ep + 1);
+	ep->ep_key = (char *)(ep->ep_elems + num_elems);
+	ep->ep_key_len = kp->epk_key_len;
+	memcpy(ep->ep_key, kp->epk_key, kp->epk_key_len);
+	ep->ep_strings = ep->ep_key + kp->epk_key_len;
+	ep->ep_strings_size = strings_size;
+
+	log_level = EXEC_POLICY_GET_STRING(eph, log_level);
+	if (log_level) {
+		ep->ep_log_level = lblog_level_name_to_number(log_level);
+		ep->ep_log_message = EXEC_POLICY_GET_STRING(eph, log_message);
+	}
+	ep->ep_env_filter = lp->epl_env_filter;
+	ep->ep_first_orig_argv = lp->epl_first_orig_argv;
+	ep->ep_num_argv_head = lp->epl_argv_head_end;
+	ep->ep_num_argv_tail = lp->epl_argv_tail_end - lp->epl_argv_tail_start;
+	ep->ep_num_env_head = lp->epl_env_head_end;
+	ep->ep_num_env_tail = lp->epl_env_tail_end - lp->epl_env_tail_start;
+
+	cp = ep->ep_strings;
+	for (i = 0; i < num_elems; i++) {
+		if (i == argv0_elem) {
+			ep->ep_elems[i] = EXEC_PLAN_ARGV0;
+		} else {
+			size_t	len = strlen(elemv[i]) + 1;
+
+			ep->ep_elems[i] = cp - ep->ep_strings;
+			memcpy(cp, elemv[i], len);
+			cp += len;
+		}
+	}
+	ep->ep_mapped_file = cp - ep->ep_strings;
+	strcpy(cp, new_mapped_file);
+
+	exec_plan_cache_mutex_lock();
+	{
+		exec_plan_t **slotp = &exec_plan_cache[kp->epk_hash &
+			(EXEC_PLAN_CACHE_SIZE - 1)];
+
+		old_ep = *slotp;
+		if (old_ep && (--old_ep->ep_refcount != 0))
+			old_ep = NULL; /* still in use, freed by the user */
+		*slotp = ep;
+	}
+	exec_plan_cache_mutex_unlock();
+	if (old_ep) free(old_ep);
+	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: stored (%u elements, %u bytes)",
+		__func__, num_elems, (unsigned)size);
+    no_store:
+	free(kp->epk_key);
+	kp->epk_key = NULL;
+}
+
+/* Apply a plan to the user's argv[] and envp[]. Both vectors and
+ * the strings of the plan are placed to a single allocation. */
+static int exec_plan_apply(const exec_plan_t *ep,
+	const char **orig_argv, const char ***set_argv,
+	const char **orig_env, const char ***set_envp,
+	char **mapped_file)
+{
+	int		argc = elem_count(orig_argv);
+	int		envc = elem_count(orig_env);
+	int		num_ld_trace_vars = 0;
+	int		max_argv;
+	int		max_envp;
+	const char	**argv;
+	const char	**envp;
+	char		*strings;
+	const uint32_t	*elemp = ep->ep_elems;
+	uint32_t	i;
+	int		a = 0, e = 0;
+	int		j;
+
+	if (ep->ep_env_filter & EXEC_PLAN_ENV_MOVE_LD_TRACE) {
+		for (j = 0; j < envc; j++)
+			if (exec_plan_env_var_is_ld_trace(orig_env[j],
+				ep->ep_env_filter)) num_ld_trace_vars++;
+	}
+	max_argv = ep->ep_num_argv_head + 2 * num_ld_trace_vars +
+		ep->ep_num_argv_tail +
+		(argc > ep->ep_first_orig_argv ? argc - ep->ep_first_orig_argv : 0);
+	max_envp = ep->ep_num_env_head + envc + ep->ep_num_env_tail;
+
+	argv = exec_arena_alloc((max_argv + 1 + max_envp + 1) * sizeof(char *) +
+		ep->ep_strings_size);
+	if (!argv) return(-1);
+	envp = argv + max_argv + 1;
+	strings = (char *)(envp + max_envp + 1);
+	memcpy(strings, ep->ep_strings, ep->ep_strings_size);
+
+#define EXEC_PLAN_ELEM(off) \
+	((off) == EXEC_PLAN_ARGV0 ? orig_argv[0] : strings + (off))
+	for (i = 0; i < ep->ep_num_argv_head; i++, elemp++)
+		argv[a++] = EXEC_PLAN_ELEM(*elemp);
+	for (j = 0; j < envc; j++) {
+		if (exec_plan_env_var_is_ld_trace(orig_env[j], ep->ep_env_filter)) {
+			argv[a++] = "-E";
+			argv[a++] = orig_env[j];
+		}
+	}
+	for (i = 0; i < ep->ep_num_argv_tail; i++, elemp++)
+		argv[a++] = EXEC_PLAN_ELEM(*elemp);
+	for (j = ep->ep_first_orig_argv; j < argc; j++)
+		argv[a++] = orig_argv[j];
+
+	for (i = 0; i < ep->ep_num_env_head; i++, elemp++)
+		envp[e++] = EXEC_PLAN_ELEM(*elemp);
+	for (j = 0; j < envc; j++) {
+		if (exec_plan_env_var_is_ld_trace(orig_env[j], ep->ep_env_filter) ||
+		    exec_plan_env_var_is_dropped(orig_env[j], ep->ep_env_filter))
+			continue;
+		envp[e++] = orig_env[j];
+	}
+	for (i = 0; i < ep->ep_num_env_tail; i++, elemp++)
+		envp[e++] = EXEC_PLAN_ELEM(*elemp);
+#undef EXEC_PLAN_ELEM
+
+	*set_argv = argv;
+	*set_envp = envp;
+	*mapped_file = strings + ep->ep_mapped_file;
+	return(0);
+}
+
+/* Returns 0 if a cached plan was applied. */
+static int exec_plan_try_cached(const char *fn_name,
+	const exec_plan_key_t *kp,
+	const char **orig_argv, const char ***set_argv,
+	const char **orig_env, const char ***set_envp,
+	char **mapped_file)
+{
+	exec_plan_t	*ep;
+	int		r;
+
+	ep = exec_plan_find(kp);
+	if (!ep) return(-1);
+	if (ep->ep_log_level > 0)
+		LB_LOG(ep->ep_log_level, "%s", ep->ep_log_message);
+	r = exec_plan_apply(ep, orig_argv, set_argv,
+		orig_env, set_envp, mapped_file);
+	exec_plan_release(ep);
+	if (r == 0) {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"%s: used cached exec plan, mapped_file=%s",
+			fn_name, *mapped_file);
+	}
+	return(r);
+}
+
 static void setenv_native_app_ld_preload(
 	exec_policy_handle_t	eph,
 	struct strv_s *new_envp)
@@ -145,7 +527,7 @@ static void setenv_native_app_ld_preload(
 #define str_not_empty(s) ((s) && *(s))
 			char *cp;
 			if (libpath) {
-				assert(asprintf(&cp, "LD_PRELOAD=%s%s%s%s%s",
+				cp = exec_arena_asprintf("LD_PRELOAD=%s%s%s%s%s",
 					(str_not_empty(native_app_ld_preload_prefix) ?
 					 native_app_ld_preload_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_preload_prefix) ? ":" : ""), /* 2 */
@@ -154,17 +536,19 @@ static void setenv_native_app_ld_preload(
 					 ":" : ""), /* 4 */
 					(str_not_empty(native_app_ld_preload_suffix) ?
 					 native_app_ld_preload_suffix : "") /* 5 */
-					) > 0);	
+					);
+				assert(cp != NULL);
 			} else {
 				/* no libpath */
-				assert(asprintf(&cp, "LD_PRELOAD=%s%s%s",
+				cp = exec_arena_asprintf("LD_PRELOAD=%s%s%s",
 					(str_not_empty(native_app_ld_preload_prefix) ?
 					 native_app_ld_preload_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_preload_prefix) &&
 					 str_not_empty(native_app_ld_preload_suffix) ? ":" : ""), /* 2 */
 					(str_not_empty(native_app_ld_preload_suffix) ?
 					 native_app_ld_preload_suffix : "") /* 3 */
-					) > 0);	
+					);
+				assert(cp != NULL);
 			}
 			new_path = cp;
 		} else {
@@ -182,7 +566,8 @@ static void setenv_native_app_ld_preload(
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"%s: No value for LD_PRELOAD, using host's variable '%s'",
 			__func__, new_path);
-		assert(asprintf(&cp, "LD_PRELOAD=%s", new_path) > 0);
+		cp = exec_arena_asprintf("LD_PRELOAD=%s", new_path);
+		assert(cp != NULL);
 		new_path = cp;
 	}
 	add_string_to_strv(new_envp, new_path);
@@ -249,7 +634,7 @@ static void setenv_native_app_ld_library_path(
 #define str_not_empty(s) ((s) && *(s))
 			char *cp;
 			if (libpath) {
-				assert(asprintf(&cp, "LD_LIBRARY_PATH=%s%s%s%s%s",
+				cp = exec_arena_asprintf("LD_LIBRARY_PATH=%s%s%s%s%s",
 					(str_not_empty(native_app_ld_library_path_prefix) ?
 					 native_app_ld_library_path_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_library_path_prefix) ? ":" : ""), /* 2 */
@@ -258,17 +643,19 @@ static void setenv_native_app_ld_library_path(
 					 ":" : ""), /* 4 */
 					(str_not_empty(native_app_ld_library_path_suffix) ?
 					 native_app_ld_library_path_suffix : "") /* 5 */
-					) > 0);	
+					);
+				assert(cp != NULL);
 			} else {
 				/* no libpath */
-				assert(asprintf(&cp, "LD_LIBRARY_PATH=%s%s%s",
+				cp = exec_arena_asprintf("LD_LIBRARY_PATH=%s%s%s",
 					(str_not_empty(native_app_ld_library_path_prefix) ?
 					 native_app_ld_library_path_prefix : ""), /* 1 */
 					(str_not_empty(native_app_ld_library_path_prefix) &&
 					 str_not_empty(native_app_ld_library_path_suffix) ? ":" : ""), /* 2 */
 					(str_not_empty(native_app_ld_library_path_suffix) ?
 					 native_app_ld_library_path_suffix : "") /* 3 */
-					) > 0);	
+					);
+				assert(cp != NULL);
 			}
 			new_path = cp;
 		} else {
@@ -286,7 +673,8 @@ static void setenv_native_app_ld_library_path(
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"%s: No value for LD_LIBRARY_PATH, using host's path '%s'",
 			__func__, new_path);
-		assert(asprintf(&cp, "LD_LIBRARY_PATH=%s", new_path) > 0);
+		cp = exec_arena_asprintf("LD_LIBRARY_PATH=%s", new_path);
+		assert(cp != NULL);
 		new_path = cp;
 	}
 	add_string_to_strv(new_envp, new_path);
@@ -343,7 +731,8 @@ static int exec_postprocess_prepare(
 	{
 		char	*cp;
 
-		assert(asprintf(&cp, "__LB_EXEC_POLICY_NAME=%s", exec_policy_name) > 0);
+		cp = exec_arena_asprintf("__LB_EXEC_POLICY_NAME=%s", exec_policy_name);
+		assert(cp != NULL);
 		add_string_to_strv(new_envp, cp);
 	}
 
@@ -383,6 +772,37 @@ int exec_postprocess_native_executable(
 	int			first_argv_element_to_copy = 0;
 	struct strv_s		new_envp;
 	struct strv_s		new_argv;
+	exec_plan_key_t		plan_key;
+	struct exec_plan_layout_s plan_layout;
+	int			setid_binary;
+
+	plan_layout.epl_argv0_idx = -1;
+
+	/* The plan depends on the policy, the binary, and on
+	 * user's LD_PRELOAD and LD_LIBRARY_PATH values */
+	setid_binary = ((info->mode & (S_ISUID | S_ISGID)) ||
+		info->has_capabilities);
+	{
+		const char *keyv[6];
+
+		keyv[0] = "native";
+		keyv[1] = exec_policy_name;
+		keyv[2] = *mapped_file;
+		keyv[3] = get_users_ld_preload(orig_env);
+		keyv[4] = get_users_ld_library_path(orig_env);
+		keyv[5] = (setid_binary ? info->pt_interp : NULL);
+		plan_key.epk_key = NULL;
+		if (exec_plan_make_key(&plan_key, keyv, 6) == 0) {
+			int	r = exec_plan_try_cached(__func__, &plan_key,
+				orig_argv, set_argv, orig_env, set_envp,
+				mapped_file);
+
+			if (r == 0) {
+				free(plan_key.epk_key);
+				return(0);
+			}
+		}
+	}
 
 	/* Prepare. For the new argv, allocate room for 
 	 * for optional new entries, needed if indirect startup:
@@ -401,7 +821,10 @@ int exec_postprocess_native_executable(
 	*/
 	if (exec_postprocess_prepare(exec_policy_name, &eph, mapped_file,
 		filename, binary_name, orig_argv, &new_argv, 6,
-		orig_env, &new_envp, 5)) return(1);
+		orig_env, &new_envp, 5)) {
+		if (plan_key.epk_key) free(plan_key.epk_key);
+		return(1);
+	}
 
 	/* Old Lua code, for reference:
 	 *	function lb_execve_postprocess_native_executable(exec_policy,
@@ -435,8 +858,7 @@ int exec_postprocess_native_executable(
 			"%s: No native_app_ld_so", __func__);
 
 		/* (new code. this wasn't present in the Lua version) */
-		if ((info->mode & (S_ISUID | S_ISGID)) |
-		    (info->has_capabilities)) {
+		if (setid_binary) {
 			/* SUID and/or SGID bit is set or the program has extra
 			 * capabilities.
 			 * Our LD_PRELOAD library will be dropped if the binary
@@ -448,7 +870,7 @@ int exec_postprocess_native_executable(
 			 * the alternative, loosing LD_PRELOAD..
 			*/
 			if (info->pt_interp) {	
-				char *pt_interp_copy = strdup(info->pt_interp);
+				char *pt_interp_copy = exec_arena_strdup(info->pt_interp);
 				LB_LOG(LB_LOGLEVEL_DEBUG,
 					"%s: No native_app_ld_so, SUID/SGID binary, "
 					"start with PT_INTERP='%s', argv[0]=´%s´",
@@ -476,7 +898,7 @@ int exec_postprocess_native_executable(
 			__func__, native_app_ld_so);
 
 		add_string_to_strv(&new_argv, native_app_ld_so);
-		new_mapped_file = strdup(native_app_ld_so); /* FIXME */
+		new_mapped_file = exec_arena_strdup(native_app_ld_so);
 
 		/* Ignore RPATH and RUNPATH information:
 		 * This will prevent accidental use of host's libraries,
@@ -540,6 +962,7 @@ int exec_postprocess_native_executable(
 		*/
 		if (EXEC_POLICY_GET_BOOLEAN(eph, native_app_ld_so_supports_argv0)) {
 			add_string_to_strv(&new_argv, "--argv0");
+			plan_layout.epl_argv0_idx = new_argv.strv_first_free_idx;
 			add_string_to_strv(&new_argv, orig_argv[0]);
 		}
 		LB_LOG(LB_LOGLEVEL_DEBUG,
@@ -592,9 +1015,11 @@ int exec_postprocess_native_executable(
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"%s: setting LOCPATH and NLSPATH to '%s'",
 				__func__, native_app_locale_path);
-			assert(asprintf(&cp, "LOCPATH=%s", native_app_locale_path) > 0);
+			cp = exec_arena_asprintf("LOCPATH=%s", native_app_locale_path);
+			assert(cp != NULL);
 			add_string_to_strv(&new_envp, cp);
-			assert(asprintf(&cp, "NLSPATH=%s", native_app_locale_path) > 0);
+			cp = exec_arena_asprintf("NLSPATH=%s", native_app_locale_path);
+			assert(cp != NULL);
 			add_string_to_strv(&new_envp, cp);
 		}
 	}
@@ -620,12 +1045,14 @@ int exec_postprocess_native_executable(
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"%s: setting GCONV_PATH to '%s'",
 				__func__, native_app_gconv_path);
-			assert(asprintf(&cp, "GCONV_PATH=%s", native_app_gconv_path) > 0);
+			cp = exec_arena_asprintf("GCONV_PATH=%s", native_app_gconv_path);
+			assert(cp != NULL);
 			add_string_to_strv(&new_envp, cp);
 		}
 	}
 		
 	/* add rest of orig.env. to new_new */
+	plan_layout.epl_env_head_end = new_envp.strv_first_free_idx;
 	{
 		int i;
 		const char *n_ld_library_path = "LD_LIBRARY_PATH=";
@@ -675,6 +1102,7 @@ int exec_postprocess_native_executable(
 	 *	return 1, mapped_file, filename, #argv, argv, #envp, envp
 	 * end
 	*/
+	plan_layout.epl_argv_head_end = new_argv.strv_first_free_idx;
 	{
 		int i;
 
@@ -685,6 +1113,17 @@ int exec_postprocess_native_executable(
 		}
 	}
 
+	if (plan_key.epk_key) {
+		plan_layout.epl_argv_tail_start = plan_layout.epl_argv_head_end;
+		plan_layout.epl_argv_tail_end = plan_layout.epl_argv_head_end;
+		plan_layout.epl_env_tail_start = new_envp.strv_first_free_idx;
+		plan_layout.epl_env_tail_end = new_envp.strv_first_free_idx;
+		plan_layout.epl_first_orig_argv = first_argv_element_to_copy;
+		plan_layout.epl_env_filter = EXEC_PLAN_ENV_DROP_LD_VARS;
+		exec_plan_store(&plan_key, eph, &new_argv, &new_envp,
+			&plan_layout, new_mapped_file);
+	}
+
 	*set_envp = new_envp.strv_new_v;
 	*set_argv = new_argv.strv_new_v;
 	*mapped_file = new_mapped_file;
@@ -774,10 +1213,37 @@ static int exec_postprocess_qemu(
 	const char	*lb_ld_preload_prefix = "__LB_LD_PRELOAD=";
 	const int	lb_ld_preload_prefix_len = strlen(lb_ld_preload_prefix);
 	int		num_ld_trace_env_vars = 0;
+	int		env_control_flags;
+	exec_plan_key_t		plan_key;
+	struct exec_plan_layout_s plan_layout;
+
+	plan_layout.epl_argv0_idx = -1;
 
 	LB_LOG(LB_LOGLEVEL_DEBUG,
 		"%s: postprocess '%s' '%s'", __func__, *mapped_file, *mapped_file);
 
+	/* The plan depends on the policy, the cpu transparency method
+	 * and the unmapped file name (which is passed to Qemu) */
+	{
+		const char *keyv[4];
+
+		keyv[0] = "qemu";
+		keyv[1] = exec_policy_name;
+		keyv[2] = conf_cputransparency_name;
+		keyv[3] = *filename;
+		plan_key.epk_key = NULL;
+		if (exec_plan_make_key(&plan_key, keyv, 4) == 0) {
+			int	r = exec_plan_try_cached(__func__, &plan_key,
+				orig_argv, set_argv, orig_env, set_envp,
+				mapped_file);
+
+			if (r == 0) {
+				free(plan_key.epk_key);
+				return(0);
+			}
+		}
+	}
+
 	namev_in_ruletree[0] = "cputransparency";
 	namev_in_ruletree[1] = conf_cputransparency_name;
 	namev_in_ruletree[2] = NULL; /* this will be varied below */
@@ -827,7 +1293,7 @@ static int exec_postprocess_qemu(
 		filename, binary_name, orig_argv,
 		&new_argv, qemu_argv_list_size + 5 + 2*num_ld_trace_env_vars,
 		orig_env, &new_envp, qemu_env_list_size + 2))
-			return(-1);
+			goto do_not_execute;
 
 	/* Old Lua code, for reference:
 	 *function lb_execve_postprocess_cpu_transparency_executable(exec_policy,
@@ -864,10 +1330,10 @@ static int exec_postprocess_qemu(
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"%s: No command for cpu_transparency (%s)", __func__,
 				conf_cputransparency_name);
-			return(-1); /* do not execute */
+			goto do_not_execute;
 		}
 		add_string_to_strv(&new_argv, cputransparency_cmd);
-		new_mapped_file = strdup(cputransparency_cmd);
+		new_mapped_file = exec_arena_strdup(cputransparency_cmd);
 	} else {
 		uint32_t i;
 		for (i = 0; i < qemu_argv_list_size; i++) {
@@ -876,9 +1342,9 @@ static int exec_postprocess_qemu(
 			cp = add_string_from_ruletreelist_to_strv(
 				qemu_argv_list_offs, i, &new_argv,
 				conf_cputransparency_name);
-			if (!cp) return(-1); /* do not execute */
+			if (!cp) goto do_not_execute;
 			if (i == 0) {
-				new_mapped_file = strdup(cp);
+				new_mapped_file = exec_arena_strdup(cp);
 			}
 		}
 	}
@@ -897,7 +1363,7 @@ static int exec_postprocess_qemu(
 			cp = add_string_from_ruletreelist_to_strv(
 				qemu_env_list_offs, i, &new_envp,
 				conf_cputransparency_name);
-			if (!cp) return(-1); /* do not execute */
+			if (!cp) goto do_not_execute;
 		}
 	}
 
@@ -917,6 +1383,7 @@ static int exec_postprocess_qemu(
 	namev_in_ruletree[2] = "has_argv0_flag";
 	if (test_cputransp_boolean(namev_in_ruletree)) {
 		add_string_to_strv(&new_argv, "-0");
+		plan_layout.epl_argv0_idx = new_argv.strv_first_free_idx;
 		add_string_to_strv(&new_argv, orig_argv[0]);
 	}
 
@@ -956,8 +1423,11 @@ static int exec_postprocess_qemu(
 	 *			new_envp = envp
 	 *		end
 	*/
+	plan_layout.epl_argv_head_end = new_argv.strv_first_free_idx;
+	plan_layout.epl_env_head_end = new_envp.strv_first_free_idx;
 	namev_in_ruletree[2] = "qemu_has_env_control_flags";
-	if (test_cputransp_boolean(namev_in_ruletree)) {
+	env_control_flags = test_cputransp_boolean(namev_in_ruletree);
+	if (env_control_flags) {
 		int i;
 		for (i = 0; i < new_envp.strv_num_orig_elems; i++) {
 			const char *orig_env_var = orig_env[i];
@@ -1049,6 +1519,7 @@ static int exec_postprocess_qemu(
 	 *		table.insert(new_envp, qemu_ldlibpath)
 	 *		table.insert(new_envp, qemu_ldpreload)
 	*/
+	plan_layout.epl_env_tail_start = new_envp.strv_first_free_idx;
 	{
 		const char	*qemu_ldlibpath = NULL;
 		const char	*qemu_ldpreload = NULL;
@@ -1062,13 +1533,14 @@ static int exec_postprocess_qemu(
 				"%s: No qemu_ld_library_path, using host's ld_library_path (%s)",
 				__func__, conf_cputransparency_name);
 			qemu_ldlibpath = ruletree_catalog_get_string("config", "host_ld_library_path");
-			assert(asprintf(&cp, "LD_LIBRARY_PATH=%s", qemu_ldlibpath) > 0);	
+			cp = exec_arena_asprintf("LD_LIBRARY_PATH=%s", qemu_ldlibpath);
+			assert(cp != NULL);
 		} else {
 			/* qemu_ldlibpath has LD_LIBRARY_PATH= prefix */
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"%s: set ld_library_path (%s) = %s",
 				__func__, conf_cputransparency_name, qemu_ldlibpath);
-			cp = strdup(qemu_ldlibpath);
+			cp = exec_arena_strdup(qemu_ldlibpath);
 		} 
 		add_string_to_strv(&new_envp, cp);
 
@@ -1080,21 +1552,26 @@ static int exec_postprocess_qemu(
 				"%s: No qemu_ld_preload, using host's ld_preload (%s)",
 				__func__, conf_cputransparency_name);
 			qemu_ldpreload = ruletree_catalog_get_string("config", "host_ld_preload");
-			assert(asprintf(&cp, "LD_PRELOAD=%s", qemu_ldpreload) > 0);	
+			cp = exec_arena_asprintf("LD_PRELOAD=%s", qemu_ldpreload);
+			assert(cp != NULL);
 		} else {
 			/* qemu_ldpreload has LD_PRELOAD= prefix */
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"%s: set ld_preload (%s) = %s",
 				__func__, conf_cputransparency_name, qemu_ldpreload);
-			cp = strdup(qemu_ldpreload);
+			cp = exec_arena_strdup(qemu_ldpreload);
 		} 
 		add_string_to_strv(&new_envp, cp);
 	}
 
+	plan_layout.epl_env_tail_end = new_envp.strv_first_free_idx;
+
 	/*		-- unmapped file is exec'd
 	 *		table.insert(new_argv, filename)
 	*/
+	plan_layout.epl_argv_tail_start = new_argv.strv_first_free_idx;
 	add_string_to_strv(&new_argv, *filename);
+	plan_layout.epl_argv_tail_end = new_argv.strv_first_free_idx;
 
 	/*
 	 *		--
@@ -1132,6 +1609,17 @@ static int exec_postprocess_qemu(
 	 *end
 	*/
 
+	if (plan_key.epk_key) {
+		plan_layout.epl_first_orig_argv = 1;
+		plan_layout.epl_env_filter = EXEC_PLAN_ENV_DROP_LOCALE_VARS;
+		if (env_control_flags)
+			plan_layout.epl_env_filter |=
+				EXEC_PLAN_ENV_MOVE_LD_TRACE |
+				EXEC_PLAN_ENV_DROP_LB_LD_PRELOAD;
+		exec_plan_store(&plan_key, eph, &new_argv, &new_envp,
+			&plan_layout, new_mapped_file);
+	}
+
 	*set_envp = new_envp.strv_new_v;
 	*set_argv = new_argv.strv_new_v;
 	*mapped_file = new_mapped_file;
@@ -1139,6 +1627,10 @@ static int exec_postprocess_qemu(
 	/* instruct caller to always use argv,envp,filename
 	 * and mapped file from this routine */
 	return(0);
+
+    do_not_execute:
+	if (plan_key.epk_key) free(plan_key.epk_key);
+	return(-1);
 }
 
 /* CPU transparency.
@@ -1202,11 +1694,13 @@ int exec_postprocess_host_static_executable(
 			return(-1);
 
 	hp = ruletree_catalog_get_string("config", "host_ld_library_path");
-	assert(asprintf(&cp, "LD_LIBRARY_PATH=%s", hp) > 0);
+	cp = exec_arena_asprintf("LD_LIBRARY_PATH=%s", hp);
+	assert(cp != NULL);
 	add_string_to_strv(&new_envp, cp);
 	
 	hp = ruletree_catalog_get_string("config", "host_ld_preload");
-	assert(asprintf(&cp, "LD_PRELOAD=%s", hp) > 0);
+	cp = exec_arena_asprintf("LD_PRELOAD=%s", hp);
+	assert(cp != NULL);
 	add_string_to_strv(&new_envp, cp);
 
 	/* Append arguments */
@@ -68,7 +68,7 @@ static int add_elements_to_argv(
 		str_offs = ruletree_objectlist_get_item(add_tbl_offs, j);
 		str = offset_to_ruletree_string_ptr(str_offs, NULL);
 		
-		argv[add_idx] = strdup(str);
+		argv[add_idx] = exec_arena_strdup(str);
 		LB_LOG(LB_LOGLEVEL_NOISE,
 			"%s: add from %s to argv[%d] = '%s'",
 				__func__, table_name, add_idx, str);
@@ -132,8 +132,69 @@ static int check_path_prefix_match(
 	return(0);
 }
 
+/* Returns the hash table of the argvmods rules, if lbrdbd created it */
+static const ruletree_exec_pp_hash_t *get_exec_pp_hash(
+	const char *argvmods_name,
+	ruletree_object_offset_t argvmods_rules_offs)
+{
+	ruletree_object_offset_t table_offs;
+	const ruletree_exec_pp_hash_t *hp;
+
+	table_offs = ruletree_catalog_get("argvmods_hash", argvmods_name);
+	if (!table_offs) return(NULL);
+	hp = offset_to_ruletree_object_ptr(table_offs,
+		LB_RULETREE_OBJECT_TYPE_EXEC_PP_HASH);
+	if (!hp ||
+	    (hp->rtree_xph_rule_list_offs != argvmods_rules_offs) ||
+	    (hp->rtree_xph_rule_list_size !=
+		ruletree_objectlist_get_list_size(argvmods_rules_offs)) ||
+	    (hp->rtree_xph_num_slots == 0)) return(NULL);
+	return(hp);
+}
+
+/* Check one rule: Returns the rule if the binary name and
+ * path prefixes match */
+static ruletree_exec_preprocessing_rule_t *test_exec_preprocessing_rule(
+	ruletree_object_offset_t argvmods_rules_offs,
+	uint32_t i,
+	const char *filename,
+	const char *file_basename,
+	int file_basename_len)
+{
+	ruletree_object_offset_t r_offs;
+	ruletree_exec_preprocessing_rule_t *execpp_rule;
+	const char *rule_bin_name;
+	uint32_t rule_bin_name_len;
+
+	r_offs = ruletree_objectlist_get_item(argvmods_rules_offs, i);
+	if (!r_offs) return(NULL);
+	execpp_rule = offset_to_exec_preprocessing_rule_ptr(r_offs);
+	if (!execpp_rule || !execpp_rule->rtree_xpr_binary_name_offs)
+		return(NULL);
+
+	rule_bin_name = offset_to_ruletree_string_ptr(
+		execpp_rule->rtree_xpr_binary_name_offs,
+		&rule_bin_name_len);
+	LB_LOG(LB_LOGLEVEL_NOISE3,
+		"%s: cmp '%s','%s'",
+		__func__, file_basename, rule_bin_name);
+	if (((int)rule_bin_name_len == file_basename_len) &&
+	    !strcmp(file_basename, rule_bin_name)) {
+
+		if (check_path_prefix_match(
+			execpp_rule, filename, file_basename)) {
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"%s: Found preprocessing rule '%s'",
+				__func__, rule_bin_name);
+			return(execpp_rule);
+		}
+	}
+	return(NULL);
+}
+
 static ruletree_exec_preprocessing_rule_t *find_exec_preprocessing_rule(
 	ruletree_object_offset_t argvmods_rules_offs,
+	const ruletree_exec_pp_hash_t *hp,
 	const char *filename)
 {
 	uint32_t list_size = ruletree_objectlist_get_list_size(argvmods_rules_offs);
@@ -150,39 +211,36 @@ static ruletree_exec_preprocessing_rule_t *find_exec_preprocessing_rule(
 		file_basename = filename;
 	}
 	file_basename_len = strlen(file_basename);
-	LB_LOG(LB_LOGLEVEL_DEBUG,
-		"%s: check %d rules, file='%s'",
-		__func__, list_size, file_basename);
-	for (i = 0; i < (int)list_size; i++) {
-		ruletree_object_offset_t r_offs;
-
-		r_offs = ruletree_objectlist_get_item(argvmods_rules_offs, i);
-		if (r_offs) {
-			execpp_rule = offset_to_exec_preprocessing_rule_ptr(r_offs);
-			if (execpp_rule) {
-				if (execpp_rule->rtree_xpr_binary_name_offs) {
-					const char *rule_bin_name;
-					uint32_t rule_bin_name_len;
-					
-					rule_bin_name = offset_to_ruletree_string_ptr(
-						execpp_rule->rtree_xpr_binary_name_offs,
-						&rule_bin_name_len);
-					LB_LOG(LB_LOGLEVEL_NOISE3,
-						"%s: cmp '%s','%s'",
-						__func__, file_basename, rule_bin_name);
-					if (((int)rule_bin_name_len == file_basename_len) &&
-					    !strcmp(file_basename, rule_bin_name)) {
-
-						if (check_path_prefix_match(
-							execpp_rule, filename, file_basename)) {
-							LB_LOG(LB_LOGLEVEL_DEBUG,
-								"%s: Found preprocessing rule '%s'",
-								__func__, rule_bin_name);
-							return(execpp_rule);
-						}
-					}
-				}
+	if (hp) {
+		/* Probe the hash table; all rules with this name
+		 * are found before the first unused slot. */
+		const uint32_t	*slots = (const uint32_t*)(hp + 1);
+		uint32_t	mask = hp->rtree_xph_num_slots - 1;
+		uint32_t	slot;
+		uint32_t	n;
+
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"%s: hash lookup, file='%s'",
+			__func__, file_basename);
+		slot = ruletree_exec_pp_hash_name(file_basename) & mask;
+		for (n = 0; (n <= mask) && slots[slot]; n++) {
+			if (slots[slot] <= list_size) {
+				execpp_rule = test_exec_preprocessing_rule(
+					argvmods_rules_offs, slots[slot] - 1,
+					filename, file_basename, file_basename_len);
+				if (execpp_rule) return(execpp_rule);
 			}
+			slot = (slot + 1) & mask;
+		}
+	} else {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"%s: check %d rules, file='%s'",
+			__func__, list_size, file_basename);
+		for (i = 0; i < (int)list_size; i++) {
+			execpp_rule = test_exec_preprocessing_rule(
+				argvmods_rules_offs, i,
+				filename, file_basename, file_basename_len);
+			if (execpp_rule) return(execpp_rule);
 		}
 	}
 	LB_LOG(LB_LOGLEVEL_DEBUG,
@@ -194,6 +252,7 @@ static ruletree_exec_preprocessing_rule_t *find_exec_preprocessing_rule(
 int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 {
 	static ruletree_object_offset_t	argvmods_rules_offs = 0;
+	static const ruletree_exec_pp_hash_t *argvmods_hash = NULL;
 	ruletree_exec_preprocessing_rule_t *execpp_rule;
 	int orig_argc;
 	int max_new_argv_elements = 0;
@@ -217,10 +276,15 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 
 			argvmods_rules_offs = ruletree_catalog_get("argvmods",
 				(use_gcc_rules ? "gcc" : "misc"));
+			if (argvmods_rules_offs)
+				argvmods_hash = get_exec_pp_hash(
+					(use_gcc_rules ? "gcc" : "misc"),
+					argvmods_rules_offs);
 
 			LB_LOG(LB_LOGLEVEL_DEBUG,
-				"%s: argvmods rules @%u, use_gcc_rules=%d",
-				__func__, argvmods_rules_offs, use_gcc_rules);
+				"%s: argvmods rules @%u, use_gcc_rules=%d, hash=%s",
+				__func__, argvmods_rules_offs, use_gcc_rules,
+				(argvmods_hash ? "yes" : "no"));
                 }
 	}
 	if (!argvmods_rules_offs) {
@@ -228,7 +292,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		return(0);
 	}
 	execpp_rule = find_exec_preprocessing_rule(
-		argvmods_rules_offs, *file);
+		argvmods_rules_offs, argvmods_hash, *file);
 
 	if (!execpp_rule) return(0);
 
@@ -259,7 +323,8 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"%s: allocating new argv, size = %d",
 			__func__, orig_argc + max_new_argv_elements);
-		new_argv = (char **)calloc(orig_argc + max_new_argv_elements + 1, sizeof(char *));
+		new_argv = exec_arena_alloc((orig_argc + max_new_argv_elements + 1) *
+			sizeof(char *));
 	} else {
 		new_argv = *argv;
 	}
@@ -311,7 +376,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 						"%s: remove argv[%d], '%s'",
 						__func__, k, str);
 				} else {
-					new_argv[i] = strdup((*argv)[k]);
+					new_argv[i] = exec_arena_strdup((*argv)[k]);
 					LB_LOG(LB_LOGLEVEL_DEBUG,
 						"%s: argv[%d]='%s'",
 						__func__, i, new_argv[i]);
@@ -323,7 +388,7 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		int k;
 		/* nothing to remove, copy old argv */
 		for (k = 1; k < orig_argc; i++, k++) {
-			new_argv[i] = strdup((*argv)[k]);
+			new_argv[i] = exec_arena_strdup((*argv)[k]);
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"%s: move argv[%d] -> argv[%d], '%s'",
 				__func__, k, i, new_argv[i]);
@@ -338,12 +403,8 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 			new_argv, i);
 	}
 
-	/* replace orig. argv */
+	/* replace orig. argv (the old one stays in the exec arena) */
 	if (*argv != new_argv) {
-		/* FIXME: free the old vector. This leaks memory,
-		 * but since this is preparing for exec,
-		 * the problem will disappear soon anyway..
-		*/
 		*argv = new_argv;
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"%s: argv (new_argc=%d) was replaced.", __func__, i);
@@ -354,14 +415,11 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		new_file_name = offset_to_ruletree_string_ptr(
 			execpp_rule->rtree_xpr_new_filename_offs, NULL);
 		if (new_file_name) {
-#if 0 /* FIXME */
-			if (*file) free(*file);
-#endif
-			*file = strdup(new_file_name);
+			*file = exec_arena_strdup(new_file_name);
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"%s: new filename '%s'.",
 				__func__, new_file_name);
-			(*argv)[0] = strdup(*file);
+			(*argv)[0] = exec_arena_strdup(*file);
 		}
 	}
 
@@ -374,13 +432,13 @@ int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp)
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"%s: num.env.vars = %d, allocate +2",
 			__func__, orig_envc);
-		new_envp = (char **)calloc(orig_envc + 2 + 1, sizeof(char *));
+		new_envp = exec_arena_alloc((orig_envc + 2 + 1) * sizeof(char *));
 		/* copy old env. */
 		for (k = 0; k < orig_envc; k++) {
-			new_envp[k] = strdup((*envp)[k]);
+			new_envp[k] = exec_arena_strdup((*envp)[k]);
 		}
-		new_envp[orig_envc] = strdup("LDBOX_DISABLE_MAPPING=1");
-		new_envp[orig_envc+1] = strdup("LDBOX_DISABLE_ARGVENVP=1");
+		new_envp[orig_envc] = exec_arena_strdup("LDBOX_DISABLE_MAPPING=1");
+		new_envp[orig_envc+1] = exec_arena_strdup("LDBOX_DISABLE_ARGVENVP=1");
 		new_envp[orig_envc+2] = NULL;
 		*envp = new_envp;
 	}
@@ -113,3 +113,77 @@ ruletree_object_offset_t add_exec_policy_selection_rule_to_ruletree(
 	return(rule_location);
 }
 
+
+/* Create a hash table (keyed by the binary name) for a list of exec
+ * preprocessing rules, and add it to the "argvmods_hash" catalog.
+ * This must be called after the list is complete.
+ * Returns location of the table, or 0 if there is no table.
+*/
+ruletree_object_offset_t ruletree_compile_exec_pp_hash(
+	const char *argvmods_name,
+	ruletree_object_offset_t rule_list_offs)
+{
+	uint32_t	rule_list_size;
+	uint32_t	num_slots = 16;
+	uint32_t	i;
+	size_t		table_size;
+	char		*buf;
+	ruletree_exec_pp_hash_t	*hp;
+	uint32_t	*slots;
+	ruletree_object_offset_t table_offs = 0;
+
+	if (!argvmods_name || !rule_list_offs) return(0);
+	rule_list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	if (rule_list_size == 0) return(0);
+
+	/* keep the load factor below 0.5 */
+	while (num_slots < 2 * rule_list_size) num_slots *= 2;
+
+	table_size = sizeof(ruletree_exec_pp_hash_t) +
+		num_slots * sizeof(uint32_t);
+	buf = calloc(1, table_size);
+	if (!buf) return(0);
+	hp = (ruletree_exec_pp_hash_t*)buf;
+	slots = (uint32_t*)(buf + sizeof(*hp));
+
+	hp->rtree_xph_rule_list_offs = rule_list_offs;
+	hp->rtree_xph_rule_list_size = rule_list_size;
+	hp->rtree_xph_num_slots = num_slots;
+
+	for (i = 0; i < rule_list_size; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_exec_preprocessing_rule_t *rp;
+		const char	*binary_name;
+		uint32_t	slot;
+
+		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
+		if (!rule_offs) continue;
+		rp = offset_to_exec_preprocessing_rule_ptr(rule_offs);
+		if (!rp || !rp->rtree_xpr_binary_name_offs) continue;
+		binary_name = offset_to_ruletree_string_ptr(
+			rp->rtree_xpr_binary_name_offs, NULL);
+		if (!binary_name) continue;
+
+		slot = ruletree_exec_pp_hash_name(binary_name) & (num_slots - 1);
+		while (slots[slot]) slot = (slot + 1) & (num_slots - 1);
+		slots[slot] = i + 1;
+	}
+
+	/* "append_struct_to_ruletree_file" will fill the magic & type */
+	table_offs = append_struct_to_ruletree_file(buf, table_size,
+		LB_RULETREE_OBJECT_TYPE_EXEC_PP_HASH);
+	free(buf);
+
+	if (!table_offs) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"Failed to create hash table for argvmods '%s'",
+			argvmods_name);
+		return(0);
+	}
+	ruletree_catalog_set("argvmods_hash", argvmods_name, table_offs);
+
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"argvmods '%s' (%u rules): hash table @%u, %u slots",
+		argvmods_name, rule_list_size, table_offs, num_slots);
+	return(table_offs);
+}
@@ -115,6 +115,7 @@
 #include "liblb.h"
 #include "exported.h"
 #include "rule_tree.h"
+#include "rule_tree_rpc.h"
 #include "processclock.h"
 
 #include "lb_execs.h"
@@ -368,6 +369,19 @@ static enum binary_type inspect_elf_binary(const char *region,
 	return (BIN_UNKNOWN);
 }
 
+/* Length of the "#!" line at the beginning of a script, as
+ * prepare_hashbang() would read it, or 0 if it is too long */
+static size_t hashbang_line_length(const char *region, size_t size)
+{
+	size_t	max = LDBOX_MAXPATH - 1;
+	size_t	i;
+
+	for (i = 0; (i < size) && (i < max); i++) {
+		if ((region[i] == '\n') || (region[i] == '\0')) return(i + 1);
+	}
+	return((size <= max) ? size : 0);
+}
+
 static enum binary_type inspect_binary(const char *filename,
 	int check_x_permission,
 	struct binary_info *info)
@@ -376,6 +390,8 @@ static enum binary_type inspect_binary(const char *filename,
 	enum binary_type retval;
 	int fd, j;
 	struct stat status;
+	struct stat real_status;
+	int cacheable = 0;
 	char *region;
 	unsigned int ei_data;
 	uint16_t e_machine;
@@ -445,6 +461,33 @@ static enum binary_type inspect_binary(const char *filename,
 		}
 	}
 
+	/* The result may be in the session-wide cache already; then
+	 * there is no need to open and read the file. */
+	if (info && (real_stat(filename, &real_status) == 0) &&
+	    S_ISREG(real_status.st_mode) && (real_status.st_size >= 4)) {
+		exec_inspect_cache_entry_t ce;
+
+		if (exec_inspect_cache_find(&real_status, &ce)) {
+			status = real_status;
+			i_virtualize_struct_stat(__func__, &status, NULL);
+			info->mode = status.st_mode;
+			info->uid = status.st_uid;
+			info->gid = status.st_gid;
+			info->machine = ce.eice_machine;
+			info->data = ce.eice_elf_data;
+			info->has_capabilities = ce.eice_has_capabilities;
+			info->pt_interp = ce.eice_pt_interp;
+			info->hashbang = ce.eice_hashbang;
+			info->hashbang_len = ce.eice_hashbang_len;
+			retval = ce.eice_binary_type;
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"%s: found from cache, type=%d => out",
+				__func__, retval);
+			goto _out;
+		}
+		cacheable = 1;
+	}
+
 	fd = open_nomap_nolog(filename, O_RDONLY, 0);
 	if (fd < 0) {
 		retval = BIN_HOST_DYNAMIC; /* can't peek in to look, assume dynamic */
@@ -467,6 +510,15 @@ static enum binary_type inspect_binary(const char *filename,
 		info->gid = status.st_gid;
 	}
 
+	/* is this still the file that was stat'ed? */
+	if (cacheable &&
+	    ((status.st_dev != real_status.st_dev) ||
+	     (status.st_ino != real_status.st_ino) ||
+	     (status.st_size != real_status.st_size) ||
+	     (status.st_mtim.tv_sec != real_status.st_mtim.tv_sec) ||
+	     (status.st_mtim.tv_nsec != real_status.st_mtim.tv_nsec)))
+		cacheable = 0;
+
 	if (!S_ISREG(status.st_mode) && !S_ISLNK(status.st_mode)) {
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"%s: not REG/LNK => out", __func__);
@@ -588,6 +640,20 @@ static enum binary_type inspect_binary(const char *filename,
 	}
 
 _out_munmap:
+	if (info && (retval == BIN_HASHBANG)) {
+		size_t	len = hashbang_line_length(region, status.st_size);
+
+		/* for prepare_hashbang() */
+		if (len && (info->hashbang = malloc(len + 1)) != NULL) {
+			memcpy(info->hashbang, region, len);
+			info->hashbang[len] = '\0';
+			info->hashbang_len = len;
+		}
+	}
+	if (cacheable)
+		exec_inspect_cache_add(&real_status, retval, info,
+			(info ? info->hashbang : NULL),
+			(info ? info->hashbang_len : 0));
 	munmap(region, status.st_size);
 _out_close:
 	close_nomap_nolog(fd);
@@ -600,7 +666,8 @@ static int prepare_hashbang(
 	char *orig_file,
 	char ***argvp,
 	char ***envpp,
-	const char *exec_policy_name)
+	const char *exec_policy_name,
+	const struct binary_info *info)
 {
 	int argc, fd, c, i, j, n;
 	char ch;
@@ -612,21 +679,30 @@ static int prepare_hashbang(
 	char *tmp = NULL, *mapped_binaryname = NULL;
 	int result = 0;
 
-	if ((fd = open_nomap(*mapped_file, O_RDONLY)) < 0) {
-		/* unexpected error, just run it */
-		return 0;
-	}
+	if (info && info->hashbang &&
+	    (info->hashbang_len >= 2) &&
+	    (info->hashbang_len < LDBOX_MAXPATH)) {
+		/* inspect_binary() already got the first line */
+		c = info->hashbang_len;
+		memcpy(hashbang, info->hashbang, c);
+	} else {
+		if ((fd = open_nomap(*mapped_file, O_RDONLY)) < 0) {
+			/* unexpected error, just run it */
+			return 0;
+		}
 
-	if ((c = read(fd, &hashbang[0], LDBOX_MAXPATH - 1)) < 2) {
-		/* again unexpected error, close fd and run it */
+		if ((c = read(fd, &hashbang[0], LDBOX_MAXPATH - 1)) < 2) {
+			/* again unexpected error, close fd and run it */
+			close_nomap_nolog(fd);
+			return 0;
+		}
 		close_nomap_nolog(fd);
-		return 0;
 	}
 
 	argc = elem_count(*argvp);
 
 	/* extra element for hashbang argument */
-	new_argv = calloc(argc + 3, sizeof(char *));
+	new_argv = exec_arena_alloc((argc + 3) * sizeof(char *));
 
 	/* skip any initial whitespace following "#!" */
 	for (i = 2; (hashbang[i] == ' ' 
@@ -644,13 +720,13 @@ static int prepare_hashbang(
 				if (n == 0) {
 					char *ptr = &hashbang[j];
 					strcpy(interpreter, ptr);
-					new_argv[n++] = strdup(interpreter);
+					new_argv[n++] = exec_arena_strdup(interpreter);
 				} else {
 					/* this was the one and only
 					 * allowed argument for the
 					 * interpreter
 					 */
-					interp_arg = strdup(&hashbang[j]);
+					interp_arg = exec_arena_strdup(&hashbang[j]);
 					new_argv[n++] = interp_arg;
 					break;
 				}
@@ -660,7 +736,7 @@ static int prepare_hashbang(
 		if (ch == '\n' || ch == 0) break;
 	}
 
-	new_argv[n++] = strdup(orig_file); /* the unmapped script path */
+	new_argv[n++] = exec_arena_strdup(orig_file); /* the unmapped script path */
 	for (i = 1; (*argvp)[i] != NULL && i < argc; ) {
 		new_argv[n++] = (*argvp)[i++];
 	}
@@ -698,7 +774,6 @@ static int prepare_hashbang(
 	case 2:
                 LB_LOG(LB_LOGLEVEL_DEBUG,
                         "%s: <2> Use ordinary path mapping", __func__);
-		if (mapped_interpreter) free(mapped_interpreter);
                 mapped_interpreter = NULL;
                 {
                         mapping_results_t       mapping_result;
@@ -707,11 +782,12 @@ static int prepare_hashbang(
                         ldbox_map_path_for_exec("script_interp",
                                 interpreter, &mapping_result);
                         if (mapping_result.mres_result_buf) {
-                                mapped_interpreter =
-                                        strdup(mapping_result.mres_result_buf);
+                                mapped_interpreter = exec_arena_strdup(
+                                        mapping_result.mres_result_buf);
                         }
                         if (mapping_result.mres_exec_policy_name)
-				c_new_exec_policy_name = strdup(mapping_result.mres_exec_policy_name);
+				c_new_exec_policy_name = exec_arena_strdup(
+					mapping_result.mres_exec_policy_name);
 			else
 				c_new_exec_policy_name = NULL;
                         free_mapping_results(&mapping_result);
@@ -723,8 +799,6 @@ static int prepare_hashbang(
 		break;
 	case -1:
 		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: <-1> exec denied", __func__);
-		if (mapped_interpreter) free(mapped_interpreter);
-		mapped_interpreter = NULL;
 		return(-1);
 	default:
                 LB_LOG(LB_LOGLEVEL_ERROR,
@@ -780,9 +854,9 @@ static char **duplicate_argv(char *const *argv)
 	char	**my_argv;
 
 	LB_LOG(LB_LOGLEVEL_NOISE2, "duplicate_argv: argc=%d", argc);
-	my_argv = (char **)calloc(argc + 1, sizeof(char *));
+	my_argv = exec_arena_alloc((argc + 1) * sizeof(char *));
 	for (i = 0, p = (char **)argv; *p; p++) {
-		my_argv[i++] = strdup(*p);
+		my_argv[i++] = exec_arena_strdup(*p);
 		LB_LOG(LB_LOGLEVEL_NOISE2, "duplicate_argv: [%d] = '%s'", i-1, my_argv[i-1]);
 	}
 	my_argv[i] = NULL;
@@ -876,16 +950,18 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 		switch (**p) {
 		case 'L':
 			if (strncmp("LD_PRELOAD=", *p, strlen("LD_PRELOAD=")) == 0) {
-				if (asprintf(&user_ld_preload,
-					"__LB_%s", *p) < 0) {
+				user_ld_preload = exec_arena_asprintf(
+					"__LB_%s", *p);
+				if (!user_ld_preload) {
 					LB_LOG(LB_LOGLEVEL_ERROR,
 						"asprintf failed to create __LB_%s", *p);
 				}
 				continue;
 			}
 			if (strncmp("LD_LIBRARY_PATH=", *p, strlen("LD_LIBRARY_PATH=")) == 0) {
-				if (asprintf(&user_ld_library_path,
-					"__LB_%s", *p) < 0) {
+				user_ld_library_path = exec_arena_asprintf(
+					"__LB_%s", *p);
+				if (!user_ld_library_path) {
 					LB_LOG(LB_LOGLEVEL_ERROR,
 						"asprintf failed to create __LB_%s", *p);
 				}
@@ -941,9 +1017,9 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 				"restored to %s", ldbox_mapping_method);
 	}
 
-	/* allocate new environment. Add 15 extra elements (all may not be
+	/* allocate new environment. Add 17 extra elements (all may not be
 	 * needed always) */
-	my_envp = (char **)calloc(envc + 15, sizeof(char *));
+	my_envp = exec_arena_alloc((envc + 17) * sizeof(char *));
 
 	for (i = 0, p=(char **)envp; *p; p++) {
 		if (strncmp(*p, "__LB_", strlen("__LB_")) == 0) {
@@ -1028,11 +1104,12 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 			}
 			break;
 		}
-		my_envp[i++] = strdup(*p);
+		my_envp[i++] = exec_arena_strdup(*p);
 	}
 
 	/* add our session directory */
-	if (asprintf(&(my_envp[i]), "LDBOX_SESSION_DIR=%s", ldbox_session_dir) < 0) {
+	my_envp[i] = exec_arena_asprintf("LDBOX_SESSION_DIR=%s", ldbox_session_dir);
+	if (!my_envp[i]) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"asprintf failed to create LDBOX_SESSION_DIR");
 	} else {
@@ -1041,7 +1118,9 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 
 	/* add our mapping method, if needed */
 	if (ldbox_mapping_method) {
-		if (asprintf(&(my_envp[i]), "LDBOX_MAPPING_METHOD=%s", ldbox_mapping_method) < 0) {
+		my_envp[i] = exec_arena_asprintf("LDBOX_MAPPING_METHOD=%s",
+			ldbox_mapping_method);
+		if (!my_envp[i]) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"asprintf failed to create LDBOX_MAPPING_METHOD");
 		} else {
@@ -1051,8 +1130,9 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 
 	/* add mode, if not using the default mode */
 	if (ldbox_session_mode && (has_ldbox_session_mode==0)) {
-		if (asprintf(&(my_envp[i]), "LDBOX_SESSION_MODE=%s",
-		     ldbox_session_mode) < 0) {
+		my_envp[i] = exec_arena_asprintf("LDBOX_SESSION_MODE=%s",
+		     ldbox_session_mode);
+		if (!my_envp[i]) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"asprintf failed to create LDBOX_SESSION_MODE");
 		} else {
@@ -1063,7 +1143,8 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 	/* add virtual uid & gid info.
 	 * at this point we don't know it is has SUID/SGID bits, we'll fix that
 	 * later if it has those */
-	my_envp[i] = vperm_export_ids_as_string_for_exec("LDBOX_VPERM_IDS=", 0,0,0, user_vperm_request);
+	my_envp[i] = exec_arena_take(vperm_export_ids_as_string_for_exec(
+		"LDBOX_VPERM_IDS=", 0,0,0, user_vperm_request));
 	if (!my_envp[i]) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"vperm_export_ids_as_string to create LDBOX_VPERM_IDS");
@@ -1077,8 +1158,9 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 		LB_LOG(LB_LOGLEVEL_NOTICE,
 		       "Detected attempt to clear LDBOX_SIGTRAP, "
 		       "restored to %s", getenv("LDBOX_SIGTRAP"));
-		if (asprintf(&(my_envp[i]), "LDBOX_SIGTRAP=%s",
-			     getenv("LDBOX_SIGTRAP")) < 0) {
+		my_envp[i] = exec_arena_asprintf("LDBOX_SIGTRAP=%s",
+			     getenv("LDBOX_SIGTRAP"));
+		if (!my_envp[i]) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 			       "asprintf failed to create LDBOX_SIGTRAP");
 		} else {
@@ -1090,13 +1172,15 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 	 * to the new process so that it's available even before
 	 * its main function is called
 	 */
-	if (asprintf(&new_binaryname_var, "__LB_BINARYNAME=%s", binaryname) < 0) {
+	new_binaryname_var = exec_arena_asprintf("__LB_BINARYNAME=%s", binaryname);
+	if (!new_binaryname_var) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"asprintf failed to create __LB_BINARYNAME");
 	}
 	my_envp[i++] = new_binaryname_var; /* add the new process' name */
 
-	if (asprintf(&new_orig_file_var, "__LB_ORIG_BINARYNAME=%s", orig_file) < 0) {
+	new_orig_file_var = exec_arena_asprintf("__LB_ORIG_BINARYNAME=%s", orig_file);
+	if (!new_orig_file_var) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"asprintf failed to create __LB_ORIG_BINARYNAME");
 	}
@@ -1106,14 +1190,15 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 	 * it is the name of script, otherwise it is same as
 	 *  __LB_ORIG_BINARYNAME
 	*/
-	if (asprintf(&new_exec_file_var, "__LB_EXEC_BINARYNAME=%s", orig_file) < 0) {
+	new_exec_file_var = exec_arena_asprintf("__LB_EXEC_BINARYNAME=%s", orig_file);
+	if (!new_exec_file_var) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"asprintf failed to create __LB_EXEC_BINARYNAME");
 	}
 	my_envp[i++] = new_exec_file_var; /* add the new process' name */
 
 	/* allocate slot for __LB_REAL_BINARYNAME that is filled later on */
-	my_envp[i++] = strdup("__LB_REAL_BINARYNAME=");
+	my_envp[i++] = exec_arena_strdup("__LB_REAL_BINARYNAME=");
 
 	/* add user's versions of LD_PRELOAD and LD_LIBRARY_PATH */
 	if (user_ld_preload != NULL) {
@@ -1127,13 +1212,27 @@ static char **prepare_envp_for_do_exec(const char *orig_file,
 
 	if (ldbox_chroot_path) {
 		/* chroot simulation is active, relay the value */
-		if (asprintf(&new_exec_file_var, "__LB_CHROOT_PATH=%s", ldbox_chroot_path) < 0) {
+		new_exec_file_var = exec_arena_asprintf("__LB_CHROOT_PATH=%s",
+			ldbox_chroot_path);
+		if (!new_exec_file_var) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"asprintf failed to create __LB_CHROOT_PATH");
 		}
 		my_envp[i++] = new_exec_file_var;
 	}
 
+	/* relay the tracked cwd, the new program doesn't need to
+	 * reverse it again (not if the mode is changed, though) */
+	if (!has_ldbox_session_mode) {
+		char	*host_cwd_var, *virtual_cwd_var;
+
+		if (pathmapping_cache_export_tracked_cwd(&host_cwd_var,
+		    &virtual_cwd_var) == 0) {
+			my_envp[i++] = exec_arena_take(host_cwd_var);
+			my_envp[i++] = exec_arena_take(virtual_cwd_var);
+		}
+	}
+
 	my_envp[i] = NULL;
 
 	return(my_envp);
@@ -1216,14 +1315,12 @@ static void change_environment_variable(
 	size_t idx;
 
 	if (strvec_contains_prefix(my_envp, var_prefix, &idx)) {
-		char *new_value_buf, *orig_value;
+		char *new_value_buf;
 
-		/* release the placeholder */
-		orig_value = my_envp[idx];
-		free(orig_value);
-
-		if (asprintf(&new_value_buf, "%s%s",
-		    var_prefix, new_value) < 0) {
+		/* the placeholder stays in the exec arena */
+		new_value_buf = exec_arena_asprintf("%s%s",
+		    var_prefix, new_value);
+		if (!new_value_buf) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"asprintf failed to create new value %s%s",
 				var_prefix, new_value);
@@ -1250,10 +1347,12 @@ static void simulate_suid_and_sgid_if_needed(
 
 		new_vperm_str = vperm_export_ids_as_string_for_exec("",
 			info->mode, info->uid, info->gid, NULL);
-		change_environment_variable(my_envp, "LDBOX_VPERM_IDS=", new_vperm_str);
+		change_environment_variable(
+			my_envp, "LDBOX_VPERM_IDS=", new_vperm_str);
 
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"Simulate SUID/SGID, new vperm str=%s", new_vperm_str);
+		free(new_vperm_str);
 
 		/* SUID/SGID simulation works fine with qemu,
 		 * but print warnings for host-compatible binaries
@@ -1414,11 +1513,10 @@ static int prepare_exec(const char *exec_fn_name,
 	LB_LOG(LB_LOGLEVEL_NOISE,
 		"%s: exec_policy_name='%s'", __func__, exec_policy_name);
 
-	tmp = strdup(orig_file);
-	binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
-	free(tmp);
+	tmp = exec_arena_strdup(orig_file);
+	binaryname = exec_arena_strdup(basename(tmp)); /* basename may modify *tmp */
 	
-	my_file = strdup(orig_file);
+	my_file = exec_arena_strdup(orig_file);
 
 	my_argv = duplicate_argv(orig_argv);
 
@@ -1439,11 +1537,11 @@ static int prepare_exec(const char *exec_fn_name,
 		/* (e.g. we came back from run_hashbang()) */
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"prepare_exec(): no double mapping, my_file = %s", my_file);
-		mapped_file = strdup(my_file);
+		mapped_file = exec_arena_strdup(my_file);
 	} else if (strvec_contains_prefix(my_envp, "LDBOX_DISABLE_MAPPING=1", NULL)) {
 		LB_LOG(LB_LOGLEVEL_DEBUG,
 			"do_exec(): mapping disabled, my_file = %s", my_file);
-		mapped_file = strdup(my_file);
+		mapped_file = exec_arena_strdup(my_file);
 
 		/* we won't call ldbox_map_path_for_exec() because mapping
 		 * is disabled.  */
@@ -1458,9 +1556,9 @@ static int prepare_exec(const char *exec_fn_name,
 		START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk3, "map_path_for_exec");
 		ldbox_map_path_for_exec("do_exec", my_file, &mapping_result);
 		mapped_file = (mapping_result.mres_result_buf ?
-			strdup(mapping_result.mres_result_buf) : NULL);
+			exec_arena_strdup(mapping_result.mres_result_buf) : NULL);
 		exec_policy_name = (mapping_result.mres_exec_policy_name ?
-			strdup(mapping_result.mres_exec_policy_name) : NULL);
+			exec_arena_strdup(mapping_result.mres_exec_policy_name) : NULL);
 		STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk3, mapped_file);
 
 		if (mapping_result.mres_errno) {
@@ -1515,7 +1613,8 @@ static int prepare_exec(const char *exec_fn_name,
 			/* prepare_hashbang() will call prepare_exec()
 			 * recursively */
 			ret = prepare_hashbang(&mapped_file, my_file,
-					&my_argv, &my_envp, exec_policy_name);
+					&my_argv, &my_envp, exec_policy_name,
+					&info);
 			break;
 
 		case BIN_HOST_DYNAMIC:
@@ -1678,21 +1777,27 @@ static int prepare_exec(const char *exec_fn_name,
 	err = errno;
 	STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, orig_file);
 	if (info.pt_interp) free(info.pt_interp);
+	if (info.hashbang) free(info.hashbang);
 	errno = err;
 	return(ret);
 }
 
-int do_exec(int *result_errno_ptr,
+/* Run the exec preparations of do_exec(): preprocessing, mapping,
+ * inspection and postprocessing of the file. Returns 0 if the exec may
+ * proceed, and then *new_file, *new_argv and *new_envp contain what
+ * should be executed (all are NULL if mapping is disabled). Otherwise
+ * returns -1 and *result_errno_ptr tells why the exec was denied.
+ * The results are allocated from the current exec arena.
+*/
+static int do_exec_prepare(int *result_errno_ptr,
 	const char *exec_fn_name, const char *orig_file,
-	char *const *orig_argv, char *const *orig_envp)
+	char *const *orig_argv, char *const *orig_envp,
+	char **new_file, char ***new_argv, char ***new_envp)
 {
-	char *new_file = NULL;
-	char **new_argv = NULL;
-	char **new_envp = NULL;
-	int  result;
-	PROCESSCLOCK(clk1)
+	*new_file = NULL;
+	*new_argv = NULL;
+	*new_envp = NULL;
 
-	START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "do_exec");
 	if (getenv("LDBOX_DISABLE_MAPPING")) {
 		/* just run it, don't worry, be happy! */
 	} else {
@@ -1718,17 +1823,18 @@ int do_exec(int *result_errno_ptr,
 				binaryname, orig_envp);
 		}
 		
-		new_envp = prepare_envp_for_do_exec(orig_file, binaryname, orig_envp);
+		*new_envp = prepare_envp_for_do_exec(orig_file, binaryname, orig_envp);
+		free(binaryname);
 
 		r = prepare_exec(exec_fn_name, NULL/*exec_policy_name: not yet known*/,
 			orig_file, 0, orig_argv, orig_envp,
-			&type, &new_file, &new_argv, &new_envp);
+			&type, new_file, new_argv, new_envp);
 
 		if (LB_LOG_IS_ACTIVE(LB_LOGLEVEL_DEBUG)) {
 			int saved_errno = errno;
 			/* find out and log if preprocessing did something */
-			compare_and_log_strvec_changes("argv", orig_argv, new_argv);
-			compare_and_log_strvec_changes("envp", my_envp_copy, new_envp);
+			compare_and_log_strvec_changes("argv", orig_argv, *new_argv);
+			compare_and_log_strvec_changes("envp", my_envp_copy, *new_envp);
 			errno = saved_errno;
 		}
 
@@ -1736,43 +1842,144 @@ int do_exec(int *result_errno_ptr,
 			*result_errno_ptr = errno;
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"EXEC denied by prepare_exec(), %s", orig_file);
-			STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "Exec denied");
 			return(r); /* exec denied */
 		}
 
 		if (check_envp_has_ld_preload_and_ld_library_path(
-			new_envp ? new_envp : orig_envp) == 0) {
+			*new_envp ? *new_envp : orig_envp) == 0) {
 
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"exec(%s) failed, internal configuration error: "
 				"LD_LIBRARY_PATH and/or LD_PRELOAD were not set "
 				"by exec mapping logic", orig_file);
 			*result_errno_ptr = EINVAL;
-			STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "Config error");
 			return(-1);
 		}
 	}
+	return(0);
+}
 
+int do_exec(int *result_errno_ptr,
+	const char *exec_fn_name, const char *orig_file,
+	char *const *orig_argv, char *const *orig_envp)
+{
+	char *new_file = NULL;
+	char **new_argv = NULL;
+	char **new_envp = NULL;
+	exec_arena_t *arena;
+	int  result;
+	PROCESSCLOCK(clk1)
+
+	START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "do_exec");
+	arena = exec_arena_begin();
+	if (!arena) {
+		*result_errno_ptr = ENOMEM;
+		STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "Out of memory");
+		return(-1);
+	}
+	if (do_exec_prepare(result_errno_ptr, exec_fn_name, orig_file,
+		orig_argv, orig_envp, &new_file, &new_argv, &new_envp) < 0) {
+		exec_arena_free(arena);
+		STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "Exec denied");
+		return(-1);
+	}
+	exec_arena_end(arena);
+
+	pathmapping_reverse_cache_publish_stats();
 	errno = *result_errno_ptr; /* restore to orig.value */
 	STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, orig_file);
+	lblog_flush();
 	result = lb_next_execve(
 		(new_file ? new_file : orig_file),
 		(new_argv ? new_argv : orig_argv),
 		(new_envp ? new_envp : orig_envp));
 	*result_errno_ptr = errno;
+	exec_arena_free(arena);
 	LB_LOG(LB_LOGLEVEL_DEBUG,
 		"EXEC failed (%s), errno=%d", orig_file, *result_errno_ptr);
 	return(result);
 }
 
+/* Prepare an exec on behalf of posix_spawn(): Everything that do_exec()
+ * would do before calling execve() is done here, in the parent. The
+ * results are returned in *new_file, *new_argv and *new_envp (all are
+ * NULL if mapping is disabled, then the originals must be used). They
+ * are allocated from the arena that is returned in *arenap, which must
+ * be released with do_spawn_release() after the child has been started.
+ * Returns 0 or an errno value, like posix_spawn() does.
+*/
+int do_spawn_prepare(const char *exec_fn_name, const char *orig_file,
+	char *const *orig_argv, char *const *orig_envp,
+	char **new_file, char ***new_argv, char ***new_envp,
+	struct exec_arena_s **arenap)
+{
+	int	err = 0;
+	PROCESSCLOCK(clk1)
+
+	START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "do_spawn_prepare");
+	*new_file = NULL;
+	*new_argv = NULL;
+	*new_envp = NULL;
+	*arenap = exec_arena_begin();
+	if (!*arenap) {
+		STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "Out of memory");
+		return(ENOMEM);
+	}
+	if (do_exec_prepare(&err, exec_fn_name, orig_file,
+		orig_argv, orig_envp, new_file, new_argv, new_envp) < 0) {
+		exec_arena_free(*arenap);
+		*arenap = NULL;
+		*new_file = NULL;
+		*new_argv = NULL;
+		*new_envp = NULL;
+		STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "Spawn denied");
+		return(err ? err : ENOEXEC);
+	}
+	exec_arena_end(*arenap);
+
+	STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, orig_file);
+	return(0);
+}
+
+/* Release the results of do_spawn_prepare() */
+void do_spawn_release(struct exec_arena_s *arena)
+{
+	exec_arena_free(arena);
+}
+
+/* Copy a vector and its strings to a single malloc'ed block */
+static char **copy_strvec(char *const *v)
+{
+	int	n = elem_count(v);
+	size_t	size = (n + 1) * sizeof(char *);
+	char	**block;
+	char	*cp;
+	int	i;
+
+	for (i = 0; i < n; i++) size += strlen(v[i]) + 1;
+	block = malloc(size);
+	if (!block) return(NULL);
+	cp = (char *)(block + n + 1);
+	for (i = 0; i < n; i++) {
+		block[i] = cp;
+		cp = stpcpy(cp, v[i]) + 1;
+	}
+	block[n] = NULL;
+	return(block);
+}
+
 /* ----- EXPORTED from interface.master: ----- */
+/* The results are malloc'ed; each of the vectors is a single
+ * allocation with its strings. */
 int lbshow__execve_mods__(
 	char *file,
 	char *const *orig_argv, char *const *orig_envp,
 	char **new_file, char ***new_argv, char ***new_envp)
 {
 	int	ret = 0;
+	int	err;
 	char	*tmp, *binaryname;
+	exec_arena_t *arena;
 
 	if (!lb_global_vars_initialized__) lb_initialize_global_variables();
 
@@ -1780,20 +1987,30 @@ int lbshow__execve_mods__(
 
 	if (!file) return(ret);
 
+	arena = exec_arena_begin();
+	if (!arena) {
+		errno = ENOMEM;
+		return(-1);
+	}
+
 	tmp = strdup(file);
 	binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
 	free(tmp);
 
 	*new_envp = prepare_envp_for_do_exec(file, binaryname, orig_envp);
+	free(binaryname);
 
 	ret = prepare_exec("lbshow_exec", NULL/*exec_policy_name*/,
 		file, 0, orig_argv, orig_envp,
 		NULL, new_file, new_argv, new_envp);
+	err = errno;
 
-	if (!*new_file) *new_file = strdup(file);
-	if (!*new_argv) *new_argv = duplicate_argv(orig_argv);
-	if (!*new_envp) *new_envp = duplicate_argv(orig_envp);
+	*new_file = strdup(*new_file ? *new_file : file);
+	*new_argv = copy_strvec(*new_argv ? *new_argv : orig_argv);
+	*new_envp = copy_strvec(*new_envp ? *new_envp : orig_envp);
+	exec_arena_free(arena);
 
+	errno = err;
 	return(ret);
 }
 
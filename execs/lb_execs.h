@@ -11,10 +11,23 @@
 #define __EXEC_INTERNAL_H
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "rule_tree.h"
 
 extern int apply_exec_preprocessing_rules(char **file, char ***argv, char ***envp);
 
+/* memory for the exec preparations (exec_arena.c) */
+typedef struct exec_arena_s exec_arena_t;
+
+extern exec_arena_t *exec_arena_begin(void);
+extern void exec_arena_end(exec_arena_t *arena);
+extern void exec_arena_free(exec_arena_t *arena);
+extern void *exec_arena_alloc(size_t size);
+extern char *exec_arena_strdup(const char *s);
+extern char *exec_arena_asprintf(const char *fmt, ...);
+extern char *exec_arena_take(char *s);
+
 extern const char *find_exec_policy_name(const char *mapped_path, const char *virtual_path);
 
 /* Exec policies are stored to catalogs in the rule tree;
@@ -70,8 +83,30 @@ struct binary_info {
 
 	char *pt_interp;
 	int has_capabilities; /* flag */
+
+	/* first line of a script, if it was read by inspect_binary() */
+	char *hashbang;
+	size_t hashbang_len;
 };
 
+/* session-wide cache for results of inspect_binary()
+ * (exec_inspect_cache.c) */
+typedef struct exec_inspect_cache_entry_s {
+	int		eice_binary_type;
+	uint16_t	eice_machine;
+	uint8_t		eice_elf_data;
+	int		eice_has_capabilities;
+	char		*eice_pt_interp;	/* NULL if none */
+	char		*eice_hashbang;		/* NULL if not stored */
+	size_t		eice_hashbang_len;
+} exec_inspect_cache_entry_t;
+
+extern int exec_inspect_cache_find(const struct stat *st,
+	exec_inspect_cache_entry_t *ce);
+extern void exec_inspect_cache_add(const struct stat *st,
+	int binary_type, const struct binary_info *info,
+	const char *hashbang, size_t hashbang_len);
+
 #define exec_policy_handle_is_valid(eph) ((eph).exec_policy_offset != 0)
 
 /* Use CPU transparency even if binaries are compatible with host */
@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <stdint.h>
 #include <stdarg.h>
 
 /* WARNING!!
@@ -47,6 +48,34 @@ struct lbcontext {
 	/* for path mapping logic: */
 	char *host_cwd;
 	char *virtual_reversed_cwd;
+
+	/* set by the mapping engine if the result of the current
+	 * mapping operation depends on something else than the path
+	 * and rules (env.vars, exec policy, file existence, etc),
+	 * i.e. the result must not be cached. */
+	int mapping_result_not_cacheable;
+
+	/* Set by the mapping engine if a symlink was followed, or if
+	 * the selected rule was binary-specific. Used by the
+	 * session-wide shared path cache (see paths_shared_cache.c) */
+	int mapping_result_followed_symlink;
+	int mapping_result_depends_on_binary_name;
+
+	/* Set by path resolution: the longest host path which was
+	 * checked for symlinks (malloc'ed), if the checked prefixes
+	 * were mapped by one rule. "..._mapped_separately" is set if
+	 * prefixes were mapped separately (then there is no single
+	 * host path which would cover all of them) */
+	char *mapping_result_resolution_host_path;
+	int mapping_result_prefixes_mapped_separately;
+
+	/* Set by the mapping engine when the result is an union
+	 * directory: rule tree offset of the list of source dirs */
+	uint32_t mapping_result_union_dir_src_list;
+
+	/* exec: the arena of the exec preparations that are in
+	 * progress in this thread (see execs/exec_arena.c) */
+	struct exec_arena_s *exec_arena;
 };
 
 /* Library interface version string:
@@ -170,7 +199,7 @@ struct lbcontext {
 /* This version string is used to check that init.lua offers
  * what lbrdbd expects, and v.v.
 */
-#define LBRDBD_LUA_C_INTERFACE_VERSION "301"
+#define LBRDBD_LUA_C_INTERFACE_VERSION "304"
 
 /* get lbcontext, without activating lua: */
 extern struct lbcontext *get_lbcontext(void);
@@ -188,6 +217,11 @@ extern int lb_next_execve(const char *filename, char *const argv [],
 
 extern int do_exec(int *result_errno_ptr, const char *exec_fn_name, const char *file,
 		char *const *argv, char *const *envp);
+extern int do_spawn_prepare(const char *exec_fn_name, const char *file,
+		char *const *argv, char *const *envp,
+		char **new_file, char ***new_argv, char ***new_envp,
+		struct exec_arena_s **arenap);
+extern void do_spawn_release(struct exec_arena_s *arena);
 
 extern time_t get_lb_timestamp(void);
 
@@ -221,6 +255,8 @@ extern void lblog_vprintf_line_to_logfile(const char *file, int line,
 	int level, const char *format, va_list ap);
 extern void lblog_printf_line_to_logfile(const char *file, int line,
 	int level, const char *format,...);
+extern void lblog_flush(void);
+extern void lblog_forget_logfile_fd(int fd);
 
 extern int lb_loglevel__; /* do not access directly */
 extern int lb_log_initial_pid__; /* current PID will be recorded here
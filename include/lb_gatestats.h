@@ -0,0 +1,137 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#ifndef LB_GATESTATS_H__
+#define LB_GATESTATS_H__
+
+/* ------------ Per-gate statistics ------------
+ *
+ * Every public wrapper generated by gen-interface.pl counts its
+ * calls, how many of them had a path mapped to another path
+ * ("mapped") or left as is ("unmapped"), how many returned with
+ * a changed errno, and the time spent in the call as a log2
+ * histogram. Counters are always on; they are kept in a shared,
+ * mmapped file in the session directory, and "lb-show stats"
+ * reads them while the session is running.
+ * Calls that do not return (exit(), a successful exec) and calls
+ * made before liblb has been initialized are not counted.
+ *
+ * The file is named after a hash of the gate table (names, slot
+ * count, structure sizes), so liblb builds with different gate
+ * sets (e.g. 32 and 64 bit) use different files.
+ *
+ * To keep threads and processes from competing for the same
+ * cache lines, each gate has LB_GATESTATS_NUM_SLOTS counter sets;
+ * a thread picks one by its stack address. Counters are updated
+ * with atomic adds, so sharing a slot is still safe.
+ * (see lblib/lb_gatestats.c)
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#define LB_GATESTATS_MAGIC	0x4c424753	/* "LBGS" */
+#define LB_GATESTATS_VERSION	1
+
+#define LB_GATESTATS_NUM_SLOTS	64	/* a power of two */
+
+/* histogram bucket N counts calls that took [2^N, 2^(N+1)) ns;
+ * the last bucket counts everything above that. */
+#define LB_GATESTATS_HIST_BUCKETS	32
+
+/* One set of counters: five cache lines */
+typedef struct lb_gatestats_counters_s {
+	uint64_t	lbgc_calls;
+	uint64_t	lbgc_mapped;
+	uint64_t	lbgc_unmapped;
+	uint64_t	lbgc_errors;
+	uint64_t	lbgc_total_ns;
+	uint64_t	lbgc_hist[LB_GATESTATS_HIST_BUCKETS];
+	uint64_t	lbgc_reserved[3];
+} lb_gatestats_counters_t;
+
+/* File header. The file has three parts: this header, gate names
+ * (lbgh_num_gates '\0'-terminated strings, in gate index order)
+ * and counters, lb_gatestats_counters_t[num_slots][num_gates] */
+typedef struct lb_gatestats_header_s {
+	volatile uint32_t	lbgh_magic;	/* set when initialized */
+	uint32_t	lbgh_version;
+	uint32_t	lbgh_layout_hash;
+	uint32_t	lbgh_num_gates;
+	uint32_t	lbgh_num_slots;
+	uint32_t	lbgh_counters_size;
+	uint64_t	lbgh_file_size;
+	uint64_t	lbgh_names_offs;
+	uint64_t	lbgh_counters_offs;
+	uint64_t	lbgh_created_us;
+} lb_gatestats_header_t;
+
+#define LB_GATESTATS_HEADER_SIZE	4096
+
+#define LB_GATESTATS_FILENAME_FORMAT	"%s/GateStats-%08x.bin"
+
+static inline lb_gatestats_counters_t *lb_gatestats_counters(
+	const lb_gatestats_header_t *hdr, unsigned int slot, unsigned int gate)
+{
+	return((lb_gatestats_counters_t *)((char *)hdr +
+		hdr->lbgh_counters_offs) +
+		(uint64_t)slot * hdr->lbgh_num_gates + gate);
+}
+
+/* liblb interface (lblib/lb_gatestats.c) */
+
+/* The gate table, created by gen-interface.pl -G to wrappers.c */
+extern const char *lb_gatestats_gate_names__[];
+extern const unsigned int lb_gatestats_num_gates__;
+
+extern lb_gatestats_header_t *lb_gatestats_hdr__; /* do not access directly */
+
+#define LB_GATESTATS_IS_ACTIVE() (lb_gatestats_hdr__ != NULL)
+
+/* Flags for lb_gatestats_call_t: */
+#define LB_GATESTATS_CALL_MAPPED	0x1
+#define LB_GATESTATS_CALL_UNMAPPED	0x2
+
+/* State of one call. The generated wrappers declare this with
+ * the "cleanup" attribute, so that lbgatestats_end() is called
+ * at every return from the wrapper. */
+typedef struct lb_gatestats_call_s {
+	int		lbgs_gate;	/* -1 = not counted */
+	int		lbgs_saved_errno;
+	uint32_t	lbgs_flags;
+	uint64_t	lbgs_start_ns;
+} lb_gatestats_call_t;
+
+extern void lbgatestats_init(void);
+extern uint64_t lbgatestats_time_ns(void);
+extern void lbgatestats_end(lb_gatestats_call_t *call);
+
+/* Returns the initial state; called before the wrapper touches errno */
+static inline lb_gatestats_call_t lbgatestats_start(int gate)
+{
+	lb_gatestats_call_t call;
+
+	call.lbgs_flags = 0;
+	call.lbgs_saved_errno = errno;
+	if (LB_GATESTATS_IS_ACTIVE()) {
+		call.lbgs_gate = gate;
+		call.lbgs_start_ns = lbgatestats_time_ns();
+	} else {
+		call.lbgs_gate = -1;
+		call.lbgs_start_ns = 0;
+	}
+	return(call);
+}
+
+/* called by the wrappers after a path has been mapped */
+static inline void lbgatestats_mapped(lb_gatestats_call_t *call,
+	const char *orig_path, const char *mapped_path)
+{
+	if ((call->lbgs_gate < 0) || !orig_path || !mapped_path) return;
+	call->lbgs_flags |= (strcmp(orig_path, mapped_path) ?
+		LB_GATESTATS_CALL_MAPPED : LB_GATESTATS_CALL_UNMAPPED);
+}
+
+#endif /* LB_GATESTATS_H__ */
@@ -15,6 +15,7 @@ extern int lb_map_network_addr(
         const char *protocol,
         const char *addr_type,
         const char *orig_dst_addr,
+        const void *orig_dst_addr_bin, /* in_addr/in6_addr, or NULL */
         int orig_port,
         char *result_addr_buf,
         int result_addr_buf_len,
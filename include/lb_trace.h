@@ -0,0 +1,120 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#ifndef LB_TRACE_H__
+#define LB_TRACE_H__
+
+/* ------------ Binary trace ring ------------
+ *
+ * An alternative to text logging: When LDBOX_TRACE_RING is set
+ * (see option -Y of lb), every process of the session writes
+ * fixed-size binary records of path mappings, process starts and
+ * exits to a shared, mmapped file. Strings (paths, function and
+ * process names) are stored once to an interned string table,
+ * records refer to them by "string ids" (offsets to the string
+ * area; 0 = no string).
+ *
+ * The record area is a ring: When it is full, the oldest records
+ * are overwritten. lb-tracez reads the file and produces the same
+ * summaries as lb-logz produces from a text log.
+ *
+ * Everything is lock-free: records are reserved by an atomic
+ * increment of lbth_next_record, and strings are added with
+ * compare-and-swap to the hash table (see lblib/lb_trace.c)
+*/
+
+#include <stdint.h>
+
+#define LB_TRACE_MAGIC		0x4c425452	/* "LBTR" */
+#define LB_TRACE_VERSION	1
+
+#define LB_TRACE_NUM_RECORDS	(1024*1024)
+#define LB_TRACE_NUM_STR_SLOTS	(1024*1024)
+#define LB_TRACE_STRINGS_SIZE	(64*1024*1024)
+
+/* Record types: */
+#define LB_TRACE_REC_START	1	/* func=exec name, vpath=exec policy,
+					 * mpath=mapping mode, arg=ppid */
+#define LB_TRACE_REC_MAPPED	2	/* func, vpath -> mpath, value=errno */
+#define LB_TRACE_REC_PASS	3	/* func, vpath, value=errno */
+#define LB_TRACE_REC_DISABLED	4	/* func, vpath (mapping was disabled) */
+#define LB_TRACE_REC_EXIT	5	/* func, value=exit status */
+#define LB_TRACE_REC_CHILD	6	/* func, arg=child pid,
+					 * value=status from wait() */
+
+/* flags: */
+#define LB_TRACE_FLAG_READONLY	0x1
+
+typedef struct lb_trace_record_s {
+	volatile uint64_t	lbtr_seq;	/* index+1; 0 = being written */
+	uint64_t	lbtr_time_us;
+	uint32_t	lbtr_pid;
+	uint16_t	lbtr_type;
+	uint16_t	lbtr_flags;
+	uint32_t	lbtr_proc;	/* string id: process name */
+	uint32_t	lbtr_func;	/* string id: function name */
+	uint32_t	lbtr_vpath;	/* string id: virtual path */
+	uint32_t	lbtr_mpath;	/* string id: mapped (host) path */
+	int32_t		lbtr_value;
+	uint32_t	lbtr_arg;
+} lb_trace_record_t;
+
+/* An interned string. String id is offset of this
+ * structure from beginning of the string area. */
+typedef struct lb_trace_string_s {
+	uint32_t	lbts_hash;
+	uint32_t	lbts_len;	/* not including the '\0' */
+	char		lbts_str[];
+} lb_trace_string_t;
+
+/* File header. The file has four parts: this header, records,
+ * hash table of strings (string ids) and strings. */
+typedef struct lb_trace_header_s {
+	volatile uint32_t	lbth_magic;	/* set when initialized */
+	uint32_t	lbth_version;
+	uint32_t	lbth_record_size;
+	uint32_t	lbth_num_records;	/* a power of two */
+	uint32_t	lbth_num_str_slots;	/* a power of two */
+	uint32_t	lbth_padding;
+	uint64_t	lbth_file_size;
+	uint64_t	lbth_records_offs;
+	uint64_t	lbth_str_slots_offs;
+	uint64_t	lbth_strings_offs;
+	uint64_t	lbth_strings_size;
+	uint64_t	lbth_created_us;
+
+	/* updated by all processes: */
+	volatile uint64_t	lbth_next_record;
+	volatile uint64_t	lbth_strings_used;
+	volatile uint32_t	lbth_strings_dropped;
+} lb_trace_header_t;
+
+#define LB_TRACE_HEADER_SIZE	4096
+
+static inline const char *lb_trace_string(
+	const lb_trace_header_t *hdr, uint32_t id)
+{
+	if (!id || id >= hdr->lbth_strings_size) return(NULL);
+	return(((const lb_trace_string_t *)((const char *)hdr +
+		hdr->lbth_strings_offs + id))->lbts_str);
+}
+
+static inline const lb_trace_record_t *lb_trace_records(
+	const lb_trace_header_t *hdr)
+{
+	return((const lb_trace_record_t *)((const char *)hdr +
+		hdr->lbth_records_offs));
+}
+
+/* liblb interface (lblib/lb_trace.c) */
+extern int lb_trace_active__;	/* do not access directly */
+
+#define LB_TRACE_IS_ACTIVE() (lb_trace_active__ > 0)
+
+extern void lbtrace_init(void);
+extern void lbtrace_record(int type, const char *func,
+	const char *vpath, const char *mpath, int value, uint32_t arg,
+	int flags);
+
+#endif /* LB_TRACE_H__ */
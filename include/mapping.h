@@ -41,6 +41,13 @@ typedef struct mapping_results_s {
 	/* Flag: set if the result has been marked read only */
 	int	mres_readonly;
 
+	/* Flag: set if the path is an union directory; the result
+	 * is then the first source directory (see union_dirs.c) */
+	int	mres_union_dir;
+	/* rule tree offset of the list of source directories
+	 * of the union directory */
+	uint32_t	mres_union_dir_src_list;
+
 	/* errno: non-zero if an error was detected during
 	 * mapping. The interface code should then return
 	 * this value to the application (in the "standard"
@@ -121,10 +128,45 @@ extern int lb_execve_postprocess(const char *exec_type,
 extern char *scratchbox_reverse_path(
 	const char *func_name, const char *full_path, uint32_t classmask);
 
-extern const char *fdpathdb_find_path(int fd);
-
+extern const char *fdpathdb_find_path(int fd, char *buf, size_t bufsize);
+
+/* forward mapping result cache (pathmapping/pathmapping_cache.c) */
+extern void pathmapping_cache_invalidate(void);
+extern void pathmapping_cache_cwd_changed(void);
+extern void pathmapping_cache_log_stats(void);
+extern uint32_t pathmapping_cache_get_cwd_generation(void);
+extern int pathmapping_cache_get_tracked_cwd(
+	char *host_cwd, size_t host_cwd_size, char **virtual_cwdp);
+extern void pathmapping_cache_set_tracked_cwd(uint32_t cwd_generation,
+	const char *host_cwd, const char *virtual_cwd);
+extern char *pathmapping_cache_get_inherited_virtual_cwd(const char *host_cwd);
+extern int pathmapping_cache_export_tracked_cwd(
+	char **host_cwd_var, char **virtual_cwd_var);
+extern void pathmapping_cache_suspend_cwd_tracking(int suspend);
+extern int pathmapping_reverse_cache_find(const char *binary_name,
+	const char *abs_host_path, uint32_t fn_class, char **virtual_pathp);
+extern void pathmapping_reverse_cache_add(const char *binary_name,
+	const char *abs_host_path, uint32_t fn_class, const char *virtual_path);
+extern void pathmapping_reverse_cache_publish_stats(void);
+
+/* session-wide shared result cache (pathmapping/paths_shared_cache.c) */
+extern int create_shared_pathcache_file(const char *session_dir);
+extern void shared_pathcache_host_path_modified(const char *host_path);
+extern void shared_pathcache_log_stats(void);
+extern void shared_pathcache_add_reverse_cache_stats(
+	unsigned long hits, unsigned long misses);
+extern int shared_pathcache_get_reverse_cache_stats(
+	uint64_t *hitsp, uint64_t *missesp);
+
+/* session-wide exec inspection cache (execs/exec_inspect_cache.c) */
+extern int create_exec_inspect_cache_file(const char *session_dir);
+
+/* union directories (preload/union_dirs.c) */
 extern char *prep_union_dir(const char *dst_path,
 		const char **src_paths, int num_real_dir_entries);
+extern void union_dir_register_fd(int fd, const mapping_results_t *res);
+extern void union_dir_dup_fd(int fd, int new_fd);
+extern void union_dir_forget_fd(int fd);
 
 /* ---- internal constants: ---- */
 
@@ -140,6 +182,7 @@ extern char *prep_union_dir(const char *dst_path,
 #define LB_MAPPING_RULE_FLAGS_READONLY_FS_IF_NOT_ROOT	010
 #define LB_MAPPING_RULE_FLAGS_READONLY_FS_ALWAYS	020
 #define LB_MAPPING_RULE_FLAGS_FORCE_ORIG_PATH_UNLESS_CHROOT	040
+#define LB_MAPPING_RULE_FLAGS_UNION_DIR			0100
 
 /* list of all known flags: The preload library will log a warning, if 
  * the mapping code (in Lua) returns unknown flags. This is important
@@ -153,7 +196,8 @@ extern char *prep_union_dir(const char *dst_path,
 	 LB_MAPPING_RULE_FLAGS_FORCE_ORIG_PATH | \
 	 LB_MAPPING_RULE_FLAGS_FORCE_ORIG_PATH_UNLESS_CHROOT | \
 	 LB_MAPPING_RULE_FLAGS_READONLY_FS_IF_NOT_ROOT | \
-	 LB_MAPPING_RULE_FLAGS_READONLY_FS_ALWAYS)
+	 LB_MAPPING_RULE_FLAGS_READONLY_FS_ALWAYS | \
+	 LB_MAPPING_RULE_FLAGS_UNION_DIR)
 
 /* Interface classes. 
  * These can be used as conditions in path mapping rules.
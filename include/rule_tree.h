@@ -18,6 +18,25 @@
 #ifndef LB_RULETREE_H__
 #define LB_RULETREE_H__
 
+#include <string.h>
+
+/* FNV-1a. Used for the hash tables in the rule tree and in the
+ * session-wide caches. Start with LB_FNV1A32_INIT; calls can
+ * be chained to hash several fields. */
+#define LB_FNV1A32_INIT	2166136261U
+
+static inline uint32_t lb_fnv1a32(uint32_t h, const void *data, size_t len)
+{
+	const unsigned char *cp = (const unsigned char *)data;
+	const unsigned char *end = cp + len;
+
+	for (; cp < end; cp++) {
+		h ^= *cp;
+		h *= 16777619U;
+	}
+	return(h);
+}
+
 /* object offset must be an unsigned type: */
 typedef uint32_t ruletree_object_offset_t;
 
@@ -43,6 +62,11 @@ typedef struct ruletree_object_hdr_s {
 #define LB_RULETREE_OBJECT_TYPE_EXEC_PP_RULE	14	/* ruletree_exec_preprocessing_rule_t */
 #define LB_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE	15	/* ruletree_exec_policy_selection_rule_t */
 #define LB_RULETREE_OBJECT_TYPE_NET_RULE	21	/* ruletree_net_rule_t */
+#define LB_RULETREE_OBJECT_TYPE_FSRULE_INDEX	22	/* ruletree_fsrule_index_t */
+#define LB_RULETREE_OBJECT_TYPE_INODESTAT_INDEX	23	/* ruletree_inodestat_index_t */
+#define LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS	24	/* ruletree_inodestat_buckets_t */
+#define LB_RULETREE_OBJECT_TYPE_EXEC_PP_HASH	25	/* ruletree_exec_pp_hash_t */
+#define LB_RULETREE_OBJECT_TYPE_NET_RULE_INDEX	26	/* ruletree_net_rule_index_t */
 
 typedef struct ruletree_hdr_s {
 	ruletree_object_hdr_t	rtree_hdr_objhdr;	/* [0], size 8 */
@@ -54,11 +78,16 @@ typedef struct ruletree_hdr_s {
 	uint64_t		rtree_min_mmap_addr;		/* [16], size 8; for clients */
 
 	uint32_t		rtree_file_size;
-	uint32_t		rtree_max_size;			/* used when mmap'ing */
+	uint32_t		rtree_max_size;			/* limit for growing the file */
 	uint32_t		rtree_min_client_socket_fd;	/* for clients */
+
+	/* incremented whenever a catalog entry or an object list
+	 * is modified; clients use this to detect that cached
+	 * results (e.g. path mapping results) may be stale. */
+	uint32_t		rtree_generation;
 } ruletree_hdr_t;
 
-#define RULE_TREE_VERSION	6
+#define RULE_TREE_VERSION	11
 
 /* catalogs are lists of name+value pairs
  * (the value can be a rule, string, or another catalog).
@@ -97,6 +126,44 @@ typedef struct ruletree_fsrule_s {
 
 } ruletree_fsrule_t;
 
+/* Compiled index for a list of FS rules (or exec policy selection
+ * rules, which use the same selector types): A prefix trie of the
+ * selectors, so that the candidate rules for a path can be found
+ * by walking the path once. The header is followed by three arrays:
+ * nodes, edges and rule references. Node 0 is the root. The edges
+ * of a node are sorted by the character.
+ * The index is created by lbrdbd after the rule list is complete,
+ * and is found via the "fsrule_index" catalog (name = offset of
+ * the rule list as a decimal number).
+*/
+typedef struct ruletree_fsrule_index_s {
+	ruletree_object_hdr_t		rtree_fri_objhdr;
+
+	ruletree_object_offset_t	rtree_fri_rule_list_offs;
+	uint32_t			rtree_fri_rule_list_size;
+	uint32_t			rtree_fri_num_nodes;
+	uint32_t			rtree_fri_num_edges;
+	uint32_t			rtree_fri_num_refs;
+} ruletree_fsrule_index_t;
+
+typedef struct ruletree_fsrule_index_node_s {
+	uint32_t	rtree_frin_first_edge;
+	uint32_t	rtree_frin_num_edges;
+	uint32_t	rtree_frin_first_ref;
+	uint32_t	rtree_frin_num_refs;
+} ruletree_fsrule_index_node_t;
+
+typedef struct ruletree_fsrule_index_edge_s {
+	uint32_t	rtree_frie_char;
+	uint32_t	rtree_frie_node;
+} ruletree_fsrule_index_edge_t;
+
+/* a rule reference is (index in the rule list << 2) | type: */
+#define LB_RULETREE_FSRULE_INDEX_REF_PREFIX	0
+#define LB_RULETREE_FSRULE_INDEX_REF_DIR	1
+#define LB_RULETREE_FSRULE_INDEX_REF_PATH	2
+#define LB_RULETREE_FSRULE_INDEX_REF_ALWAYS	3 /* rule has a condition */
+
 typedef struct ruletree_exec_preprocessing_rule_s {
 	ruletree_object_hdr_t		rtree_xpr_objhdr;
 
@@ -110,6 +177,29 @@ typedef struct ruletree_exec_preprocessing_rule_s {
         uint32_t			rtree_xpr_disable_mapping;
 } ruletree_exec_preprocessing_rule_t;
 
+/* Hash table for a list of exec preprocessing ("argvmods") rules,
+ * keyed by the binary name. The header is followed by the slots;
+ * a slot contains (index in the rule list + 1), or 0 if it is unused.
+ * Open addressing with linear probing, rules with the same name are
+ * in the order of the rule list.
+ * The table is created by lbrdbd after the rule list is complete,
+ * and is found via the "argvmods_hash" catalog (by the same name
+ * as the list in the "argvmods" catalog).
+*/
+typedef struct ruletree_exec_pp_hash_s {
+	ruletree_object_hdr_t		rtree_xph_objhdr;
+
+	ruletree_object_offset_t	rtree_xph_rule_list_offs;
+	uint32_t			rtree_xph_rule_list_size;
+	uint32_t			rtree_xph_num_slots;	/* a power of two */
+	uint32_t			rtree_xph_padding;
+} ruletree_exec_pp_hash_t;
+
+static inline uint32_t ruletree_exec_pp_hash_name(const char *name)
+{
+	return(lb_fnv1a32(LB_FNV1A32_INIT, name, strlen(name)));
+}
+
 typedef struct ruletree_exec_policy_selection_rule_s {
 	ruletree_object_hdr_t		rtree_xps_objhdr;
 
@@ -149,6 +239,39 @@ typedef struct ruletree_inodestat_s {
 	inodesimu_t		rtree_inode_simu;
 } ruletree_inodestat_t;
 
+/* Index of the inodestats: A hash table of 64-byte buckets, keyed by
+ * (dev,ino). Every bucket holds three entries and a link to an
+ * overflow bucket. The table is replaced by a larger one when it
+ * gets full; rtree_isi_buckets is updated after the new table is
+ * complete, so readers need no locks. There is only one writer
+ * (lbrdbd).
+*/
+typedef struct ruletree_inodestat_index_s {
+	ruletree_object_hdr_t		rtree_isi_objhdr;
+	volatile ruletree_object_offset_t rtree_isi_buckets;
+	uint32_t			rtree_isi_num_entries;
+	uint32_t			rtree_isi_num_overflow_buckets;
+	uint32_t			rtree_isi_num_resizes;
+} ruletree_inodestat_index_t;
+
+#define RULETREE_INODESTAT_BUCKET_ENTRIES	3
+
+typedef struct ruletree_inodestat_bucket_s {
+	uint64_t			rtree_isb_ino[RULETREE_INODESTAT_BUCKET_ENTRIES];
+	uint64_t			rtree_isb_dev[RULETREE_INODESTAT_BUCKET_ENTRIES];
+	/* offsets of ruletree_inodestat_t objects, 0 = free */
+	volatile ruletree_object_offset_t rtree_isb_value[RULETREE_INODESTAT_BUCKET_ENTRIES];
+	/* a ruletree_inodestat_buckets_t with one bucket */
+	volatile ruletree_object_offset_t rtree_isb_overflow;
+} ruletree_inodestat_bucket_t;
+
+/* the buckets follow this header in the file */
+typedef struct ruletree_inodestat_buckets_s {
+	ruletree_object_hdr_t		rtree_isbs_objhdr;
+	uint32_t			rtree_isbs_num_buckets; /* power of two */
+	uint32_t			rtree_isbs_reserved[13]; /* 64 bytes */
+} ruletree_inodestat_buckets_t;
+
 /* bit mask simulated_fields: */
 #define RULETREE_INODESTAT_SIM_UID	0x1	/* set when UID simulation is active */
 #define RULETREE_INODESTAT_SIM_GID	0x2	/* set when GID simulation is active */
@@ -229,11 +352,54 @@ typedef struct ruletree_net_rule_s {
 #define LB_RULETREE_NET_RULETYPE_ALLOW	1
 #define LB_RULETREE_NET_RULETYPE_RULES	2
 
+/* Precompiled form of a list of net rules: The header is followed by
+ * one ruletree_net_rule_match_t for every rule of the list, in the
+ * same order. Address patterns have been converted to binary address
+ * and mask (network byte order), and the names to hashes, so that
+ * rules can be matched without parsing or allocating anything.
+ * The index is created by lbrdbd after the rule list is complete,
+ * and is found via the "net_rule_index" catalog (name = offset of
+ * the rule list as a decimal number).
+*/
+typedef struct ruletree_net_rule_index_s {
+	ruletree_object_hdr_t		rtree_nri_objhdr;
+
+	ruletree_object_offset_t	rtree_nri_rule_list_offs;
+	uint32_t			rtree_nri_rule_list_size;
+} ruletree_net_rule_index_t;
+
+typedef struct ruletree_net_rule_match_s {
+	uint8_t				rtree_nrm_addr[16];
+	uint8_t				rtree_nrm_mask[16];
+	uint32_t			rtree_nrm_addr_match;	/* see below */
+	uint32_t			rtree_nrm_port;		/* 0 = any */
+	/* names: string offs. (0 = any) and a hash of the string */
+	ruletree_object_offset_t	rtree_nrm_func_name;
+	uint32_t			rtree_nrm_func_name_hash;
+	ruletree_object_offset_t	rtree_nrm_binary_name;
+	uint32_t			rtree_nrm_binary_name_hash;
+	ruletree_object_offset_t	rtree_nrm_rule_offs;	/* 0 = hole */
+	/* index of rtree_net_rules, if any */
+	ruletree_object_offset_t	rtree_nrm_subrules_index;
+} ruletree_net_rule_match_t;
+
+#define LB_RULETREE_NET_ADDR_MATCH_ANY	0	/* no address in the rule */
+#define LB_RULETREE_NET_ADDR_MATCH_NONE	1	/* unusable address pattern */
+#define LB_RULETREE_NET_ADDR_MATCH_IPV4	2	/* 4 bytes of addr & mask */
+#define LB_RULETREE_NET_ADDR_MATCH_IPV6	3	/* 16 bytes of addr & mask */
+
+static inline uint32_t ruletree_net_rule_hash_name(const char *name)
+{
+	return(lb_fnv1a32(LB_FNV1A32_INIT, name, strlen(name)));
+}
+
 /* ----------- rule_tree.c: ----------- */
 extern int ruletree_to_memory(void); /* 0 if ok, negative if rule tree is not available. */
 
 extern size_t ruletree_get_file_size(void);
 
+extern uint32_t ruletree_get_generation(void);
+
 extern int ruletree_get_min_client_socket_fd(void);
 
 extern ruletree_object_offset_t append_struct_to_ruletree_file(void *ptr, size_t size, uint32_t type);
@@ -301,13 +467,8 @@ typedef struct {
 	uint64_t	rfh_dev;     /* device containing it; used as key */
 	uint64_t	rfh_ino;     /* inode number; used as key */
 
-	/* bintree node offset, if known */
+	/* inodestat object offset, if known */
 	ruletree_object_offset_t	rfh_offs;
-
-	/* next two fields are filled by ruletree_find_inodestat(),
-	 * and used by ruletree_set_inodestat() */
-	ruletree_object_offset_t        rfh_last_visited_node;
-	int				rfh_last_result;
 } ruletree_inodestat_handle_t;
 
 #define ruletree_clear_inodestat_handle(p) \
@@ -335,6 +496,13 @@ extern ruletree_object_offset_t add_rule_to_ruletree(
 	int flags, const char *binary_name,
         int func_class, const char *exec_policy_name);
 
+extern ruletree_object_offset_t ruletree_compile_fsrule_index(
+	ruletree_object_offset_t rule_list_offs);
+extern int ruletree_rebuild_fsrule_indexes(void);
+
+extern int ruletree_find_first_selector_match(
+	ruletree_object_offset_t rule_list_offs, const char *path);
+
 /* ------------ exec rule maintenance routines ------------ */
 ruletree_object_offset_t add_exec_preprocessing_rule_to_ruletree(
         const char      *binary_name,
@@ -346,6 +514,10 @@ ruletree_object_offset_t add_exec_preprocessing_rule_to_ruletree(
         const char *new_filename,
         int disable_mapping);
 
+extern ruletree_object_offset_t ruletree_compile_exec_pp_hash(
+	const char *argvmods_name,
+	ruletree_object_offset_t rule_list_offs);
+
 ruletree_object_offset_t add_exec_policy_selection_rule_to_ruletree(
 	uint32_t	ruletype,
         const char      *selector,
@@ -355,6 +527,8 @@ ruletree_object_offset_t add_exec_policy_selection_rule_to_ruletree(
 /* ------------ net rule maintenance routines ------------ */
 ruletree_object_offset_t add_net_rule_to_ruletree(
 	ruletree_net_rule_t	*rule);
+extern ruletree_object_offset_t ruletree_compile_net_rule_index(
+	ruletree_object_offset_t rule_list_offs);
 
 /* ------------ rule_tree_utils.c: ------------ */
 
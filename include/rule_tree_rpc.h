@@ -14,7 +14,7 @@
  *   information to the rule tree.
 */
 
-#define RULETREE_RPC_PROTOCOL_VERSION	3
+#define RULETREE_RPC_PROTOCOL_VERSION	5
 
 /* Commands: Client -> server messages */
 typedef struct ruletree_rpc_msg_command_s {
@@ -36,6 +36,13 @@ typedef struct ruletree_rpc_msg_command_s {
 #define RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO	4
 #define RULETREE_RPC_MESSAGE_COMMAND__INIT2		5
 #define RULETREE_RPC_MESSAGE_COMMAND__GETFILEINFO	6
+#define RULETREE_RPC_MESSAGE_COMMAND__STATS		8
+
+/* SETFILEINFO, RELEASEFILEINFO and CLEARFILEINFO are one-way
+ * commands: The server does not send a reply. A GETFILEINFO from any
+ * client is answered only after every message that was in the
+ * server's sockets when it arrived has been executed.
+*/
 
 /* Replies: Server -> Client messages */
 typedef struct ruletree_rpc_msg_reply_hdr_s {
@@ -65,20 +72,22 @@ typedef struct ruletree_rpc_msg_reply_s {
 extern void ruletree_rpc__ping(void);
 extern char *ruletree_rpc__init2(void);
 
-extern void ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino);
+extern int ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino);
 
-extern void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
+extern int ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
 	int set_uid, uint32_t uid, int set_gid, uint32_t gid);
-extern void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
+extern int ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	int release_uid, int release_gid);
-extern void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
+extern int ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
 	mode_t mode, uint64_t rdev);
 
-extern void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
+extern int ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
 	mode_t real_mode, mode_t virt_mode, mode_t suid_sgid_bits);
-extern void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino);
+extern int ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino);
 
 extern int ruletree_rpc__get_inodestat(uint64_t dev, uint64_t ino,
 	inodesimu_t *istat_in_db);
 
+extern char *ruletree_rpc__stats(void);
+
 #endif /* LB_RULETREE_H__ */
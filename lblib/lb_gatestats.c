@@ -0,0 +1,257 @@
+/*
+ * Per-gate statistics: the writer side (see include/lb_gatestats.h)
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* The file is created like the trace ring (lb_trace.c): the first
+ * process creates it (O_EXCL), sets its size and writes the header
+ * and the gate names; lbgh_magic is set last. Other processes map
+ * the file after it has got its final size and the magic number.
+ * If anything goes wrong, statistics are just not collected in
+ * that process.
+ *
+ * The counter area is sparse; pages are allocated only for slots
+ * and gates that are actually used.
+ *
+ * clock_gettime() is looked up with dlsym(), because older glibc
+ * versions have it only in librt (which can't be linked to liblb,
+ * see preload/Makefile). gettimeofday() is used if it isn't found.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+
+#include <lb.h>
+#include <lb_gatestats.h>
+#include <rule_tree.h>
+#include <config.h>
+
+#include "exported.h"
+
+lb_gatestats_header_t *lb_gatestats_hdr__ = NULL;
+
+static int gatestats_init_done = 0;
+
+static int (*gatestats_clock_gettime)(clockid_t clk_id,
+	struct timespec *tp) = NULL;
+
+uint64_t lbgatestats_time_ns(void)
+{
+	struct timespec	ts;
+	struct timeval	tv;
+
+	if (gatestats_clock_gettime &&
+	    ((*gatestats_clock_gettime)(CLOCK_MONOTONIC, &ts) == 0))
+		return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	if (gettimeofday(&tv, (struct timezone *)NULL) < 0) return(0);
+	return((uint64_t)tv.tv_sec * 1000000000ULL +
+		(uint64_t)tv.tv_usec * 1000);
+}
+
+static uint32_t gatestats_layout_hash(void)
+{
+	uint32_t	h = LB_FNV1A32_INIT;
+	uint32_t	layout[3];
+	unsigned int	i;
+
+	for (i = 0; i < lb_gatestats_num_gates__; i++)
+		h = lb_fnv1a32(h, lb_gatestats_gate_names__[i],
+			strlen(lb_gatestats_gate_names__[i]) + 1);
+	layout[0] = LB_GATESTATS_NUM_SLOTS;
+	layout[1] = sizeof(lb_gatestats_counters_t);
+	layout[2] = LB_GATESTATS_VERSION;
+	return(lb_fnv1a32(h, layout, sizeof(layout)));
+}
+
+static uint64_t gatestats_names_size(void)
+{
+	uint64_t	size = 0;
+	unsigned int	i;
+
+	for (i = 0; i < lb_gatestats_num_gates__; i++)
+		size += strlen(lb_gatestats_gate_names__[i]) + 1;
+	return(size);
+}
+
+static int gatestats_create_file(const char *path, int fd, uint32_t hash)
+{
+	lb_gatestats_header_t *hdr;
+	uint64_t	names_size = gatestats_names_size();
+	uint64_t	counters_offs;
+	uint64_t	file_size;
+	char		*cp;
+	unsigned int	i;
+
+	counters_offs = (LB_GATESTATS_HEADER_SIZE + names_size + 4095) &
+		~4095ULL;
+	file_size = counters_offs + (uint64_t)LB_GATESTATS_NUM_SLOTS *
+		lb_gatestats_num_gates__ * sizeof(lb_gatestats_counters_t);
+
+	if (ftruncate(fd, file_size) < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"gatestats: Failed to set size of %s", path);
+		return(-1);
+	}
+	hdr = mmap(NULL, counters_offs, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) return(-1);
+	hdr->lbgh_version = LB_GATESTATS_VERSION;
+	hdr->lbgh_layout_hash = hash;
+	hdr->lbgh_num_gates = lb_gatestats_num_gates__;
+	hdr->lbgh_num_slots = LB_GATESTATS_NUM_SLOTS;
+	hdr->lbgh_counters_size = sizeof(lb_gatestats_counters_t);
+	hdr->lbgh_file_size = file_size;
+	hdr->lbgh_names_offs = LB_GATESTATS_HEADER_SIZE;
+	hdr->lbgh_counters_offs = counters_offs;
+	hdr->lbgh_created_us = lbgatestats_time_ns() / 1000;
+	cp = (char *)hdr + LB_GATESTATS_HEADER_SIZE;
+	for (i = 0; i < lb_gatestats_num_gates__; i++) {
+		size_t	len = strlen(lb_gatestats_gate_names__[i]) + 1;
+
+		memcpy(cp, lb_gatestats_gate_names__[i], len);
+		cp += len;
+	}
+	__sync_synchronize();
+	hdr->lbgh_magic = LB_GATESTATS_MAGIC;
+	munmap(hdr, counters_offs);
+	return(0);
+}
+
+/* Wait until the creator has initialized the file. */
+static lb_gatestats_header_t *gatestats_map_file(const char *path,
+	int fd, uint32_t hash)
+{
+	lb_gatestats_header_t *hdr;
+	struct stat	st;
+	int		i;
+
+	for (i = 0; i < 100; i++) {
+		if (fstat_nomap_nolog(fd, &st) < 0) return(NULL);
+		if (st.st_size >= LB_GATESTATS_HEADER_SIZE) {
+			hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+			if (hdr == MAP_FAILED) return(NULL);
+			if ((hdr->lbgh_magic == LB_GATESTATS_MAGIC) &&
+			    (hdr->lbgh_file_size == (uint64_t)st.st_size)) {
+				__sync_synchronize();
+				if ((hdr->lbgh_version == LB_GATESTATS_VERSION) &&
+				    (hdr->lbgh_layout_hash == hash) &&
+				    (hdr->lbgh_num_gates ==
+					lb_gatestats_num_gates__) &&
+				    (hdr->lbgh_num_slots ==
+					LB_GATESTATS_NUM_SLOTS))
+					return(hdr);
+				LB_LOG(LB_LOGLEVEL_WARNING,
+					"gatestats: %s has wrong layout", path);
+				munmap(hdr, st.st_size);
+				return(NULL);
+			}
+			munmap(hdr, st.st_size);
+		}
+		usleep(1000);
+	}
+	LB_LOG(LB_LOGLEVEL_WARNING, "gatestats: %s was not initialized", path);
+	return(NULL);
+}
+
+/* Called once in every process, when the global variables
+ * have been initialized. */
+void lbgatestats_init(void)
+{
+	char		*path = NULL;
+	int		fd;
+	uint32_t	hash;
+
+	if (gatestats_init_done) return;
+	gatestats_init_done = 1;
+	if (!ldbox_session_dir || !lb_gatestats_num_gates__) return;
+
+	gatestats_clock_gettime = dlsym(RTLD_DEFAULT, "clock_gettime");
+
+	hash = gatestats_layout_hash();
+	if (asprintf(&path, LB_GATESTATS_FILENAME_FORMAT,
+	    ldbox_session_dir, hash) < 0) return;
+
+	fd = open_nomap_nolog(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		S_IRUSR | S_IWUSR);
+	if (fd >= 0) {
+		if (gatestats_create_file(path, fd, hash) < 0) {
+			close_nomap_nolog(fd);
+			free(path);
+			return;
+		}
+	} else if (errno == EEXIST) {
+		fd = open_nomap_nolog(path, O_RDWR | O_CLOEXEC, 0);
+	}
+	if (fd < 0) {
+		LB_LOG(LB_LOGLEVEL_WARNING, "gatestats: Can't open %s", path);
+		free(path);
+		return;
+	}
+	lb_gatestats_hdr__ = gatestats_map_file(path, fd, hash);
+	close_nomap_nolog(fd);
+	free(path);
+}
+
+/* Pick a slot by the stack address: threads have their own stacks,
+ * and stacks of different processes are at random addresses. Bits
+ * below 64kB are ignored, so that the slot does not change with
+ * the call depth. */
+static unsigned int gatestats_slot(const void *stack_addr)
+{
+	uint64_t	a = (uintptr_t)stack_addr >> 16;
+
+	a *= 0x9E3779B97F4A7C15ULL;
+	return((unsigned int)(a >> 40) & (LB_GATESTATS_NUM_SLOTS - 1));
+}
+
+static int gatestats_bucket(uint64_t ns)
+{
+	int	b;
+
+	if (ns < 2) return(0);
+	b = 63 - __builtin_clzll(ns);
+	return(b < LB_GATESTATS_HIST_BUCKETS ? b : LB_GATESTATS_HIST_BUCKETS - 1);
+}
+
+/* The cleanup function of lb_gatestats_call_t */
+void lbgatestats_end(lb_gatestats_call_t *call)
+{
+	lb_gatestats_header_t	*hdr = lb_gatestats_hdr__;
+	lb_gatestats_counters_t	*c;
+	uint64_t		ns;
+	int			saved_errno = errno;
+
+	if (call->lbgs_gate < 0 || !hdr ||
+	    (unsigned int)call->lbgs_gate >= hdr->lbgh_num_gates)
+		return;
+
+	ns = lbgatestats_time_ns() - call->lbgs_start_ns;
+	c = lb_gatestats_counters(hdr, gatestats_slot(&c), call->lbgs_gate);
+
+	__sync_fetch_and_add(&c->lbgc_calls, 1);
+	if (call->lbgs_flags & LB_GATESTATS_CALL_MAPPED)
+		__sync_fetch_and_add(&c->lbgc_mapped, 1);
+	else if (call->lbgs_flags & LB_GATESTATS_CALL_UNMAPPED)
+		__sync_fetch_and_add(&c->lbgc_unmapped, 1);
+	if (saved_errno != call->lbgs_saved_errno)
+		__sync_fetch_and_add(&c->lbgc_errors, 1);
+	__sync_fetch_and_add(&c->lbgc_total_ns, ns);
+	__sync_fetch_and_add(&c->lbgc_hist[gatestats_bucket(ns)], 1);
+	errno = saved_errno;
+}
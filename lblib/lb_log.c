@@ -43,6 +43,7 @@
 #include <sys/resource.h>
 #include <sys/vfs.h>
 #include <sys/statvfs.h>
+#include <errno.h>
 
 #include <lb.h>
 #include <config.h>
@@ -121,37 +122,261 @@ static void make_log_timestamp(char *buf, size_t bufsize)
 		(unsigned int)now.tv_sec, (unsigned int)(now.tv_usec/1000));
 }
 
-/* Write a message block to a logfile.
+/* ----- The log file descriptor -----
  *
- * Note that a safer but slower design was selected intentionally:
- * a routine which always opens a file, writes the message and then closes
- * the file is really stupid if only performance is considered. Usually
- * anyone would open the log file only once and keep it open, but here
- * a different strategy was selected because this library should be transparent
- * to the running program and having an extra open fd hanging around might
- * introduce really peculiar problems with some programs.
+ * The log file is opened once and kept open. The descriptor is moved
+ * above LOGFILE_FD_MIN, so that it does not occupy the low numbers
+ * which programs may expect to get from their own open() calls, and
+ * it is always close-on-exec. The program may still close it or dup2()
+ * something on top of it: close(), dup2() and dup3() tell us about
+ * that (see fdpathdb.c), and dev+ino of the descriptor is checked
+ * before each write to catch the cases which bypass those gates.
+ * After fork() the child opens a descriptor of its own.
+ *
+ * The descriptor is protected by a lock which is never waited for:
+ * if it is busy (another thread is writing, or this thread was
+ * interrupted by a signal handler while writing) the message is
+ * written the old way, by opening the file for just this write.
 */
+#define LOGFILE_FD_MIN	200
+
+#ifdef O_CLOEXEC
+#define LOGFILE_OPEN_FLAGS (O_APPEND | O_WRONLY | O_CREAT | O_CLOEXEC)
+#else
+#define LOGFILE_OPEN_FLAGS (O_APPEND | O_WRONLY | O_CREAT)
+#endif
+#define LOGFILE_OPEN_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP \
+			   | S_IROTH | S_IWOTH)
+
+static struct lb_logfile_fd_s {
+	volatile int	lfd_lock;
+	volatile int	lfd_fd;
+	pid_t		lfd_pid;
+	dev_t		lfd_dev;
+	ino_t		lfd_ino;
+} lb_logfile_fd = {
+	.lfd_lock = 0,
+	.lfd_fd = -1,
+	.lfd_pid = 0,
+	.lfd_dev = 0,
+	.lfd_ino = 0,
+};
+
+/* Returns the log file descriptor, or -1. Must be called with the
+ * lock held. */
+static int get_logfile_fd(void)
+{
+	struct stat	st;
+	int		fd = lb_logfile_fd.lfd_fd;
+
+	if (fd >= 0) {
+		if (fstat_nomap_nolog(fd, &st) < 0 ||
+		    st.st_dev != lb_logfile_fd.lfd_dev ||
+		    st.st_ino != lb_logfile_fd.lfd_ino) {
+			/* Closed or replaced behind our back.
+			 * Not ours anymore, must not be closed. */
+			fd = -1;
+		} else if (lb_logfile_fd.lfd_pid != getpid()) {
+			/* inherited from the parent */
+			close_nomap_nolog(fd);
+			fd = -1;
+		}
+		if (fd < 0) lb_logfile_fd.lfd_fd = -1;
+	}
+	if (fd < 0) {
+		int	high_fd;
+
+		fd = open_nomap_nolog(lb_log_state.lbl_logfile,
+			LOGFILE_OPEN_FLAGS, LOGFILE_OPEN_MODE);
+		if (fd < 0) return(-1);
+#ifdef F_DUPFD_CLOEXEC
+		high_fd = fcntl_nomap_nolog(fd, F_DUPFD_CLOEXEC, LOGFILE_FD_MIN);
+#else
+		high_fd = fcntl_nomap_nolog(fd, F_DUPFD, LOGFILE_FD_MIN);
+		if (high_fd >= 0)
+			fcntl_nomap_nolog(high_fd, F_SETFD, FD_CLOEXEC);
+#endif
+		if (high_fd >= 0) {
+			close_nomap_nolog(fd);
+			fd = high_fd;
+		}
+		if (fstat_nomap_nolog(fd, &st) < 0) {
+			close_nomap_nolog(fd);
+			return(-1);
+		}
+		lb_logfile_fd.lfd_pid = getpid();
+		lb_logfile_fd.lfd_dev = st.st_dev;
+		lb_logfile_fd.lfd_ino = st.st_ino;
+		lb_logfile_fd.lfd_fd = fd;
+	}
+	return(fd);
+}
+
+/* Write a message block (one or more complete lines) to the logfile. */
 static void write_to_logfile(const char *msg, int msglen)
 {
 	int logfd;
+	int r; /* needed to get around some unnecessary warnings from gcc*/
 
-	if (lb_log_state.lbl_logfile[0]) {
-		if (lb_log_state.lbl_logfile[0] == '-' &&
-		    lb_log_state.lbl_logfile[1] == '\0') {
-			/* log to stdout. */
-			int r; /* needed to get around some unnecessary warnings from gcc*/
-			r = write(1, msg, msglen);
-			(void)r;
-		} else if ((logfd = open_nomap_nolog(lb_log_state.lbl_logfile,
-					O_APPEND | O_RDWR | O_CREAT,
-					S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP
-					| S_IROTH | S_IWOTH)) >= 0) {
-			int r; /* needed to get around some unnecessary warnings from gcc*/
+	if (!lb_log_state.lbl_logfile[0]) return;
+
+	if (lb_log_state.lbl_logfile[0] == '-' &&
+	    lb_log_state.lbl_logfile[1] == '\0') {
+		/* log to stdout. */
+		r = write(1, msg, msglen);
+		(void)r;
+	} else if (__sync_bool_compare_and_swap(&lb_logfile_fd.lfd_lock, 0, 1)) {
+		if ((logfd = get_logfile_fd()) >= 0) {
 			r = write(logfd, msg, msglen);
 			(void)r;
-			close_nomap_nolog(logfd);
+		}
+		__sync_lock_release(&lb_logfile_fd.lfd_lock);
+	} else if ((logfd = open_nomap_nolog(lb_log_state.lbl_logfile,
+				LOGFILE_OPEN_FLAGS, LOGFILE_OPEN_MODE)) >= 0) {
+		r = write(logfd, msg, msglen);
+		(void)r;
+		close_nomap_nolog(logfd);
+	}
+}
+
+/* ----- Per-thread line buffers -----
+ *
+ * Lines are collected to a buffer of the current thread, and written
+ * with one write() when the buffer gets full or the oldest line in it
+ * is older than LOG_BUFFER_MAX_AGE seconds, at exit, before exec
+ * and fork, and when the thread exits. Errors and warnings are
+ * written immediately (lb-monitor watches for those, and they
+ * should not be lost if the process crashes). Only complete lines
+ * are written, so lines from different processes and threads
+ * never get mixed even if the log file is shared.
+ *
+ * The buffers are never freed; a buffer of an exited thread is taken
+ * over by the next new thread. All buffers are kept in a list,
+ * so that lblog_flush() can write out the lines of other threads, too.
+*/
+#define LOG_BUFFER_SIZE	4096
+#define LOG_BUFFER_MAX_AGE	1
+
+typedef struct lb_log_buffer_s {
+	volatile int		lbb_busy;
+	volatile int		lbb_in_use;
+	int			lbb_len;
+	time_t			lbb_since;	/* time of the oldest line */
+	struct lb_log_buffer_s	*lbb_next;
+	char			lbb_data[LOG_BUFFER_SIZE];
+} lb_log_buffer_t;
+
+static lb_log_buffer_t *volatile lb_log_buffers = NULL;
+
+static pthread_key_t log_buffer_key;
+static pthread_once_t log_buffer_key_once = PTHREAD_ONCE_INIT;
+static int log_buffer_key_created = 0;
+
+static volatile int log_buffer_handlers_registered = 0;
+
+/* used only if pthread lib is not available: */
+static lb_log_buffer_t *my_log_buffer = NULL;
+
+/* Write out the lines. Must be called with lbb_busy set. */
+static void flush_log_buffer(lb_log_buffer_t *buf)
+{
+	if (buf->lbb_len > 0) {
+		write_to_logfile(buf->lbb_data, buf->lbb_len);
+		buf->lbb_len = 0;
+	}
+}
+
+/* pthread key destructor: the thread is exiting */
+static void release_log_buffer(void *ptr)
+{
+	lb_log_buffer_t *buf = ptr;
+
+	if (__sync_bool_compare_and_swap(&buf->lbb_busy, 0, 1)) {
+		flush_log_buffer(buf);
+		buf->lbb_busy = 0;
+	}
+	__sync_lock_release(&buf->lbb_in_use);
+}
+
+/* The only thread of a new child process: buffers of the other
+ * threads of the parent are copies, their lines belong to the parent. */
+static void log_buffers_after_fork_in_child(void)
+{
+	lb_log_buffer_t	*my_buf = NULL;
+	lb_log_buffer_t	*buf;
+
+	if (pthread_library_is_available) {
+		if (log_buffer_key_created && pthread_getspecific_fnptr)
+			my_buf = (*pthread_getspecific_fnptr)(log_buffer_key);
+	} else {
+		my_buf = my_log_buffer;
+	}
+	for (buf = lb_log_buffers; buf; buf = buf->lbb_next) {
+		buf->lbb_busy = 0;
+		if (buf != my_buf) {
+			buf->lbb_len = 0;
+			if (buf != my_log_buffer) buf->lbb_in_use = 0;
 		}
 	}
+	lb_logfile_fd.lfd_lock = 0;
+}
+
+static void alloc_log_buffer_key(void)
+{
+	if (pthread_key_create_fnptr &&
+	    ((*pthread_key_create_fnptr)(&log_buffer_key,
+			release_log_buffer) == 0))
+		log_buffer_key_created = 1;
+}
+
+/* returns the buffer of the current thread, or NULL if buffering
+ * is not possible */
+static lb_log_buffer_t *get_log_buffer(void)
+{
+	lb_log_buffer_t	*buf;
+
+	if (pthread_library_is_available) {
+		if (pthread_once_fnptr)
+			(*pthread_once_fnptr)(&log_buffer_key_once,
+				alloc_log_buffer_key);
+		if (!log_buffer_key_created ||
+		    !pthread_getspecific_fnptr || !pthread_setspecific_fnptr)
+			return(NULL);
+		buf = (*pthread_getspecific_fnptr)(log_buffer_key);
+	} else {
+		buf = my_log_buffer;
+	}
+	if (buf) return(buf);
+
+	for (buf = lb_log_buffers; buf; buf = buf->lbb_next) {
+		if (buf != my_log_buffer &&
+		    __sync_bool_compare_and_swap(&buf->lbb_in_use, 0, 1))
+			break;
+	}
+	if (!buf) {
+		buf = malloc(sizeof(*buf));
+		if (!buf) return(NULL);
+		buf->lbb_busy = 0;
+		buf->lbb_in_use = 1;
+		buf->lbb_len = 0;
+		buf->lbb_since = 0;
+		do {
+			buf->lbb_next = lb_log_buffers;
+		} while (!__sync_bool_compare_and_swap(&lb_log_buffers,
+				buf->lbb_next, buf));
+	}
+	if (pthread_library_is_available) {
+		(*pthread_setspecific_fnptr)(log_buffer_key, buf);
+	} else {
+		my_log_buffer = buf;
+	}
+
+	if (__sync_bool_compare_and_swap(&log_buffer_handlers_registered, 0, 1)) {
+		atexit(lblog_flush);
+		pthread_atfork(lblog_flush, NULL,
+			log_buffers_after_fork_in_child);
+	}
+	return(buf);
 }
 
 /* ===================== public functions ===================== */
@@ -281,131 +506,188 @@ void lblog_init(void)
 	lblog_init_level_logfile_format(NULL,NULL,NULL);
 }
 
-/* a vprintf-like routine for logging. This will
- * - prefix the line with current timestamp, log level of the message, and PID
- * - add a newline, if the message does not already end to a newline.
+/* Write out buffered lines of all threads. Called at exit and
+ * before exec (atexit() handlers are not called by exec or _exit())
 */
-void lblog_vprintf_line_to_logfile(
+void lblog_flush(void)
+{
+	lb_log_buffer_t	*buf;
+
+	for (buf = lb_log_buffers; buf; buf = buf->lbb_next) {
+		if (buf->lbb_len > 0 &&
+		    __sync_bool_compare_and_swap(&buf->lbb_busy, 0, 1)) {
+			flush_log_buffer(buf);
+			buf->lbb_busy = 0;
+		}
+	}
+}
+
+/* Called after the program has closed "fd" or made it a copy of
+ * another descriptor. If it was our log file, it must be forgotten
+ * (without closing it, it isn't ours anymore).
+*/
+void lblog_forget_logfile_fd(int fd)
+{
+	if ((fd >= 0) && (fd == lb_logfile_fd.lfd_fd))
+		lb_logfile_fd.lfd_fd = -1;
+}
+
+/* Format one log line to "line", which must have room for
+ * LOG_LINE_BUFSIZE bytes. Returns length of the line. */
+static int format_log_line(
+	char		*line,
 	const char	*file,
-	int		line,
+	int		srcline,
 	int		level,
 	const char	*format,
 	va_list		ap)
 {
 	char	tstamp[LOG_TIMESTAMP_BUFSIZE];
-	char	logmsg[LOG_MSG_MAXLEN];
-	char	finalmsg[LOG_LINE_BUFSIZE];
+	char	levelnum[16];
+	const char *levelname = NULL;
+	char	*logmsg;
+	int	len;
 	int	msglen;
-	char	*forbidden_chrp;
-	char	optional_src_location[LOG_SRCLOCATION_MAXLEN];
-	char	*levelname = NULL;
+	char	*cp;
 
-	if (lb_loglevel__ == LB_LOGLEVEL_uninitialized) lblog_init();
+	switch(level) {
+	case LB_LOGLEVEL_ERROR:		levelname = "ERROR"; break;
+	case LB_LOGLEVEL_WARNING:	levelname = "WARNING"; break;
+	case LB_LOGLEVEL_NETWORK:	levelname = "NET"; break;
+	case LB_LOGLEVEL_NOTICE:	levelname = "NOTICE"; break;
+	default:
+		/* default is to pass level info as numbers */
+		snprintf(levelnum, sizeof(levelnum), "%d", level);
+		levelname = levelnum;
+	}
 
+	/* First the fields before the message. Fields are separated
+	 * by tabs. */
 	if (lb_log_state.lbl_simple_format) {
-		*tstamp = '\0';
+		/* simple format. No timestamp or pid, this makes
+		 * it easier to compare logfiles.
+		*/
+		len = snprintf(line, LOG_LINE_BUFSIZE, "(%s)\t%s\t",
+			levelname, lb_log_state.lbl_binary_name);
 	} else {
-		/* first, the timestamp: */
 		if (level > LB_LOGLEVEL_WARNING) {
-			/* no timestamps to errors & warnings */
 			make_log_timestamp(tstamp, sizeof(tstamp));
 		} else {
+			/* no timestamps to errors & warnings */
 			*tstamp = '\0';
 		}
+		if (pthread_library_is_available && pthread_self_fnptr) {
+			pthread_t	tid = (*pthread_self_fnptr)();
+
+			len = snprintf(line, LOG_LINE_BUFSIZE,
+				"%s (%s)\t%s[%d/%ld]\t", tstamp, levelname,
+				lb_log_state.lbl_binary_name,
+				getpid(), (long)tid);
+		} else {
+			len = snprintf(line, LOG_LINE_BUFSIZE,
+				"%s (%s)\t%s[%d]\t", tstamp, levelname,
+				lb_log_state.lbl_binary_name, getpid());
+		}
 	}
+	if (len < 0) len = 0;
+	else if (len > LOG_LINE_BUFSIZE - LOG_MSG_MAXLEN -
+			LOG_SRCLOCATION_MAXLEN - 2)
+		len = LOG_LINE_BUFSIZE - LOG_MSG_MAXLEN -
+			LOG_SRCLOCATION_MAXLEN - 2;
 
-	/* next, print the log message to a buffer: */
-	msglen = vsnprintf(logmsg, sizeof(logmsg), format, ap);
+	/* next, print the log message directly after the headers: */
+	logmsg = line + len;
+	msglen = vsnprintf(logmsg, LOG_MSG_MAXLEN, format, ap);
 
 	if (msglen < 0) {
 		/* OOPS. should log an error message, but this is the
 		 * logger... can't do it */
 		logmsg[0] = '\0';
-	} else if (msglen > (int)sizeof(logmsg)) {
+	} else if (msglen > LOG_MSG_MAXLEN) {
 		/* message was truncated. logmsg[LOG_MSG_MAXLEN-1] is '\0' */
 		logmsg[LOG_MSG_MAXLEN-3] = logmsg[LOG_MSG_MAXLEN-2] = '.';
 	}
+	msglen = strlen(logmsg);
 
 	/* post-format the log message.
 	 *
-	 * First, clean all newlines: some people like to use \n chars in
-	 * messages, but that is forbidden (attempt to manually reformat
-	 * log messages *will* break all post-processing tools).
-	 * - remove trailing newline(s)
-	 * - replace embedded newlines by $
+	 * First, replace all newlines by $: some people like to use
+	 * \n chars in messages, but that is forbidden (attempt to manually
+	 * reformat log messages *will* break all post-processing tools).
 	 *
 	 * Second, replace all tabs by spaces because of similar reasons
-	 * as above. We'll use tabs to separate the pre-defined fields below.
+	 * as above. Tabs separate the pre-defined fields.
 	*/
-	while ((msglen > 0) && (logmsg[msglen-1] == '\n')) {
-		logmsg[msglen--] = '\0';
-	}
-	while ((forbidden_chrp = strchr(logmsg,'\n')) != NULL) {
-		*forbidden_chrp = '$'; /* newlines to $ */
-	}
-	while ((forbidden_chrp = strchr(logmsg,'\t')) != NULL) {
-		*forbidden_chrp = ' '; /* tabs to spaces */
+	for (cp = logmsg; cp < logmsg + msglen; cp++) {
+		if (*cp == '\n') *cp = '$';
+		else if (*cp == '\t') *cp = ' ';
 	}
+	len += msglen;
 
-	/* combine the timestamp and log message to another buffer.
-	 * here we use tabs to separate fields. Note that the location,
-	 * if present, should always be the last field (so that same
-	 * post-processing tools can be used in both cases)  */
+	/* Note that the location, if present, should always be the
+	 * last field (so that same post-processing tools can be used
+	 * in both cases)  */
 	if (lb_log_state.lbl_print_file_and_line) {
-		snprintf(optional_src_location, sizeof(optional_src_location), "\t[%s:%d]", file, line);
-	} else {
-		optional_src_location[0] = '\0';
-	}
+		int	n = snprintf(line + len, LOG_SRCLOCATION_MAXLEN,
+				"\t[%s:%d]", file, srcline);
 
-	switch(level) {
-	case LB_LOGLEVEL_ERROR:		levelname = "ERROR"; break;
-	case LB_LOGLEVEL_WARNING:	levelname = "WARNING"; break;
-	case LB_LOGLEVEL_NETWORK:	levelname = "NET"; break;
-	case LB_LOGLEVEL_NOTICE:	levelname = "NOTICE"; break;
-	/* default is to pass level info as numbers */
+		if (n > 0)
+			len += (n < LOG_SRCLOCATION_MAXLEN ?
+				n : LOG_SRCLOCATION_MAXLEN - 1);
 	}
-	
-	if (lb_log_state.lbl_simple_format) {
-		/* simple format. No timestamp or pid, this makes
-		 * it easier to compare logfiles.
-		*/
-		if(levelname) {
-			snprintf(finalmsg, sizeof(finalmsg), "(%s)\t%s\t%s%s\n",
-				levelname, lb_log_state.lbl_binary_name,
-				logmsg, optional_src_location);
-		} else {
-			snprintf(finalmsg, sizeof(finalmsg), "(%d)\t%s\t%s%s\n",
-				level, lb_log_state.lbl_binary_name,
-				logmsg, optional_src_location);
-		}
-	} else {
-		char	process_and_thread_id[LOG_PIDANDTID_MAXLEN];
+	line[len++] = '\n';
+	return(len);
+}
 
-		if (pthread_library_is_available && pthread_self_fnptr) {
-			pthread_t	tid = (*pthread_self_fnptr)();
+/* a vprintf-like routine for logging. This will
+ * - prefix the line with current timestamp, log level of the message, and PID
+ * - add a newline, if the message does not already end to a newline.
+*/
+void lblog_vprintf_line_to_logfile(
+	const char	*file,
+	int		line,
+	int		level,
+	const char	*format,
+	va_list		ap)
+{
+	lb_log_buffer_t	*buf = NULL;
+	int		saved_errno = errno;
 
-			snprintf(process_and_thread_id, sizeof(process_and_thread_id),
-				"[%d/%ld]", getpid(), (long)tid);
-		} else {
-			snprintf(process_and_thread_id, sizeof(process_and_thread_id),
-				"[%d]", getpid());
-		}
+	if (lb_loglevel__ == LB_LOGLEVEL_uninitialized) lblog_init();
 
-		/* full format */
-		if(levelname) {
-			snprintf(finalmsg, sizeof(finalmsg), "%s (%s)\t%s%s\t%s%s\n",
-				tstamp, levelname, lb_log_state.lbl_binary_name,
-				process_and_thread_id, logmsg,
-				optional_src_location);
-		} else {
-			snprintf(finalmsg, sizeof(finalmsg), "%s (%d)\t%s%s\t%s%s\n",
-				tstamp, level, lb_log_state.lbl_binary_name,
-				process_and_thread_id, logmsg,
-				optional_src_location);
-		}
+	if (!lb_log_state.lbl_logfile[0]) return;
+
+	/* Errors, warnings and logging to stdout are not buffered.
+	 * The buffer can't be used if this is a signal handler which
+	 * interrupted logging of the same thread. */
+	if ((level > LB_LOGLEVEL_WARNING) &&
+	    !(lb_log_state.lbl_logfile[0] == '-' &&
+	      lb_log_state.lbl_logfile[1] == '\0')) {
+		buf = get_log_buffer();
+		if (buf && !__sync_bool_compare_and_swap(&buf->lbb_busy, 0, 1))
+			buf = NULL;
 	}
 
-	write_to_logfile(finalmsg, strlen(finalmsg));
+	if (buf) {
+		time_t	now = time(NULL);
+
+		if (buf->lbb_len > LOG_BUFFER_SIZE - LOG_LINE_BUFSIZE)
+			flush_log_buffer(buf);
+		if (buf->lbb_len == 0) buf->lbb_since = now;
+		buf->lbb_len += format_log_line(buf->lbb_data + buf->lbb_len,
+			file, line, level, format, ap);
+		if (now - buf->lbb_since >= LOG_BUFFER_MAX_AGE)
+			flush_log_buffer(buf);
+		buf->lbb_busy = 0;
+	} else {
+		char	finalmsg[LOG_LINE_BUFSIZE];
+		int	len;
+
+		len = format_log_line(finalmsg, file, line, level, format, ap);
+		lblog_flush();
+		write_to_logfile(finalmsg, len);
+	}
+	errno = saved_errno;
 }
 
 void lblog_printf_line_to_logfile(
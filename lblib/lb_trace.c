@@ -0,0 +1,321 @@
+/*
+ * Binary trace ring: the writer side (see include/lb_trace.h)
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* The first process that needs the ring creates the file (O_EXCL),
+ * sets its size and initializes the header; lbth_magic is set last.
+ * Other processes map the file after it has got its final size and
+ * the magic number. If anything goes wrong, tracing is just
+ * disabled in the process (text logging is not affected).
+ *
+ * Strings are interned to an open-addressing hash table. A new string
+ * is first copied to the string area (space is reserved by an atomic
+ * add), and then the table slot is claimed with compare-and-swap.
+ * If another process claimed the slot first, its string is compared
+ * to ours. So each string is stored to the table only once, even if
+ * copies may be left to the string area. Function names are static
+ * strings; their ids are cached per process by the address (and
+ * checked, two names may share a cache slot).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+
+#include <lb.h>
+#include <lb_trace.h>
+#include <rule_tree.h>
+#include <config.h>
+
+#include "exported.h"
+
+#define LB_TRACE_MAX_STR_PROBES	64
+
+#define LB_TRACE_FUNC_CACHE_SIZE	256
+
+int lb_trace_active__ = 0;
+
+static lb_trace_header_t *trace_hdr = NULL;
+static lb_trace_record_t *trace_records = NULL;
+static volatile uint32_t *trace_str_slots = NULL;
+
+/* process name of this process */
+static uint32_t trace_proc_id = 0;
+
+/* ids of function names, indexed by the address of the name */
+static volatile uint32_t trace_func_cache[LB_TRACE_FUNC_CACHE_SIZE];
+
+static uint64_t trace_time_us(void)
+{
+	struct timeval	now;
+
+	if (gettimeofday(&now, (struct timezone *)NULL) < 0) return(0);
+	return((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+}
+
+static uint32_t trace_string_hash(const char *str, uint32_t *lenp)
+{
+	size_t	len = strlen(str);
+
+	*lenp = len;
+	return(lb_fnv1a32(LB_FNV1A32_INIT, str, len));
+}
+
+static lb_trace_string_t *trace_string_at(uint32_t id)
+{
+	return((lb_trace_string_t *)((char *)trace_hdr +
+		trace_hdr->lbth_strings_offs + id));
+}
+
+/* Copy a string to the string area. Returns the id, or 0 */
+static uint32_t trace_store_string(const char *str,
+	uint32_t hash, uint32_t len)
+{
+	uint64_t	size = (sizeof(lb_trace_string_t) + len + 1 + 7) & ~7ULL;
+	uint64_t	id;
+	lb_trace_string_t *ts;
+
+	id = __sync_fetch_and_add(&trace_hdr->lbth_strings_used, size);
+	if (id + size > trace_hdr->lbth_strings_size) {
+		__sync_fetch_and_add(&trace_hdr->lbth_strings_dropped, 1);
+		return(0);
+	}
+	ts = trace_string_at((uint32_t)id);
+	ts->lbts_hash = hash;
+	ts->lbts_len = len;
+	memcpy(ts->lbts_str, str, len + 1);
+	__sync_synchronize();
+	return((uint32_t)id);
+}
+
+/* Returns id of "str", adds it to the table if needed. */
+static uint32_t trace_intern(const char *str)
+{
+	uint32_t	len;
+	uint32_t	hash;
+	uint32_t	mask = trace_hdr->lbth_num_str_slots - 1;
+	uint32_t	slot;
+	uint32_t	my_id = 0;
+	int		i;
+
+	if (!str) return(0);
+	hash = trace_string_hash(str, &len);
+	slot = hash & mask;
+	for (i = 0; i < LB_TRACE_MAX_STR_PROBES; i++) {
+		uint32_t	id = trace_str_slots[slot];
+
+		if (!id) {
+			if (!my_id) {
+				my_id = trace_store_string(str, hash, len);
+				if (!my_id) return(0);
+			}
+			if (__sync_bool_compare_and_swap(&trace_str_slots[slot],
+					0, my_id))
+				return(my_id);
+			/* someone was faster; check what it added */
+			id = trace_str_slots[slot];
+		}
+		__sync_synchronize();
+		if (id) {
+			lb_trace_string_t *ts = trace_string_at(id);
+
+			if ((ts->lbts_hash == hash) && (ts->lbts_len == len) &&
+			    !memcmp(ts->lbts_str, str, len))
+				return(id);
+		}
+		slot = (slot + 1) & mask;
+	}
+	__sync_fetch_and_add(&trace_hdr->lbth_strings_dropped, 1);
+	return(0);
+}
+
+static uint32_t trace_intern_func(const char *func)
+{
+	unsigned int	i;
+	uint32_t	id;
+
+	if (!func) return(0);
+	i = ((uintptr_t)func >> 3) % LB_TRACE_FUNC_CACHE_SIZE;
+	id = trace_func_cache[i];
+	if (id && !strcmp(trace_string_at(id)->lbts_str, func))
+		return(id);
+	id = trace_intern(func);
+	trace_func_cache[i] = id;
+	return(id);
+}
+
+static int trace_create_file(const char *path, int fd)
+{
+	lb_trace_header_t *hdr;
+	uint64_t	records_size;
+	uint64_t	slots_size;
+	uint64_t	file_size;
+
+	records_size = (uint64_t)LB_TRACE_NUM_RECORDS * sizeof(lb_trace_record_t);
+	slots_size = (uint64_t)LB_TRACE_NUM_STR_SLOTS * sizeof(uint32_t);
+	file_size = LB_TRACE_HEADER_SIZE + records_size + slots_size +
+		LB_TRACE_STRINGS_SIZE;
+
+	if (ftruncate(fd, file_size) < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"trace: Failed to set size of %s", path);
+		return(-1);
+	}
+	hdr = mmap(NULL, LB_TRACE_HEADER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) return(-1);
+	hdr->lbth_version = LB_TRACE_VERSION;
+	hdr->lbth_record_size = sizeof(lb_trace_record_t);
+	hdr->lbth_num_records = LB_TRACE_NUM_RECORDS;
+	hdr->lbth_num_str_slots = LB_TRACE_NUM_STR_SLOTS;
+	hdr->lbth_file_size = file_size;
+	hdr->lbth_records_offs = LB_TRACE_HEADER_SIZE;
+	hdr->lbth_str_slots_offs = LB_TRACE_HEADER_SIZE + records_size;
+	hdr->lbth_strings_offs = hdr->lbth_str_slots_offs + slots_size;
+	hdr->lbth_strings_size = LB_TRACE_STRINGS_SIZE;
+	hdr->lbth_created_us = trace_time_us();
+	hdr->lbth_next_record = 0;
+	hdr->lbth_strings_used = 8; /* id 0 = no string */
+	hdr->lbth_strings_dropped = 0;
+	__sync_synchronize();
+	hdr->lbth_magic = LB_TRACE_MAGIC;
+	munmap(hdr, LB_TRACE_HEADER_SIZE);
+	return(0);
+}
+
+/* Wait until the creator has initialized the file. */
+static lb_trace_header_t *trace_map_file(const char *path, int fd)
+{
+	lb_trace_header_t *hdr;
+	struct stat	st;
+	int		i;
+
+	for (i = 0; i < 100; i++) {
+		if (fstat_nomap_nolog(fd, &st) < 0) return(NULL);
+		if (st.st_size >= LB_TRACE_HEADER_SIZE) {
+			hdr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+			if (hdr == MAP_FAILED) return(NULL);
+			if ((hdr->lbth_magic == LB_TRACE_MAGIC) &&
+			    (hdr->lbth_file_size == (uint64_t)st.st_size)) {
+				__sync_synchronize();
+				if ((hdr->lbth_version == LB_TRACE_VERSION) &&
+				    (hdr->lbth_record_size ==
+					sizeof(lb_trace_record_t)))
+					return(hdr);
+				LB_LOG(LB_LOGLEVEL_WARNING,
+					"trace: %s has wrong version", path);
+				munmap(hdr, st.st_size);
+				return(NULL);
+			}
+			munmap(hdr, st.st_size);
+		}
+		usleep(1000);
+	}
+	LB_LOG(LB_LOGLEVEL_WARNING, "trace: %s was not initialized", path);
+	return(NULL);
+}
+
+static const char *trace_process_name(char *buf, size_t bufsize)
+{
+	/* same as in the log: "scriptname{interpreter}" for scripts */
+	if (ldbox_exec_name && ldbox_orig_binary_name &&
+	    strcmp(ldbox_exec_name, ldbox_orig_binary_name)) {
+		const char *cp = strrchr(ldbox_exec_name, '/');
+
+		snprintf(buf, bufsize, "%s{%s}",
+			(cp ? cp + 1 : ldbox_exec_name),
+			(ldbox_binary_name ? ldbox_binary_name : ""));
+		return(buf);
+	}
+	return(ldbox_binary_name ? ldbox_binary_name : "");
+}
+
+/* Called once in every process, when the global variables
+ * have been initialized. */
+void lbtrace_init(void)
+{
+	const char	*path;
+	int		fd;
+	char		namebuf[256];
+
+	if (lb_trace_active__) return;
+	path = getenv("LDBOX_TRACE_RING");
+	if (!path || !*path) {
+		lb_trace_active__ = -1;
+		return;
+	}
+	lb_trace_active__ = -1;
+
+	fd = open_nomap_nolog(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		S_IRUSR | S_IWUSR);
+	if (fd >= 0) {
+		if (trace_create_file(path, fd) < 0) {
+			close_nomap_nolog(fd);
+			return;
+		}
+	} else if (errno == EEXIST) {
+		fd = open_nomap_nolog(path, O_RDWR | O_CLOEXEC, 0);
+	}
+	if (fd < 0) {
+		LB_LOG(LB_LOGLEVEL_WARNING, "trace: Can't open %s", path);
+		return;
+	}
+	trace_hdr = trace_map_file(path, fd);
+	close_nomap_nolog(fd);
+	if (!trace_hdr) return;
+
+	trace_records = (lb_trace_record_t *)((char *)trace_hdr +
+		trace_hdr->lbth_records_offs);
+	trace_str_slots = (volatile uint32_t *)((char *)trace_hdr +
+		trace_hdr->lbth_str_slots_offs);
+	trace_proc_id = trace_intern(trace_process_name(namebuf,
+		sizeof(namebuf)));
+	lb_trace_active__ = 1;
+
+	lbtrace_record(LB_TRACE_REC_START, ldbox_exec_name,
+		ldbox_active_exec_policy_name, ldbox_session_mode,
+		0, getppid(), 0);
+}
+
+/* Add a record to the ring. "func" must be a static string. */
+void lbtrace_record(int type, const char *func,
+	const char *vpath, const char *mpath, int value, uint32_t arg,
+	int flags)
+{
+	uint64_t	idx;
+	lb_trace_record_t *rec;
+
+	if (!LB_TRACE_IS_ACTIVE()) return;
+
+	idx = __sync_fetch_and_add(&trace_hdr->lbth_next_record, 1);
+	rec = &trace_records[idx & (trace_hdr->lbth_num_records - 1)];
+	rec->lbtr_seq = 0;
+	__sync_synchronize();
+	rec->lbtr_time_us = trace_time_us();
+	rec->lbtr_pid = getpid();
+	rec->lbtr_type = type;
+	rec->lbtr_flags = flags;
+	rec->lbtr_proc = trace_proc_id;
+	rec->lbtr_func = (type == LB_TRACE_REC_START ?
+		trace_intern(func) : trace_intern_func(func));
+	rec->lbtr_vpath = trace_intern(vpath);
+	rec->lbtr_mpath = trace_intern(mpath);
+	rec->lbtr_value = value;
+	rec->lbtr_arg = arg;
+	__sync_synchronize();
+	rec->lbtr_seq = idx + 1;
+}
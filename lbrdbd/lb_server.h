@@ -19,18 +19,60 @@ extern char *execute_init2_script(void);
 extern void create_server_socket(void);
 extern void ruletree_server(void);
 
-extern void send_reply_to_client(struct sockaddr_un *client_address,
+/* A connection from a client (SOCK_SEQPACKET). Freed when the
+ * client has closed it and no replies are pending. */
+typedef struct lbrdbd_connection_s {
+	int		conn_fd;
+	volatile int	conn_refcount;
+} lbrdbd_connection_t;
+
+/* Where to send a reply */
+typedef struct lbrdbd_client_s {
+	lbrdbd_connection_t	*cl_conn;	/* NULL = the datagram socket */
+	struct sockaddr_un	cl_address;	/* for the datagram socket */
+} lbrdbd_client_t;
+
+extern void lbrdbd_connection_ref(lbrdbd_connection_t *conn);
+extern void lbrdbd_connection_unref(lbrdbd_connection_t *conn);
+
+extern void send_reply_to_client(lbrdbd_client_t *client,
 	ruletree_rpc_msg_reply_t *reply,
 	size_t reply_size);
 
-extern int receive_command_from_server_socket(struct sockaddr_un *client_address,
-	ruletree_rpc_msg_command_t *command);
+extern int wait_for_server_events(int timeout_ms);
+extern int server_round_was_complete(void);
+extern int receive_command_from_server_socket(lbrdbd_client_t *client,
+	ruletree_rpc_msg_command_t *command, size_t *msg_size);
 /* return codes from receive_command_from_server_socket(): */
 #define RPC_COMMAND_RECEIVED		1
 #define RECEIVE_FAILED_TRY_AGAIN	2
 #define	SOCKET_DELETED			3
+#define	NO_MORE_COMMANDS		4 /* all events have been handled */
+
+/* Statistics, see ruletree_cmd_stats() */
+typedef struct lbrdbd_stats_s {
+	unsigned long	st_messages;		/* received messages */
+	unsigned long	st_inline_commands;	/* executed by the main thread */
+	volatile unsigned long	st_worker_commands; /* executed by workers */
+	unsigned long	st_rounds;		/* epoll_wait() calls */
+	unsigned long	st_max_messages_per_round;
+	unsigned long	st_connections;		/* accepted connections */
+	unsigned long	st_open_connections;
+	unsigned long	st_queue_depth;		/* jobs waiting for a worker */
+	unsigned long	st_max_queue_depth;
+} lbrdbd_stats_t;
+
+extern lbrdbd_stats_t lbrdbd_stats;
+extern int lbrdbd_num_worker_threads;
 
 extern const char *progname;
 extern char    *pid_file;
 
+/* ruletree_cache.c */
+extern char *ruletree_cache_dir;
+extern void ruletree_cache_start_recording(lua_State *l);
+extern void ruletree_cache_store(const char *rule_tree_path);
+extern int ruletree_cache_restore(const char *rule_tree_path,
+	uint32_t max_size, uint64_t min_mmap_addr, int min_client_socket_fd);
+
 #endif /* LB_SERVER_H__ */
@@ -117,6 +117,19 @@ static char *read_string_variable_from_lua(const char *name)
 	return(result);
 }
 
+static void create_lua_state(void)
+{
+	lbrdbd_lua = luaL_newstate();
+	lua_atpanic(lbrdbd_lua, lb_lua_panic);
+
+	luaL_openlibs(lbrdbd_lua);
+#if 0
+	lua_bind_lb_functions(lbrdbd_lua); /* register our lb_ functions */
+#endif
+	lua_bind_ruletree_functions(lbrdbd_lua); /* register our ruletree_ functions */
+	lua_bind_lblib_functions(lbrdbd_lua); /* register our lblib.* functions */
+}
+
 static void initialize_lua(void)
 {
 	char *main_lua_script = NULL;
@@ -131,15 +144,8 @@ static void initialize_lua(void)
 		
 	LB_LOG(LB_LOGLEVEL_INFO, "Loading '%s'", main_lua_script);
 
-	lbrdbd_lua = luaL_newstate();
-	lua_atpanic(lbrdbd_lua, lb_lua_panic);
-
-	luaL_openlibs(lbrdbd_lua);
-#if 0
-	lua_bind_lb_functions(lbrdbd_lua); /* register our lb_ functions */
-#endif
-	lua_bind_ruletree_functions(lbrdbd_lua); /* register our ruletree_ functions */
-	lua_bind_lblib_functions(lbrdbd_lua); /* register our lblib.* functions */
+	create_lua_state();
+	ruletree_cache_start_recording(lbrdbd_lua);
 
 	load_and_execute_lua_file(main_lua_script);
 
@@ -166,6 +172,27 @@ static void initialize_lua(void)
 	free(main_lua_script);
 }
 
+/* The rule tree was restored from the cache: init.lua is not
+ * executed, but init2.lua needs the utility functions. */
+static void initialize_lua_for_cached_ruletree(void)
+{
+	char *functions_script = NULL;
+
+	if (asprintf(&functions_script, "%s/lua_scripts/init_functions.lua",
+	     ldbox_session_dir) < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"%s: asprintf failed to allocate memory", __func__);
+		return;
+	}
+	LB_LOG(LB_LOGLEVEL_INFO, "Loading '%s'", functions_script);
+
+	create_lua_state();
+	load_and_execute_lua_file(functions_script);
+
+	LB_LOG(LB_LOGLEVEL_INFO, "lua initialized (cached rule tree).");
+	free(functions_script);
+}
+
 char *execute_init2_script(void)
 {
 	char	*init2_script = NULL;
@@ -216,9 +243,10 @@ int main(int argc, char *argv[])
 	char	*debug_level = NULL;
 	char	*debug_file = NULL;
 	char	*rule_tree_path = NULL;
-	uint32_t max_size = 16*1024*1024; /* default 16MB */
+	uint32_t max_size = 1024*1024*1024; /* default 1GB */
 	uint64_t min_mmap_addr = 0;
 	int	min_client_socket_fd = 279;
+	int	ruletree_restored = 0;
 
 	progname = argv[0];
 
@@ -233,7 +261,7 @@ int main(int argc, char *argv[])
 	assert(sizeof(uint32_t) >= sizeof(gid_t));
 	assert(sizeof(uint32_t) >= sizeof(mode_t));
 
-	while ((opt = getopt(argc, argv, "d:l:s:p:nfS:M:F:")) != -1) {
+	while ((opt = getopt(argc, argv, "d:l:s:p:nfS:M:F:w:C:")) != -1) {
 		switch (opt) {
 		case 'd':
 			debug_level = strdup(optarg);
@@ -262,6 +290,12 @@ int main(int argc, char *argv[])
 		case 'F':
 			min_client_socket_fd = parse_num(optarg);
 			break;
+		case 'w':
+			lbrdbd_num_worker_threads = parse_num(optarg);
+			break;
+		case 'C':
+			ruletree_cache_dir = strdup(optarg);
+			break;
 		default:
 			fprintf(stderr, "Illegal option\n");
 			exit(1);
@@ -287,7 +321,10 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	if (create_ruletree_file(rule_tree_path,
+	if (ruletree_cache_restore(rule_tree_path,
+		max_size, min_mmap_addr, min_client_socket_fd) == 0) {
+		ruletree_restored = 1;
+	} else if (create_ruletree_file(rule_tree_path,
 		max_size, min_mmap_addr, min_client_socket_fd) < 0) {
 
 		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to create rule tree file (%s)",
@@ -297,7 +334,20 @@ int main(int argc, char *argv[])
 	}
 	LB_LOG(LB_LOGLEVEL_DEBUG, "Rule tree file opened & mapped to memory");
 
-	initialize_lua();
+	/* not fatal; clients work without the shared path cache */
+	if (create_shared_pathcache_file(ldbox_session_dir) < 0) {
+		LB_LOG(LB_LOGLEVEL_WARNING, "Failed to create the shared path cache");
+	}
+	if (create_exec_inspect_cache_file(ldbox_session_dir) < 0) {
+		LB_LOG(LB_LOGLEVEL_WARNING, "Failed to create the exec inspection cache");
+	}
+
+	if (ruletree_restored) {
+		initialize_lua_for_cached_ruletree();
+	} else {
+		initialize_lua();
+		ruletree_cache_store(rule_tree_path);
+	}
 
 	/* ----- Server ----- */
 	if (start_server) {
@@ -28,6 +28,8 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "lb_server.h"
 #include "liblb.h"
@@ -48,10 +50,17 @@ char *ldbox_orig_binary_name = "[lbrdbd]";
 char *ldbox_active_exec_policy_name = "[lbrdbd]";
 char *ldbox_mapping_method = "";
 
-int pthread_library_is_available = 0;
-pthread_t (*pthread_self_fnptr)(void) = NULL;
-int (*pthread_mutex_lock_fnptr)(pthread_mutex_t *mutex) = NULL;
-int (*pthread_mutex_unlock_fnptr)(pthread_mutex_t *mutex) = NULL;
+/* lbrdbd has worker threads */
+int pthread_library_is_available = 1;
+pthread_t (*pthread_self_fnptr)(void) = pthread_self;
+int (*pthread_mutex_lock_fnptr)(pthread_mutex_t *mutex) = pthread_mutex_lock;
+int (*pthread_mutex_unlock_fnptr)(pthread_mutex_t *mutex) = pthread_mutex_unlock;
+int (*pthread_key_create_fnptr)(pthread_key_t *key,
+	void (*destructor)(void*)) = pthread_key_create;
+void *(*pthread_getspecific_fnptr)(pthread_key_t key) = pthread_getspecific;
+int (*pthread_setspecific_fnptr)(pthread_key_t key,
+	const void *value) = pthread_setspecific;
+int (*pthread_once_fnptr)(pthread_once_t *, void (*)(void)) = pthread_once;
 
 
 int open_nomap_nolog(const char *pathname, int flags, ...)
@@ -71,6 +80,22 @@ int close_nomap_nolog(int fd)
 	return(close(fd));
 }
 
+int fcntl_nomap_nolog(int fd, int cmd, ...)
+{
+	va_list	arg;
+	long	val;
+
+	va_start(arg, cmd);
+	val = va_arg(arg, long);
+	va_end(arg);
+	return(fcntl(fd, cmd, val));
+}
+
+int fstat_nomap_nolog(int fd, struct stat *buf)
+{
+	return(fstat(fd, buf));
+}
+
 FILE *fopen_nomap(const char *path, const char *mode)
 {
 	return(fopen(path, mode));
@@ -81,3 +106,8 @@ int faccessat_nomap_nolog(int dirfd, const char *pathname, int mode, int flags)
 	return(faccessat(dirfd, pathname, mode, flags));
 }
 
+READLINK_TYPE readlink_nomap(const char *path, char *buf, size_t bufsize)
+{
+	return(readlink(path, buf, bufsize));
+}
+
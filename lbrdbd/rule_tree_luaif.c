@@ -98,6 +98,65 @@ static int lua_lb_add_rule_to_ruletree(lua_State *l)
 	return 1;
 }
 
+/* ruletree.compile_fsrule_index(rule_list_offs)
+ * must be called when a list of FS rules is complete.
+*/
+static int lua_lb_compile_fsrule_index(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	ruletree_object_offset_t index_offs = 0;
+
+	if (n == 1) {
+		ruletree_object_offset_t rule_list_offs = lua_tointeger(l, 1);
+
+		index_offs = ruletree_compile_fsrule_index(rule_list_offs);
+	}
+	LB_LOG(LB_LOGLEVEL_NOISE,
+		"lua_lb_compile_fsrule_index => %d", index_offs);
+	lua_pushnumber(l, index_offs);
+	return 1;
+}
+
+/* ruletree.compile_argvmods_hash(argvmods_name, rule_list_offs)
+ * must be called when a list of exec preprocessing rules is complete.
+*/
+static int lua_lb_compile_argvmods_hash(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	ruletree_object_offset_t table_offs = 0;
+
+	if (n == 2) {
+		const char	*argvmods_name = lua_tostring(l, 1);
+		ruletree_object_offset_t rule_list_offs = lua_tointeger(l, 2);
+
+		table_offs = ruletree_compile_exec_pp_hash(argvmods_name,
+			rule_list_offs);
+	}
+	LB_LOG(LB_LOGLEVEL_NOISE,
+		"lua_lb_compile_argvmods_hash => %d", table_offs);
+	lua_pushnumber(l, table_offs);
+	return 1;
+}
+
+/* ruletree.compile_net_rule_index(rule_list_offs)
+ * must be called when a list of net rules is complete.
+*/
+static int lua_lb_compile_net_rule_index(lua_State *l)
+{
+	int	n = lua_gettop(l);
+	ruletree_object_offset_t index_offs = 0;
+
+	if (n == 1) {
+		ruletree_object_offset_t rule_list_offs = lua_tointeger(l, 1);
+
+		index_offs = ruletree_compile_net_rule_index(rule_list_offs);
+	}
+	LB_LOG(LB_LOGLEVEL_NOISE,
+		"lua_lb_compile_net_rule_index => %d", index_offs);
+	lua_pushnumber(l, index_offs);
+	return 1;
+}
+
 /* ruletree.add_exec_preprocessing_rule_to_ruletree(...)
 */
 static int lua_lb_add_exec_preprocessing_rule_to_ruletree(lua_State *l)
@@ -523,13 +582,16 @@ static const luaL_reg reg[] =
 
 	/* FS rules */
 	{"add_rule_to_ruletree",	lua_lb_add_rule_to_ruletree},
+	{"compile_fsrule_index",	lua_lb_compile_fsrule_index},
 
 	/* exec rules */
 	{"add_exec_preprocessing_rule_to_ruletree",	lua_lb_add_exec_preprocessing_rule_to_ruletree},
+	{"compile_argvmods_hash",	lua_lb_compile_argvmods_hash},
 	{"add_exec_policy_selection_rule_to_ruletree",	lua_lb_add_exec_policy_selection_rule_to_ruletree},
 
 	/* Network rules */
 	{"add_net_rule_to_ruletree",	lua_lb_add_net_rule_to_ruletree},
+	{"compile_net_rule_index",	lua_lb_compile_net_rule_index},
 
 	{NULL,				NULL}
 };
@@ -0,0 +1,806 @@
+/*
+ * Copyright (C) 2011 Nokia Corporation.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* Rule tree server: A cache for compiled rule trees.
+ *
+ * Executing init.lua is the most expensive part of session startup,
+ * but the result (RuleTree.bin and a few generated files in the
+ * session directory) depends only on a small set of inputs. The
+ * cache stores the result after a successful initialization and
+ * restores it for later sessions, if the inputs are still the same.
+ *
+ * Cache entries are directories under the cache directory (option
+ * -C), named by a hash of the "static" inputs: rule tree and Lua/C
+ * interface versions, the lbrdbd binary, the contents of init.lua,
+ * the modes that are used and length of the session directory name.
+ * Everything else that the Lua scripts read is recorded while
+ * init.lua is executed: The loaded and opened files (as hashes of
+ * contents), results of lblib.path_exists() and lblib.readlink()
+ * and values of environment variables. Those are stored to the
+ * entry ("deps") and validated when the entry is used. Files that
+ * the scripts write are stored to the entry, too.
+ *
+ * The session directory name is different in every session, but
+ * it has the same length for every session of the same user (see
+ * how "lb" creates it). The session directory is replaced by a
+ * placeholder in the recorded values and in the hashes of file
+ * contents, and occurrences of the old directory are patched in
+ * place in the restored rule tree. Indexes which depend on the
+ * contents of strings are rebuilt after that.
+ *
+ * If anything is unclear, the cache is not used; init.lua is
+ * executed as usual.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "lb_server.h"
+#include "rule_tree_lua.h"
+
+/* placeholder for the session directory in recorded values */
+#define RTC_SESSION_DIR_MARKER	"@LDBOX_SESSION_DIR@"
+
+/* kinds of records */
+#define RTC_FILE	'F'	/* value = hash of contents, or "-" */
+#define RTC_EXISTS	'E'	/* value = "1" or "0" */
+#define RTC_READLINK	'L'	/* value = destination, or "-" */
+#define RTC_GETENV	'V'	/* value = value of the variable, or "-" */
+#define RTC_OUTPUT	'O'	/* value = name of the copy in the entry */
+#define RTC_IO_OPEN	'I'	/* io.open(): RTC_FILE or RTC_OUTPUT */
+
+typedef struct rtc_record_s {
+	struct rtc_record_s	*rtcr_next;
+	char			rtcr_kind;
+	char			*rtcr_name;	/* normalized */
+	char			*rtcr_value;	/* normalized */
+} rtc_record_t;
+
+char	*ruletree_cache_dir = NULL;
+
+static rtc_record_t	*rtc_records = NULL;
+static rtc_record_t	**rtc_records_tail = &rtc_records;
+static int		rtc_num_outputs = 0;
+static int		rtc_recording = 0;
+static int		rtc_uncachable = 0;
+
+/* ---------- hashes ---------- */
+
+#define RTC_FNV_OFFSET	14695981039346656037ULL
+#define RTC_FNV_PRIME	1099511628211ULL
+
+static uint64_t rtc_hash_bytes(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *cp = p;
+
+	while (len-- > 0) {
+		h ^= *cp++;
+		h *= RTC_FNV_PRIME;
+	}
+	return(h);
+}
+
+static uint64_t rtc_hash_str(uint64_t h, const char *s)
+{
+	/* include the terminating null, "ab"+"c" != "a"+"bc" */
+	return(rtc_hash_bytes(h, s ? s : "", (s ? strlen(s) : 0) + 1));
+}
+
+/* Hash a buffer, with the session directory replaced by the marker */
+static uint64_t rtc_hash_normalized(uint64_t h, const char *buf, size_t len)
+{
+	size_t	sdlen = strlen(ldbox_session_dir);
+	const char *end = buf + len;
+
+	while (buf < end) {
+		const char *sd = memmem(buf, end - buf, ldbox_session_dir, sdlen);
+
+		if (!sd) {
+			h = rtc_hash_bytes(h, buf, end - buf);
+			break;
+		}
+		h = rtc_hash_bytes(h, buf, sd - buf);
+		h = rtc_hash_bytes(h, RTC_SESSION_DIR_MARKER,
+			sizeof(RTC_SESSION_DIR_MARKER) - 1);
+		buf = sd + sdlen;
+	}
+	return(h);
+}
+
+/* Read a whole file to memory. Returns NULL if it can't be read. */
+static char *rtc_read_file(const char *path, size_t *lenp)
+{
+	int	fd;
+	struct stat st;
+	char	*buf = NULL;
+	size_t	len = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return(NULL);
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+		buf = malloc(st.st_size + 1);
+		while (buf && (len < (size_t)st.st_size)) {
+			ssize_t	n = read(fd, buf + len, st.st_size - len);
+
+			if (n <= 0) {
+				free(buf);
+				buf = NULL;
+			} else {
+				len += n;
+			}
+		}
+	}
+	close(fd);
+	if (buf) {
+		buf[len] = '\0';
+		*lenp = len;
+	}
+	return(buf);
+}
+
+/* ---------- session directory vs. the marker ---------- */
+
+static char *rtc_normalize(const char *s)
+{
+	size_t	sdlen = strlen(ldbox_session_dir);
+	char	*result = NULL;
+
+	if (!strncmp(s, ldbox_session_dir, sdlen) &&
+	    ((s[sdlen] == '/') || (s[sdlen] == '\0'))) {
+		if (asprintf(&result, "%s%s", RTC_SESSION_DIR_MARKER,
+		    s + sdlen) < 0) return(NULL);
+		return(result);
+	}
+	return(strdup(s));
+}
+
+static char *rtc_denormalize(const char *s)
+{
+	size_t	mlen = sizeof(RTC_SESSION_DIR_MARKER) - 1;
+	char	*result = NULL;
+
+	if (!strncmp(s, RTC_SESSION_DIR_MARKER, mlen)) {
+		if (asprintf(&result, "%s%s", ldbox_session_dir,
+		    s + mlen) < 0) return(NULL);
+		return(result);
+	}
+	return(strdup(s));
+}
+
+/* ---------- recorded values ---------- */
+
+/* Get the current value of a dependency. "path" is not normalized. */
+static char *rtc_get_value(char kind, const char *path)
+{
+	char	buf[PATH_MAX + 1];
+	char	*contents;
+	size_t	len;
+	ssize_t	n;
+	const char *cp;
+
+	switch (kind) {
+	case RTC_FILE:
+		contents = rtc_read_file(path, &len);
+		if (!contents) return(strdup("-"));
+		snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)
+			rtc_hash_normalized(RTC_FNV_OFFSET, contents, len));
+		free(contents);
+		return(strdup(buf));
+	case RTC_EXISTS:
+		return(strdup(lb_path_exists(path) ? "1" : "0"));
+	case RTC_READLINK:
+		n = readlink(path, buf, PATH_MAX);
+		if (n < 0) return(strdup("-"));
+		buf[n] = '\0';
+		return(rtc_normalize(buf));
+	case RTC_GETENV:
+		cp = getenv(path);
+		if (!cp) return(strdup("-"));
+		return(rtc_normalize(cp));
+	}
+	return(NULL);
+}
+
+static rtc_record_t *rtc_find_record(char kind, const char *name)
+{
+	rtc_record_t	*rp;
+
+	for (rp = rtc_records; rp; rp = rp->rtcr_next) {
+		if ((rp->rtcr_kind == kind) && !strcmp(rp->rtcr_name, name))
+			return(rp);
+	}
+	return(NULL);
+}
+
+/* Called after a function has been called from Lua */
+static void rtc_record(char kind, const char *name)
+{
+	rtc_record_t	*rp;
+	char		*normalized_name;
+	char		*value = NULL;
+	char		outname[32];
+
+	if (!rtc_recording || rtc_uncachable) return;
+
+	if ((kind != RTC_GETENV) && (*name != '/')) {
+		/* relative to lbrdbd's CWD, which is not recorded */
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"Rule tree cache: relative path '%s'", name);
+		rtc_uncachable = 1;
+		return;
+	}
+	normalized_name = rtc_normalize(name);
+	if (!normalized_name) {
+		rtc_uncachable = 1;
+		return;
+	}
+
+	if (rtc_find_record(kind, normalized_name) ||
+	    ((kind == RTC_FILE) &&
+	     rtc_find_record(RTC_OUTPUT, normalized_name))) {
+		/* only the first observation is relevant; files that
+		 * were created by the scripts will be restored. */
+		free(normalized_name);
+		return;
+	}
+
+	if (kind == RTC_OUTPUT) {
+		if (strncmp(normalized_name, RTC_SESSION_DIR_MARKER "/",
+		    sizeof(RTC_SESSION_DIR_MARKER))) {
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"Rule tree cache: output to '%s'", name);
+			rtc_uncachable = 1;
+			free(normalized_name);
+			return;
+		}
+		snprintf(outname, sizeof(outname), "out.%d", rtc_num_outputs++);
+		value = strdup(outname);
+	} else {
+		value = rtc_get_value(kind, name);
+	}
+	if (!value || strpbrk(normalized_name, "\t\n") ||
+	    strpbrk(value, "\t\n")) {
+		/* can't be stored to the "deps" file */
+		rtc_uncachable = 1;
+		free(normalized_name);
+		if (value) free(value);
+		return;
+	}
+
+	rp = calloc(1, sizeof(*rp));
+	if (!rp) {
+		rtc_uncachable = 1;
+		free(normalized_name);
+		free(value);
+		return;
+	}
+	rp->rtcr_kind = kind;
+	rp->rtcr_name = normalized_name;
+	rp->rtcr_value = value;
+	*rtc_records_tail = rp;
+	rtc_records_tail = &rp->rtcr_next;
+}
+
+/* ---------- Lua wrappers ---------- */
+
+/* Wrapper for the original function (upvalue 1), records the
+ * first argument after the call. */
+static int rtc_lua_wrapper(lua_State *l)
+{
+	char	kind = (char)lua_tointeger(l, lua_upvalueindex(2));
+	int	nargs = lua_gettop(l);
+	char	*name = NULL;
+
+	if ((nargs >= 1) && (lua_type(l, 1) == LUA_TSTRING)) {
+		name = strdup(lua_tostring(l, 1));
+	} else if (kind != RTC_GETENV) {
+		/* e.g. dofile() without arguments reads stdin */
+		rtc_uncachable = 1;
+	}
+	if (kind == RTC_IO_OPEN) {
+		const char *mode = NULL;
+
+		if ((nargs >= 2) && (lua_type(l, 2) == LUA_TSTRING))
+			mode = lua_tostring(l, 2);
+		kind = (mode && strpbrk(mode, "wa+")) ? RTC_OUTPUT : RTC_FILE;
+	}
+
+	lua_pushvalue(l, lua_upvalueindex(1));
+	lua_insert(l, 1);
+	lua_call(l, nargs, LUA_MULTRET);
+
+	if (name) {
+		rtc_record(kind, name);
+		free(name);
+	}
+	return(lua_gettop(l));
+}
+
+/* Replace table[fn_name] (or the global fn_name, if "table" is NULL)
+ * by a wrapper. */
+static void rtc_wrap_lua_function(lua_State *l,
+	const char *table, const char *fn_name, char kind)
+{
+	if (table) {
+		lua_getglobal(l, table);
+		if (!lua_istable(l, -1)) {
+			lua_pop(l, 1);
+			return;
+		}
+	} else {
+		lua_pushvalue(l, LUA_GLOBALSINDEX);
+	}
+	lua_getfield(l, -1, fn_name);
+	if (!lua_isfunction(l, -1)) {
+		lua_pop(l, 2);
+		return;
+	}
+	lua_pushinteger(l, kind);
+	lua_pushcclosure(l, rtc_lua_wrapper, 2);
+	lua_setfield(l, -2, fn_name);
+	lua_pop(l, 1);
+}
+
+/* Start recording dependencies; called before init.lua is executed */
+void ruletree_cache_start_recording(lua_State *l)
+{
+	if (!ruletree_cache_dir) return;
+
+	rtc_wrap_lua_function(l, NULL, "dofile", RTC_FILE);
+	rtc_wrap_lua_function(l, NULL, "loadfile", RTC_FILE);
+	rtc_wrap_lua_function(l, "io", "open", RTC_IO_OPEN);
+	rtc_wrap_lua_function(l, "os", "getenv", RTC_GETENV);
+	rtc_wrap_lua_function(l, "lblib", "path_exists", RTC_EXISTS);
+	rtc_wrap_lua_function(l, "lblib", "readlink", RTC_READLINK);
+	rtc_wrap_lua_function(l, "lb", "path_exists", RTC_EXISTS);
+	rtc_recording = 1;
+}
+
+/* ---------- cache entries ---------- */
+
+/* Create the name of the cache entry. Returns NULL if the cache
+ * can't be used. */
+static char *rtc_entry_path(void)
+{
+	uint64_t	h = RTC_FNV_OFFSET;
+	struct stat	st;
+	char		*init_script = NULL;
+	char		*contents;
+	char		*entry = NULL;
+	size_t		len;
+	uint32_t	u;
+
+	h = rtc_hash_str(h, LBRDBD_LUA_C_INTERFACE_VERSION);
+	u = RULE_TREE_VERSION;
+	h = rtc_hash_bytes(h, &u, sizeof(u));
+	u = strlen(ldbox_session_dir);
+	h = rtc_hash_bytes(h, &u, sizeof(u));
+
+	/* this binary */
+	if (stat("/proc/self/exe", &st) < 0) return(NULL);
+	h = rtc_hash_bytes(h, &st.st_dev, sizeof(st.st_dev));
+	h = rtc_hash_bytes(h, &st.st_ino, sizeof(st.st_ino));
+	h = rtc_hash_bytes(h, &st.st_size, sizeof(st.st_size));
+	h = rtc_hash_bytes(h, &st.st_mtime, sizeof(st.st_mtime));
+
+	/* the same values are in "deps", too, but having them here
+	 * allows different sets of modes to be cached at the same time */
+	h = rtc_hash_str(h, getenv("LB_ALL_MODES"));
+	h = rtc_hash_str(h, getenv("LB_ALL_NET_MODES"));
+	h = rtc_hash_str(h, getenv("LB_DEFAULT_NETWORK_MODE"));
+
+	if (asprintf(&init_script, "%s/lua_scripts/init.lua",
+	    ldbox_session_dir) < 0) return(NULL);
+	contents = rtc_read_file(init_script, &len);
+	free(init_script);
+	if (!contents) return(NULL);
+	h = rtc_hash_normalized(h, contents, len);
+	free(contents);
+
+	if (asprintf(&entry, "%s/%016llx", ruletree_cache_dir,
+	    (unsigned long long)h) < 0) return(NULL);
+	return(entry);
+}
+
+/* Copy a file, sharing the data blocks if the filesystem can do that */
+static int rtc_copy_file(const char *src, const char *dst, int excl)
+{
+	int	in_fd, out_fd;
+	char	buf[65536];
+	ssize_t	n = 0;
+	int	result = -1;
+
+	in_fd = open(src, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) return(-1);
+	out_fd = open(dst, O_WRONLY | O_CREAT | O_CLOEXEC |
+		(excl ? O_EXCL : O_TRUNC), S_IRUSR | S_IWUSR);
+	if (out_fd < 0) {
+		close(in_fd);
+		return(-1);
+	}
+#ifdef FICLONE
+	if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+		result = 0;
+	} else
+#endif
+	{
+		while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+			if (write(out_fd, buf, n) != n) break;
+		}
+		if (n == 0) result = 0;
+	}
+	close(in_fd);
+	if (close(out_fd) < 0) result = -1;
+	return(result);
+}
+
+/* Write "len" bytes of "buf" to a file, replacing "old" by "new" */
+static int rtc_write_file_replacing(const char *path,
+	const char *buf, size_t len, const char *old, const char *new)
+{
+	FILE	*f;
+	size_t	old_len = strlen(old);
+	const char *end = buf + len;
+	int	result = 0;
+
+	f = fopen(path, "we");
+	if (!f) return(-1);
+	while (buf < end) {
+		const char *cp = (*old && strcmp(old, new)) ?
+			memmem(buf, end - buf, old, old_len) : NULL;
+
+		if (!cp) {
+			if (fwrite(buf, end - buf, 1, f) != 1) result = -1;
+			break;
+		}
+		if ((cp > buf) && (fwrite(buf, cp - buf, 1, f) != 1))
+			result = -1;
+		if (fputs(new, f) < 0) result = -1;
+		buf = cp + old_len;
+	}
+	if (fclose(f) != 0) result = -1;
+	return(result);
+}
+
+static void rtc_remove_entry_dir(const char *dir)
+{
+	char	*path = NULL;
+	rtc_record_t	*rp;
+
+	if (asprintf(&path, "%s/RuleTree.bin", dir) >= 0) {
+		unlink(path);
+		free(path);
+	}
+	if (asprintf(&path, "%s/deps", dir) >= 0) {
+		unlink(path);
+		free(path);
+	}
+	if (asprintf(&path, "%s/session_dir", dir) >= 0) {
+		unlink(path);
+		free(path);
+	}
+	for (rp = rtc_records; rp; rp = rp->rtcr_next) {
+		if ((rp->rtcr_kind == RTC_OUTPUT) &&
+		    (asprintf(&path, "%s/%s", dir, rp->rtcr_value) >= 0)) {
+			unlink(path);
+			free(path);
+		}
+	}
+	rmdir(dir);
+}
+
+/* Store the current rule tree and the recorded dependencies
+ * to the cache. Must be called before any clients have been
+ * started, i.e. before the server is started. */
+void ruletree_cache_store(const char *rule_tree_path)
+{
+	char	*entry;
+	char	*tmpdir = NULL;
+	char	*path = NULL;
+	FILE	*f;
+	rtc_record_t	*rp;
+	int	ok = 1;
+
+	if (!ruletree_cache_dir || !rtc_recording) return;
+	rtc_recording = 0;
+	if (rtc_uncachable) {
+		LB_LOG(LB_LOGLEVEL_INFO,
+			"Rule tree cache: the rule tree can not be cached");
+		return;
+	}
+	entry = rtc_entry_path();
+	if (!entry) return;
+
+	if ((mkdir(ruletree_cache_dir, S_IRWXU) < 0) && (errno != EEXIST)) {
+		LB_LOG(LB_LOGLEVEL_WARNING,
+			"Rule tree cache: Failed to create %s",
+			ruletree_cache_dir);
+		free(entry);
+		return;
+	}
+	if ((asprintf(&tmpdir, "%s.tmp.%d", entry, (int)getpid()) < 0) ||
+	    (mkdir(tmpdir, S_IRWXU) < 0)) {
+		free(entry);
+		if (tmpdir) free(tmpdir);
+		return;
+	}
+
+	/* the rule tree */
+	if (asprintf(&path, "%s/RuleTree.bin", tmpdir) < 0) path = NULL;
+	if (!path || (rtc_copy_file(rule_tree_path, path, 1) < 0)) ok = 0;
+	if (path) free(path);
+
+	/* the old session directory, will be patched when restoring */
+	if (asprintf(&path, "%s/session_dir", tmpdir) < 0) path = NULL;
+	if (!path || rtc_write_file_replacing(path, ldbox_session_dir,
+	    strlen(ldbox_session_dir), "", "") < 0) ok = 0;
+	if (path) free(path);
+
+	/* files that were created by the scripts, and dependencies */
+	for (rp = rtc_records; ok && rp; rp = rp->rtcr_next) {
+		char	*src;
+
+		if (rp->rtcr_kind != RTC_OUTPUT) continue;
+		src = rtc_denormalize(rp->rtcr_name);
+		if (!src || (asprintf(&path, "%s/%s", tmpdir,
+		    rp->rtcr_value) < 0)) {
+			ok = 0;
+		} else {
+			if (rtc_copy_file(src, path, 1) < 0) ok = 0;
+			free(path);
+		}
+		if (src) free(src);
+	}
+	if (ok && (asprintf(&path, "%s/deps", tmpdir) >= 0)) {
+		f = fopen(path, "we");
+		free(path);
+		if (f) {
+			for (rp = rtc_records; rp; rp = rp->rtcr_next) {
+				fprintf(f, "%c\t%s\t%s\n", rp->rtcr_kind,
+					rp->rtcr_name, rp->rtcr_value);
+			}
+			if (fclose(f) != 0) ok = 0;
+		} else {
+			ok = 0;
+		}
+	}
+
+	if (ok) {
+		/* replace an old entry (a failed validation
+		 * leaves the entry in place) */
+		char	*old = NULL;
+
+		if (asprintf(&old, "%s.old.%d", entry, (int)getpid()) >= 0) {
+			if (rename(entry, old) == 0) rtc_remove_entry_dir(old);
+			free(old);
+		}
+		if (rename(tmpdir, entry) < 0) ok = 0;
+	}
+	if (ok) {
+		LB_LOG(LB_LOGLEVEL_INFO, "Rule tree cache: stored %s", entry);
+	} else {
+		LB_LOG(LB_LOGLEVEL_WARNING,
+			"Rule tree cache: Failed to store %s", entry);
+		rtc_remove_entry_dir(tmpdir);
+	}
+	free(tmpdir);
+	free(entry);
+}
+
+/* Check that all dependencies of an entry are still valid, and
+ * read the list of output files to rtc_records. */
+static int rtc_validate_deps(const char *entry)
+{
+	char	*path = NULL;
+	FILE	*f;
+	char	line[3 * PATH_MAX];
+	int	valid = 1;
+
+	if (asprintf(&path, "%s/deps", entry) < 0) return(0);
+	f = fopen(path, "re");
+	free(path);
+	if (!f) return(0);
+
+	while (valid && fgets(line, sizeof(line), f)) {
+		char	*name, *value, *cp;
+		char	*real_name;
+		char	*current;
+
+		name = strchr(line, '\t');
+		value = name ? strchr(name + 1, '\t') : NULL;
+		cp = value ? strchr(value + 1, '\n') : NULL;
+		if (!cp || (name != line + 1)) {
+			valid = 0;
+			break;
+		}
+		*name++ = '\0';
+		*value++ = '\0';
+		*cp = '\0';
+
+		if (line[0] == RTC_OUTPUT) {
+			rtc_record_t	*rp = calloc(1, sizeof(*rp));
+
+			if (!rp) {
+				valid = 0;
+				break;
+			}
+			rp->rtcr_kind = RTC_OUTPUT;
+			rp->rtcr_name = strdup(name);
+			rp->rtcr_value = strdup(value);
+			*rtc_records_tail = rp;
+			rtc_records_tail = &rp->rtcr_next;
+			continue;
+		}
+		real_name = (line[0] == RTC_GETENV) ?
+			strdup(name) : rtc_denormalize(name);
+		current = real_name ? rtc_get_value(line[0], real_name) : NULL;
+		if (!current || strcmp(current, value)) {
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"Rule tree cache: %c %s changed", line[0], name);
+			valid = 0;
+		}
+		if (current) free(current);
+		if (real_name) free(real_name);
+	}
+	fclose(f);
+	return(valid);
+}
+
+/* Patch the header and all occurrences of the old session directory
+ * in a restored rule tree. Returns number of replaced strings,
+ * or -1 if failed. */
+static int rtc_patch_ruletree(const char *rule_tree_path,
+	const char *old_session_dir, uint32_t max_size,
+	uint64_t min_mmap_addr, int min_client_socket_fd)
+{
+	int	fd;
+	struct stat st;
+	char	*p;
+	char	*cp, *end;
+	ruletree_hdr_t *hdr;
+	size_t	sdlen = strlen(ldbox_session_dir);
+	int	count = 0;
+
+	fd = open(rule_tree_path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) return(-1);
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(*hdr)) ||
+	    (st.st_size > max_size)) {
+		close(fd);
+		return(-1);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return(-1);
+
+	hdr = (ruletree_hdr_t*)p;
+	if ((hdr->rtree_version != RULE_TREE_VERSION) ||
+	    (hdr->rtree_file_size != st.st_size)) {
+		munmap(p, st.st_size);
+		return(-1);
+	}
+	hdr->rtree_max_size = max_size;
+	hdr->rtree_min_mmap_addr = min_mmap_addr;
+	hdr->rtree_min_client_socket_fd = min_client_socket_fd;
+
+	if (strcmp(old_session_dir, ldbox_session_dir)) {
+		end = p + st.st_size;
+		for (cp = p + sizeof(*hdr);
+		     (cp = memmem(cp, end - cp, old_session_dir, sdlen)) != NULL;
+		     cp += sdlen) {
+			memcpy(cp, ldbox_session_dir, sdlen);
+			count++;
+		}
+	}
+	munmap(p, st.st_size);
+	return(count);
+}
+
+/* Restore the rule tree and generated files from the cache.
+ * Returns 0 if the rule tree was restored and attached, or
+ * -1 if it wasn't (init.lua must be executed then). */
+int ruletree_cache_restore(const char *rule_tree_path,
+	uint32_t max_size, uint64_t min_mmap_addr, int min_client_socket_fd)
+{
+	char	*entry;
+	char	*path = NULL;
+	char	*old_session_dir = NULL;
+	size_t	len;
+	rtc_record_t	*rp;
+	int	patched;
+	int	result = -1;
+
+	if (!ruletree_cache_dir) return(-1);
+	entry = rtc_entry_path();
+	if (!entry) return(-1);
+
+	if (asprintf(&path, "%s/session_dir", entry) >= 0) {
+		old_session_dir = rtc_read_file(path, &len);
+		free(path);
+	}
+	if (!old_session_dir ||
+	    (strlen(old_session_dir) != strlen(ldbox_session_dir))) {
+		LB_LOG(LB_LOGLEVEL_DEBUG, "Rule tree cache: no entry %s", entry);
+		goto out;
+	}
+	if (!rtc_validate_deps(entry)) {
+		LB_LOG(LB_LOGLEVEL_INFO,
+			"Rule tree cache: %s is not valid", entry);
+		goto out;
+	}
+
+	/* restore generated files */
+	for (rp = rtc_records; rp; rp = rp->rtcr_next) {
+		char	*dst = rtc_denormalize(rp->rtcr_name);
+		char	*contents = NULL;
+
+		if (dst && (asprintf(&path, "%s/%s", entry,
+		    rp->rtcr_value) >= 0)) {
+			contents = rtc_read_file(path, &len);
+			free(path);
+		}
+		if (!contents || (rtc_write_file_replacing(dst, contents, len,
+		    old_session_dir, ldbox_session_dir) < 0)) {
+			LB_LOG(LB_LOGLEVEL_WARNING,
+				"Rule tree cache: Failed to restore %s", dst);
+			if (contents) free(contents);
+			if (dst) free(dst);
+			goto out;
+		}
+		free(contents);
+		free(dst);
+	}
+
+	/* restore the rule tree */
+	if (asprintf(&path, "%s/RuleTree.bin", entry) < 0) goto out;
+	if (rtc_copy_file(path, rule_tree_path, 1) < 0) {
+		free(path);
+		goto out;
+	}
+	free(path);
+	patched = rtc_patch_ruletree(rule_tree_path, old_session_dir,
+		max_size, min_mmap_addr, min_client_socket_fd);
+	if ((patched < 0) || (attach_ruletree(rule_tree_path, 1) < 0)) {
+		LB_LOG(LB_LOGLEVEL_WARNING,
+			"Rule tree cache: Failed to use %s", entry);
+		unlink(rule_tree_path);
+		goto out;
+	}
+	if (patched > 0) ruletree_rebuild_fsrule_indexes();
+
+	LB_LOG(LB_LOGLEVEL_INFO,
+		"Rule tree cache: restored %s (%d strings patched)",
+		entry, patched);
+	result = 0;
+
+    out:
+	while (rtc_records) {
+		rp = rtc_records;
+		rtc_records = rp->rtcr_next;
+		free(rp->rtcr_name);
+		free(rp->rtcr_value);
+		free(rp);
+	}
+	rtc_records_tail = &rtc_records;
+	if (old_session_dir) free(old_session_dir);
+	free(entry);
+	return(result);
+}
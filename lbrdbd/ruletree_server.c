@@ -242,82 +242,302 @@ static void ruletree_cmd_getfileinfo(
 	}
 }
 
+static void ruletree_cmd_stats(ruletree_rpc_msg_reply_t *reply)
+{
+	snprintf(reply->msg.rimr_str, sizeof(reply->msg.rimr_str),
+		"messages=%lu inline=%lu workers=%d worker_commands=%lu "
+		"rounds=%lu max_messages_per_round=%lu "
+		"connections=%lu open_connections=%lu "
+		"queue_depth=%lu max_queue_depth=%lu",
+		lbrdbd_stats.st_messages, lbrdbd_stats.st_inline_commands,
+		lbrdbd_num_worker_threads, lbrdbd_stats.st_worker_commands,
+		lbrdbd_stats.st_rounds,
+		lbrdbd_stats.st_max_messages_per_round,
+		lbrdbd_stats.st_connections, lbrdbd_stats.st_open_connections,
+		lbrdbd_stats.st_queue_depth, lbrdbd_stats.st_max_queue_depth);
+	reply->hdr.rimr_message_type = RULETREE_RPC_MESSAGE_REPLY__MESSAGE;
+}
+
+static int command_is_one_way(const ruletree_rpc_msg_command_t *command)
+{
+	switch (command->rimc_message_type) {
+	case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+	case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+		return(1);
+	}
+	return(0);
+}
+
+/* Execute a command. Returns size of the reply, or 0 if no reply
+ * should be sent. */
+static size_t execute_command(
+	ruletree_rpc_msg_command_t	*command,
+	ruletree_rpc_msg_reply_t	*reply)
+{
+	size_t	reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t);
+
+	if (command->rimc_message_protocol_version !=
+		RULETREE_RPC_PROTOCOL_VERSION) {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"wrong protocol version %d",
+				command->rimc_message_protocol_version);
+		reply->hdr.rimr_message_type =
+			RULETREE_RPC_MESSAGE_REPLY__PROTOVRSERR;
+	} else {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"got command %d", command->rimc_message_type);
+		switch (command->rimc_message_type) {
+		case RULETREE_RPC_MESSAGE_COMMAND__PING:
+			reply->hdr.rimr_message_type =
+				RULETREE_RPC_MESSAGE_REPLY__OK;
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__INIT2:
+			ruletree_cmd_init2(reply);
+			reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t) +
+				strlen(reply->msg.rimr_str) + 1;
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__STATS:
+			ruletree_cmd_stats(reply);
+			reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t) +
+				strlen(reply->msg.rimr_str) + 1;
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
+			ruletree_cmd_setfileinfo(command, reply);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__GETFILEINFO:
+			ruletree_cmd_getfileinfo(command, reply);
+			if (reply->hdr.rimr_message_type == RULETREE_RPC_MESSAGE_REPLY__FILEINFO)
+				reply_size += sizeof(inodesimu_t);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
+			ruletree_cmd_releasefileinfo(command, reply);
+			break;
+
+		case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
+			ruletree_cmd_clearfileinfo(command, reply);
+			break;
+
+		default:
+			reply->hdr.rimr_message_type =
+				RULETREE_RPC_MESSAGE_REPLY__UNKNOWNCMD;
+		}
+	}
+	/* clients don't wait for replies to one-way commands, not even
+	 * error replies */
+	if (command_is_one_way(command))
+		return(0);
+	reply->hdr.rimr_message_protocol_version = command->rimc_message_protocol_version;
+	reply->hdr.rimr_message_serial = command->rimc_message_serial;
+	return(reply_size);
+}
+
+/* ----- Worker threads -----
+ * Commands which only read the rule tree are executed by a pool of
+ * worker threads. All other commands are executed by the main
+ * thread, the only writer. The writer holds ruletree_rwlock
+ * for writing while it executes a command, because the readers
+ * copy inodestat structures that the writer updates in place.
+*/
+int lbrdbd_num_worker_threads = 4;
+lbrdbd_stats_t lbrdbd_stats;
+
+typedef struct lbrdbd_job_s {
+	struct lbrdbd_job_s		*job_next;
+	lbrdbd_client_t			job_client;
+	ruletree_rpc_msg_command_t	job_command;
+} lbrdbd_job_t;
+
+static pthread_mutex_t	job_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	job_queue_cond = PTHREAD_COND_INITIALIZER;
+static lbrdbd_job_t	*job_queue_first = NULL;
+static lbrdbd_job_t	*job_queue_last = NULL;
+
+static pthread_rwlock_t	ruletree_rwlock;
+
+static int command_is_read_only(const ruletree_rpc_msg_command_t *command)
+{
+	if (lbrdbd_num_worker_threads <= 0) return(0);
+	if (command->rimc_message_protocol_version !=
+	    RULETREE_RPC_PROTOCOL_VERSION) return(0);
+	switch (command->rimc_message_type) {
+	case RULETREE_RPC_MESSAGE_COMMAND__PING:
+	case RULETREE_RPC_MESSAGE_COMMAND__GETFILEINFO:
+		return(1);
+	}
+	return(0);
+}
+
+/* append a list of jobs to the queue */
+static void queue_jobs(lbrdbd_job_t *first, lbrdbd_job_t *last,
+	unsigned long num_jobs)
+{
+	pthread_mutex_lock(&job_queue_mutex);
+	if (job_queue_last) job_queue_last->job_next = first;
+	else job_queue_first = first;
+	job_queue_last = last;
+	lbrdbd_stats.st_queue_depth += num_jobs;
+	if (lbrdbd_stats.st_queue_depth > lbrdbd_stats.st_max_queue_depth)
+		lbrdbd_stats.st_max_queue_depth = lbrdbd_stats.st_queue_depth;
+	pthread_cond_broadcast(&job_queue_cond);
+	pthread_mutex_unlock(&job_queue_mutex);
+}
+
+static void *worker_thread(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		lbrdbd_job_t			*job;
+		ruletree_rpc_msg_reply_t	reply;
+		size_t				reply_size;
+
+		pthread_mutex_lock(&job_queue_mutex);
+		while (!job_queue_first)
+			pthread_cond_wait(&job_queue_cond, &job_queue_mutex);
+		job = job_queue_first;
+		job_queue_first = job->job_next;
+		if (!job_queue_first) job_queue_last = NULL;
+		lbrdbd_stats.st_queue_depth--;
+		pthread_mutex_unlock(&job_queue_mutex);
+
+		pthread_rwlock_rdlock(&ruletree_rwlock);
+		reply_size = execute_command(&job->job_command, &reply);
+		pthread_rwlock_unlock(&ruletree_rwlock);
+
+		if (reply_size)
+			send_reply_to_client(&job->job_client, &reply, reply_size);
+		if (job->job_client.cl_conn)
+			lbrdbd_connection_unref(job->job_client.cl_conn);
+		__sync_fetch_and_add(&lbrdbd_stats.st_worker_commands, 1);
+		free(job);
+	}
+	return(NULL);
+}
+
+static void start_worker_threads(void)
+{
+	pthread_rwlockattr_t	attr;
+	int			i;
+
+	/* a steady stream of readers must not block the writer */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&ruletree_rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	for (i = 0; i < lbrdbd_num_worker_threads; i++) {
+		pthread_t	tid;
+
+		if (pthread_create(&tid, NULL, worker_thread, NULL) != 0) {
+			LB_LOG(LB_LOGLEVEL_ERROR,
+				"Failed to create worker thread #%d", i);
+			break;
+		}
+		pthread_detach(tid);
+	}
+	if (i == 0) lbrdbd_num_worker_threads = 0;
+	LB_LOG(LB_LOGLEVEL_DEBUG, "%d worker threads", i);
+}
+
+/* Server main loop.
+ *
+ * Events are handled in rounds: Every round starts with
+ * epoll_wait(), and all messages from the ready descriptors are
+ * received. Commands that modify the rule tree are executed
+ * immediately. Read-only commands are collected and given to the
+ * worker threads after a later round that saw all ready descriptors
+ * (see server_round_was_complete()): Then everything that any
+ * client had sent before the read-only command has been executed.
+ * This matters because clients don't wait for replies to one-way
+ * commands (for example, a process may send a SETFILEINFO and exit,
+ * and its parent then asks for the same inode on another connection).
+ * A round is incomplete if epoll_wait() filled its event array or
+ * if new connections were accepted; then the next round is started
+ * without waiting.
+*/
 void ruletree_server(void)
 {
 	ruletree_rpc_msg_command_t	command;
 	ruletree_rpc_msg_reply_t	reply;
-	struct sockaddr_un		client_address;
+	lbrdbd_client_t			client;
+	lbrdbd_job_t	*waiting_first = NULL, *waiting_last = NULL;
+	lbrdbd_job_t	*received_first = NULL, *received_last = NULL;
+	unsigned long	num_waiting = 0, num_received = 0;
+	int		r;
+
+	start_worker_threads();
 
 	LB_LOG(LB_LOGLEVEL_DEBUG, "Entering server loop");
 	while (1) {
-		int	r;
-		size_t	reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t);
-
-		LB_LOG(LB_LOGLEVEL_DEBUG, "get message");
-		r = receive_command_from_server_socket(&client_address, &command);
-		switch (r) {
-		case RPC_COMMAND_RECEIVED:
-			if (command.rimc_message_protocol_version !=
-				RULETREE_RPC_PROTOCOL_VERSION) {
-				LB_LOG(LB_LOGLEVEL_DEBUG,
-					"wrong protocol version %d",
-						command.rimc_message_protocol_version);
-			} else {
-				LB_LOG(LB_LOGLEVEL_DEBUG,
-					"got command %d", command.rimc_message_type);
-				switch (command.rimc_message_type) {
-				case RULETREE_RPC_MESSAGE_COMMAND__PING:
-					reply.hdr.rimr_message_type =
-						RULETREE_RPC_MESSAGE_REPLY__OK;
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__INIT2:
-					ruletree_cmd_init2(&reply);
-					reply_size = sizeof(ruletree_rpc_msg_reply_hdr_t) +
-						strlen(reply.msg.rimr_str) + 1;
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO:
-					ruletree_cmd_setfileinfo(&command,&reply);
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__GETFILEINFO:
-					ruletree_cmd_getfileinfo(&command,&reply);
-					if (reply.hdr.rimr_message_type == RULETREE_RPC_MESSAGE_REPLY__FILEINFO)
-						reply_size += sizeof(inodesimu_t);
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO:
-					ruletree_cmd_releasefileinfo(&command,&reply);
-					break;
-
-				case RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO:
-					ruletree_cmd_clearfileinfo(&command,&reply);
-					break;
-
-				default:
-					reply.hdr.rimr_message_type =
-						RULETREE_RPC_MESSAGE_REPLY__UNKNOWNCMD;
+		unsigned long	messages_in_round = 0;
+		size_t		msg_size = 0;
+
+		wait_for_server_events(waiting_first ? 0 : -1);
+
+		while ((r = receive_command_from_server_socket(&client,
+				&command, &msg_size)) == RPC_COMMAND_RECEIVED) {
+			size_t	reply_size;
+
+			messages_in_round++;
+			if (msg_size < sizeof(command)) {
+				LB_LOG(LB_LOGLEVEL_ERROR,
+					"illegal message (size=%d)", (int)msg_size);
+				continue;
+			}
+			if (command_is_read_only(&command)) {
+				lbrdbd_job_t *job = malloc(sizeof(*job));
+
+				if (job) {
+					job->job_next = NULL;
+					job->job_client = client;
+					job->job_command = command;
+					if (client.cl_conn)
+						lbrdbd_connection_ref(client.cl_conn);
+					if (received_last) received_last->job_next = job;
+					else received_first = job;
+					received_last = job;
+					num_received++;
+					continue;
 				}
+				/* else execute it here */
 			}
-			reply.hdr.rimr_message_protocol_version = command.rimc_message_protocol_version;
-			reply.hdr.rimr_message_serial = command.rimc_message_serial;
+			pthread_rwlock_wrlock(&ruletree_rwlock);
+			reply_size = execute_command(&command, &reply);
+			pthread_rwlock_unlock(&ruletree_rwlock);
+			lbrdbd_stats.st_inline_commands++;
+			if (reply_size)
+				send_reply_to_client(&client, &reply, reply_size);
+		}
+		lbrdbd_stats.st_messages += messages_in_round;
+		if (messages_in_round > lbrdbd_stats.st_max_messages_per_round)
+			lbrdbd_stats.st_max_messages_per_round = messages_in_round;
 
-			send_reply_to_client(&client_address, &reply, reply_size);
-			break;
-		case RECEIVE_FAILED_TRY_AGAIN:
-			LB_LOG(LB_LOGLEVEL_DEBUG,
-				"receive_command_from_server_socket failed, try again");
-			break;
-		case SOCKET_DELETED:
+		if (r == SOCKET_DELETED) {
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"Socket has been deleted, exit.");
-			return;
-		default:
-			LB_LOG(LB_LOGLEVEL_ERROR,
-				"%s: Internal error: Unknown return code %d from "
-				"receive_command_from_server_socket.", progname, r);
-			return;
+			break;
+		}
+		if (waiting_first && server_round_was_complete()) {
+			queue_jobs(waiting_first, waiting_last, num_waiting);
+			waiting_first = waiting_last = NULL;
+			num_waiting = 0;
+		}
+		if (received_first) {
+			if (waiting_last) waiting_last->job_next = received_first;
+			else waiting_first = received_first;
+			waiting_last = received_last;
+			num_waiting += num_received;
+			received_first = received_last = NULL;
+			num_received = 0;
 		}
 	}
+	ruletree_cmd_stats(&reply);
+	LB_LOG(LB_LOGLEVEL_INFO, "lbrdbd: %s", reply.msg.rimr_str);
 }
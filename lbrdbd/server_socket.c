@@ -5,7 +5,16 @@
  * Licensed under LGPL version 2.1, see top level LICENSE file for details.
 */
 
-/* Rule tree server, server socket routines */
+/* Rule tree server, server socket routines
+ *
+ * There are two sockets:
+ *  - "ssock", a datagram socket. Every message contains the
+ *    sender's address (the client's own socket).
+ *  - "csock", for SOCK_SEQPACKET connections. Clients normally
+ *    keep one connection open for their lifetime.
+ * All sockets and the inotify descriptor are watched with epoll;
+ * events are handled in rounds, see ruletree_server().
+*/
 
 #include <stdio.h>
 #include <stdint.h>
@@ -23,21 +32,56 @@
 #include <sys/un.h>
 
 #include <sys/inotify.h>
+#include <sys/epoll.h>
 
 #include "lb_server.h"
 
 static struct sockaddr_un server_address;
 static socklen_t	server_addr_len;
+static struct sockaddr_un conn_listen_address;
+static socklen_t	conn_listen_addr_len;
 static int server_socket = -1;
+static int conn_listen_socket = -1;
 static int inotify_fd = -1;
 static int inotify_server_sock_dir_wd = -1;
 static char *server_sock_dir = NULL;
 
-static void initialize_server_address(void)
+static int epoll_fd = -1;
+
+/* epoll_event.data.ptr of the fixed descriptors; all other events
+ * are for connections and point to a lbrdbd_connection_t */
+static char server_socket_tag, conn_listen_socket_tag, inotify_fd_tag;
+
+#define LBRDBD_MAX_EVENTS	64
+static struct epoll_event ready_events[LBRDBD_MAX_EVENTS];
+static int num_ready_events = 0;
+static int next_ready_event = 0;
+static int connections_accepted_in_round = 0;
+
+static void set_socket_address(const char *sock_name,
+	struct sockaddr_un *addr, socklen_t *addr_len)
 {
 	char	*sock_path = NULL;
 	size_t	sock_path_len;
 
+	if (asprintf(&sock_path, "%s/%s", server_sock_dir, sock_name) < 0) {
+		fprintf(stderr, "%s: Fatal: asprintf failed\n", progname);
+		exit(1);
+	}
+	sock_path_len = strlen(sock_path);
+	if (sock_path_len >= sizeof(addr->sun_path)-1) {
+		fprintf(stderr, "%s: Fatal: server socket address lenght is too big (%d)\n",
+			progname, (int)sock_path_len);
+		exit(1);
+	}
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, sock_path); /* it fits. */
+	*addr_len = sizeof(sa_family_t) + sock_path_len + 1;
+	free(sock_path);
+}
+
+static void initialize_server_address(void)
+{
 	if (asprintf(&server_sock_dir, "%s/lbrdbd-sock.d", ldbox_session_dir) < 0) {
 		fprintf(stderr, "%s: Fatal: asprintf failed\n", progname);
 		exit(1);
@@ -47,25 +91,26 @@ static void initialize_server_address(void)
 			progname, server_sock_dir);
 		exit(1);
 	}
-	if (asprintf(&sock_path, "%s/ssock", server_sock_dir) < 0) {
-		fprintf(stderr, "%s: Fatal: asprintf failed\n", progname);
-		exit(1);
-	}
-	sock_path_len = strlen(sock_path);
-	if (sock_path_len >= sizeof(server_address.sun_path)-1) {
-		fprintf(stderr, "%s: Fatal: server socket address lenght is too big (%d)\n",
-			progname, (int)sock_path_len);
+	set_socket_address("ssock", &server_address, &server_addr_len);
+	set_socket_address("csock", &conn_listen_address, &conn_listen_addr_len);
+}
+
+static void add_to_epoll(int fd, void *ptr)
+{
+	struct epoll_event	ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		fprintf(stderr, "%s: Fatal: epoll_ctl failed\n", progname);
 		exit(1);
 	}
-	server_address.sun_family = AF_UNIX;
-	strcpy(server_address.sun_path, sock_path); /* it fits. */
-	server_addr_len = sizeof(sa_family_t) + sock_path_len + 1;
-	free(sock_path);
 }
 
 void create_server_socket(void)
 {
-	server_socket = socket(PF_UNIX, SOCK_DGRAM, 0);
+	server_socket = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	if (server_socket < 0) {
 		fprintf(stderr, "%s: Fatal: Failed to create server socket\n", progname);
 		exit(1);
@@ -79,6 +124,23 @@ void create_server_socket(void)
 		exit(1);
 	}
 	LB_LOG(LB_LOGLEVEL_DEBUG, "server socket = (%s)", server_address.sun_path);
+
+	conn_listen_socket = socket(PF_UNIX,
+		SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (conn_listen_socket < 0) {
+		fprintf(stderr, "%s: Fatal: Failed to create server socket\n", progname);
+		exit(1);
+	}
+	unlink(conn_listen_address.sun_path);
+	if ((bind(conn_listen_socket, (struct sockaddr*)&conn_listen_address,
+		  conn_listen_addr_len) < 0) ||
+	    (listen(conn_listen_socket, SOMAXCONN) < 0)) {
+		fprintf(stderr, "%s: Fatal: Failed to bind server socket address (%s)\n",
+			progname, conn_listen_address.sun_path);
+		exit(1);
+	}
+	LB_LOG(LB_LOGLEVEL_DEBUG, "connection socket = (%s)",
+		conn_listen_address.sun_path);
 	/* done, ok. */
 
 	/* we'll use inotify to watch if the socket gets removed.
@@ -91,94 +153,216 @@ void create_server_socket(void)
 		server_sock_dir, IN_DELETE);
 	LB_LOG(LB_LOGLEVEL_DEBUG, "inotify_fd = %d, inotify_server_sock_dir_wd = %d",
 		inotify_fd, inotify_server_sock_dir_wd);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "%s: Fatal: epoll_create1 failed\n", progname);
+		exit(1);
+	}
+	add_to_epoll(server_socket, &server_socket_tag);
+	add_to_epoll(conn_listen_socket, &conn_listen_socket_tag);
+	add_to_epoll(inotify_fd, &inotify_fd_tag);
 }
 
-void send_reply_to_client(struct sockaddr_un *client_address,
+void lbrdbd_connection_ref(lbrdbd_connection_t *conn)
+{
+	__sync_add_and_fetch(&conn->conn_refcount, 1);
+}
+
+void lbrdbd_connection_unref(lbrdbd_connection_t *conn)
+{
+	if (__sync_sub_and_fetch(&conn->conn_refcount, 1) == 0) {
+		close(conn->conn_fd);
+		free(conn);
+	}
+}
+
+static void accept_connections(void)
+{
+	while (1) {
+		lbrdbd_connection_t	*conn;
+		int			fd;
+
+		fd = accept4(conn_listen_socket, NULL, NULL,
+			SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+			    (errno != EINTR))
+				LB_LOG(LB_LOGLEVEL_ERROR,
+					"%s: accept failed, errno=%d",
+					progname, errno);
+			return;
+		}
+		conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			close(fd);
+			return;
+		}
+		conn->conn_fd = fd;
+		conn->conn_refcount = 1; /* owned by epoll */
+		add_to_epoll(fd, conn);
+		connections_accepted_in_round = 1;
+		lbrdbd_stats.st_connections++;
+		lbrdbd_stats.st_open_connections++;
+		LB_LOG(LB_LOGLEVEL_DEBUG, "new connection, fd=%d", fd);
+	}
+}
+
+static void close_connection(lbrdbd_connection_t *conn)
+{
+	LB_LOG(LB_LOGLEVEL_DEBUG, "connection closed, fd=%d", conn->conn_fd);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->conn_fd, NULL);
+	lbrdbd_stats.st_open_connections--;
+	lbrdbd_connection_unref(conn);
+}
+
+void send_reply_to_client(lbrdbd_client_t *client,
 	ruletree_rpc_msg_reply_t *reply,
 	size_t reply_size)
 {
 	ssize_t	sent_msg_size;
 
+	if (client->cl_conn) {
+		sent_msg_size = send(client->cl_conn->conn_fd, reply,
+			reply_size, MSG_NOSIGNAL);
+		LB_LOG(LB_LOGLEVEL_DEBUG, "send => %d (fd=%d)",
+			(int)sent_msg_size, client->cl_conn->conn_fd);
+		return;
+	}
 	sent_msg_size = sendto(server_socket, reply, reply_size, 0,
-		client_address,
-		sizeof(sa_family_t) + strlen(client_address->sun_path) + 1);
+		&client->cl_address,
+		sizeof(sa_family_t) + strlen(client->cl_address.sun_path) + 1);
 	LB_LOG(LB_LOGLEVEL_DEBUG, "sendto => %d (%s)",
-		(int)sent_msg_size, client_address->sun_path);
+		(int)sent_msg_size, client->cl_address.sun_path);
 }
 
-int receive_command_from_server_socket(struct sockaddr_un *client_address,
-	ruletree_rpc_msg_command_t *command)
+static int read_inotify_events(void)
 {
-	ssize_t	received_msg_size;
-	socklen_t addrlen = sizeof(struct sockaddr_un);
-	fd_set in_set;
-	int selected;
-
-	FD_ZERO(&in_set);
-	FD_SET(server_socket, &in_set);
-	FD_SET(inotify_fd, &in_set);
-
-	selected = select((server_socket < inotify_fd) ? (inotify_fd + 1) : (server_socket + 1),
-		&in_set, NULL, NULL, NULL);
-	if (selected <= 0) {
-		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: select returned %d?",
-			__func__, selected);
-		if (selected < 0) return(-2);
-		return(RECEIVE_FAILED_TRY_AGAIN);
-	}
-
-	LB_LOG(LB_LOGLEVEL_DEBUG, "select => %d", selected);
-
-	if (FD_ISSET(server_socket, &in_set)) {
-		received_msg_size = recvfrom(server_socket, command, sizeof(*command), 0,
-			(struct sockaddr*)client_address, &addrlen);
-		LB_LOG(LB_LOGLEVEL_DEBUG, "recvfrom => %d (%s)", 
-			(int)received_msg_size, client_address->sun_path);
-		if (received_msg_size <= 0) {
-			perror(progname);
-			return (RECEIVE_FAILED_TRY_AGAIN);
-		}
-		/* FIXME: If message is too small... */
-		return(RPC_COMMAND_RECEIVED);
-	}
-	if (FD_ISSET(inotify_fd, &in_set)) {
-		char eventbuf[50 * (sizeof(struct inotify_event) + 30)];
-		int eb_len, event_idx;
-
-		LB_LOG(LB_LOGLEVEL_DEBUG, "I've been inotified");
-		eb_len = read(inotify_fd, eventbuf, sizeof(eventbuf));
-		if (eb_len < 0) {
-			LB_LOG(LB_LOGLEVEL_ERROR,
-				"%s: Failed to receive inotify events",
-				progname);
-		} else for (event_idx = 0; event_idx < eb_len;) {
-			struct inotify_event *ie = (struct inotify_event*)(eventbuf+event_idx);
-
-			if (ie->wd != inotify_server_sock_dir_wd) {
-				fprintf(stderr, "%s: Warning: received inotify "
-					"event for an unknown descriptor\n", progname);
-			} else {
-				if (ie->mask & IN_DELETE) {
-					/* normally this does not happen (see comment
-					 * above) but if the delete events start
-					 * to work someday... */
-					LB_LOG(LB_LOGLEVEL_DEBUG, "%s: deleted = '%s'",
+	char eventbuf[50 * (sizeof(struct inotify_event) + 30)];
+	int eb_len, event_idx;
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "I've been inotified");
+	eb_len = read(inotify_fd, eventbuf, sizeof(eventbuf));
+	if (eb_len < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"%s: Failed to receive inotify events",
+			progname);
+	} else for (event_idx = 0; event_idx < eb_len;) {
+		struct inotify_event *ie = (struct inotify_event*)(eventbuf+event_idx);
+
+		if (ie->wd != inotify_server_sock_dir_wd) {
+			fprintf(stderr, "%s: Warning: received inotify "
+				"event for an unknown descriptor\n", progname);
+		} else {
+			if (ie->mask & IN_DELETE) {
+				/* normally this does not happen (see comment
+				 * above) but if the delete events start
+				 * to work someday... */
+				LB_LOG(LB_LOGLEVEL_DEBUG, "%s: deleted = '%s'",
+					__func__, ie->name);
+				if (!strcmp(ie->name, "ssock")) {
+					LB_LOG(LB_LOGLEVEL_DEBUG,
+						"%s: server socket has been deleted.",
 						__func__, ie->name);
-					if (!strcmp(ie->name, "ssock")) {
-						LB_LOG(LB_LOGLEVEL_DEBUG,
-							"%s: server socket has been deleted.",
-							__func__, ie->name);
-						return(SOCKET_DELETED);
-					}
-				} else {
-					LB_LOG(LB_LOGLEVEL_WARNING,
-						"%s: Warning: received unexpected inotify "
-						"event, mask=0x%X\n", progname, ie->mask);
+					return(SOCKET_DELETED);
 				}
+			} else {
+				LB_LOG(LB_LOGLEVEL_WARNING,
+					"%s: Warning: received unexpected inotify "
+					"event, mask=0x%X\n", progname, ie->mask);
 			}
-			event_idx += sizeof(struct inotify_event) + ie->len;
 		}
+		event_idx += sizeof(struct inotify_event) + ie->len;
 	}
 	return(RECEIVE_FAILED_TRY_AGAIN);
 }
 
+/* Start a new round: Wait for events (timeout_ms as for epoll_wait).
+ * Returns the number of ready descriptors. */
+int wait_for_server_events(int timeout_ms)
+{
+	int	n;
+
+	/* lines of the logger are buffered, write them out
+	 * before going idle */
+	if (timeout_ms != 0) lblog_flush();
+	n = epoll_wait(epoll_fd, ready_events, LBRDBD_MAX_EVENTS, timeout_ms);
+	if (n < 0) {
+		if (errno != EINTR)
+			LB_LOG(LB_LOGLEVEL_ERROR, "%s: epoll_wait failed, errno=%d",
+				progname, errno);
+		n = 0;
+	}
+	LB_LOG(LB_LOGLEVEL_NOISE, "epoll_wait => %d", n);
+	num_ready_events = n;
+	next_ready_event = 0;
+	connections_accepted_in_round = 0;
+	lbrdbd_stats.st_rounds++;
+	return(n);
+}
+
+/* Returns true if the current round saw every descriptor that was
+ * ready when it started: epoll_wait() did not fill the event array,
+ * and no new connections were accepted (their messages are received
+ * in the next round). Call after receive_command_from_server_socket()
+ * has returned NO_MORE_COMMANDS. */
+int server_round_was_complete(void)
+{
+	return((num_ready_events < LBRDBD_MAX_EVENTS) &&
+		!connections_accepted_in_round);
+}
+
+/* Get the next message of the current round. Every ready
+ * descriptor is read until it would block, so when this returns
+ * NO_MORE_COMMANDS, everything that was in the socket buffers when
+ * the round started has been received. */
+int receive_command_from_server_socket(lbrdbd_client_t *client,
+	ruletree_rpc_msg_command_t *command, size_t *msg_size)
+{
+	while (next_ready_event < num_ready_events) {
+		void	*tag = ready_events[next_ready_event].data.ptr;
+		ssize_t	received_msg_size;
+
+		if (tag == &server_socket_tag) {
+			socklen_t addrlen = sizeof(struct sockaddr_un);
+
+			received_msg_size = recvfrom(server_socket, command,
+				sizeof(*command), MSG_DONTWAIT,
+				(struct sockaddr*)&client->cl_address, &addrlen);
+			if (received_msg_size > 0) {
+				LB_LOG(LB_LOGLEVEL_DEBUG, "recvfrom => %d (%s)", 
+					(int)received_msg_size,
+					client->cl_address.sun_path);
+				client->cl_conn = NULL;
+				*msg_size = received_msg_size;
+				return(RPC_COMMAND_RECEIVED);
+			}
+			if ((received_msg_size < 0) && (errno != EAGAIN) &&
+			    (errno != EWOULDBLOCK) && (errno != EINTR))
+				perror(progname);
+		} else if (tag == &conn_listen_socket_tag) {
+			accept_connections();
+		} else if (tag == &inotify_fd_tag) {
+			if (read_inotify_events() == SOCKET_DELETED)
+				return(SOCKET_DELETED);
+		} else {
+			lbrdbd_connection_t *conn = tag;
+
+			received_msg_size = recv(conn->conn_fd, command,
+				sizeof(*command), MSG_DONTWAIT);
+			if (received_msg_size > 0) {
+				LB_LOG(LB_LOGLEVEL_DEBUG, "recv => %d (fd=%d)", 
+					(int)received_msg_size, conn->conn_fd);
+				client->cl_conn = conn;
+				*msg_size = received_msg_size;
+				return(RPC_COMMAND_RECEIVED);
+			}
+			if ((received_msg_size == 0) ||
+			    ((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+			     (errno != EINTR)))
+				close_connection(conn);
+		}
+		next_ready_event++;
+	}
+	return(NO_MORE_COMMANDS);
+}
@@ -497,12 +497,14 @@ for m_index,m_name in pairs(all_modes) do
 		print("-- Added ruleset fwd rules")
 	end
 	ruletree.catalog_set("fs_rules", modename_in_ruletree, ri)
+	ruletree.compile_fsrule_index(ri)
 
 	ri = add_list_of_rules(reverse_fs_mapping_rules, "reverse "..m_name, '') -- add reverse  rules
 	if debug_messages_enabled then
 		print("-- Added ruleset rev.rules")
 	end
 	ruletree.catalog_set("rev_rules", modename_in_ruletree, ri)
+	ruletree.compile_fsrule_index(ri)
 
 	add_all_exec_policies(modename_in_ruletree)
 end
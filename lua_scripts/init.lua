@@ -7,8 +7,9 @@
 -- initializes the rule tree database (which is empty
 -- but attached when this script is started)
 
-session_dir = os.getenv("LDBOX_SESSION_DIR")
-debug_messages_enabled = lblib.debug_messages_enabled()
+-- Utility functions (also needed by init2.lua when the rule tree
+-- has been restored from the cache and this script is not executed)
+dofile(os.getenv("LDBOX_SESSION_DIR") .. "/lua_scripts/init_functions.lua")
 
 -- This version string is used to check that the lua scripts offer 
 -- what lbrdbd expects, and v.v.
@@ -16,56 +17,17 @@ debug_messages_enabled = lblib.debug_messages_enabled()
 --
 -- NOTE: the corresponding identifier for C is in include/lb.h,
 -- see that file for description about differences
-lbrdbd_lua_c_interface_version = "301"
+lbrdbd_lua_c_interface_version = "304"
 
 -- Create the "vperm" catalog
---	vperm::inodestats is the binary tree, initially empty,
---	but the entry must be present.
+--	vperm::inodestats is the hashed inode index; lbrdbd
+--	creates it when the first inode is added, but the entry
+--	must be present.
 --	all counters must be present and zero in the beginning.
 ruletree.catalog_set("vperm", "inodestats", 0)
 ruletree.catalog_set("vperm", "num_active_inodestats",
 	ruletree.new_uint32(0))
 
-function do_file(filename)
-	if (debug_messages_enabled) then
-		lblib.log("debug", string.format("Loading '%s'", filename))
-	end
-	local f, err = loadfile(filename)
-	if (f == nil) then
-		error("\nError while loading " .. filename .. ": \n" 
-			.. err .. "\n")
-		-- "error()" never returns
-	else
-		return f() -- execute the loaded chunk
-	end
-end
-
-function import_from_fs_rule_library(libname)
-	local libpath = session_dir.."/rule_lib/fs_rules/"..libname..".lua"
-	local fs_rules
-	fs_rule_lib_interface_version = nil
-	fs_rules = do_file(libpath)
-	if fs_rule_lib_interface_version == "105" then
-		return fs_rules
-	end
-	error("\nIncorrect fs_rule_lib_interface_version while loading FS rule library "..libname.."\n")
-end
-
--- A dummy lb_procfs_mapper function is needed for the rules,
--- now when the real function is gone
-function lb_procfs_mapper()
-	return true
-end
-
--- Other utility functions for the mapping rules:
-function basename(path)
-	if (path == "/") then
-		return "/"
-	else
-		return string.match(path, "[^/]*$")
-	end
-end
-
 -- Load session-specific settings
 do_file(session_dir .. "/lb-session.conf.lua")
 
@@ -144,6 +144,7 @@ function argvmods_to_ruletree(argvmods_mode_name, num_argvmods_rules, argvmods_t
 		k = k + 1
 	end
 	ruletree.catalog_set("argvmods", argvmods_mode_name, argvmods_rule_list_index)
+	ruletree.compile_argvmods_hash(argvmods_mode_name, argvmods_rule_list_index)
 end
 
 -- This function creates the old-style argvmods_*.lua files.
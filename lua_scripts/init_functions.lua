@@ -0,0 +1,53 @@
+-- Copyright (c) 2011 Nokia Corporation.
+-- Author: Lauri T. Aarnio
+--
+-- Licensed under LGPL version 2.1, see top level LICENSE file for details.
+
+-- Utility functions for lbrdbd's Lua scripts. This is loaded by
+-- init.lua, and directly by lbrdbd when the rule tree was restored
+-- from the rule tree cache (init.lua is not executed at all then,
+-- but init2.lua still needs these).
+
+session_dir = os.getenv("LDBOX_SESSION_DIR")
+debug_messages_enabled = lblib.debug_messages_enabled()
+
+function do_file(filename)
+	if (debug_messages_enabled) then
+		lblib.log("debug", string.format("Loading '%s'", filename))
+	end
+	local f, err = loadfile(filename)
+	if (f == nil) then
+		error("\nError while loading " .. filename .. ": \n" 
+			.. err .. "\n")
+		-- "error()" never returns
+	else
+		return f() -- execute the loaded chunk
+	end
+end
+
+function import_from_fs_rule_library(libname)
+	local libpath = session_dir.."/rule_lib/fs_rules/"..libname..".lua"
+	local fs_rules
+	fs_rule_lib_interface_version = nil
+	fs_rules = do_file(libpath)
+	if fs_rule_lib_interface_version == "105" then
+		return fs_rules
+	end
+	error("\nIncorrect fs_rule_lib_interface_version while loading FS rule library "..libname.."\n")
+end
+
+-- A dummy lb_procfs_mapper function is needed for the rules,
+-- now when the real function is gone
+function lb_procfs_mapper()
+	return true
+end
+
+-- Other utility functions for the mapping rules:
+function basename(path)
+	if (path == "/") then
+		return "/"
+	else
+		return string.match(path, "[^/]*$")
+	end
+end
+
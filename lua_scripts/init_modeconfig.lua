@@ -75,6 +75,7 @@ for m_index,m_name in pairs(all_modes) do
 		end
 		ruletree.catalog_set("exec_policy_selection", m_name,
 			epsrule_list_index)
+		ruletree.compile_fsrule_index(epsrule_list_index)
 	else
 		error("No exec policy selection table in "..config_file_name)
 	end
@@ -198,6 +198,7 @@ function add_network_rules(net_modename)
 			chain_index = add_net_rule_chain(net_modename, chain_name, rules)
 			ruletree.catalog_vset("NET_RULES", net_modename, chain_name,
 				chain_index)
+			ruletree.compile_net_rule_index(chain_index)
 		end
 	end
 --        if (all_exec_policies ~= nil) then
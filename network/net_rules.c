@@ -18,6 +18,12 @@
  * optimize now if it turns out to be a problem. Remember
  * that these routines are usually called for connections, not
  * for every TCP packet (see "NETWORKING MODES" in lb(1))
+ *
+ * Test suites do a lot of localhost networking, so normally the
+ * rules are matched using the precompiled form of the rule lists
+ * (see ruletree_net_rule_index_t): binary addresses and masks,
+ * and hashes of the names. find_net_rule() is used only if the
+ * index is not available or the address is not numeric.
 */
 
 #include <lua.h>
@@ -376,6 +382,142 @@ static ruletree_net_rule_t *find_net_rule(
 	return(NULL);
 }
 
+/* ========== find a rule using the precompiled rules: ========== */
+
+/* must be a power of two */
+#define NET_RULE_INDEX_MEMO_SIZE	16
+
+/* (rule list offs << 32) | index offs, for lists seen by this process */
+static volatile uint64_t net_rule_index_memo[NET_RULE_INDEX_MEMO_SIZE];
+
+typedef struct net_rule_query_s {
+	const char	*realfnname;
+	uint32_t	realfnname_hash;
+	const char	*binary_name;
+	uint32_t	binary_name_hash;
+	uint32_t	addr_match;	/* LB_RULETREE_NET_ADDR_MATCH_IPV4/6 */
+	uint8_t		addr[16];	/* network byte order */
+	unsigned int	port;
+
+	/* for find_net_rule(): */
+	const char	*addr_type;
+	const char	*orig_dst_addr;
+} net_rule_query_t;
+
+static const ruletree_net_rule_index_t *get_net_rule_index(
+	ruletree_object_offset_t rule_list_offs)
+{
+	volatile uint64_t	*mp;
+	uint64_t		m;
+	ruletree_object_offset_t index_offs;
+	const ruletree_net_rule_index_t *idx;
+
+	if (!rule_list_offs) return(NULL);
+	mp = &net_rule_index_memo[rule_list_offs &
+		(NET_RULE_INDEX_MEMO_SIZE - 1)];
+	m = *mp;
+	if ((m >> 32) == rule_list_offs) {
+		index_offs = (ruletree_object_offset_t)m;
+	} else {
+		char	index_name[32];
+
+		snprintf(index_name, sizeof(index_name), "%u", rule_list_offs);
+		index_offs = ruletree_catalog_get("net_rule_index", index_name);
+		*mp = ((uint64_t)rule_list_offs << 32) | index_offs;
+	}
+	if (!index_offs) return(NULL);
+
+	idx = offset_to_ruletree_object_ptr(index_offs,
+		LB_RULETREE_OBJECT_TYPE_NET_RULE_INDEX);
+	if (!idx ||
+	    (idx->rtree_nri_rule_list_offs != rule_list_offs) ||
+	    (idx->rtree_nri_rule_list_size !=
+		ruletree_objectlist_get_list_size(rule_list_offs)))
+		return(NULL);
+	return(idx);
+}
+
+static int net_rule_name_matches(ruletree_object_offset_t name_offs,
+	uint32_t name_hash, const char *name, uint32_t hash)
+{
+	const char	*rule_name;
+
+	if (!name_offs) return(1); /* any name */
+	if (!name || (name_hash != hash)) return(0);
+	rule_name = offset_to_ruletree_string_ptr(name_offs, NULL);
+	return(rule_name && !strcmp(rule_name, name));
+}
+
+/* Same as find_net_rule(), but uses the precompiled rules. */
+static ruletree_net_rule_t *find_indexed_net_rule(
+	const ruletree_net_rule_index_t *idx,
+	const net_rule_query_t *q)
+{
+	const ruletree_net_rule_match_t *matches;
+	uint32_t	i;
+
+	matches = (const ruletree_net_rule_match_t*)
+		((const char*)idx + sizeof(*idx));
+
+	for (i = 0; i < idx->rtree_nri_rule_list_size; i++) {
+		const ruletree_net_rule_match_t *mp = &matches[i];
+		ruletree_net_rule_t	*rule;
+
+		if (!mp->rtree_nrm_rule_offs) continue;
+		if (mp->rtree_nrm_port && (mp->rtree_nrm_port != q->port))
+			continue;
+		if (!net_rule_name_matches(mp->rtree_nrm_func_name,
+			mp->rtree_nrm_func_name_hash,
+			q->realfnname, q->realfnname_hash))
+			continue;
+		if (!net_rule_name_matches(mp->rtree_nrm_binary_name,
+			mp->rtree_nrm_binary_name_hash,
+			q->binary_name, q->binary_name_hash))
+			continue;
+
+		if (mp->rtree_nrm_addr_match != LB_RULETREE_NET_ADDR_MATCH_ANY) {
+			int	addr_len;
+			int	j;
+
+			if (mp->rtree_nrm_addr_match != q->addr_match)
+				continue;
+			addr_len = (q->addr_match ==
+				LB_RULETREE_NET_ADDR_MATCH_IPV4) ? 4 : 16;
+			for (j = 0; j < addr_len; j++) {
+				if ((q->addr[j] & mp->rtree_nrm_mask[j]) !=
+				    mp->rtree_nrm_addr[j]) break;
+			}
+			if (j < addr_len) continue;
+		}
+
+		rule = offset_to_ruletree_object_ptr(mp->rtree_nrm_rule_offs,
+			LB_RULETREE_OBJECT_TYPE_NET_RULE);
+		if (!rule) continue;
+
+		if (rule->rtree_net_rules) {
+			const ruletree_net_rule_index_t *sub_idx = NULL;
+
+			LB_LOG(LB_LOGLEVEL_NOISE,
+				"%s: [%d] => more rules @%d", __func__, i,
+				rule->rtree_net_rules);
+			if (mp->rtree_nrm_subrules_index)
+				sub_idx = offset_to_ruletree_object_ptr(
+					mp->rtree_nrm_subrules_index,
+					LB_RULETREE_OBJECT_TYPE_NET_RULE_INDEX);
+			if (sub_idx)
+				return(find_indexed_net_rule(sub_idx, q));
+			return(find_net_rule(rule->rtree_net_rules,
+				q->realfnname, q->addr_type, q->orig_dst_addr,
+				q->port, q->binary_name));
+		}
+		LB_LOG(LB_LOGLEVEL_NOISE,
+			"%s: rule found @%d", __func__, mp->rtree_nrm_rule_offs);
+		return(rule);
+	}
+	LB_LOG(LB_LOGLEVEL_NOISE, "%s: rule NOT found", __func__);
+	return(NULL);
+}
+
 /* Body of this function was converted from (Lua) function
  *  ldbox_map_network_addr()
  * returns zero if OK, or code for errno
@@ -467,6 +609,7 @@ int lb_map_network_addr(
 	const char *protocol,
 	const char *addr_type,
 	const char *orig_dst_addr,
+	const void *orig_dst_addr_bin,
 	int orig_port,
 	char *result_addr_buf,
 	int result_addr_buf_len,
@@ -476,6 +619,7 @@ int lb_map_network_addr(
 	ruletree_net_rule_t *rule = NULL;
 	const char *v[4];
 	ruletree_object_offset_t	net_rule_list_offs;
+	const ruletree_net_rule_index_t *idx;
 	const char *modename = ldbox_network_mode;
 
 #if 1
@@ -503,8 +647,47 @@ int lb_map_network_addr(
 	net_rule_list_offs = ruletree_catalog_vget(v);
 	LB_LOG(LB_LOGLEVEL_NOISE, "%s: net rules at = %d", __func__, net_rule_list_offs);
 
-	rule = find_net_rule(net_rule_list_offs, realfnname, addr_type,
-		orig_dst_addr, orig_port, binary_name);
+	idx = get_net_rule_index(net_rule_list_offs);
+	if (idx) {
+		net_rule_query_t	q;
+		int	addr_len = 0;
+		int	af = AF_UNSPEC;
+
+		memset(&q, 0, sizeof(q));
+		if (addr_type && !strncmp(addr_type, "ipv4", 4)) {
+			q.addr_match = LB_RULETREE_NET_ADDR_MATCH_IPV4;
+			af = AF_INET;
+			addr_len = 4;
+		} else if (addr_type && !strncmp(addr_type, "ipv6", 4)) {
+			q.addr_match = LB_RULETREE_NET_ADDR_MATCH_IPV6;
+			af = AF_INET6;
+			addr_len = 16;
+		}
+		if (orig_dst_addr_bin && addr_len) {
+			memcpy(q.addr, orig_dst_addr_bin, addr_len);
+		} else if (addr_len &&
+			   (inet_pton(af, orig_dst_addr, q.addr) != 1)) {
+			/* not numeric; only find_net_rule() can
+			 * compare it to the rules */
+			idx = NULL;
+		}
+		if (idx) {
+			q.realfnname = realfnname;
+			q.realfnname_hash = realfnname ?
+				ruletree_net_rule_hash_name(realfnname) : 0;
+			q.binary_name = binary_name;
+			q.binary_name_hash = binary_name ?
+				ruletree_net_rule_hash_name(binary_name) : 0;
+			q.port = orig_port;
+			q.addr_type = addr_type;
+			q.orig_dst_addr = orig_dst_addr;
+			rule = find_indexed_net_rule(idx, &q);
+		}
+	}
+	if (!idx) {
+		rule = find_net_rule(net_rule_list_offs, realfnname, addr_type,
+			orig_dst_addr, orig_port, binary_name);
+	}
 
 	result = EPERM; /* default value */
 	if (rule) {
@@ -544,7 +727,7 @@ int lbshow__map_network_addr__(
 	result_buf[0] = '\0';
 	res = lb_map_network_addr(
 		binary_name, fn_name, protocol,
-		addr_type, dst_addr, port,
+		addr_type, dst_addr, NULL, port,
 		result_buf, sizeof(result_buf),
 		new_portp);
 	*addr_bufp = strdup(result_buf);
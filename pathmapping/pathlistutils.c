@@ -47,6 +47,141 @@
 
 /* ========== Path & Path component handling primitives: ========== */
 
+/* Path entries are allocated from a small per-thread pool, because
+ * every mapping operation splits and duplicates paths (one entry per
+ * component) and frees them soon after. malloc() is used only for
+ * long components, when the pool is exhausted, or if the pool is
+ * being used by an interrupted call of the same thread (i.e. this
+ * is called from a signal handler).
+*/
+#define PATH_ENTRY_POOL_SIZE	64
+#define PATH_ENTRY_POOL_MAX_COMPONENT_LEN	63
+
+typedef union path_entry_pool_slot_u {
+	union path_entry_pool_slot_u	*ps_next_free;
+	struct path_entry		ps_entry;
+	char				ps_space[sizeof(struct path_entry) +
+						PATH_ENTRY_POOL_MAX_COMPONENT_LEN];
+} path_entry_pool_slot_t;
+
+struct path_entry_pool {
+	volatile int		pep_busy;
+	path_entry_pool_slot_t	*pep_free_list;
+	path_entry_pool_slot_t	pep_slots[PATH_ENTRY_POOL_SIZE];
+};
+
+static pthread_key_t path_entry_pool_key;
+static pthread_once_t path_entry_pool_key_once = PTHREAD_ONCE_INIT;
+static int path_entry_pool_key_created = 0;
+
+/* used only if pthread lib is not available: */
+static struct path_entry_pool *my_path_entry_pool = NULL;
+
+static void alloc_path_entry_pool_key(void)
+{
+	if (pthread_key_create_fnptr &&
+	    ((*pthread_key_create_fnptr)(&path_entry_pool_key, free) == 0))
+		path_entry_pool_key_created = 1;
+}
+
+/* returns the pool of the current thread, if it has been created */
+static struct path_entry_pool *current_path_entry_pool(void)
+{
+	if (pthread_library_is_available) {
+		if (!path_entry_pool_key_created || !pthread_getspecific_fnptr)
+			return(NULL);
+		return((*pthread_getspecific_fnptr)(path_entry_pool_key));
+	}
+	return(my_path_entry_pool);
+}
+
+static struct path_entry_pool *get_path_entry_pool(void)
+{
+	struct path_entry_pool *pool = NULL;
+	int	i;
+
+	if (pthread_library_is_available && pthread_once_fnptr)
+		(*pthread_once_fnptr)(&path_entry_pool_key_once,
+			alloc_path_entry_pool_key);
+	pool = current_path_entry_pool();
+	if (pool) return(pool);
+	if (pthread_library_is_available &&
+	    (!path_entry_pool_key_created || !pthread_setspecific_fnptr))
+		return(NULL);
+
+	pool = malloc(sizeof(*pool));
+	if (!pool) return(NULL);
+	pool->pep_busy = 0;
+	pool->pep_free_list = NULL;
+	for (i = PATH_ENTRY_POOL_SIZE - 1; i >= 0; i--) {
+		pool->pep_slots[i].ps_next_free = pool->pep_free_list;
+		pool->pep_free_list = &pool->pep_slots[i];
+	}
+	if (pthread_library_is_available) {
+		(*pthread_setspecific_fnptr)(path_entry_pool_key, pool);
+	} else {
+		my_path_entry_pool = pool;
+	}
+	return(pool);
+}
+
+static int path_entry_is_from_pool(
+	const struct path_entry_pool *pool,
+	const struct path_entry *pep)
+{
+	return (pool &&
+		((const char *)pep >= (const char *)pool->pep_slots) &&
+		((const char *)pep < (const char *)(pool->pep_slots +
+			PATH_ENTRY_POOL_SIZE)));
+}
+
+/* Allocate an entry for a component of "len" bytes. All fields
+ * are cleared, except the component itself. */
+static struct path_entry *alloc_path_entry(int len)
+{
+	struct path_entry	*new = NULL;
+
+	if (len <= PATH_ENTRY_POOL_MAX_COMPONENT_LEN) {
+		struct path_entry_pool *pool = get_path_entry_pool();
+
+		if (pool && !pool->pep_busy) {
+			pool->pep_busy = 1;
+			if (pool->pep_free_list) {
+				new = &pool->pep_free_list->ps_entry;
+				pool->pep_free_list =
+					pool->pep_free_list->ps_next_free;
+			}
+			pool->pep_busy = 0;
+		}
+	}
+	if (!new) {
+		new = malloc(sizeof(struct path_entry) + len);
+		if (!new) abort();
+	}
+	memset(new, 0, sizeof(struct path_entry));
+	return(new);
+}
+
+static void release_path_entry(struct path_entry *pep)
+{
+	struct path_entry_pool *pool = current_path_entry_pool();
+
+	if (path_entry_is_from_pool(pool, pep)) {
+		path_entry_pool_slot_t *slot = (path_entry_pool_slot_t *)pep;
+
+		/* The pool is busy only if a signal handler frees an
+		 * entry which it did not allocate. That should never
+		 * happen; losing the slot is the safe thing to do. */
+		if (pool->pep_busy) return;
+		pool->pep_busy = 1;
+		slot->ps_next_free = pool->pep_free_list;
+		pool->pep_free_list = slot;
+		pool->pep_busy = 0;
+	} else {
+		free(pep);
+	}
+}
+
 void set_flags_in_path_entries(struct path_entry *pep, int flags)
 {
 	while (pep) {
@@ -72,44 +207,40 @@ struct path_entry *append_path_entries(
 	return (head);
 }
 
-/* returns an allocated buffer */
-char *path_entries_to_string_until(
+/* Write the path to "buf", if it is large enough (bufsize must include
+ * space for the terminating \0). Returns length of the path string
+ * (without the \0) in any case, like snprintf().
+*/
+size_t path_entries_to_buf_until(
 	const struct path_entry *p_entry,
 	const struct path_entry *last_path_entry_to_include,
-	int flags)
+	int flags,
+	char *buf,
+	size_t bufsize)
 {
-	char *buf;
 	const struct path_entry *work;
-	int len;
+	size_t	len = 0;
+	char	last_char = '\0';
 
 	if (!p_entry) {
 		/* "p_entry" will be empty if orig.path was "/." */
-		return(strdup("/"));
+		if (bufsize >= 2) strcpy(buf, "/");
+		return(1);
 	}
 
 	/* first, count length of the buffer */
 	work = p_entry;
-	len = 0;
-	while (work) {
-		len++; /* "/" */
-		len += work->pe_path_component_len;
-		if (work == last_path_entry_to_include) break;
-		work = work->pe_next;
-	}
-	len += 2; /* for trailing (optional) '/' and \0 */
-
-	buf = malloc(len);
-	*buf = '\0';
-
-	/* add path components to the buffer */
-	work = p_entry;
 	if (flags & PATH_FLAGS_ABSOLUTE) {
-		strcpy(buf, "/");
+		len++;
+		last_char = '/';
 	}
 	while (work) {
 		int component_is_empty;
-		if (*work->pe_path_component) {
-			strcat(buf, work->pe_path_component);
+
+		if (work->pe_path_component_len > 0) {
+			len += work->pe_path_component_len;
+			last_char = work->pe_path_component[
+				work->pe_path_component_len - 1];
 			component_is_empty = 0;
 		} else {
 			component_is_empty = 1;
@@ -117,16 +248,58 @@ char *path_entries_to_string_until(
 		if (work == last_path_entry_to_include) break;
 		work = work->pe_next;
 		if (work && (component_is_empty==0)) {
-			strcat(buf, "/");
+			len++;
+			last_char = '/';
 		}
 	}
-	if (flags & PATH_FLAGS_HAS_TRAILING_SLASH) {
-		char *cp = buf;
-		/* point to last char in buf */
-		while (*cp && cp[1]) cp++; 
-		if (*cp != '/') strcat(buf, "/");
+	if ((flags & PATH_FLAGS_HAS_TRAILING_SLASH) && (last_char != '/')) {
+		len++;
+	}
+	if (len >= bufsize) return(len);
+
+	/* add path components to the buffer */
+	{
+		char	*cp = buf;
+
+		work = p_entry;
+		if (flags & PATH_FLAGS_ABSOLUTE) *cp++ = '/';
+		while (work) {
+			int component_is_empty;
+
+			if (work->pe_path_component_len > 0) {
+				memcpy(cp, work->pe_path_component,
+					work->pe_path_component_len);
+				cp += work->pe_path_component_len;
+				component_is_empty = 0;
+			} else {
+				component_is_empty = 1;
+			}
+			if (work == last_path_entry_to_include) break;
+			work = work->pe_next;
+			if (work && (component_is_empty==0)) *cp++ = '/';
+		}
+		if ((flags & PATH_FLAGS_HAS_TRAILING_SLASH) &&
+		    (last_char != '/')) *cp++ = '/';
+		*cp = '\0';
 	}
+	return(len);
+}
 
+/* returns an allocated buffer */
+char *path_entries_to_string_until(
+	const struct path_entry *p_entry,
+	const struct path_entry *last_path_entry_to_include,
+	int flags)
+{
+	char	*buf;
+	size_t	len;
+
+	len = path_entries_to_buf_until(p_entry, last_path_entry_to_include,
+		flags, NULL, 0);
+	buf = malloc(len + 1);
+	if (!buf) abort();
+	path_entries_to_buf_until(p_entry, last_path_entry_to_include,
+		flags, buf, len + 1);
 	return(buf);
 }
 
@@ -151,7 +324,7 @@ static void free_path_entry(struct path_entry *work)
 		work->pe_path_component_len, work->pe_path_component,
 		(work->pe_link_dest ? work->pe_link_dest : NULL));
 	if (work->pe_link_dest) free(work->pe_link_dest);
-	free(work);
+	release_path_entry(work);
 }
 
 void free_path_entries(struct path_entry *work)
@@ -206,11 +379,9 @@ struct path_entry *split_path_to_path_entries(
 		} else {
 			struct path_entry *new;
 
-			new = malloc(sizeof(struct path_entry) + len);
+			new = alloc_path_entry(len);
 			if(!first) first = new;
-			if (!new) abort();
-			memset(new, 0, sizeof(struct path_entry));
-			strncpy(new->pe_path_component, start, len);
+			memcpy(new->pe_path_component, start, len);
 			new->pe_path_component[len] = '\0';
 			new->pe_path_component_len = len;
 
@@ -256,12 +427,10 @@ struct path_entry *duplicate_path_entries_until(
 		struct path_entry *new;
 		int	len = source_path->pe_path_component_len;
 
-		new = malloc(sizeof(struct path_entry) + len);
-		if (!new) abort();
+		new = alloc_path_entry(len);
 		if(!first) first = new;
-		memset(new, 0, sizeof(struct path_entry) + len);
 
-		strncpy(new->pe_path_component, source_path->pe_path_component, len);
+		memcpy(new->pe_path_component, source_path->pe_path_component, len);
 		new->pe_path_component[len] = '\0';
 		new->pe_path_component_len = len;
 
@@ -56,6 +56,10 @@ extern char *path_entries_to_string_until(
 	const struct path_entry *p_entry,
 	const struct path_entry *last_path_entry_to_include,
 	int flags);
+extern size_t path_entries_to_buf_until(
+	const struct path_entry *p_entry,
+	const struct path_entry *last_path_entry_to_include,
+	int flags, char *buf, size_t bufsize);
 extern struct path_entry *append_path_entries(
 	struct path_entry *head,
 	struct path_entry *new_entries);
@@ -184,5 +188,47 @@ extern char *ldbox_reverse_path_internal__c_engine(
         const char *abs_host_path,
 	int drop_chroot_prefix); /* flag */
 
+/* ----------- pathmapping_cache.c ----------- */
+extern int pathmapping_cache_find(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	mapping_results_t *res);
+
+extern void pathmapping_cache_add(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	const mapping_results_t *res,
+	uint32_t session_modification_count);
+
+/* ----------- paths_shared_cache.c ----------- */
+extern int shared_pathcache_find(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	mapping_results_t *res,
+	uint32_t *modification_countp);
+
+extern void shared_pathcache_add(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	const mapping_results_t *res,
+	uint32_t modification_count);
+
+extern ssize_t shared_pathcache_readlink(
+	const char *host_path, char *buf, size_t bufsize);
+
+extern uint32_t shared_pathcache_get_modification_count(void);
+
 #endif /* __PATHMAPPING_INTERNAL_H */
 
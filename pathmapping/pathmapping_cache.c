@@ -0,0 +1,615 @@
+/*
+ * Copyright (C) 2026 ldbox contributors.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Pathmapping subsystem: Per-process cache for forward mapping results.
+ *
+ * Mapping the same path again and again (builds stat and open the same
+ * headers and libraries over and over) is expensive: The path must be
+ * split, cleaned and resolved component by component, and the rule must
+ * be found from the rule tree. This cache remembers complete results
+ * of ldbox_map_path_internal__c_engine(), keyed by
+ * (virtual path, function class, flags, binary name, cwd generation).
+ *
+ * Entries are invalidated by
+ *  - changes to the rule tree (rule tree generation number), and
+ *  - the mutating gates (rename, unlink, rmdir, symlink, mkdir, ...),
+ *    because symlink resolution depends on the contents of the file
+ *    system. Gates of this process call pathmapping_cache_invalidate();
+ *    changes made by other processes of the session are noticed from
+ *    the modification counter of the shared path cache
+ *    (paths_shared_cache.c), which every entry records.
+ * Relative paths are valid only as long as the current directory does
+ * not change; chdir() and fchdir() call pathmapping_cache_cwd_changed().
+ *
+ * The current directory itself (host path and the reversed, virtual
+ * path) is also tracked here, see "tracked cwd" below, and so are
+ * results of reverse mapping ("reverse mapping cache").
+ *
+ * Results which depend on something else than the path and the rules
+ * (conditional actions, env.vars, union directories, procfs, simulated
+ * uid) are never stored; the mapping engine marks those by setting
+ * lbctx->mapping_result_not_cacheable.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <mapping.h>
+#include <lb.h>
+#include "liblb.h"
+#include "exported.h"
+
+#include "pathmapping.h" /* get private definitions of this subsystem */
+
+/* must be a power of two */
+#define PATHMAPPING_CACHE_SIZE	1024
+
+typedef struct pathmapping_cache_entry_s {
+	uint32_t	pce_hash;
+	uint32_t	pce_generation;
+	uint32_t	pce_ruletree_generation;
+	uint32_t	pce_cwd_generation;
+	uint32_t	pce_session_modification_count;
+	uint32_t	pce_fn_class;
+	uint32_t	pce_flags;
+	char		*pce_virtual_path;
+	char		*pce_binary_name;
+
+	/* the result: */
+	char		*pce_result_buf;	/* absolute host path */
+	int		pce_result_path_offs;	/* -1 = ".", else offset in buf */
+	char		*pce_virtual_cwd;	/* only for relative paths */
+	int		pce_readonly;
+	const char	*pce_exec_policy_name;	/* ptr to the rule tree */
+} pathmapping_cache_entry_t;
+
+static pathmapping_cache_entry_t pathmapping_cache[PATHMAPPING_CACHE_SIZE];
+
+static volatile uint32_t pathmapping_cache_generation = 1;
+static volatile uint32_t pathmapping_cache_cwd_generation = 1;
+
+/* nftw() with FTW_CHDIR changes the directory behind our back */
+static volatile int pathmapping_cwd_tracking_suspended = 0;
+
+static unsigned long	pathmapping_cache_hits = 0;
+static unsigned long	pathmapping_cache_misses = 0;
+static unsigned long	pathmapping_cache_invalidations = 0;
+
+static pthread_mutex_t	pathmapping_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Functions to lock/unlock the mutex, if libpthreads is available.
+ * If it isn't, this is used in a sigle-threaded program and we can
+ * safely live without the mutex.
+ * NO logging while the mutex is locked!
+*/
+static void pathmapping_cache_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&pathmapping_cache_mutex);
+}
+static void pathmapping_cache_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&pathmapping_cache_mutex);
+}
+
+static uint32_t pathmapping_cache_hash(
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class)
+{
+	uint32_t	h;
+	uint32_t	v[2];
+
+	h = lb_fnv1a32(LB_FNV1A32_INIT, virtual_path, strlen(virtual_path));
+	h = lb_fnv1a32(h, binary_name, strlen(binary_name));
+	v[0] = fn_class;
+	v[1] = flags;
+	return(lb_fnv1a32(h, v, sizeof(v)));
+}
+
+/* Returns true if the cache can be used in the current state. */
+static int pathmapping_cache_is_usable(
+	struct lbcontext *lbctx,
+	const char *virtual_path)
+{
+	if (!virtual_path || !*virtual_path) return(0);
+	if (!lbctx || lbctx->mapping_disabled) return(0);
+	/* lb-logz needs to see the "pass:" and "mapped:" messages
+	 * from the mapping engine for every call */
+	if (LB_LOG_IS_ACTIVE(LB_LOGLEVEL_INFO)) return(0);
+	if ((*virtual_path != '/') && pathmapping_cwd_tracking_suspended)
+		return(0);
+	return(1);
+}
+
+/* Returns 1 and fills *res if a valid entry was found, 0 otherwise. */
+int pathmapping_cache_find(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	mapping_results_t *res)
+{
+	uint32_t	hash;
+	uint32_t	cwd_generation;
+	uint32_t	session_modification_count;
+	pathmapping_cache_entry_t *ep;
+	int		found = 0;
+
+	if (!pathmapping_cache_is_usable(lbctx, virtual_path)) return(0);
+
+	session_modification_count = shared_pathcache_get_modification_count();
+	hash = pathmapping_cache_hash(binary_name, virtual_path, flags, fn_class);
+	cwd_generation = (*virtual_path == '/') ? 0 : pathmapping_cache_cwd_generation;
+
+	pathmapping_cache_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		ep = &pathmapping_cache[hash & (PATHMAPPING_CACHE_SIZE - 1)];
+		if (ep->pce_virtual_path &&
+		    (ep->pce_hash == hash) &&
+		    (ep->pce_generation == pathmapping_cache_generation) &&
+		    (ep->pce_ruletree_generation == ruletree_get_generation()) &&
+		    (ep->pce_cwd_generation == cwd_generation) &&
+		    (ep->pce_session_modification_count ==
+			session_modification_count) &&
+		    (ep->pce_fn_class == fn_class) &&
+		    (ep->pce_flags == flags) &&
+		    !strcmp(ep->pce_virtual_path, virtual_path) &&
+		    !strcmp(ep->pce_binary_name, binary_name)) {
+			res->mres_result_buf = strdup(ep->pce_result_buf);
+			if (ep->pce_result_path_offs < 0) {
+				res->mres_result_path = strdup(".");
+				res->mres_result_path_was_allocated = 1;
+			} else {
+				res->mres_result_path = res->mres_result_buf +
+					ep->pce_result_path_offs;
+			}
+			if (ep->pce_virtual_cwd)
+				res->mres_virtual_cwd = strdup(ep->pce_virtual_cwd);
+			res->mres_readonly = ep->pce_readonly;
+			res->mres_exec_policy_name = ep->pce_exec_policy_name;
+			pathmapping_cache_hits++;
+			found = 1;
+		} else {
+			pathmapping_cache_misses++;
+		}
+	}
+	pathmapping_cache_mutex_unlock();
+
+	if (found) {
+		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: hit %s(%s) => '%s'",
+			__func__, binary_name, virtual_path, res->mres_result_buf);
+	}
+	return(found);
+}
+
+/* "session_modification_count" must have been read with
+ * shared_pathcache_get_modification_count() before the
+ * result was computed. */
+void pathmapping_cache_add(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	const mapping_results_t *res,
+	uint32_t session_modification_count)
+{
+	uint32_t	hash;
+	pathmapping_cache_entry_t new_entry;
+	pathmapping_cache_entry_t old_entry;
+	pathmapping_cache_entry_t *ep;
+
+	if (!pathmapping_cache_is_usable(lbctx, virtual_path)) return;
+	if (lbctx->mapping_result_not_cacheable) {
+		LB_LOG(LB_LOGLEVEL_NOISE, "%s: not cacheable (%s)",
+			__func__, virtual_path);
+		return;
+	}
+	if (!res->mres_result_buf || res->mres_errno ||
+	    res->mres_errormsg || res->mres_error_text) return;
+	/* the exec policy name is stored as a pointer to the rule tree */
+	if (res->mres_allocated_exec_policy_name) return;
+	if ((*virtual_path != '/') && !res->mres_virtual_cwd) {
+		/* failed to convert to an absolute path */
+		return;
+	}
+
+	memset(&new_entry, 0, sizeof(new_entry));
+	if (res->mres_result_path_was_allocated) {
+		if (strcmp(res->mres_result_path, ".")) return;
+		new_entry.pce_result_path_offs = -1;
+	} else {
+		new_entry.pce_result_path_offs =
+			res->mres_result_path - res->mres_result_buf;
+	}
+	hash = pathmapping_cache_hash(binary_name, virtual_path, flags, fn_class);
+	new_entry.pce_hash = hash;
+	new_entry.pce_ruletree_generation = ruletree_get_generation();
+	new_entry.pce_session_modification_count = session_modification_count;
+	new_entry.pce_fn_class = fn_class;
+	new_entry.pce_flags = flags;
+	new_entry.pce_readonly = res->mres_readonly;
+	new_entry.pce_exec_policy_name = res->mres_exec_policy_name;
+	new_entry.pce_virtual_path = strdup(virtual_path);
+	new_entry.pce_binary_name = strdup(binary_name);
+	new_entry.pce_result_buf = strdup(res->mres_result_buf);
+	if (res->mres_virtual_cwd)
+		new_entry.pce_virtual_cwd = strdup(res->mres_virtual_cwd);
+
+	pathmapping_cache_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		new_entry.pce_generation = pathmapping_cache_generation;
+		new_entry.pce_cwd_generation = (*virtual_path == '/') ?
+			0 : pathmapping_cache_cwd_generation;
+		ep = &pathmapping_cache[hash & (PATHMAPPING_CACHE_SIZE - 1)];
+		old_entry = *ep;
+		*ep = new_entry;
+	}
+	pathmapping_cache_mutex_unlock();
+
+	/* free the replaced entry outside of the critical section */
+	if (old_entry.pce_virtual_path) free(old_entry.pce_virtual_path);
+	if (old_entry.pce_binary_name) free(old_entry.pce_binary_name);
+	if (old_entry.pce_result_buf) free(old_entry.pce_result_buf);
+	if (old_entry.pce_virtual_cwd) free(old_entry.pce_virtual_cwd);
+}
+
+/* Called by gates which modify the file system:
+ * forget everything (the entries will be freed when the
+ * slots are reused) */
+void pathmapping_cache_invalidate(void)
+{
+	pathmapping_cache_mutex_lock();
+	pathmapping_cache_generation++;
+	pathmapping_cache_invalidations++;
+	pathmapping_cache_mutex_unlock();
+}
+
+/* Called when the current directory has been changed:
+ * forget results of relative paths. */
+void pathmapping_cache_cwd_changed(void)
+{
+	pathmapping_cache_mutex_lock();
+	pathmapping_cache_cwd_generation++;
+	pathmapping_cache_mutex_unlock();
+}
+
+/* ---------- Tracked cwd ----------
+ *
+ * Relative paths need the host cwd and the virtual cwd, which is
+ * found by reverse mapping the host cwd. Both are remembered
+ * process-wide until the current directory changes (cwd generation)
+ * or the rule tree is modified, so that relative paths can be
+ * mapped without calling getcwd(). A new process inherits the pair
+ * from __LB_HOST_CWD and __LB_VIRTUAL_CWD (see lb_exec.c), and
+ * validates it by a single getcwd().
+*/
+static char	*tracked_host_cwd = NULL;
+static char	*tracked_virtual_cwd = NULL;
+static uint32_t	tracked_cwd_cwd_generation = 0;
+static uint32_t	tracked_cwd_ruletree_generation = 0;
+
+uint32_t pathmapping_cache_get_cwd_generation(void)
+{
+	return(pathmapping_cache_cwd_generation);
+}
+
+/* Copy the tracked host cwd to "host_cwd", and if "virtual_cwdp"
+ * is not NULL, return a copy of the virtual cwd there.
+ * Returns 0 if the tracked cwd is valid, -1 if not. */
+int pathmapping_cache_get_tracked_cwd(
+	char *host_cwd, size_t host_cwd_size, char **virtual_cwdp)
+{
+	int	r = -1;
+
+	pathmapping_cache_mutex_lock();
+	if (tracked_host_cwd && !pathmapping_cwd_tracking_suspended &&
+	    (tracked_cwd_cwd_generation == pathmapping_cache_cwd_generation) &&
+	    (tracked_cwd_ruletree_generation == ruletree_get_generation()) &&
+	    (strlen(tracked_host_cwd) < host_cwd_size)) {
+		strcpy(host_cwd, tracked_host_cwd);
+		if (virtual_cwdp) *virtual_cwdp = strdup(tracked_virtual_cwd);
+		r = 0;
+	}
+	pathmapping_cache_mutex_unlock();
+	return(r);
+}
+
+/* Remember the cwd. "cwd_generation" must have been read before
+ * the host cwd was read, so that a concurrent chdir() wins. */
+void pathmapping_cache_set_tracked_cwd(uint32_t cwd_generation,
+	const char *host_cwd, const char *virtual_cwd)
+{
+	char	*new_host_cwd = strdup(host_cwd);
+	char	*new_virtual_cwd = strdup(virtual_cwd);
+
+	if (!new_host_cwd || !new_virtual_cwd) goto out;
+	pathmapping_cache_mutex_lock();
+	if (!pathmapping_cwd_tracking_suspended &&
+	    (cwd_generation == pathmapping_cache_cwd_generation)) {
+		char	*cp;
+
+		cp = tracked_host_cwd;
+		tracked_host_cwd = new_host_cwd;
+		new_host_cwd = cp;
+		cp = tracked_virtual_cwd;
+		tracked_virtual_cwd = new_virtual_cwd;
+		new_virtual_cwd = cp;
+		tracked_cwd_cwd_generation = cwd_generation;
+		tracked_cwd_ruletree_generation = ruletree_get_generation();
+	}
+	pathmapping_cache_mutex_unlock();
+    out:
+	/* free the replaced (or unused) copies */
+	if (new_host_cwd) free(new_host_cwd);
+	if (new_virtual_cwd) free(new_virtual_cwd);
+}
+
+/* Returns the virtual cwd which was inherited from the parent
+ * process (an allocated string), if "host_cwd" is still the
+ * same directory. */
+char *pathmapping_cache_get_inherited_virtual_cwd(const char *host_cwd)
+{
+	const char	*inherited_host_cwd;
+	const char	*inherited_virtual_cwd;
+	char		*cp;
+	unsigned long	generation;
+
+	/* not valid after the first chdir() */
+	if (pathmapping_cache_cwd_generation != 1) return(NULL);
+
+	inherited_host_cwd = getenv("__LB_HOST_CWD");
+	inherited_virtual_cwd = getenv("__LB_VIRTUAL_CWD");
+	if (!inherited_host_cwd || !inherited_virtual_cwd) return(NULL);
+	if (strcmp(inherited_host_cwd, host_cwd)) return(NULL);
+
+	/* "generation:path" */
+	generation = strtoul(inherited_virtual_cwd, &cp, 10);
+	if ((*cp != ':') || (cp[1] != '/') ||
+	    (generation != ruletree_get_generation())) return(NULL);
+	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: inherited virtual cwd '%s'",
+		__func__, cp + 1);
+	return(strdup(cp + 1));
+}
+
+/* Create "__LB_HOST_CWD=..." and "__LB_VIRTUAL_CWD=..." for
+ * a new program. Returns 0 if the tracked cwd was valid. */
+int pathmapping_cache_export_tracked_cwd(
+	char **host_cwd_var, char **virtual_cwd_var)
+{
+	char	host_cwd[PATH_MAX + 1];
+	char	*virtual_cwd = NULL;
+
+	*host_cwd_var = *virtual_cwd_var = NULL;
+	if (pathmapping_cache_get_tracked_cwd(host_cwd, sizeof(host_cwd),
+	    &virtual_cwd) < 0) return(-1);
+	if (!virtual_cwd) return(-1);
+	if ((asprintf(host_cwd_var, "__LB_HOST_CWD=%s", host_cwd) < 0) ||
+	    (asprintf(virtual_cwd_var, "__LB_VIRTUAL_CWD=%u:%s",
+		ruletree_get_generation(), virtual_cwd) < 0)) {
+		if (*host_cwd_var) free(*host_cwd_var);
+		*host_cwd_var = *virtual_cwd_var = NULL;
+		free(virtual_cwd);
+		return(-1);
+	}
+	free(virtual_cwd);
+	return(0);
+}
+
+/* Called around library functions that change the directory
+ * while calling back to the application. */
+void pathmapping_cache_suspend_cwd_tracking(int suspend)
+{
+	pathmapping_cache_mutex_lock();
+	if (suspend) {
+		pathmapping_cwd_tracking_suspended++;
+	} else {
+		pathmapping_cwd_tracking_suspended--;
+	}
+	pathmapping_cache_cwd_generation++;
+	pathmapping_cache_mutex_unlock();
+}
+
+/* ---------- Reverse mapping cache ----------
+ *
+ * getcwd(), realpath() etc. reverse host paths back to virtual paths,
+ * and shells and make call getcwd() all the time. A small LRU list
+ * remembers results of scratchbox_reverse_path(), keyed by
+ * (host path, function class, binary name). Reversing does not look
+ * at the file system, so only changes to the rule tree invalidate
+ * the entries. "No result" (NULL) is cached, too.
+*/
+
+/* small: lookups are linear */
+#define REVERSE_CACHE_SIZE	32
+
+typedef struct reverse_cache_entry_s {
+	uint32_t	rce_hash;
+	uint32_t	rce_ruletree_generation;
+	uint32_t	rce_fn_class;
+	uint32_t	rce_last_used;	/* 0 = unused */
+	char		*rce_host_path;
+	char		*rce_binary_name;
+	char		*rce_virtual_path;	/* NULL = no result */
+} reverse_cache_entry_t;
+
+static reverse_cache_entry_t reverse_cache[REVERSE_CACHE_SIZE];
+static uint32_t	reverse_cache_clock = 0;
+
+/* The counters are added to the session-wide totals at exit (an
+ * atexit() handler, and the _exit() gate), before exec, and after
+ * every REVERSE_CACHE_STATS_INTERVAL lookups. After fork() the child
+ * has a copy of the parent's counters; the child drops them (and
+ * those are published by the parent). */
+#define REVERSE_CACHE_STATS_INTERVAL	256
+
+static unsigned long	reverse_cache_hits = 0;
+static unsigned long	reverse_cache_misses = 0;
+static pid_t		reverse_cache_stats_pid = 0; /* owner of the counters */
+static int		reverse_cache_stats_registered = 0;
+
+/* Returns 1 and sets *virtual_pathp (an allocated string or NULL)
+ * if a valid entry was found, 0 otherwise. */
+int pathmapping_reverse_cache_find(
+	const char *binary_name,
+	const char *abs_host_path,
+	uint32_t fn_class,
+	char **virtual_pathp)
+{
+	uint32_t	hash;
+	uint32_t	ruletree_generation;
+	reverse_cache_entry_t *ep;
+	int		i;
+	int		found = 0;
+	int		publish_stats;
+
+	if (!abs_host_path || ldbox_chroot_path) return(0);
+
+	if (__sync_bool_compare_and_swap(&reverse_cache_stats_registered, 0, 1)) {
+		reverse_cache_stats_pid = getpid();
+		atexit(pathmapping_reverse_cache_publish_stats);
+	}
+
+	hash = pathmapping_cache_hash(binary_name, abs_host_path, 0, fn_class);
+	ruletree_generation = ruletree_get_generation();
+
+	pathmapping_cache_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		for (i = 0, ep = reverse_cache; i < REVERSE_CACHE_SIZE; i++, ep++) {
+			if (ep->rce_last_used &&
+			    (ep->rce_hash == hash) &&
+			    (ep->rce_ruletree_generation == ruletree_generation) &&
+			    (ep->rce_fn_class == fn_class) &&
+			    !strcmp(ep->rce_host_path, abs_host_path) &&
+			    !strcmp(ep->rce_binary_name, binary_name)) {
+				*virtual_pathp = ep->rce_virtual_path ?
+					strdup(ep->rce_virtual_path) : NULL;
+				ep->rce_last_used = ++reverse_cache_clock;
+				found = 1;
+				break;
+			}
+		}
+		if (found) reverse_cache_hits++;
+		else reverse_cache_misses++;
+		publish_stats = (reverse_cache_hits + reverse_cache_misses >=
+			REVERSE_CACHE_STATS_INTERVAL);
+	}
+	pathmapping_cache_mutex_unlock();
+
+	if (publish_stats) pathmapping_reverse_cache_publish_stats();
+
+	if (found) {
+		LB_LOG(LB_LOGLEVEL_NOISE, "%s: hit %s(%s) => '%s'",
+			__func__, binary_name, abs_host_path,
+			(*virtual_pathp ? *virtual_pathp : "<none>"));
+	}
+	return(found);
+}
+
+/* Store a result; replaces the least recently used entry. */
+void pathmapping_reverse_cache_add(
+	const char *binary_name,
+	const char *abs_host_path,
+	uint32_t fn_class,
+	const char *virtual_path)
+{
+	reverse_cache_entry_t new_entry;
+	reverse_cache_entry_t old_entry;
+	reverse_cache_entry_t *ep;
+	reverse_cache_entry_t *victim;
+	int		i;
+
+	if (!abs_host_path || ldbox_chroot_path) return;
+
+	memset(&new_entry, 0, sizeof(new_entry));
+	new_entry.rce_hash = pathmapping_cache_hash(binary_name,
+		abs_host_path, 0, fn_class);
+	new_entry.rce_ruletree_generation = ruletree_get_generation();
+	new_entry.rce_fn_class = fn_class;
+	new_entry.rce_host_path = strdup(abs_host_path);
+	new_entry.rce_binary_name = strdup(binary_name);
+	if (virtual_path) new_entry.rce_virtual_path = strdup(virtual_path);
+
+	pathmapping_cache_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		victim = reverse_cache;
+		for (i = 0, ep = reverse_cache; i < REVERSE_CACHE_SIZE; i++, ep++) {
+			if (!ep->rce_last_used ||
+			    (ep->rce_ruletree_generation !=
+				new_entry.rce_ruletree_generation)) {
+				victim = ep;
+				break;
+			}
+			if (ep->rce_last_used < victim->rce_last_used)
+				victim = ep;
+		}
+		new_entry.rce_last_used = ++reverse_cache_clock;
+		old_entry = *victim;
+		*victim = new_entry;
+	}
+	pathmapping_cache_mutex_unlock();
+
+	/* free the replaced entry outside of the critical section */
+	if (old_entry.rce_host_path) free(old_entry.rce_host_path);
+	if (old_entry.rce_binary_name) free(old_entry.rce_binary_name);
+	if (old_entry.rce_virtual_path) free(old_entry.rce_virtual_path);
+}
+
+/* Add the counters of this process to the session-wide totals
+ * (see "lb-show cachestats") and reset them. */
+void pathmapping_reverse_cache_publish_stats(void)
+{
+	unsigned long	hits, misses;
+	pid_t		pid = getpid();
+	pid_t		owner;
+
+	pathmapping_cache_mutex_lock();
+	hits = reverse_cache_hits;
+	misses = reverse_cache_misses;
+	reverse_cache_hits = reverse_cache_misses = 0;
+	owner = reverse_cache_stats_pid;
+	reverse_cache_stats_pid = pid;
+	pathmapping_cache_mutex_unlock();
+
+	if ((owner == pid) && (hits || misses))
+		shared_pathcache_add_reverse_cache_stats(hits, misses);
+}
+
+void pathmapping_cache_log_stats(void)
+{
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"pathmapping cache: hits=%lu misses=%lu invalidations=%lu",
+		pathmapping_cache_hits, pathmapping_cache_misses,
+		pathmapping_cache_invalidations);
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"reverse mapping cache: hits=%lu misses=%lu",
+		reverse_cache_hits, reverse_cache_misses);
+}
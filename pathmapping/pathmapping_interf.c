@@ -16,6 +16,7 @@
 #include "liblb.h"
 #include "exported.h"
 #include "processclock.h"
+#include "lb_trace.h"
 
 #ifdef EXTREME_DEBUGGING
 #include <execinfo.h>
@@ -25,6 +26,30 @@
 
 /* ========== Public interfaces to the mapping & resolution code: ========== */
 
+/* Add the result to the binary trace. This is done here and not by
+ * the mapping engine, so that results from the caches are included. */
+static void trace_mapping_result(
+	const struct lbcontext *lbctx,
+	const char *func_name,
+	const char *virtual_path,
+	const mapping_results_t *res)
+{
+	int	flags = res->mres_readonly ? LB_TRACE_FLAG_READONLY : 0;
+
+	if (!res->mres_result_path) return;
+	if (lbctx && lbctx->mapping_disabled) {
+		lbtrace_record(LB_TRACE_REC_DISABLED, func_name,
+			virtual_path, NULL, 0, 0, flags);
+	} else if (!strcmp(res->mres_result_path, virtual_path)) {
+		lbtrace_record(LB_TRACE_REC_PASS, func_name,
+			virtual_path, NULL, res->mres_errno, 0, flags);
+	} else {
+		lbtrace_record(LB_TRACE_REC_MAPPED, func_name,
+			virtual_path, res->mres_result_path,
+			res->mres_errno, 0, flags);
+	}
+}
+
 static void fwd_map_path(
 	const char *binary_name,
 	const char *func_name,
@@ -35,6 +60,7 @@ static void fwd_map_path(
 	mapping_results_t *res)
 {
 	struct lbcontext *lbctx = NULL;
+	int	use_caches;
 
 	(void)exec_mode; /* not used */
 
@@ -47,14 +73,53 @@ static void fwd_map_path(
 		lbctx = get_lbcontext();
 
 		START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "fwd_map_path");
-		ldbox_map_path_internal__c_engine(lbctx, binary_name,
-			func_name, virtual_path,
-			flags, 0, fn_class, res, 0);
-		if (res->mres_errormsg) {
-			LB_LOG(LB_LOGLEVEL_NOTICE,
-				"C path mapping engine failed (%s) (%s)",
-				res->mres_errormsg, virtual_path);
+		/* checked at every call, like the mapping engine does;
+		 * lb-show and lbrdbdctl set and unset it at runtime */
+		use_caches = (getenv("LDBOX_DISABLE_MAPPING") == NULL);
+		if (!use_caches || !pathmapping_cache_find(lbctx, binary_name,
+			virtual_path, flags, fn_class, res)) {
+			uint32_t	modification_count = 0;
+			uint32_t	session_modification_count =
+				shared_pathcache_get_modification_count();
+			int		shared_hit = 0;
+
+			if (lbctx) {
+				lbctx->mapping_result_not_cacheable = 0;
+				lbctx->mapping_result_followed_symlink = 0;
+				lbctx->mapping_result_depends_on_binary_name = 0;
+				lbctx->mapping_result_prefixes_mapped_separately = 0;
+				if (lbctx->mapping_result_resolution_host_path) {
+					free(lbctx->mapping_result_resolution_host_path);
+					lbctx->mapping_result_resolution_host_path = NULL;
+				}
+			}
+			/* the shared cache is not used while chroot
+			 * is simulated: keys are plain virtual paths */
+			if (use_caches && !ldbox_chroot_path)
+				shared_hit = shared_pathcache_find(lbctx,
+					binary_name, virtual_path, flags,
+					fn_class, res, &modification_count);
+			if (!shared_hit) {
+				ldbox_map_path_internal__c_engine(lbctx,
+					binary_name, func_name, virtual_path,
+					flags, 0, fn_class, res, 0);
+			}
+			if (res->mres_errormsg) {
+				LB_LOG(LB_LOGLEVEL_NOTICE,
+					"C path mapping engine failed (%s) (%s)",
+					res->mres_errormsg, virtual_path);
+			} else if (use_caches) {
+				if (!shared_hit && !ldbox_chroot_path)
+					shared_pathcache_add(lbctx, binary_name,
+						virtual_path, flags, fn_class,
+						res, modification_count);
+				pathmapping_cache_add(lbctx, binary_name,
+					virtual_path, flags, fn_class, res,
+					session_modification_count);
+			}
 		}
+		if (LB_TRACE_IS_ACTIVE())
+			trace_mapping_result(lbctx, func_name, virtual_path, res);
 		release_lbcontext(lbctx);
 		STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, virtual_path);
 	}
@@ -243,6 +308,7 @@ void ldbox_map_path_at(
 	uint32_t classmask)
 {
 	const char *dirfd_path;
+	char dirfd_path_buf[PATH_MAX + 1];
 
 	if (!virtual_path) {
 		res->mres_result_buf = res->mres_result_path = NULL;
@@ -264,7 +330,8 @@ void ldbox_map_path_at(
 	}
 
 	/* relative to something else than CWD */
-	dirfd_path = fdpathdb_find_path(dirfd);
+	dirfd_path = fdpathdb_find_path(dirfd,
+		dirfd_path_buf, sizeof(dirfd_path_buf));
 
 	if (dirfd_path) {
 		/* pathname found */
@@ -325,9 +392,18 @@ char *scratchbox_reverse_path(
 	ctx.pmc_fn_class = classmask;
 	ctx.pmc_virtual_orig_path = "";
 	ctx.pmc_dont_resolve_final_symlink = 0;
+
+	if (pathmapping_reverse_cache_find(ctx.pmc_binary_name,
+	    abs_host_path, classmask, &virtual_path))
+		return(virtual_path);
+
 	ctx.pmc_lbctx = get_lbcontext();
+	if (ctx.pmc_lbctx) ctx.pmc_lbctx->mapping_result_not_cacheable = 0;
 
 	virtual_path = reverse_map_path(&ctx, abs_host_path);
+	if (ctx.pmc_lbctx && !ctx.pmc_lbctx->mapping_result_not_cacheable)
+		pathmapping_reverse_cache_add(ctx.pmc_binary_name,
+			abs_host_path, classmask, virtual_path);
 	release_lbcontext(ctx.pmc_lbctx);
 	return(virtual_path);
 }
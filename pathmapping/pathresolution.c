@@ -419,6 +419,59 @@ static ruletree_object_offset_t lb_path_resolution_resolve_symlink(
 	mapping_results_t *resolved_virtual_path_res,
 	int nest_count);
 
+/* Append "/component" to a host path, which must have been allocated
+ * by malloc(). The buffer is enlarged only when needed, so that
+ * walking thru a path does not need an allocation per component.
+ * *bufsizep is the size of the buffer, or zero if it is not known
+ * (ruletree_translate_path() allocates the exact size)
+*/
+static char *append_component_to_host_path(
+	char *host_path,
+	size_t *bufsizep,
+	const struct path_entry *pep)
+{
+	size_t	len;
+	size_t	new_len;
+
+	/* mapping of the prefix failed, nothing to append to */
+	if (!host_path) return(NULL);
+	len = strlen(host_path);
+	new_len = len + 1 + pep->pe_path_component_len;
+	if (new_len >= *bufsizep) {
+		size_t	new_size = (new_len < PATH_MAX ? PATH_MAX : new_len) + 1;
+		char	*new_buf = realloc(host_path, new_size);
+
+		if (!new_buf) abort();
+		host_path = new_buf;
+		*bufsizep = new_size;
+	}
+	host_path[len] = '/';
+	memcpy(host_path + len + 1, pep->pe_path_component,
+		pep->pe_path_component_len + 1);
+	return(host_path);
+}
+
+/* Remember the host path of the last prefix that was checked for
+ * symlinks, for the shared path cache (see paths_shared_cache.c).
+ * Takes ownership of "host_path". */
+static void remember_resolution_host_path(
+	const path_mapping_context_t *ctx,
+	char *host_path)
+{
+	struct lbcontext *lbctx = ctx->pmc_lbctx;
+
+	if (!lbctx || !host_path) {
+		free(host_path);
+		return;
+	}
+	if (lbctx->mapping_result_resolution_host_path) {
+		/* resolved twice during one mapping operation */
+		lbctx->mapping_result_prefixes_mapped_separately = 1;
+		free(lbctx->mapping_result_resolution_host_path);
+	}
+	lbctx->mapping_result_resolution_host_path = host_path;
+}
+
 /* lb_path_resolution():  This is the place where symlinks are followed.
  *
  * Note: For Lua mapping:
@@ -438,7 +491,11 @@ static ruletree_object_offset_t lb_path_resolution(
 	int	component_index = 0;
 	int	min_path_len_to_check;
 	char	*prefix_mapping_result_host_path = NULL;
+	size_t	prefix_mapping_result_host_path_size = 0;
 	int	prefix_mapping_result_host_path_flags;
+	/* link_dest is also used as a temporary buffer for the
+	 * virtual path prefixes, before readlink() needs it */
+	char	link_dest[PATH_MAX+1];
 	int	call_translate_for_all = 0;
 	int	abs_virtual_source_path_has_trailing_slash;
 	ruletree_object_offset_t	rule_offs = 0;
@@ -538,15 +595,20 @@ static ruletree_object_offset_t lb_path_resolution(
 
 	/* (the source path is clean.) */
 	{
-		char	*clean_virtual_path_prefix_tmp = NULL;
+		char	*clean_virtual_path_prefix_tmp = link_dest;
 		path_mapping_context_t	ctx_copy = *ctx;
 		const char *errormsg = NULL;
 
 		ctx_copy.pmc_binary_name = "PATH_RESOLUTION";
 
-		clean_virtual_path_prefix_tmp = path_entries_to_string_until(
+		if (path_entries_to_buf_until(
 			abs_virtual_clean_source_path_list->pl_first,
-			virtual_path_work_ptr, PATH_FLAGS_ABSOLUTE);
+			virtual_path_work_ptr, PATH_FLAGS_ABSOLUTE,
+			link_dest, sizeof(link_dest)) >= sizeof(link_dest)) {
+			clean_virtual_path_prefix_tmp = path_entries_to_string_until(
+				abs_virtual_clean_source_path_list->pl_first,
+				virtual_path_work_ptr, PATH_FLAGS_ABSOLUTE);
+		}
 
 		LB_LOG(LB_LOGLEVEL_NOISE, "clean_virtual_path_prefix_tmp => %s",
 			clean_virtual_path_prefix_tmp);
@@ -560,7 +622,8 @@ static ruletree_object_offset_t lb_path_resolution(
 			resolved_virtual_path_res->mres_errormsg =
 				errormsg;
 		}
-		free(clean_virtual_path_prefix_tmp);
+		if (clean_virtual_path_prefix_tmp != link_dest)
+			free(clean_virtual_path_prefix_tmp);
 	}
 
 	LB_LOG(LB_LOGLEVEL_NOISE, "prefix_mapping_result_host_path before loop => %s",
@@ -570,8 +633,6 @@ static ruletree_object_offset_t lb_path_resolution(
 	 * is found, recurse..
 	*/
 	while (virtual_path_work_ptr) {
-		char	link_dest[PATH_MAX+1];
-
 		if (prefix_mapping_result_host_path_flags &
 		    LB_MAPPING_RULE_FLAGS_FORCE_ORIG_PATH_UNLESS_CHROOT) {
 			/* "force_orig_path_unless_chroot" is set when normally symlinks
@@ -626,10 +687,13 @@ static ruletree_object_offset_t lb_path_resolution(
 			 * this can't be done with lstat(), because lstat() does not
 			 * exist as a function on Linux => lstat_nomap() can not be
 			 * used eiher. fortunately readlink() is an ordinary function.
+			 * The results are cached session-wide (see
+			 * paths_shared_cache.c).
 			*/
 			int	link_len;
 
-			link_len = readlink_nomap(prefix_mapping_result_host_path, link_dest, PATH_MAX);
+			link_len = shared_pathcache_readlink(
+				prefix_mapping_result_host_path, link_dest, PATH_MAX);
 
 			if (link_len > 0) {
 				/* was a symlink */
@@ -690,10 +754,13 @@ static ruletree_object_offset_t lb_path_resolution(
 		if (virtual_path_work_ptr->pe_flags & PATH_FLAGS_IS_SYMLINK) {
 			/* symlink */
 
+			if (ctx->pmc_lbctx)
+				ctx->pmc_lbctx->mapping_result_followed_symlink = 1;
 			LB_LOG(LB_LOGLEVEL_NOISE,
 				"Path resolution found symlink '%s' "
 				"-> '%s'",
-				prefix_mapping_result_host_path, link_dest);
+				prefix_mapping_result_host_path,
+				virtual_path_work_ptr->pe_link_dest);
 			free(prefix_mapping_result_host_path);
 			prefix_mapping_result_host_path = NULL;
 
@@ -722,15 +789,24 @@ static ruletree_object_offset_t lb_path_resolution(
 				path_mapping_context_t	ctx_copy = *ctx;
 				const char *errormsg = NULL;
 
+				if (ctx->pmc_lbctx)
+					ctx->pmc_lbctx->mapping_result_prefixes_mapped_separately = 1;
 				ctx_copy.pmc_binary_name = "PATH_RESOLUTION/2";
 				if (prefix_mapping_result_host_path) {
 					free(prefix_mapping_result_host_path);
 					prefix_mapping_result_host_path = NULL;
 				}
-				virtual_path_prefix_to_map = path_entries_to_string_until(
+				virtual_path_prefix_to_map = link_dest;
+				if (path_entries_to_buf_until(
+					abs_virtual_clean_source_path_list->pl_first,
+					virtual_path_work_ptr,
+					abs_virtual_clean_source_path_list->pl_flags,
+					link_dest, sizeof(link_dest)) >= sizeof(link_dest)) {
+					virtual_path_prefix_to_map = path_entries_to_string_until(
 						abs_virtual_clean_source_path_list->pl_first,
 						virtual_path_work_ptr,
 						abs_virtual_clean_source_path_list->pl_flags);
+				}
 				prefix_mapping_result_host_path =
 					ruletree_translate_path(
 						&ctx_copy, LB_LOGLEVEL_NOISE,
@@ -738,39 +814,36 @@ static ruletree_object_offset_t lb_path_resolution(
 						&prefix_mapping_result_host_path_flags,
 						&resolved_virtual_path_res->mres_exec_policy_name,
 						&errormsg);
+				prefix_mapping_result_host_path_size = 0;
 				if (errormsg) {
 					resolved_virtual_path_res->mres_errormsg = errormsg;
 				}
-				free (virtual_path_prefix_to_map);
+				if (virtual_path_prefix_to_map != link_dest)
+					free(virtual_path_prefix_to_map);
 			} else {
 				/* "standard mapping", based on prefix or
 				 * exact match. Ok to skip ldbox_translate_path()
 				 * because here it would just add the component
 				 * to end of the path; instead we'll do that
-				 * here. This is a performance optimization.
+				 * here, in place. This is a performance
+				 * optimization.
 				*/
-				char	*next_dir = NULL;
-
-				if (asprintf(&next_dir, "%s/%s",
-					prefix_mapping_result_host_path,
-					virtual_path_work_ptr->pe_path_component) < 0) {
-					LB_LOG(LB_LOGLEVEL_ERROR,
-						"asprintf failed");
-				}
-				if (prefix_mapping_result_host_path) {
-					free(prefix_mapping_result_host_path);
-					prefix_mapping_result_host_path = NULL;
-				}
-				prefix_mapping_result_host_path = next_dir;
+				prefix_mapping_result_host_path =
+					append_component_to_host_path(
+						prefix_mapping_result_host_path,
+						&prefix_mapping_result_host_path_size,
+						virtual_path_work_ptr);
 			}
 		} else {
-			free(prefix_mapping_result_host_path);
+			remember_resolution_host_path(ctx,
+				prefix_mapping_result_host_path);
 			prefix_mapping_result_host_path = NULL;
 		}
 		component_index++;
 	}
 	if (prefix_mapping_result_host_path) {
-		free(prefix_mapping_result_host_path);
+		remember_resolution_host_path(ctx,
+			prefix_mapping_result_host_path);
 		prefix_mapping_result_host_path = NULL;
 	}
 
@@ -1014,13 +1087,21 @@ static int relative_virtual_path_to_abs_path(
 	char *virtual_reversed_cwd = NULL;
 	struct path_entry	*cwd_entries;
 	int			cwd_flags;
-
-	if (get_and_check_host_cwd(host_cwd, host_cwd_size) < 0) {
+	int			cwd_is_tracked;
+	uint32_t		cwd_generation;
+
+	/* The tracked cwd is used if the current directory hasn't
+	 * been changed; getcwd() is needed only after chdir() */
+	cwd_generation = pathmapping_cache_get_cwd_generation();
+	cwd_is_tracked = (pathmapping_cache_get_tracked_cwd(
+		host_cwd, host_cwd_size, NULL) == 0);
+	if (!cwd_is_tracked &&
+	    (get_and_check_host_cwd(host_cwd, host_cwd_size) < 0)) {
 		return(-1);
 	}
 	LB_LOG(LB_LOGLEVEL_DEBUG,
-		"relative_virtual_path_to_abs_path: converting to abs.path cwd=%s",
-		host_cwd);
+		"relative_virtual_path_to_abs_path: converting to abs.path cwd=%s%s",
+		host_cwd, (cwd_is_tracked ? " (tracked)" : ""));
 	
 	/* reversing of paths is expensive...try if a previous
 	 * result can be used, and call the reversing logic only if
@@ -1035,7 +1116,25 @@ static int relative_virtual_path_to_abs_path(
 			virtual_reversed_cwd);
 	} else {
 		/* "cache miss" */
-		if ( (host_cwd[1]=='\0') && (*host_cwd=='/') ) {
+		if (cwd_is_tracked) {
+			/* lbctx is per thread; the tracked cwd may
+			 * have been set by another thread */
+			if (pathmapping_cache_get_tracked_cwd(host_cwd,
+			    host_cwd_size, &virtual_reversed_cwd) < 0) {
+				if (get_and_check_host_cwd(host_cwd,
+				    host_cwd_size) < 0) return(-1);
+				cwd_is_tracked = 0;
+			}
+		}
+		if (!virtual_reversed_cwd && !cwd_is_tracked) {
+			virtual_reversed_cwd =
+				pathmapping_cache_get_inherited_virtual_cwd(host_cwd);
+		}
+		if (virtual_reversed_cwd) {
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"relative_virtual_path_to_abs_path: known rev_cwd=%s",
+				virtual_reversed_cwd);
+		} else if ( (host_cwd[1]=='\0') && (*host_cwd=='/') ) {
 			LB_LOG(LB_LOGLEVEL_DEBUG,
 				"relative_virtual_path_to_abs_path: no need to reverse, '/' is always '/'");
 			/* reversed "/" is always "/" */
@@ -1063,6 +1162,9 @@ static int relative_virtual_path_to_abs_path(
 		lbctx->host_cwd = strdup(host_cwd);
 		lbctx->virtual_reversed_cwd = virtual_reversed_cwd;
 	}
+	if (!cwd_is_tracked)
+		pathmapping_cache_set_tracked_cwd(cwd_generation,
+			host_cwd, virtual_reversed_cwd);
 	cwd_entries = split_path_to_path_entries(virtual_reversed_cwd, &cwd_flags);
 	/* getcwd() always returns a real path. Assume that the
 	 * reversed path is also real (if it isn't, then the reversing
@@ -1451,6 +1553,11 @@ void ldbox_map_path_internal__c_engine(
 				res->mres_readonly = (flags & (LB_MAPPING_RULE_FLAGS_READONLY |
 					LB_MAPPING_RULE_FLAGS_READONLY_FS_ALWAYS) ? 1 : 0);
 			}
+			res->mres_union_dir = (flags &
+				LB_MAPPING_RULE_FLAGS_UNION_DIR ? 1 : 0);
+			if (res->mres_union_dir && ctx.pmc_lbctx)
+				res->mres_union_dir_src_list = ctx.pmc_lbctx->
+					mapping_result_union_dir_src_list;
 		}
 	forget_mapping:
 		free_mapping_results(&resolved_virtual_path_res);
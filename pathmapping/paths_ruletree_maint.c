@@ -173,3 +173,310 @@ ruletree_object_offset_t add_rule_to_ruletree(
 	return(rule_location);
 }
 
+
+/* ---------- Compiled index for FS rule lists ----------
+ *
+ * The trie is built to malloc'ed nodes first, and then
+ * written to the rule tree as one object (see rule_tree.h)
+*/
+
+typedef struct fsrule_index_bnode_s {
+	uint32_t			*refs;
+	uint32_t			num_refs;
+	ruletree_fsrule_index_edge_t	*edges;
+	uint32_t			num_edges;
+} fsrule_index_bnode_t;
+
+typedef struct fsrule_index_builder_s {
+	fsrule_index_bnode_t	*nodes;
+	uint32_t		num_nodes;
+	uint32_t		max_nodes;
+	uint32_t		num_edges;
+	uint32_t		num_refs;
+	int			failed;
+} fsrule_index_builder_t;
+
+static uint32_t fsrule_index_new_node(fsrule_index_builder_t *b)
+{
+	if (b->num_nodes >= b->max_nodes) {
+		fsrule_index_bnode_t *new_nodes;
+		uint32_t new_max = b->max_nodes ? 2 * b->max_nodes : 256;
+
+		new_nodes = realloc(b->nodes, new_max * sizeof(*new_nodes));
+		if (!new_nodes) {
+			b->failed = 1;
+			return(0);
+		}
+		b->nodes = new_nodes;
+		b->max_nodes = new_max;
+	}
+	memset(&b->nodes[b->num_nodes], 0, sizeof(b->nodes[0]));
+	return(b->num_nodes++);
+}
+
+static void fsrule_index_add(fsrule_index_builder_t *b,
+	const char *selector, uint32_t ref)
+{
+	uint32_t	node = 0;
+	uint32_t	*new_refs;
+	const unsigned char *cp;
+
+	for (cp = (const unsigned char *)selector; *cp && !b->failed; cp++) {
+		fsrule_index_bnode_t	*np = &b->nodes[node];
+		uint32_t		i;
+		uint32_t		child;
+		ruletree_fsrule_index_edge_t *new_edges;
+
+		for (i = 0; i < np->num_edges; i++) {
+			if (np->edges[i].rtree_frie_char == *cp) break;
+		}
+		if (i < np->num_edges) {
+			node = np->edges[i].rtree_frie_node;
+			continue;
+		}
+		child = fsrule_index_new_node(b);
+		if (b->failed) return;
+		np = &b->nodes[node]; /* may have been moved by realloc */
+		new_edges = realloc(np->edges,
+			(np->num_edges + 1) * sizeof(*new_edges));
+		if (!new_edges) {
+			b->failed = 1;
+			return;
+		}
+		np->edges = new_edges;
+		np->edges[np->num_edges].rtree_frie_char = *cp;
+		np->edges[np->num_edges].rtree_frie_node = child;
+		np->num_edges++;
+		b->num_edges++;
+		node = child;
+	}
+	if (b->failed) return;
+
+	new_refs = realloc(b->nodes[node].refs,
+		(b->nodes[node].num_refs + 1) * sizeof(uint32_t));
+	if (!new_refs) {
+		b->failed = 1;
+		return;
+	}
+	b->nodes[node].refs = new_refs;
+	b->nodes[node].refs[b->nodes[node].num_refs++] = ref;
+	b->num_refs++;
+}
+
+static void fsrule_index_add_selector(fsrule_index_builder_t *b,
+	uint32_t i, uint32_t selector_type, const char *selector)
+{
+	switch (selector_type) {
+	case LB_RULETREE_FSRULE_SELECTOR_PATH:
+		fsrule_index_add(b, selector,
+			(i << 2) | LB_RULETREE_FSRULE_INDEX_REF_PATH);
+		break;
+	case LB_RULETREE_FSRULE_SELECTOR_PREFIX:
+		if (*selector) fsrule_index_add(b, selector,
+			(i << 2) | LB_RULETREE_FSRULE_INDEX_REF_PREFIX);
+		break;
+	case LB_RULETREE_FSRULE_SELECTOR_DIR:
+		if (*selector) fsrule_index_add(b, selector,
+			(i << 2) | LB_RULETREE_FSRULE_INDEX_REF_DIR);
+		break;
+	default:
+		/* defunct rules, never match */
+		break;
+	}
+}
+
+static int compare_fsrule_index_edges(const void *a, const void *b)
+{
+	const ruletree_fsrule_index_edge_t *ea = a;
+	const ruletree_fsrule_index_edge_t *eb = b;
+
+	return((int)ea->rtree_frie_char - (int)eb->rtree_frie_char);
+}
+
+/* Create an index for a list of FS rules (and recursively for
+ * the lists of "subtree" rules), and add it to the "fsrule_index"
+ * catalog. If "rebuild" is set, an existing index is replaced and
+ * subtree lists are not visited (ruletree_rebuild_fsrule_indexes()
+ * handles every list that has an index).
+*/
+static ruletree_object_offset_t compile_fsrule_index(
+	ruletree_object_offset_t rule_list_offs, int rebuild)
+{
+	fsrule_index_builder_t	b;
+	uint32_t		rule_list_size;
+	uint32_t		i;
+	size_t			index_size;
+	char			*buf;
+	ruletree_fsrule_index_t		*idx;
+	ruletree_fsrule_index_node_t	*nodes;
+	ruletree_fsrule_index_edge_t	*edges;
+	uint32_t		*refs;
+	uint32_t		edge_n = 0;
+	uint32_t		ref_n = 0;
+	ruletree_object_offset_t index_offs = 0;
+	char			index_name[32];
+
+	if (!rule_list_offs) return(0);
+	rule_list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	if (rule_list_size == 0) return(0);
+
+	/* the same list may be linked from several subtree rules */
+	snprintf(index_name, sizeof(index_name), "%u", rule_list_offs);
+	if (!rebuild) {
+		index_offs = ruletree_catalog_get("fsrule_index", index_name);
+		if (index_offs) return(index_offs);
+	}
+
+	memset(&b, 0, sizeof(b));
+	fsrule_index_new_node(&b); /* root */
+
+	for (i = 0; (i < rule_list_size) && !b.failed; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_fsrule_t	*rp;
+		ruletree_exec_policy_selection_rule_t *xps;
+		const char		*selector;
+
+		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
+		if (!rule_offs) continue;
+		rp = offset_to_ruletree_fsrule_ptr(rule_offs);
+		if (!rp) {
+			xps = offset_to_ruletree_object_ptr(rule_offs,
+				LB_RULETREE_OBJECT_TYPE_EXEC_SEL_RULE);
+			if (!xps) continue;
+			selector = offset_to_ruletree_string_ptr(
+				xps->rtree_xps_selector_offs, NULL);
+			if (!selector) continue;
+			fsrule_index_add_selector(&b, i,
+				xps->rtree_xps_type, selector);
+			continue;
+		}
+
+		if (!rebuild &&
+		    (rp->rtree_fsr_action_type == LB_RULETREE_FSRULE_ACTION_SUBTREE) &&
+		    rp->rtree_fsr_rule_list_link) {
+			compile_fsrule_index(rp->rtree_fsr_rule_list_link, 0);
+		}
+
+		if (rp->rtree_fsr_condition_type != 0) {
+			/* ruletree_find_rule() must see these
+			 * regardless of the path */
+			fsrule_index_add(&b, "",
+				(i << 2) | LB_RULETREE_FSRULE_INDEX_REF_ALWAYS);
+			continue;
+		}
+
+		selector = offset_to_ruletree_string_ptr(
+			rp->rtree_fsr_selector_offs, NULL);
+		if (!selector) continue;
+		fsrule_index_add_selector(&b, i,
+			rp->rtree_fsr_selector_type, selector);
+	}
+
+	index_size = sizeof(ruletree_fsrule_index_t) +
+		b.num_nodes * sizeof(ruletree_fsrule_index_node_t) +
+		b.num_edges * sizeof(ruletree_fsrule_index_edge_t) +
+		b.num_refs * sizeof(uint32_t);
+	buf = b.failed ? NULL : calloc(1, index_size);
+	if (buf) {
+		idx = (ruletree_fsrule_index_t*)buf;
+		nodes = (ruletree_fsrule_index_node_t*)(buf + sizeof(*idx));
+		edges = (ruletree_fsrule_index_edge_t*)(nodes + b.num_nodes);
+		refs = (uint32_t*)(edges + b.num_edges);
+
+		idx->rtree_fri_rule_list_offs = rule_list_offs;
+		idx->rtree_fri_rule_list_size = rule_list_size;
+		idx->rtree_fri_num_nodes = b.num_nodes;
+		idx->rtree_fri_num_edges = b.num_edges;
+		idx->rtree_fri_num_refs = b.num_refs;
+
+		for (i = 0; i < b.num_nodes; i++) {
+			fsrule_index_bnode_t *np = &b.nodes[i];
+
+			qsort(np->edges, np->num_edges, sizeof(*np->edges),
+				compare_fsrule_index_edges);
+			nodes[i].rtree_frin_first_edge = edge_n;
+			nodes[i].rtree_frin_num_edges = np->num_edges;
+			if (np->num_edges) memcpy(&edges[edge_n], np->edges,
+				np->num_edges * sizeof(*np->edges));
+			edge_n += np->num_edges;
+
+			nodes[i].rtree_frin_first_ref = ref_n;
+			nodes[i].rtree_frin_num_refs = np->num_refs;
+			if (np->num_refs) memcpy(&refs[ref_n], np->refs,
+				np->num_refs * sizeof(uint32_t));
+			ref_n += np->num_refs;
+		}
+		/* "append_struct_to_ruletree_file" will fill the magic & type */
+		index_offs = append_struct_to_ruletree_file(buf, index_size,
+			LB_RULETREE_OBJECT_TYPE_FSRULE_INDEX);
+		free(buf);
+	}
+
+	for (i = 0; i < b.num_nodes; i++) {
+		if (b.nodes[i].edges) free(b.nodes[i].edges);
+		if (b.nodes[i].refs) free(b.nodes[i].refs);
+	}
+	if (b.nodes) free(b.nodes);
+
+	if (!index_offs) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"Failed to create index for rule list @%u", rule_list_offs);
+		return(0);
+	}
+
+	ruletree_catalog_set("fsrule_index", index_name, index_offs);
+
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"Rule list @%u (%u rules): index @%u, %u nodes, %u refs",
+		rule_list_offs, rule_list_size, index_offs,
+		b.num_nodes, b.num_refs);
+	return(index_offs);
+}
+
+/* Create an index for a list of FS rules (and recursively for
+ * the lists of "subtree" rules), and add it to the "fsrule_index"
+ * catalog. This must be called after the list is complete.
+ * Lists of exec policy selection rules can be indexed, too (those
+ * use the same selector types).
+ * Returns location of the index, or 0 if there is no index.
+*/
+ruletree_object_offset_t ruletree_compile_fsrule_index(
+	ruletree_object_offset_t rule_list_offs)
+{
+	return(compile_fsrule_index(rule_list_offs, 0));
+}
+
+/* Recreate all indexes of the "fsrule_index" catalog. Needed when
+ * selector strings have been modified in place (the rule tree cache
+ * of lbrdbd does that when a cached rule tree is restored to a new
+ * session directory); the old indexes become garbage.
+ * Returns number of indexes that were rebuilt.
+*/
+int ruletree_rebuild_fsrule_indexes(void)
+{
+	const char	*namev[] = { "fsrule_index", NULL };
+	ruletree_object_offset_t entry_offs;
+	int		count = 0;
+
+	entry_offs = ruletree_catalog_vget(namev);
+	while (entry_offs) {
+		ruletree_catalog_entry_t	*ep;
+		const char	*name;
+		char		*end = NULL;
+		unsigned long	rule_list_offs;
+
+		ep = offset_to_ruletree_object_ptr(entry_offs,
+			LB_RULETREE_OBJECT_TYPE_CATALOG);
+		if (!ep) break;
+		name = offset_to_ruletree_string_ptr(ep->rtree_cat_name_offs, NULL);
+		/* compile_fsrule_index() replaces the value of this entry */
+		entry_offs = ep->rtree_cat_next_entry_offs;
+		if (!name) continue;
+
+		rule_list_offs = strtoul(name, &end, 10);
+		if (!end || *end || !rule_list_offs) continue;
+		if (compile_fsrule_index(rule_list_offs, 1)) count++;
+	}
+	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: %d indexes rebuilt", __func__, count);
+	return(count);
+}
@@ -114,6 +114,161 @@ static int ruletree_test_path_match(const char *full_path, size_t full_path_len,
 	return(result);
 }
 
+/* ---------- Compiled rule list indexes ----------
+ * (created by ruletree_compile_fsrule_index(), see rule_tree.h) */
+
+/* Per-process memo: rule list location => index location.
+ * Entries are ((list << 32) | index), written atomically,
+ * so no locking is needed. Zero = unused entry. */
+#define FSRULE_INDEX_MEMO_SIZE	64
+static volatile uint64_t fsrule_index_memo[FSRULE_INDEX_MEMO_SIZE];
+
+/* max. number of candidates from the index; if there are more,
+ * the list is scanned without the index */
+#define FSRULE_INDEX_MAX_CANDIDATES	128
+
+static const ruletree_fsrule_index_t *ruletree_get_fsrule_index(
+	ruletree_object_offset_t rule_list_offs,
+	uint32_t rule_list_size)
+{
+	volatile uint64_t	*mp;
+	uint64_t		m;
+	ruletree_object_offset_t index_offs;
+	const ruletree_fsrule_index_t *idx;
+
+	mp = &fsrule_index_memo[rule_list_offs % FSRULE_INDEX_MEMO_SIZE];
+	m = *mp;
+	if ((m >> 32) == rule_list_offs) {
+		index_offs = (ruletree_object_offset_t)m;
+	} else {
+		char	index_name[32];
+
+		snprintf(index_name, sizeof(index_name), "%u", rule_list_offs);
+		index_offs = ruletree_catalog_get("fsrule_index", index_name);
+		*mp = ((uint64_t)rule_list_offs << 32) | index_offs;
+	}
+	if (!index_offs) return(NULL);
+
+	idx = offset_to_ruletree_object_ptr(index_offs,
+		LB_RULETREE_OBJECT_TYPE_FSRULE_INDEX);
+	if (!idx ||
+	    (idx->rtree_fri_rule_list_offs != rule_list_offs) ||
+	    (idx->rtree_fri_rule_list_size != rule_list_size) ||
+	    (idx->rtree_fri_num_nodes == 0)) return(NULL);
+	return(idx);
+}
+
+/* Find candidate rules for 'path' by walking the trie: Every rule
+ * whose selector might match is returned, in the order of the
+ * rule list. Returns number of candidates, or -1 if there are too many.
+*/
+static int ruletree_fsrule_index_get_candidates(
+	const ruletree_fsrule_index_t *idx,
+	const char *path,
+	size_t path_len,
+	uint32_t *candidates)
+{
+	const ruletree_fsrule_index_node_t *nodes;
+	const ruletree_fsrule_index_edge_t *edges;
+	const uint32_t	*refs;
+	uint32_t	node = 0;
+	size_t		depth = 0;
+	int		num_candidates = 0;
+	int		i, j;
+
+	nodes = (const ruletree_fsrule_index_node_t*)
+		((const char*)idx + sizeof(*idx));
+	edges = (const ruletree_fsrule_index_edge_t*)
+		(nodes + idx->rtree_fri_num_nodes);
+	refs = (const uint32_t*)(edges + idx->rtree_fri_num_edges);
+
+	while (1) {
+		const ruletree_fsrule_index_node_t *np = &nodes[node];
+		uint32_t	r, lo, hi, end;
+		unsigned char	c;
+
+		for (r = 0; r < np->rtree_frin_num_refs; r++) {
+			uint32_t	ref = refs[np->rtree_frin_first_ref + r];
+			int		match = 0;
+
+			/* same tests as in ruletree_test_path_match() */
+			switch (ref & 3) {
+			case LB_RULETREE_FSRULE_INDEX_REF_PREFIX:
+			case LB_RULETREE_FSRULE_INDEX_REF_ALWAYS:
+				match = 1;
+				break;
+			case LB_RULETREE_FSRULE_INDEX_REF_DIR:
+				match = (path[depth] == '/') ||
+					(path[depth] == '\0') ||
+					((depth == 1) && (*path == '/'));
+				break;
+			case LB_RULETREE_FSRULE_INDEX_REF_PATH:
+				match = (depth == path_len);
+				break;
+			}
+			if (match) {
+				if (num_candidates >= FSRULE_INDEX_MAX_CANDIDATES)
+					return(-1);
+				candidates[num_candidates++] = ref >> 2;
+			}
+		}
+		if (depth >= path_len) break;
+
+		/* follow the edge for the next character */
+		c = (unsigned char)path[depth];
+		lo = np->rtree_frin_first_edge;
+		end = hi = lo + np->rtree_frin_num_edges;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (edges[mid].rtree_frie_char < c) lo = mid + 1;
+			else hi = mid;
+		}
+		if ((lo >= end) || (edges[lo].rtree_frie_char != c)) break;
+		node = edges[lo].rtree_frie_node;
+		if (node >= idx->rtree_fri_num_nodes) return(-1);
+		depth++;
+	}
+
+	/* restore the order of the rule list */
+	for (i = 1; i < num_candidates; i++) {
+		uint32_t	v = candidates[i];
+
+		for (j = i - 1; (j >= 0) && (candidates[j] > v); j--)
+			candidates[j+1] = candidates[j];
+		candidates[j+1] = v;
+	}
+	return(num_candidates);
+}
+
+/* Find the first rule of an indexed list whose selector matches
+ * 'path' (conditions are not checked; this is used for lists without
+ * conditional rules, e.g. the exec policy selection rules).
+ * Returns the index in the rule list, -1 if no rule matches,
+ * or -2 if the list has no usable index.
+*/
+int ruletree_find_first_selector_match(
+	ruletree_object_offset_t rule_list_offs,
+	const char *path)
+{
+	const ruletree_fsrule_index_t *idx;
+	uint32_t	candidates[FSRULE_INDEX_MAX_CANDIDATES];
+	uint32_t	rule_list_size;
+	int		num_candidates;
+
+	if (!rule_list_offs || !path) return(-2);
+	rule_list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	if (rule_list_size == 0) return(-1);
+
+	idx = ruletree_get_fsrule_index(rule_list_offs, rule_list_size);
+	if (!idx) return(-2);
+	num_candidates = ruletree_fsrule_index_get_candidates(
+		idx, path, strlen(path), candidates);
+	if (num_candidates < 0) return(-2);
+	if (num_candidates == 0) return(-1);
+	return((int)candidates[0]);
+}
+
 static ruletree_object_offset_t ruletree_find_rule(
         const path_mapping_context_t *ctx,
 	ruletree_object_offset_t rule_list_offs,
@@ -125,6 +280,10 @@ static ruletree_object_offset_t ruletree_find_rule(
 {
 	uint32_t	rule_list_size;
 	uint32_t	i;
+	uint32_t	n, num_rules_to_check;
+	const ruletree_fsrule_index_t *idx;
+	uint32_t	candidates[FSRULE_INDEX_MAX_CANDIDATES];
+	int		num_candidates = -1;
 	PROCESSCLOCK(clk1)
 
 	START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "ruletree_find_rule");
@@ -136,10 +295,19 @@ static ruletree_object_offset_t ruletree_find_rule(
 
 	if (rule_list_size == 0) return(0);
 
-	for (i = 0; i < rule_list_size; i++) {
+	/* If the list has been indexed, check only the candidates
+	 * from the index (in the same order); otherwise all rules. */
+	idx = ruletree_get_fsrule_index(rule_list_offs, rule_list_size);
+	if (idx) num_candidates = ruletree_fsrule_index_get_candidates(
+		idx, virtual_path, virtual_path_len, candidates);
+	num_rules_to_check = (num_candidates >= 0) ?
+		(uint32_t)num_candidates : rule_list_size;
+
+	for (n = 0; n < num_rules_to_check; n++) {
 		ruletree_fsrule_t	*rp;
 		ruletree_object_offset_t rule_offs;
 
+		i = (num_candidates >= 0) ? candidates[n] : n;
 		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
 		if (!rule_offs) continue;
 
@@ -176,6 +344,8 @@ static ruletree_object_offset_t ruletree_find_rule(
 				if (rp->rtree_fsr_binary_name) {
 					const char	*bin_name_in_rule =
 						offset_to_ruletree_string_ptr(rp->rtree_fsr_binary_name, NULL);
+					if (ctx->pmc_lbctx)
+						ctx->pmc_lbctx->mapping_result_depends_on_binary_name = 1;
 					if (strcmp(ctx->pmc_binary_name, bin_name_in_rule)) {
 						/* binary name does not match, not this rule... */
 						continue;
@@ -262,13 +432,21 @@ ruletree_object_offset_t ruletree_get_mapping_requirements(
         int *call_translate_for_all_p,
 	uint32_t fn_class)
 {
+	char				abs_virtual_source_path_buf[PATH_MAX+1];
 	char    			*abs_virtual_source_path_string;
 	ruletree_fsrule_t		*rule = NULL;
 	ruletree_object_offset_t	rule_offs = 0;
 	PROCESSCLOCK(clk1)
 
 	START_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "ruletree_get_mapping_requirements");
-	abs_virtual_source_path_string = path_list_to_string(abs_virtual_source_path_list);
+	abs_virtual_source_path_string = abs_virtual_source_path_buf;
+	if (path_entries_to_buf_until(abs_virtual_source_path_list->pl_first,
+		NULL, abs_virtual_source_path_list->pl_flags,
+		abs_virtual_source_path_buf, sizeof(abs_virtual_source_path_buf))
+	    >= sizeof(abs_virtual_source_path_buf)) {
+		abs_virtual_source_path_string =
+			path_list_to_string(abs_virtual_source_path_list);
+	}
 
 	if (rule_list_offs) {
 		rule_offs = ruletree_find_rule(ctx,
@@ -283,6 +461,23 @@ ruletree_object_offset_t ruletree_get_mapping_requirements(
 		if (min_path_lenp) *min_path_lenp = 0;
 	}
 
+	if (rule && ctx->pmc_lbctx) {
+		/* results of these rules depend on env.vars, the exec
+		 * policy, existence of files or the simulated uid;
+		 * tell the caller that the result must not be cached. */
+		switch (rule->rtree_fsr_action_type) {
+		case LB_RULETREE_FSRULE_ACTION_CONDITIONAL_ACTIONS:
+		case LB_RULETREE_FSRULE_ACTION_PROCFS:
+		case LB_RULETREE_FSRULE_ACTION_UNION_DIR:
+		case LB_RULETREE_FSRULE_ACTION_MAP_TO_VALUE_OF_ENV_VAR:
+		case LB_RULETREE_FSRULE_ACTION_REPLACE_BY_VALUE_OF_ENV_VAR:
+			ctx->pmc_lbctx->mapping_result_not_cacheable = 1;
+			break;
+		}
+		if (rule->rtree_fsr_flags & LB_MAPPING_RULE_FLAGS_READONLY_FS_IF_NOT_ROOT)
+			ctx->pmc_lbctx->mapping_result_not_cacheable = 1;
+	}
+
 	if (call_translate_for_all_p) {
 		if (rule) {
 			switch (rule->rtree_fsr_action_type) {
@@ -299,7 +494,8 @@ ruletree_object_offset_t ruletree_get_mapping_requirements(
 		}
 	}
 
-	free(abs_virtual_source_path_string);
+	if (abs_virtual_source_path_string != abs_virtual_source_path_buf)
+		free(abs_virtual_source_path_string);
 
 	STOP_AND_REPORT_PROCESSCLOCK(LB_LOGLEVEL_INFO, &clk1, "");
 	return (rule_offs); 
@@ -448,6 +644,7 @@ static char *execute_map_to(const char *abs_clean_virtual_path,
 
 /* "standard actions" = use_orig_path, force_orig_path, map_to, replace_by */
 static char *execute_std_action(
+	const path_mapping_context_t *ctx,
 	ruletree_fsrule_t *rule_selector,
 	ruletree_fsrule_t *action,
 	const char *abs_clean_virtual_path, int *flagsp)
@@ -547,6 +744,12 @@ static char *execute_std_action(
 			if (src_paths) free(src_paths);
 		}
 		LB_LOG(LB_LOGLEVEL_DEBUG, "union_dir result = '%s'", union_dir_result);
+		if (union_dir_result) {
+			*flagsp |= LB_MAPPING_RULE_FLAGS_UNION_DIR;
+			if (ctx->pmc_lbctx)
+				ctx->pmc_lbctx->mapping_result_union_dir_src_list =
+					rule_selector->rtree_fsr_rule_list_link;
+		}
 		return(union_dir_result);
 
 	default:
@@ -718,7 +921,7 @@ static char *ruletree_execute_conditional_actions(
 			case LB_RULETREE_FSRULE_ACTION_REPLACE_BY_VALUE_OF_ENV_VAR:
 			case LB_RULETREE_FSRULE_ACTION_PROCFS:
 			case LB_RULETREE_FSRULE_ACTION_UNION_DIR:
-				return(execute_std_action(rule_selector, action_cand_p,
+				return(execute_std_action(ctx, rule_selector, action_cand_p,
 					abs_clean_virtual_path, flagsp));
 
 			default:
@@ -800,7 +1003,7 @@ char *ruletree_translate_path(
 	case LB_RULETREE_FSRULE_ACTION_REPLACE_BY_VALUE_OF_ENV_VAR:
 	case LB_RULETREE_FSRULE_ACTION_PROCFS:
 	case LB_RULETREE_FSRULE_ACTION_UNION_DIR:
-		host_path = execute_std_action(rule, rule, abs_clean_virtual_path, flagsp);
+		host_path = execute_std_action(ctx, rule, rule, abs_clean_virtual_path, flagsp);
 		break;
 
 	case LB_RULETREE_FSRULE_ACTION_CONDITIONAL_ACTIONS:
@@ -0,0 +1,801 @@
+/*
+ * Copyright (C) 2026 ldbox contributors.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Pathmapping subsystem: Session-wide shared cache for forward mapping
+ * results.
+ *
+ * The per-process cache (pathmapping_cache.c) starts empty in every
+ * process, but a build runs thousands of short-lived processes (compiler
+ * drivers, cc1, as, ld, sh, sed...) which all map the same toolchain
+ * paths and headers. This cache lives in a file next to RuleTree.bin
+ * ("PathCache.bin", created by lbrdbd) and is mmap'ed to every process
+ * of the session, so a result computed by one process can be used by
+ * all others.
+ *
+ * The file contains a header, a table of "epoch" counters, and a table
+ * of fixed-size slots (open addressing, linear probing over a short
+ * window). Each slot is protected by a sequence counter: Writers claim
+ * a slot by changing the counter from even to odd with an atomic
+ * compare-and-swap and make it even again when done; readers copy the
+ * slot and accept the copy only if the counter was even and did not
+ * change. No locks are held, and a crashed writer can only make one
+ * slot unusable.
+ *
+ * Only absolute virtual paths, which did not contain "." or ".."
+ * components and whose resolution did not follow symlinks, are stored.
+ * Then the result depends on the file system only through the
+ * symlink-ness of the host paths that path resolution checked. Those
+ * are prefixes of the resulting host path, or, if the prefixes were
+ * mapped by another rule than the full path, prefixes of the
+ * "resolution path" (the last checked prefix), which is then stored
+ * in the entry, too. Results where prefixes were mapped one by one
+ * (custom mapping functions) are not stored. Gates that can change
+ * symlink-ness (rename, unlink, symlink, ...) call
+ * shared_pathcache_host_path_modified(), which increments the epoch
+ * counter selected by a hash of the modified host path. Every entry
+ * records the sum of the epochs of all prefixes of its host path
+ * and resolution path, and is valid only if the sum is unchanged.
+ * Changes to the rule tree invalidate everything (rule tree
+ * generation number).
+ *
+ * Results of binary-specific rules are stored together with the binary
+ * name; all other results are shared by all binaries.
+ *
+ * The same file has a second table for the results of readlink() on
+ * host paths, which is used by lb_path_resolution() to find out if
+ * a prefix of the path is a symlink. Entries are validated with the
+ * same epochs. Only "is a symlink" (with the destination) and "is not
+ * a symlink" are stored; a path which does not exist may be created
+ * by any gate, so ENOENT is never cached.
+ *
+ * The header also collects the session-wide hit/miss counters of the
+ * per-process reverse mapping caches, for "lb-show cachestats".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <mapping.h>
+#include <lb.h>
+#include "liblb.h"
+#include "exported.h"
+
+#include "pathmapping.h" /* get private definitions of this subsystem */
+
+#define SHARED_PATHCACHE_FILE_NAME	"PathCache.bin"
+
+#define SHARED_PATHCACHE_MAGIC		0x4350424CU	/* "LBPC" */
+#define SHARED_PATHCACHE_VERSION	5
+
+/* both must be powers of two */
+#define SHARED_PATHCACHE_NUM_SLOTS	16384
+#define SHARED_PATHCACHE_NUM_EPOCHS	16384
+
+#define SHARED_PATHCACHE_MAX_PROBES	8
+
+/* size of the string area of a slot; the whole slot is 512 bytes */
+#define SHARED_PATHCACHE_DATA_SIZE	472
+
+/* must be a power of two */
+#define SHARED_SYMLINKCACHE_NUM_SLOTS	16384
+
+/* size of the string area of a symlink slot; the slot is 512 bytes */
+#define SHARED_SYMLINKCACHE_DATA_SIZE	492
+
+typedef struct shared_pathcache_hdr_s {
+	uint32_t		spch_magic;
+	uint32_t		spch_version;
+	uint32_t		spch_num_slots;
+	uint32_t		spch_num_epochs;
+
+	/* incremented when everything must be invalidated */
+	volatile uint32_t	spch_global_epoch;
+
+	/* incremented by every call to ..._modified(); results which
+	 * were computed while this changed are not stored. */
+	volatile uint32_t	spch_modification_count;
+
+	uint32_t		spch_num_symlink_slots;
+	uint32_t		spch_reserved;
+
+	/* session totals of the per-process reverse mapping caches,
+	 * added by every process when it exits */
+	volatile uint64_t	spch_reverse_cache_hits;
+	volatile uint64_t	spch_reverse_cache_misses;
+} shared_pathcache_hdr_t;
+
+typedef struct shared_pathcache_slot_s {
+	/* 0 = never used, odd = being written */
+	volatile uint32_t	sps_seq;
+
+	uint32_t	sps_hash;
+	uint32_t	sps_ruletree_generation;
+	uint32_t	sps_global_epoch;
+	uint32_t	sps_epoch_sum;
+	uint32_t	sps_fn_class;
+	uint32_t	sps_flags;
+	uint16_t	sps_readonly;
+	/* lengths include the terminating '\0'. zero binary name length
+	 * means that the entry is not binary-specific, zero exec
+	 * policy name length means that there is no exec policy name */
+	uint16_t	sps_virtual_path_len;
+	uint16_t	sps_binary_name_len;
+	uint16_t	sps_host_path_len;
+	uint16_t	sps_exec_policy_name_len;
+	/* zero if all checked prefixes were prefixes of the host path */
+	uint16_t	sps_resolution_path_len;
+
+	/* virtual path, binary name, host path, exec policy name
+	 * and resolution path */
+	char		sps_data[SHARED_PATHCACHE_DATA_SIZE];
+} shared_pathcache_slot_t;
+
+typedef struct shared_symlinkcache_slot_s {
+	/* 0 = never used, odd = being written */
+	volatile uint32_t	sss_seq;
+
+	uint32_t	sss_hash;
+	uint32_t	sss_global_epoch;
+	uint32_t	sss_epoch_sum;
+	/* lengths include the terminating '\0'. zero link destination
+	 * length means that the path is not a symlink */
+	uint16_t	sss_host_path_len;
+	uint16_t	sss_link_dest_len;
+
+	/* host path and link destination */
+	char		sss_data[SHARED_SYMLINKCACHE_DATA_SIZE];
+} shared_symlinkcache_slot_t;
+
+#define SHARED_PATHCACHE_EPOCHS_OFFS	(sizeof(shared_pathcache_hdr_t))
+#define SHARED_PATHCACHE_SLOTS_OFFS	(SHARED_PATHCACHE_EPOCHS_OFFS + \
+	SHARED_PATHCACHE_NUM_EPOCHS * sizeof(uint32_t))
+#define SHARED_SYMLINKCACHE_SLOTS_OFFS	(SHARED_PATHCACHE_SLOTS_OFFS + \
+	SHARED_PATHCACHE_NUM_SLOTS * sizeof(shared_pathcache_slot_t))
+#define SHARED_PATHCACHE_FILE_SIZE	(SHARED_SYMLINKCACHE_SLOTS_OFFS + \
+	SHARED_SYMLINKCACHE_NUM_SLOTS * sizeof(shared_symlinkcache_slot_t))
+
+static shared_pathcache_hdr_t	*shared_pathcache_hdr = NULL;
+static volatile uint32_t	*shared_pathcache_epochs = NULL;
+static shared_pathcache_slot_t	*shared_pathcache_slots = NULL;
+static shared_symlinkcache_slot_t *shared_symlinkcache_slots = NULL;
+static int			shared_pathcache_attach_failed = 0;
+
+static unsigned long	shared_pathcache_hits = 0;
+static unsigned long	shared_pathcache_misses = 0;
+static unsigned long	shared_pathcache_stores = 0;
+static unsigned long	shared_symlinkcache_hits = 0;
+static unsigned long	shared_symlinkcache_misses = 0;
+
+static pthread_mutex_t	shared_pathcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The mutex is needed only while attaching.
+ * NO logging while the mutex is locked! */
+static void shared_pathcache_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&shared_pathcache_mutex);
+}
+static void shared_pathcache_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&shared_pathcache_mutex);
+}
+
+/* For the server: Create the cache file. Clients attach to it
+ * when they need it for the first time. */
+int create_shared_pathcache_file(const char *session_dir)
+{
+	char			*path = NULL;
+	int			fd;
+	shared_pathcache_hdr_t	hdr;
+
+	if (!session_dir) return(-1);
+	if (asprintf(&path, "%s/%s", session_dir,
+	    SHARED_PATHCACHE_FILE_NAME) < 0) return(-1);
+
+	fd = open_nomap_nolog(path, O_CLOEXEC | O_RDWR | O_CREAT,
+		S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to create %s", path);
+		free(path);
+		return(-1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.spch_magic = SHARED_PATHCACHE_MAGIC;
+	hdr.spch_version = SHARED_PATHCACHE_VERSION;
+	hdr.spch_num_slots = SHARED_PATHCACHE_NUM_SLOTS;
+	hdr.spch_num_epochs = SHARED_PATHCACHE_NUM_EPOCHS;
+	hdr.spch_num_symlink_slots = SHARED_SYMLINKCACHE_NUM_SLOTS;
+	hdr.spch_global_epoch = 1;
+
+	/* the file is sparse; slots are zero (=unused) until written */
+	if ((ftruncate(fd, SHARED_PATHCACHE_FILE_SIZE) < 0) ||
+	    (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to initialize %s", path);
+		close(fd);
+		unlink(path);
+		free(path);
+		return(-1);
+	}
+	close(fd);
+	LB_LOG(LB_LOGLEVEL_DEBUG, "Created shared path cache %s", path);
+	free(path);
+	return(0);
+}
+
+/* For clients: returns 0 if the cache is available. */
+static int attach_shared_pathcache(void)
+{
+	char			*path = NULL;
+	int			fd;
+	void			*p;
+	shared_pathcache_hdr_t	*hdr;
+
+	if (shared_pathcache_hdr) return(0);
+	if (shared_pathcache_attach_failed) return(-1);
+
+	/* set this first; attach is not retried */
+	shared_pathcache_attach_failed = 1;
+
+	if (!ldbox_session_dir) return(-1);
+	if (asprintf(&path, "%s/%s", ldbox_session_dir,
+	    SHARED_PATHCACHE_FILE_NAME) < 0) return(-1);
+	fd = open_nomap_nolog(path, O_CLOEXEC | O_RDWR);
+	if (fd < 0) {
+		LB_LOG(LB_LOGLEVEL_DEBUG, "No shared path cache (%s)", path);
+		free(path);
+		return(-1);
+	}
+	p = mmap(NULL, SHARED_PATHCACHE_FILE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Failed to mmap() %s", path);
+		free(path);
+		return(-1);
+	}
+	hdr = (shared_pathcache_hdr_t*)p;
+	if ((hdr->spch_magic != SHARED_PATHCACHE_MAGIC) ||
+	    (hdr->spch_version != SHARED_PATHCACHE_VERSION) ||
+	    (hdr->spch_num_slots != SHARED_PATHCACHE_NUM_SLOTS) ||
+	    (hdr->spch_num_epochs != SHARED_PATHCACHE_NUM_EPOCHS) ||
+	    (hdr->spch_num_symlink_slots != SHARED_SYMLINKCACHE_NUM_SLOTS)) {
+		LB_LOG(LB_LOGLEVEL_ERROR, "Faulty shared path cache %s", path);
+		munmap(p, SHARED_PATHCACHE_FILE_SIZE);
+		free(path);
+		return(-1);
+	}
+	free(path);
+
+	shared_pathcache_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		if (!shared_pathcache_hdr) {
+			shared_pathcache_epochs = (volatile uint32_t*)
+				((char*)p + SHARED_PATHCACHE_EPOCHS_OFFS);
+			shared_pathcache_slots = (shared_pathcache_slot_t*)
+				((char*)p + SHARED_PATHCACHE_SLOTS_OFFS);
+			shared_symlinkcache_slots = (shared_symlinkcache_slot_t*)
+				((char*)p + SHARED_SYMLINKCACHE_SLOTS_OFFS);
+			/* the header pointer is used without
+			 * the mutex, set it last */
+			__sync_synchronize();
+			shared_pathcache_hdr = hdr;
+			p = NULL;
+		}
+		shared_pathcache_attach_failed = 0;
+	}
+	shared_pathcache_mutex_unlock();
+
+	/* another thread was faster? */
+	if (p) munmap(p, SHARED_PATHCACHE_FILE_SIZE);
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "Shared path cache attached");
+	return(0);
+}
+
+static uint32_t shared_pathcache_hash(
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class)
+{
+	uint32_t	h;
+	uint32_t	v[2];
+
+	h = lb_fnv1a32(LB_FNV1A32_INIT, virtual_path, strlen(virtual_path));
+	v[0] = fn_class;
+	v[1] = flags;
+	return(lb_fnv1a32(h, v, sizeof(v)));
+}
+
+/* Sum of the epochs of all prefixes of an absolute host path,
+ * including the path itself. The same hash is used to select
+ * the epoch in shared_pathcache_host_path_modified() */
+static uint32_t shared_pathcache_epoch_sum(const char *host_path)
+{
+	uint32_t	h = LB_FNV1A32_INIT;
+	uint32_t	sum = 0;
+	const char	*start = host_path;
+	const char	*slash;
+
+	/* hash is chained over the components: at every '/',
+	 * h is the hash of the prefix before it */
+	while (*start && ((slash = strchr(start + 1, '/')) != NULL)) {
+		h = lb_fnv1a32(h, start, slash - start);
+		sum += shared_pathcache_epochs[h &
+			(SHARED_PATHCACHE_NUM_EPOCHS - 1)];
+		start = slash;
+	}
+	h = lb_fnv1a32(h, start, strlen(start));
+	sum += shared_pathcache_epochs[h & (SHARED_PATHCACHE_NUM_EPOCHS - 1)];
+	return(sum);
+}
+
+/* Epoch sum of a cache entry */
+static uint32_t shared_pathcache_entry_epoch_sum(
+	const char *host_path,
+	const char *resolution_path)
+{
+	uint32_t	sum = shared_pathcache_epoch_sum(host_path);
+
+	if (resolution_path)
+		sum += shared_pathcache_epoch_sum(resolution_path);
+	return(sum);
+}
+
+/* Returns true if 'prefix' is 'path' or one of its
+ * parent directories */
+static int is_path_prefix(const char *prefix, const char *path)
+{
+	size_t	len = strlen(prefix);
+
+	if (strncmp(prefix, path, len)) return(0);
+	return((path[len] == '\0') || (path[len] == '/') ||
+		((len == 1) && (*prefix == '/')));
+}
+
+/* Returns true if 'path' is absolute and does not contain
+ * "." or ".." components */
+static int is_clean_absolute_path(const char *path)
+{
+	const char *cp;
+
+	if (*path != '/') return(0);
+	for (cp = path; *cp; cp++) {
+		if ((cp[0] == '/') && (cp[1] == '.')) {
+			if ((cp[2] == '\0') || (cp[2] == '/')) return(0);
+			if ((cp[2] == '.') && ((cp[3] == '\0') || (cp[3] == '/')))
+				return(0);
+		}
+	}
+	return(1);
+}
+
+static int shared_pathcache_is_usable(
+	struct lbcontext *lbctx,
+	const char *virtual_path)
+{
+	if (!virtual_path || !is_clean_absolute_path(virtual_path)) return(0);
+	if (!lbctx || lbctx->mapping_disabled) return(0);
+	/* lb-logz needs the "pass:" and "mapped:" messages */
+	if (LB_LOG_IS_ACTIVE(LB_LOGLEVEL_INFO)) return(0);
+	if (attach_shared_pathcache() < 0) return(0);
+	return(1);
+}
+
+/* Take a consistent copy of a slot. Returns 0 if the slot
+ * is unused or being written. */
+static int shared_pathcache_read_slot(
+	const shared_pathcache_slot_t *sp,
+	shared_pathcache_slot_t *copy)
+{
+	uint32_t	seq = sp->sps_seq;
+
+	if ((seq == 0) || (seq & 1)) return(0);
+	__sync_synchronize();
+	memcpy(copy, (const void*)sp, sizeof(*copy));
+	__sync_synchronize();
+	if (sp->sps_seq != seq) return(0);
+
+	/* the copy is consistent, but check the lengths anyway.
+	 * the file is writable by all processes of the session. */
+	if (!copy->sps_virtual_path_len || !copy->sps_host_path_len ||
+	    ((size_t)copy->sps_virtual_path_len + copy->sps_binary_name_len +
+	     copy->sps_host_path_len + copy->sps_exec_policy_name_len +
+	     copy->sps_resolution_path_len >
+	     SHARED_PATHCACHE_DATA_SIZE)) return(0);
+	copy->sps_data[SHARED_PATHCACHE_DATA_SIZE-1] = '\0';
+	return(1);
+}
+
+/* Returns 1 and fills *res if a valid entry was found, 0 otherwise.
+ * '*modification_countp' must be passed to shared_pathcache_add()
+ * after the result has been computed. */
+int shared_pathcache_find(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	mapping_results_t *res,
+	uint32_t *modification_countp)
+{
+	uint32_t	hash;
+	uint32_t	ruletree_generation;
+	size_t		virtual_path_len;
+	size_t		binary_name_len;
+	int		i;
+
+	*modification_countp = 0;
+	if (!shared_pathcache_is_usable(lbctx, virtual_path)) return(0);
+
+	*modification_countp = shared_pathcache_hdr->spch_modification_count;
+	__sync_synchronize();
+
+	hash = shared_pathcache_hash(virtual_path, flags, fn_class);
+	virtual_path_len = strlen(virtual_path) + 1;
+	binary_name_len = strlen(binary_name) + 1;
+	ruletree_generation = ruletree_get_generation();
+
+	for (i = 0; i < SHARED_PATHCACHE_MAX_PROBES; i++) {
+		const shared_pathcache_slot_t *sp = &shared_pathcache_slots[
+			(hash + i) & (SHARED_PATHCACHE_NUM_SLOTS - 1)];
+		shared_pathcache_slot_t	copy;
+		const char		*cp;
+		const char		*host_path;
+		const char		*resolution_path = NULL;
+
+		if (sp->sps_seq == 0) break; /* end of the probe chain */
+		if (sp->sps_hash != hash) continue;
+		if (!shared_pathcache_read_slot(sp, &copy)) continue;
+
+		if ((copy.sps_hash != hash) ||
+		    (copy.sps_fn_class != fn_class) ||
+		    (copy.sps_flags != flags) ||
+		    (copy.sps_virtual_path_len != virtual_path_len) ||
+		    memcmp(copy.sps_data, virtual_path, virtual_path_len))
+			continue;
+		cp = copy.sps_data + copy.sps_virtual_path_len;
+		if (copy.sps_binary_name_len) {
+			if ((copy.sps_binary_name_len != binary_name_len) ||
+			    memcmp(cp, binary_name, binary_name_len))
+				continue;
+			cp += copy.sps_binary_name_len;
+		}
+		host_path = cp;
+		if (copy.sps_resolution_path_len)
+			resolution_path = host_path + copy.sps_host_path_len +
+				copy.sps_exec_policy_name_len;
+
+		if ((copy.sps_ruletree_generation != ruletree_generation) ||
+		    (copy.sps_global_epoch != shared_pathcache_hdr->spch_global_epoch) ||
+		    (copy.sps_epoch_sum != shared_pathcache_entry_epoch_sum(
+			host_path, resolution_path))) {
+			/* stale. A new entry for the same key may
+			 * follow, keep probing */
+			continue;
+		}
+
+		res->mres_result_buf = res->mres_result_path = strdup(host_path);
+		res->mres_readonly = copy.sps_readonly;
+		if (copy.sps_exec_policy_name_len) {
+			res->mres_allocated_exec_policy_name =
+				strdup(host_path + copy.sps_host_path_len);
+			res->mres_exec_policy_name =
+				res->mres_allocated_exec_policy_name;
+		}
+		shared_pathcache_hits++;
+		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: hit %s(%s) => '%s'",
+			__func__, binary_name, virtual_path, res->mres_result_buf);
+		return(1);
+	}
+	shared_pathcache_misses++;
+	return(0);
+}
+
+void shared_pathcache_add(
+	struct lbcontext *lbctx,
+	const char *binary_name,
+	const char *virtual_path,
+	uint32_t flags,
+	uint32_t fn_class,
+	const mapping_results_t *res,
+	uint32_t modification_count)
+{
+	uint32_t	hash;
+	size_t		virtual_path_len;
+	size_t		binary_name_len = 0;
+	size_t		host_path_len;
+	size_t		exec_policy_name_len = 0;
+	size_t		resolution_path_len = 0;
+	const char	*resolution_path;
+	shared_pathcache_slot_t	*victim = NULL;
+	uint32_t	seq;
+	char		*cp;
+	int		i;
+
+	if (!shared_pathcache_is_usable(lbctx, virtual_path)) return;
+	if (lbctx->mapping_result_not_cacheable ||
+	    lbctx->mapping_result_followed_symlink ||
+	    lbctx->mapping_result_prefixes_mapped_separately) return;
+	if (!res->mres_result_buf || res->mres_errno ||
+	    res->mres_errormsg || res->mres_error_text ||
+	    res->mres_result_path_was_allocated ||
+	    (res->mres_result_path != res->mres_result_buf) ||
+	    (*res->mres_result_buf != '/')) return;
+
+	virtual_path_len = strlen(virtual_path) + 1;
+	if (lbctx->mapping_result_depends_on_binary_name)
+		binary_name_len = strlen(binary_name) + 1;
+	host_path_len = strlen(res->mres_result_buf) + 1;
+	if (res->mres_exec_policy_name)
+		exec_policy_name_len = strlen(res->mres_exec_policy_name) + 1;
+	resolution_path = lbctx->mapping_result_resolution_host_path;
+	if (resolution_path) {
+		if (*resolution_path != '/') return;
+		if (is_path_prefix(resolution_path, res->mres_result_buf))
+			resolution_path = NULL; /* covered by the host path */
+		else
+			resolution_path_len = strlen(resolution_path) + 1;
+	}
+	if (virtual_path_len + binary_name_len + host_path_len +
+	    exec_policy_name_len + resolution_path_len >
+	    SHARED_PATHCACHE_DATA_SIZE) return;
+
+	hash = shared_pathcache_hash(virtual_path, flags, fn_class);
+
+	/* Select a slot: An unused one, or one which has the same key.
+	 * This peeks at slots without the sequence counter protocol;
+	 * a wrong guess only costs a slot. */
+	for (i = 0; i < SHARED_PATHCACHE_MAX_PROBES; i++) {
+		shared_pathcache_slot_t *sp = &shared_pathcache_slots[
+			(hash + i) & (SHARED_PATHCACHE_NUM_SLOTS - 1)];
+
+		if ((sp->sps_seq == 0) ||
+		    ((sp->sps_hash == hash) &&
+		     (sp->sps_fn_class == fn_class) &&
+		     (sp->sps_flags == flags) &&
+		     (sp->sps_virtual_path_len == virtual_path_len) &&
+		     (sp->sps_binary_name_len == binary_name_len) &&
+		     !memcmp(sp->sps_data, virtual_path, virtual_path_len) &&
+		     (!binary_name_len ||
+		      !memcmp(sp->sps_data + virtual_path_len,
+				binary_name, binary_name_len)))) {
+			victim = sp;
+			break;
+		}
+	}
+	if (!victim) {
+		/* all slots of the probe window are in use,
+		 * replace one of them */
+		victim = &shared_pathcache_slots[
+			(hash + ((hash >> 16) % SHARED_PATHCACHE_MAX_PROBES)) &
+			(SHARED_PATHCACHE_NUM_SLOTS - 1)];
+	}
+
+	seq = victim->sps_seq;
+	if (seq & 1) return; /* someone else is writing it */
+	if (!__sync_bool_compare_and_swap(&victim->sps_seq, seq, seq + 1))
+		return;
+
+	victim->sps_hash = hash;
+	victim->sps_ruletree_generation = ruletree_get_generation();
+	victim->sps_global_epoch = shared_pathcache_hdr->spch_global_epoch;
+	victim->sps_epoch_sum = shared_pathcache_entry_epoch_sum(
+		res->mres_result_buf, resolution_path);
+	victim->sps_fn_class = fn_class;
+	victim->sps_flags = flags;
+	victim->sps_readonly = res->mres_readonly ? 1 : 0;
+	victim->sps_virtual_path_len = virtual_path_len;
+	victim->sps_binary_name_len = binary_name_len;
+	victim->sps_host_path_len = host_path_len;
+	victim->sps_exec_policy_name_len = exec_policy_name_len;
+	victim->sps_resolution_path_len = resolution_path_len;
+	cp = victim->sps_data;
+	memcpy(cp, virtual_path, virtual_path_len);
+	cp += virtual_path_len;
+	if (binary_name_len) {
+		memcpy(cp, binary_name, binary_name_len);
+		cp += binary_name_len;
+	}
+	memcpy(cp, res->mres_result_buf, host_path_len);
+	cp += host_path_len;
+	if (exec_policy_name_len) {
+		memcpy(cp, res->mres_exec_policy_name, exec_policy_name_len);
+		cp += exec_policy_name_len;
+	}
+	if (resolution_path_len)
+		memcpy(cp, resolution_path, resolution_path_len);
+
+	__sync_synchronize();
+	if (shared_pathcache_hdr->spch_modification_count != modification_count) {
+		/* the file system was modified while the result was
+		 * being computed; the result may be based on old
+		 * information. Leave the slot unusable. */
+		victim->sps_virtual_path_len = 0;
+	}
+	__sync_synchronize();
+	victim->sps_seq = seq + 2;
+	shared_pathcache_stores++;
+}
+
+/* readlink() without mapping, using the session-wide cache.
+ * Same semantics as readlink() (the result is not \0-terminated) */
+ssize_t shared_pathcache_readlink(
+	const char *host_path,
+	char *buf,
+	size_t bufsize)
+{
+	uint32_t	hash;
+	uint32_t	modification_count;
+	size_t		host_path_len;
+	shared_symlinkcache_slot_t *sp;
+	shared_symlinkcache_slot_t copy;
+	ssize_t		link_len;
+	size_t		link_dest_len;
+	uint32_t	seq;
+	int		saved_errno;
+
+	if (!host_path || !is_clean_absolute_path(host_path) ||
+	    (attach_shared_pathcache() < 0))
+		return(readlink_nomap(host_path, buf, bufsize));
+
+	host_path_len = strlen(host_path);
+	hash = lb_fnv1a32(LB_FNV1A32_INIT, host_path, host_path_len);
+	host_path_len++;
+	sp = &shared_symlinkcache_slots[
+		hash & (SHARED_SYMLINKCACHE_NUM_SLOTS - 1)];
+
+	seq = sp->sss_seq;
+	if (seq && !(seq & 1) && (sp->sss_hash == hash)) {
+		__sync_synchronize();
+		memcpy(&copy, (const void*)sp, sizeof(copy));
+		__sync_synchronize();
+		if ((sp->sss_seq == seq) &&
+		    (copy.sss_hash == hash) &&
+		    (copy.sss_host_path_len == host_path_len) &&
+		    ((size_t)copy.sss_host_path_len + copy.sss_link_dest_len <=
+		     SHARED_SYMLINKCACHE_DATA_SIZE) &&
+		    !memcmp(copy.sss_data, host_path, host_path_len) &&
+		    (copy.sss_global_epoch == shared_pathcache_hdr->spch_global_epoch) &&
+		    (copy.sss_epoch_sum == shared_pathcache_epoch_sum(host_path))) {
+			shared_symlinkcache_hits++;
+			if (copy.sss_link_dest_len == 0) {
+				errno = EINVAL;
+				return(-1);
+			}
+			link_len = copy.sss_link_dest_len - 1;
+			if ((size_t)link_len > bufsize) link_len = bufsize;
+			memcpy(buf, copy.sss_data + host_path_len, link_len);
+			return(link_len);
+		}
+	}
+	shared_symlinkcache_misses++;
+
+	modification_count = shared_pathcache_hdr->spch_modification_count;
+	__sync_synchronize();
+	link_len = readlink_nomap(host_path, buf, bufsize);
+	saved_errno = errno;
+
+	if (link_len > 0) {
+		link_dest_len = link_len + 1;
+		if ((size_t)link_len == bufsize) {
+			/* may have been truncated, don't store */
+			errno = saved_errno;
+			return(link_len);
+		}
+	} else if ((link_len < 0) && (saved_errno == EINVAL)) {
+		link_dest_len = 0;
+	} else {
+		return(link_len);
+	}
+	if (host_path_len + link_dest_len > SHARED_SYMLINKCACHE_DATA_SIZE) {
+		errno = saved_errno;
+		return(link_len);
+	}
+
+	seq = sp->sss_seq;
+	if (!(seq & 1) &&
+	    __sync_bool_compare_and_swap(&sp->sss_seq, seq, seq + 1)) {
+		sp->sss_hash = hash;
+		sp->sss_global_epoch = shared_pathcache_hdr->spch_global_epoch;
+		sp->sss_epoch_sum = shared_pathcache_epoch_sum(host_path);
+		sp->sss_host_path_len = host_path_len;
+		sp->sss_link_dest_len = link_dest_len;
+		memcpy(sp->sss_data, host_path, host_path_len);
+		if (link_dest_len) {
+			memcpy(sp->sss_data + host_path_len, buf, link_len);
+			sp->sss_data[host_path_len + link_len] = '\0';
+		}
+		__sync_synchronize();
+		if (shared_pathcache_hdr->spch_modification_count !=
+		    modification_count) {
+			/* see shared_pathcache_add() */
+			sp->sss_host_path_len = 0;
+		}
+		__sync_synchronize();
+		sp->sss_seq = seq + 2;
+	}
+	errno = saved_errno;
+	return(link_len);
+}
+
+/* For the per-process cache: The session-wide modification counter,
+ * or 0 if the shared cache is not available. */
+uint32_t shared_pathcache_get_modification_count(void)
+{
+	uint32_t	count;
+
+	if (attach_shared_pathcache() < 0) return(0);
+	count = shared_pathcache_hdr->spch_modification_count;
+	__sync_synchronize();
+	return(count);
+}
+
+/* Called by gates which have modified the file system at 'host_path'.
+ * If the path is not known (NULL or not absolute), all entries
+ * are invalidated. */
+void shared_pathcache_host_path_modified(const char *host_path)
+{
+	uint32_t	h;
+
+	if (attach_shared_pathcache() < 0) return;
+
+	__sync_fetch_and_add(&shared_pathcache_hdr->spch_modification_count, 1);
+	if (!host_path || (*host_path != '/')) {
+		__sync_fetch_and_add(&shared_pathcache_hdr->spch_global_epoch, 1);
+		return;
+	}
+	h = lb_fnv1a32(LB_FNV1A32_INIT, host_path, strlen(host_path));
+	__sync_fetch_and_add(&shared_pathcache_epochs[
+		h & (SHARED_PATHCACHE_NUM_EPOCHS - 1)], 1);
+}
+
+void shared_pathcache_add_reverse_cache_stats(
+	unsigned long hits, unsigned long misses)
+{
+	if (attach_shared_pathcache() < 0) return;
+
+	__sync_fetch_and_add(&shared_pathcache_hdr->spch_reverse_cache_hits,
+		(uint64_t)hits);
+	__sync_fetch_and_add(&shared_pathcache_hdr->spch_reverse_cache_misses,
+		(uint64_t)misses);
+}
+
+/* For lb-show: returns 0 if the session totals are available. */
+int shared_pathcache_get_reverse_cache_stats(
+	uint64_t *hitsp, uint64_t *missesp)
+{
+	if (attach_shared_pathcache() < 0) return(-1);
+
+	*hitsp = shared_pathcache_hdr->spch_reverse_cache_hits;
+	*missesp = shared_pathcache_hdr->spch_reverse_cache_misses;
+	return(0);
+}
+
+void shared_pathcache_log_stats(void)
+{
+	if (!shared_pathcache_hdr) return;
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"shared path cache: hits=%lu misses=%lu stores=%lu"
+		" symlink hits=%lu misses=%lu",
+		shared_pathcache_hits, shared_pathcache_misses,
+		shared_pathcache_stores, shared_symlinkcache_hits,
+		shared_symlinkcache_misses);
+}
@@ -134,6 +134,8 @@ int chroot_gate(int *result_errno_ptr,
 		ldbox_chroot_path = new_chroot_path;
 		if (cp) free(cp);
 	}
+	/* absolute paths are now relative to the new root */
+	pathmapping_cache_invalidate();
 	return(0);
 
     free_mapping_results_and_return_minus1:
@@ -33,6 +33,8 @@
 #include <signal.h>
 #include "liblb.h"
 #include "exported.h"
+#include "rule_tree.h"
+#include "rule_tree_rpc.h"
 
 /* strchrnul(): Find the first occurrence of C in S or the final NUL byte.
  * This is not present on all systems, so we'll use our own version in ldbox.
@@ -125,6 +127,28 @@ int lb_next_execve(const char *file, char *const *argv, char *const *envp)
 }
 
 
+/* posix_spawn() restores the stack limit in the child, see
+ * spawngates.c. Returns 1 and fills *limp if the limit must be
+ * restored before the exec, 0 otherwise.
+*/
+int lb_get_stack_limit_for_exec(struct rlimit64 *limp)
+{
+	switch (restore_stack_before_exec) {
+	case 1:
+		limp->rlim_cur = (stack_limits_for_exec.rlim_cur == RLIM_INFINITY ?
+			RLIM64_INFINITY : stack_limits_for_exec.rlim_cur);
+		limp->rlim_max = (stack_limits_for_exec.rlim_max == RLIM_INFINITY ?
+			RLIM64_INFINITY : stack_limits_for_exec.rlim_max);
+		return(1);
+#ifndef __APPLE__
+	case 64:
+		*limp = stack_limits64_for_exec;
+		return(1);
+#endif
+	}
+	return(0);
+}
+
 /* collect exec arguments from a varargs list to an array.
  * returns an allocated array (use free() to free it if exec fails)
 */
@@ -23,64 +23,229 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include "liblb.h"
 #include "exported.h"
 
-typedef struct fd_path_db_entry_s {
-	char	*fpdb_path;
-} fd_path_db_entry_t;
+/* The DB is lock-free: Multithreaded programs (linkers, ninja..)
+ * open, close and dup descriptors and call *at() functions in
+ * every thread all the time.
+ *
+ * Slots are atomic pointers to path entries. The slot array grows
+ * in segments, which are added with compare-and-swap and never
+ * moved or freed, so a slot can be read without any locks. Path
+ * entries are immutable and shared by all descriptors that refer
+ * to the same open file (dup(), dup2(), F_DUPFD); the reference
+ * count is the number of slots that point to the entry.
+ *
+ * An entry whose reference count drops to zero is not freed
+ * immediately, because another thread may still be reading it.
+ * Readers announce themselves by incrementing one of two counters
+ * (selected by the current "epoch"). Retired entries are collected
+ * to a list; when the list is moved to the "waiting" state the
+ * epoch is flipped, and the waiting entries are freed later when
+ * nobody is reading with the old epoch anymore. Readers never wait;
+ * writers never wait either, they just try to reclaim memory.
+*/
 
-static fd_path_db_entry_t *fd_path_db = NULL;
-static int fd_path_db_slots = 0;
+typedef struct fdpathdb_entry_s {
+	struct fdpathdb_entry_s	*fpdb_next_retired;
+	volatile uint32_t	fpdb_refcount;
+	char			fpdb_path[];
+} fdpathdb_entry_t;
 
-static pthread_mutex_t	fd_path_db_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* both must be powers of two */
+#define FDPATHDB_SEGMENT_SIZE	1024
+#define FDPATHDB_MAX_SEGMENTS	1024
 
-/* Functions to lock/unlock the mutex, if libpthreads is available.
- * If it isn't, this is used in a sigle-threaded program and we can
- * safely live without the mutex.
-*/
-static void fdpathdb_mutex_lock(void)
+static fdpathdb_entry_t * volatile * volatile
+	fdpathdb_segments[FDPATHDB_MAX_SEGMENTS];
+
+static volatile uint32_t	fdpathdb_epoch = 0;
+static volatile uint32_t	fdpathdb_readers[2];
+
+static fdpathdb_entry_t * volatile fdpathdb_retired = NULL;
+static fdpathdb_entry_t * volatile fdpathdb_waiting = NULL;
+static volatile int		fdpathdb_reclaim_busy = 0;
+
+/* Returns the epoch which must be passed to fdpathdb_read_end().
+ * NO logging while reading! */
+static uint32_t fdpathdb_read_begin(void)
+{
+	uint32_t	epoch;
+
+	while (1) {
+		epoch = fdpathdb_epoch;
+		__sync_fetch_and_add(&fdpathdb_readers[epoch & 1], 1);
+		if (fdpathdb_epoch == epoch) return(epoch);
+		/* the epoch was flipped, use the new one */
+		__sync_fetch_and_sub(&fdpathdb_readers[epoch & 1], 1);
+	}
+}
+
+static void fdpathdb_read_end(uint32_t epoch)
+{
+	__sync_fetch_and_sub(&fdpathdb_readers[epoch & 1], 1);
+}
+
+/* Returns address of the slot, or NULL if "fd" has no slot.
+ * If "create" is set, a missing segment is added. */
+static fdpathdb_entry_t * volatile *fdpathdb_slot(int fd, int create)
 {
-	if (pthread_library_is_available) {
-		LB_LOG(LB_LOGLEVEL_NOISE2, "Going to lock fd_path_db_mutex");
-		(*pthread_mutex_lock_fnptr)(&fd_path_db_mutex);
-		/* NO logging here! */
+	unsigned int	seg_n;
+	fdpathdb_entry_t * volatile *seg;
+
+	if (fd < 0) return(NULL);
+	seg_n = (unsigned int)fd / FDPATHDB_SEGMENT_SIZE;
+	if (seg_n >= FDPATHDB_MAX_SEGMENTS) return(NULL);
+
+	seg = fdpathdb_segments[seg_n];
+	if (!seg && create) {
+		fdpathdb_entry_t * volatile *new_seg;
+
+		new_seg = calloc(FDPATHDB_SEGMENT_SIZE,
+			sizeof(fdpathdb_entry_t*));
+		if (!new_seg) return(NULL);
+		if (__sync_bool_compare_and_swap(&fdpathdb_segments[seg_n],
+			NULL, new_seg)) {
+			seg = new_seg;
+		} else {
+			/* another thread was faster */
+			free((void*)new_seg);
+			seg = fdpathdb_segments[seg_n];
+		}
+	}
+	if (!seg) return(NULL);
+	return(&seg[(unsigned int)fd & (FDPATHDB_SEGMENT_SIZE - 1)]);
+}
+
+/* Free retired entries which nobody can be reading anymore. */
+static void fdpathdb_reclaim(void)
+{
+	uint32_t	epoch;
+	fdpathdb_entry_t *ep;
+
+	if (!fdpathdb_retired && !fdpathdb_waiting) return;
+	if (!__sync_bool_compare_and_swap(&fdpathdb_reclaim_busy, 0, 1))
+		return; /* another thread is doing this */
+
+	epoch = fdpathdb_epoch;
+	if (fdpathdb_waiting && (fdpathdb_readers[(epoch - 1) & 1] == 0)) {
+		/* these were retired before the epoch was flipped,
+		 * and all readers of the previous epoch are gone. */
+		ep = fdpathdb_waiting;
+		fdpathdb_waiting = NULL;
+		while (ep) {
+			fdpathdb_entry_t *next = ep->fpdb_next_retired;
+
+			free(ep);
+			ep = next;
+		}
 	}
+	if (!fdpathdb_waiting && fdpathdb_retired) {
+		do {
+			ep = fdpathdb_retired;
+		} while (!__sync_bool_compare_and_swap(&fdpathdb_retired,
+			ep, NULL));
+		fdpathdb_waiting = ep;
+		__sync_fetch_and_add(&fdpathdb_epoch, 1);
+	}
+	__sync_synchronize();
+	fdpathdb_reclaim_busy = 0;
 }
-static void fdpathdb_mutex_unlock(void)
+
+/* Drop a reference; the entry must not be in any slot anymore
+ * when the count drops to zero. */
+static void fdpathdb_entry_release(fdpathdb_entry_t *ep)
+{
+	fdpathdb_entry_t *head;
+
+	if (!ep) return;
+	if (__sync_sub_and_fetch(&ep->fpdb_refcount, 1) != 0) return;
+
+	do {
+		head = fdpathdb_retired;
+		ep->fpdb_next_retired = head;
+	} while (!__sync_bool_compare_and_swap(&fdpathdb_retired, head, ep));
+}
+
+/* Get a reference to the entry of "fd", or NULL. */
+static fdpathdb_entry_t *fdpathdb_entry_get(int fd)
 {
-	if (pthread_library_is_available) {
-		/* NO logging here! */
-		(*pthread_mutex_unlock_fnptr)(&fd_path_db_mutex);
-		LB_LOG(LB_LOGLEVEL_NOISE2, "unlocked fd_path_db_mutex");
+	fdpathdb_entry_t * volatile *slotp;
+	fdpathdb_entry_t *ep = NULL;
+	uint32_t	epoch;
+
+	slotp = fdpathdb_slot(fd, 0);
+	if (!slotp) return(NULL);
+
+	epoch = fdpathdb_read_begin();
+	ep = *slotp;
+	while (ep) {
+		uint32_t refcount = ep->fpdb_refcount;
+
+		if (refcount == 0) {
+			/* being retired; "fd" was closed just now */
+			ep = NULL;
+			break;
+		}
+		if (__sync_bool_compare_and_swap(&ep->fpdb_refcount,
+			refcount, refcount + 1)) break;
 	}
+	fdpathdb_read_end(epoch);
+	return(ep);
 }
 
-const char *fdpathdb_find_path(int fd)
+/* Store "ep" (a new reference, or NULL) to the slot of "fd" */
+static void fdpathdb_entry_set(int fd, fdpathdb_entry_t *ep)
 {
-	const char *ret = NULL;
+	fdpathdb_entry_t * volatile *slotp;
+	fdpathdb_entry_t *old;
+
+	slotp = fdpathdb_slot(fd, (ep != NULL));
+	if (!slotp) {
+		if (ep) {
+			LB_LOG(LB_LOGLEVEL_WARNING,
+				"fdpathdb: Can't store path of FD %d", fd);
+			fdpathdb_entry_release(ep);
+			fdpathdb_reclaim();
+		}
+		return;
+	}
+	do {
+		old = *slotp;
+	} while (!__sync_bool_compare_and_swap(slotp, old, ep));
 
-	fdpathdb_mutex_lock();
-	{
-		/* NOTE: This is a critical section:
-		 * - Do not return from this block, mutex is locked !!
-		 * - Do not call the logger from this block !!
-		*/
-		if ((fd >= 0) &&
-		    (fd_path_db_slots > fd) &&
-		    fd_path_db[fd].fpdb_path) {
-			ret = fd_path_db[fd].fpdb_path;
+	fdpathdb_entry_release(old);
+	fdpathdb_reclaim();
+}
+
+/* Copy the path of "fd" to "buf". Returns "buf",
+ * or NULL if the path is not known. */
+const char *fdpathdb_find_path(int fd, char *buf, size_t bufsize)
+{
+	fdpathdb_entry_t * volatile *slotp;
+	fdpathdb_entry_t *ep;
+	const char	*ret = NULL;
+	uint32_t	epoch;
+
+	slotp = fdpathdb_slot(fd, 0);
+	if (slotp && bufsize > 0) {
+		epoch = fdpathdb_read_begin();
+		ep = *slotp;
+		if (ep && (strlen(ep->fpdb_path) < bufsize)) {
+			strcpy(buf, ep->fpdb_path);
+			ret = buf;
 		}
+		fdpathdb_read_end(epoch);
 	}
-	fdpathdb_mutex_unlock();
 
 	if (ret) {
 		LB_LOG(LB_LOGLEVEL_NOISE,
-			"fdpathdb_find_path: FD %d => '%s'",
-			fd, fd_path_db[fd].fpdb_path);
+			"fdpathdb_find_path: FD %d => '%s'", fd, ret);
 	} else {
 		LB_LOG(LB_LOGLEVEL_NOISE,
 			"fdpathdb_find_path: No pathname for FD %d", fd);
@@ -94,9 +259,12 @@ static void fdpathdb_register_mapped_path(
 	const char *mapped_path, const char *orig_path)
 {
 	const char *path = NULL;
+	fdpathdb_entry_t *ep = NULL;
 
 	if (fd < 0) return;
 
+	union_dir_forget_fd(fd);
+
 	if (orig_path && mapped_path) {
 		if (*orig_path == '/') {
 			/* orig.path is an absolute path, use that directly */
@@ -120,46 +288,29 @@ static void fdpathdb_register_mapped_path(
 	LB_LOG(LB_LOGLEVEL_NOISE, "%s: Register %d => '%s'",
 		realfnname, fd, path ? path : "(NULL path)");
 
-	fdpathdb_mutex_lock();
-	{
-		/* NOTE: This is a critical section:
-		 * - Do not return from this block, mutex is locked !!
-		 * - Do not call the logger from this block !!
-		*/
-
-		if (fd_path_db_slots <= fd) {
-			if (fd_path_db) {
-				int slots_after_realloc = fd + 1;
-				int new_slots = slots_after_realloc -
-					fd_path_db_slots;
-
-				/* allocate more slots */
-				fd_path_db = realloc(fd_path_db,
-					slots_after_realloc *
-						sizeof(fd_path_db_entry_t));
-				/* realloc() does not initialize memory;
-				 * clear new slots */
-				memset(fd_path_db + fd_path_db_slots, 0,
-					new_slots * sizeof(fd_path_db_entry_t));
-
-				fd_path_db_slots = slots_after_realloc;
-			} else {
-				/* allocate a new table */
-				fd_path_db_slots = fd + 1;
-				fd_path_db = calloc(fd_path_db_slots,
-					sizeof(fd_path_db_entry_t));
-			}
-		}
+	if (path) {
+		size_t	len = strlen(path);
 
-		if (fd_path_db[fd].fpdb_path) {
-			/* overwriting an old entry */
-			free(fd_path_db[fd].fpdb_path);
-			fd_path_db[fd].fpdb_path = NULL;
+		ep = malloc(sizeof(fdpathdb_entry_t) + len + 1);
+		if (ep) {
+			ep->fpdb_next_retired = NULL;
+			ep->fpdb_refcount = 1;
+			memcpy(ep->fpdb_path, path, len + 1);
 		}
-
-		fd_path_db[fd].fpdb_path = path ? strdup(path) : NULL;
 	}
-	fdpathdb_mutex_unlock();
+	fdpathdb_entry_set(fd, ep);
+}
+
+/* Make "new_fd" refer to the same path as "fd" */
+static void fdpathdb_register_dup(const char *realfnname, int fd, int new_fd)
+{
+	fdpathdb_entry_t *ep;
+
+	ep = fdpathdb_entry_get(fd);
+	LB_LOG(LB_LOGLEVEL_NOISE, "%s: Register %d => '%s' (from %d)",
+		realfnname, new_fd, ep ? ep->fpdb_path : "(NULL path)", fd);
+	fdpathdb_entry_set(new_fd, ep);
+	union_dir_dup_fd(fd, new_fd);
 }
 
 static void fdpathdb_register_mapping_result(const char *realfnname,
@@ -201,6 +352,8 @@ static void fdpathdb_register_mapping_result(const char *realfnname,
 				res->mres_result_buf, pathname);
 		}
 	}
+	if (res->mres_union_dir && (ret_fd >= 0))
+		union_dir_register_fd(ret_fd, res);
 }
 
 /* Wrappers' postprocessors: these register paths to this DB */
@@ -314,50 +467,37 @@ void opendir_postprocess_name(
 
 void dup_postprocess_(const char *realfnname, int ret, int fd)
 {
-	const char	*cp = NULL;
-
-	if (ret >= 0) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, ret, cp, cp);
-	}
+	if (ret >= 0)
+		fdpathdb_register_dup(realfnname, fd, ret);
 }
 
 void dup2_postprocess_(const char *realfnname, int ret, int fd, int fd2)
 {
-	const char	*cp = NULL;
-
 	if ((ret >= 0) && (fd != fd2)) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, fd2, cp, cp);
+		lblog_forget_logfile_fd(fd2);
+		fdpathdb_register_dup(realfnname, fd, fd2);
 	}
 }
 
 void dup3_postprocess_(const char *realfnname, int ret, int fd, int fd2, int flags)
 {
-	const char	*cp = NULL;
-
 	(void)flags;
 	if ((ret >= 0) && (fd != fd2)) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, fd2, cp, cp);
+		lblog_forget_logfile_fd(fd2);
+		fdpathdb_register_dup(realfnname, fd, fd2);
 	}
 }
 
 void close_postprocess_(const char *realfnname, int ret, int fd)
 {
 	(void)ret;
+	lblog_forget_logfile_fd(fd);
 	fdpathdb_register_mapped_path(realfnname, fd, NULL, NULL);
 }
 
 void fcntl_postprocess_(const char *realfnname, int ret,
 	int fd, int cmd, void *arg)
 {
-	const char	*cp = NULL;
-
-	(void)cp;
 	(void)arg;
 
 	switch (cmd) {
@@ -429,4 +569,15 @@ int fclose_gate(int *result_errno_ptr,
 	return(ret);
 }
 
-
+int closedir_gate(int *result_errno_ptr,
+		int (*real_closedir_ptr)(DIR *dirp),
+		const char *realfnname, DIR *dirp)
+{
+	int fd = dirfd(dirp);
+	int ret = (*real_closedir_ptr)(dirp);
+	if (ret == 0)
+		fdpathdb_register_mapped_path(realfnname, fd, NULL, NULL);
+	else
+		*result_errno_ptr = errno;
+	return(ret);
+}
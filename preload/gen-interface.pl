@@ -100,12 +100,12 @@
 
 use strict;
 
-our($opt_d, $opt_W, $opt_E, $opt_L, $opt_M, $opt_n, $opt_m, $opt_V);
+our($opt_d, $opt_W, $opt_E, $opt_L, $opt_M, $opt_n, $opt_m, $opt_V, $opt_G);
 use Getopt::Std;
 use File::Basename;
 
 # Process options:
-getopts("dW:E:L:M:n:m:V:");
+getopts("dW:E:L:M:n:m:V:G");
 my $debug = $opt_d;
 my $wrappers_c_output_file = $opt_W;		# -W generated_c_filename
 my $export_h_output_file = $opt_E;		# -E generated_h_filename
@@ -114,6 +114,7 @@ my $export_map_for_ld_output_file = $opt_M;	# -M generated_export_map_for_ld
 my $interface_name = $opt_n;			# -n interface_name
 my $man_page_output_file = $opt_m;		# -m man_page_file_name
 my $vrs = $opt_V;				# -V lb_version
+my $gatestats = $opt_G;				# -G: count calls (lb_gatestats.h)
 
 my $num_errors = 0;
 
@@ -1030,6 +1031,9 @@ my $export_h_buffer =
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
 #endif
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
 
 #include \"mapping.h\"
 
@@ -1051,6 +1055,9 @@ sub add_fn_to_man_page {
 
 my %fn_to_classmasks;
 
+# gate names for lb_gatestats_gate_names__, in gate index order (-G)
+my @gatestats_names;
+
 # Handle "WRAP" and "GATE" commands.
 sub command_wrap_or_gate {
 	my $command = shift;
@@ -1124,8 +1131,15 @@ sub command_wrap_or_gate {
 		$nomap_nolog_fn_c_code .= "\t$fn_return_type ret = $default_return_value;\n";
 	}
 	$wrapper_fn_c_code .=	"\tint saved_errno = errno;\n".
-				"\tint result_errno = saved_errno;\n".
-				"\tuint32_t classmask = ".$mods->{'class'}.";\n".
+				"\tint result_errno = saved_errno;\n";
+	if($gatestats) {
+		# lbgatestats_end() is called at every return
+		$wrapper_fn_c_code .= "\tlb_gatestats_call_t gatestats__ ".
+			"__attribute__((cleanup(lbgatestats_end))) = ".
+			"lbgatestats_start(".scalar(@gatestats_names).");\n";
+		push(@gatestats_names, $fn_name);
+	}
+	$wrapper_fn_c_code .=	"\tuint32_t classmask = ".$mods->{'class'}.";\n".
 				"\t(void)classmask; /* ok, if it isn't used */\n".
 				"\terrno = 0;\n";
 	if(defined($mods->{'conditionally_class_cnd'})) {
@@ -1148,8 +1162,16 @@ sub command_wrap_or_gate {
 		$nomap_fn_c_code .=		"\tLB_LOG(".$mods->{'log_params'}.");\n";
 	}
 
-	$wrapper_fn_c_code .=		$mods->{'path_mapping_code'}.
-					$mods->{'path_ro_check_code'};
+	$wrapper_fn_c_code .=		$mods->{'path_mapping_code'};
+	if($gatestats) {
+		my $param_name;
+		foreach $param_name (sort(keys(%{$mods->{'mapping_results_by_orig_name'}}))) {
+			my $res = $mods->{'mapping_results_by_orig_name'}->{$param_name};
+			$wrapper_fn_c_code .= "\tlbgatestats_mapped(&gatestats__, ".
+				"$param_name, $res.mres_result_path);\n";
+		}
+	}
+	$wrapper_fn_c_code .=		$mods->{'path_ro_check_code'};
 	$wrapper_fn_c_code .=		$mods->{'va_list_handler_code'};
 	$nomap_fn_c_code .=		$mods->{'path_nomap_code'}.
 					$mods->{'va_list_handler_code'};
@@ -1485,6 +1507,17 @@ if(defined $wrappers_c_output_file) {
 			$fn_to_classmasks{$fnn}."},\n";
 	}
 	$interface_functions_and_classes .= "\t{NULL, 0},\n};\n";
+	if($gatestats) {
+		my $gatestats_table = "\nconst char *lb_gatestats_gate_names__[] = {\n";
+		foreach $fnn (@gatestats_names) {
+			$gatestats_table .= "\t\"".$fnn."\",\n";
+		}
+		$gatestats_table .= "\tNULL\n};\n".
+			"const unsigned int lb_gatestats_num_gates__ = ".
+			scalar(@gatestats_names).";\n";
+		$interface_functions_and_classes .= $gatestats_table;
+		$include_h_file .= '#include "lb_gatestats.h"'."\n";
+	}
 	write_output_file($wrappers_c_output_file,
 		$file_header_comment.
 		'#include "liblb.h"'."\n".
@@ -36,6 +36,8 @@
 #include <signal.h>
 #include "liblb.h"
 #include "exported.h"
+#include "lb_trace.h"
+#include "lb_gatestats.h"
 
 /* String vector contents to a single string for logging.
  * returns pointer to an allocated buffer, caller should free() it.
@@ -174,6 +176,14 @@ char *lbshow__reverse_path__(const char *func_name, const char *abs_path, uint32
 	return(reversed__path);
 }
 
+/* session totals of the reverse mapping caches */
+int lbshow__reverse_cache_stats__(uint64_t *hits, uint64_t *misses)
+{
+	if (!lb_global_vars_initialized__) lb_initialize_global_variables();
+
+	return(shared_pathcache_get_reverse_cache_stats(hits, misses));
+}
+
 char *lbshow__get_real_cwd__(const char *binary_name, const char *fn_name)
 {
 	char path[PATH_MAX];
@@ -351,6 +361,8 @@ void lb_initialize_global_variables(void)
 			lb_global_vars_initialized__ = 1;
 			lblog_init();
 			LB_LOG(LB_LOGLEVEL_DEBUG, "global vars initialized from env");
+			lbtrace_init();
+			lbgatestats_init();
 
 			/* check if the user wants us to SIGTRAP
 			 * during liblb initialization.
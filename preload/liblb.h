@@ -63,6 +63,9 @@
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
 #endif
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
 
 //#include <elf.h>
 #include <sys/user.h>
@@ -109,7 +112,37 @@ extern int do_glob64 (const char *pattern, int flags,
 	int (*errfunc) (const char *, int), glob64_t *pglob);
 #endif
 
+#ifdef HAVE_FTS_H
+/* walker for union directories (union_dir_walk.c) */
+extern FTS *union_dir_fts_open(char * const *path_argv, int options,
+	int (*compar)(const FTSENT **, const FTSENT **));
+extern int union_dir_fts_is_own(FTS *ftsp);
+extern FTSENT *union_dir_fts_read(FTS *ftsp);
+extern FTSENT *union_dir_fts_children(FTS *ftsp, int options);
+extern int union_dir_fts_set(FTS *ftsp, FTSENT *f, int instr);
+extern int union_dir_fts_close(FTS *ftsp);
+extern int union_dir_ftw(const char *dir,
+	int (*fn)(const char *file, const struct stat *sb, int flag));
+extern int union_dir_nftw(const char *dir,
+	int (*fn)(const char *file, const struct stat *sb,
+		int flag, struct FTW *s),
+	int flags);
+#ifdef HAVE_FTW64
+extern int union_dir_ftw64(const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb, int flag));
+#endif
+#ifdef HAVE_NFTW64
+extern int union_dir_nftw64(const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb,
+		int flag, struct FTW *s),
+	int flags);
+#endif
+#endif
+
 extern int lb_execvep(const char *file, char *const argv[], char *const envp[]);
+#ifndef __APPLE__
+extern int lb_get_stack_limit_for_exec(struct rlimit64 *limp);
+#endif
 extern char *strvec_to_string(char *const *argv);
 
 #endif /* ifndef LIBLB_H_INCLUDED_ */
@@ -0,0 +1,148 @@
+/*
+ * liblb -- postprocessors for gates that invalidate the
+ *	    path mapping result cache.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* Path mapping results depend on the symlinks found from the
+ * file system, and results of relative paths on the current
+ * directory. These postprocessors are attached to the gates
+ * that may change either one (see interface.master).
+ * The session-wide shared cache (pathmapping/paths_shared_cache.c)
+ * needs to know the host path that was modified, so most of these
+ * get the mapping result of the affected parameter.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "lb.h"
+#include "liblb.h"
+#include "exported.h"
+
+/* Per-process results are simply forgotten; the shared cache is
+ * told which host path was modified. */
+static void host_path_modified(const mapping_results_t *res)
+{
+	pathmapping_cache_invalidate();
+	shared_pathcache_host_path_modified(res->mres_result_buf);
+}
+
+void rename_postprocess_oldpath(const char *realfnname, int ret,
+	mapping_results_t *res, const char *oldpath, const char *newpath)
+{
+	(void)realfnname; (void)oldpath; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void rename_postprocess_newpath(const char *realfnname, int ret,
+	mapping_results_t *res, const char *oldpath, const char *newpath)
+{
+	(void)realfnname; (void)oldpath; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void renameat_postprocess_oldpath(const char *realfnname, int ret,
+	mapping_results_t *res,
+	int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+	(void)realfnname; (void)olddirfd; (void)oldpath;
+	(void)newdirfd; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void renameat_postprocess_newpath(const char *realfnname, int ret,
+	mapping_results_t *res,
+	int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+	(void)realfnname; (void)olddirfd; (void)oldpath;
+	(void)newdirfd; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void unlink_postprocess_pathname(const char *realfnname, int ret,
+	mapping_results_t *res, const char *pathname)
+{
+	(void)realfnname; (void)pathname;
+	if (ret == 0) host_path_modified(res);
+}
+
+void unlinkat_postprocess_pathname(const char *realfnname, int ret,
+	mapping_results_t *res, int dirfd, const char *pathname, int flags)
+{
+	(void)realfnname; (void)dirfd; (void)pathname; (void)flags;
+	if (ret == 0) host_path_modified(res);
+}
+
+void remove_postprocess_pathname(const char *realfnname, int ret,
+	mapping_results_t *res, const char *pathname)
+{
+	(void)realfnname; (void)pathname;
+	if (ret == 0) host_path_modified(res);
+}
+
+void rmdir_postprocess_pathname(const char *realfnname, int ret,
+	mapping_results_t *res, const char *pathname)
+{
+	(void)realfnname; (void)pathname;
+	if (ret == 0) host_path_modified(res);
+}
+
+void link_postprocess_newpath(const char *realfnname, int ret,
+	mapping_results_t *res, const char *oldpath, const char *newpath)
+{
+	(void)realfnname; (void)oldpath; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void linkat_postprocess_newpath(const char *realfnname, int ret,
+	mapping_results_t *res, int olddirfd, const char *oldpath,
+	int newdirfd, const char *newpath, int flags)
+{
+	(void)realfnname; (void)olddirfd; (void)oldpath;
+	(void)newdirfd; (void)newpath; (void)flags;
+	if (ret == 0) host_path_modified(res);
+}
+
+void mkdir_postprocess_(const char *realfnname, int ret,
+	const char *pathname, mode_t mode)
+{
+	(void)realfnname; (void)pathname; (void)mode;
+	if (ret == 0) pathmapping_cache_invalidate();
+}
+
+void mkdirat_postprocess_(const char *realfnname, int ret,
+	int dirfd, const char *pathname, mode_t mode)
+{
+	(void)realfnname; (void)dirfd; (void)pathname; (void)mode;
+	if (ret == 0) pathmapping_cache_invalidate();
+}
+
+void symlink_postprocess_newpath(const char *realfnname, int ret,
+	mapping_results_t *res, const char *oldpath, const char *newpath)
+{
+	(void)realfnname; (void)oldpath; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void symlinkat_postprocess_newpath(const char *realfnname, int ret,
+	mapping_results_t *res, const char *oldpath, int newdirfd,
+	const char *newpath)
+{
+	(void)realfnname; (void)oldpath; (void)newdirfd; (void)newpath;
+	if (ret == 0) host_path_modified(res);
+}
+
+void chdir_postprocess_(const char *realfnname, int ret,
+	const char *path)
+{
+	(void)realfnname; (void)path;
+	if (ret == 0) pathmapping_cache_cwd_changed();
+}
+
+void fchdir_postprocess_(const char *realfnname, int ret, int fd)
+{
+	(void)realfnname; (void)fd;
+	if (ret == 0) pathmapping_cache_cwd_changed();
+}
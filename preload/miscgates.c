@@ -33,6 +33,8 @@
 #include "liblb.h"
 #include "exported.h"
 #include "rule_tree.h"
+#include "rule_tree_rpc.h"
+#include "lb_trace.h"
 
 #ifdef HAVE_FTS_H
 /* FIXME: why there was #if !defined(HAVE___OPENDIR2) around fts_open() ???? */
@@ -50,6 +52,7 @@ FTS * fts_open_gate(
 	char **new_path_argv;
 	char **np;
 	int n;
+	int union_dir_found = 0;
 	FTS *result;
 
 	for (n=0, p=path_argv; *p; n++, p++);
@@ -71,16 +74,219 @@ FTS * fts_open_gate(
 		} else {
 			*np = strdup("");
 		}
+		if (res.mres_union_dir) union_dir_found = 1;
 		free_mapping_results(&res);
 	}
 
+	if (union_dir_found) {
+		/* glibc's fts would read only the first source directory;
+		 * the own walker uses the virtual paths and the gates. */
+		for (np = new_path_argv; *np; np++) free(*np);
+		free(new_path_argv);
+		errno = *result_errno_ptr; /* restore to orig.value */
+		result = union_dir_fts_open(path_argv, options, compar);
+		*result_errno_ptr = errno;
+		return(result);
+	}
+
 	/* FIXME: this system causes memory leaks */
 
 	errno = *result_errno_ptr; /* restore to orig.value */
 	result = (*real_fts_open_ptr)(new_path_argv, options, compar);
 	*result_errno_ptr = errno;
+	/* fts_read() and fts_children() may change the directory;
+	 * resumed by fts_close() */
+	if (result && !(result->fts_options & FTS_NOCHDIR))
+		pathmapping_cache_suspend_cwd_tracking(1);
 	return(result);
 }
+
+int fts_set_gate(
+	int *result_errno_ptr,
+	int (*real_fts_set_ptr)(FTS *ftsp, FTSENT *f, int instr),
+	const char *realfnname,
+	FTS *ftsp,
+	FTSENT *f,
+	int instr)
+{
+	int	r;
+
+	(void)realfnname;
+	errno = *result_errno_ptr; /* restore to orig.value */
+	if (union_dir_fts_is_own(ftsp))
+		r = union_dir_fts_set(ftsp, f, instr);
+	else
+		r = (*real_fts_set_ptr)(ftsp, f, instr);
+	*result_errno_ptr = errno;
+	return(r);
+}
+
+int fts_close_gate(
+	int *result_errno_ptr,
+	int (*real_fts_close_ptr)(FTS *ftsp),
+	const char *realfnname,
+	FTS *ftsp)
+{
+	int	suspended;
+	int	r;
+
+	(void)realfnname;
+	errno = *result_errno_ptr; /* restore to orig.value */
+	if (union_dir_fts_is_own(ftsp)) {
+		r = union_dir_fts_close(ftsp);
+		*result_errno_ptr = errno;
+		return(r);
+	}
+	suspended = (ftsp && !(ftsp->fts_options & FTS_NOCHDIR));
+	r = (*real_fts_close_ptr)(ftsp);
+	*result_errno_ptr = errno;
+	if (suspended) pathmapping_cache_suspend_cwd_tracking(0);
+	return(r);
+}
+#endif
+
+/* ftw() and nftw(): glibc reads the directories with internal
+ * functions, which would see only the first source directory of
+ * an union directory. Walks that start from an union directory are
+ * done by liblb's own walker, which reads the directories via the
+ * gates and passes the virtual paths to "fn".
+ * Returns the mapped path in "res", or -1 if mapping failed.
+*/
+static int ftw_map_dir(int *result_errno_ptr, const char *realfnname,
+	const char *dir, mapping_results_t *res)
+{
+	clear_mapping_results_struct(res);
+	ldbox_map_path(realfnname, dir, 0/*flags*/, res, 0/*classmask*/);
+	if (res->mres_errno) {
+		LB_LOG(LB_LOGLEVEL_DEBUG, "mapping failed, errno %d",
+			res->mres_errno);
+		*result_errno_ptr = res->mres_errno;
+		free_mapping_results(res);
+		return(-1);
+	}
+	return(0);
+}
+
+int ftw_gate(int *result_errno_ptr,
+	int (*real_ftw_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat *sb, int flag),
+		int nopenfd),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat *sb, int flag),
+	int nopenfd)
+{
+	mapping_results_t res;
+	int	r;
+
+	if (ftw_map_dir(result_errno_ptr, realfnname, dir, &res) < 0)
+		return(-1);
+	errno = *result_errno_ptr; /* restore to orig.value */
+#ifdef HAVE_FTS_H
+	if (res.mres_union_dir)
+		r = union_dir_ftw(dir, fn);
+	else
+#endif
+		r = (*real_ftw_ptr)(res.mres_result_path, fn, nopenfd);
+	*result_errno_ptr = errno;
+	free_mapping_results(&res);
+	return(r);
+}
+
+#ifdef HAVE_FTW64
+int ftw64_gate(int *result_errno_ptr,
+	int (*real_ftw64_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat64 *sb, int flag),
+		int nopenfd),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb, int flag),
+	int nopenfd)
+{
+	mapping_results_t res;
+	int	r;
+
+	if (ftw_map_dir(result_errno_ptr, realfnname, dir, &res) < 0)
+		return(-1);
+	errno = *result_errno_ptr; /* restore to orig.value */
+#ifdef HAVE_FTS_H
+	if (res.mres_union_dir)
+		r = union_dir_ftw64(dir, fn);
+	else
+#endif
+		r = (*real_ftw64_ptr)(res.mres_result_path, fn, nopenfd);
+	*result_errno_ptr = errno;
+	free_mapping_results(&res);
+	return(r);
+}
+#endif
+
+/* nftw() with FTW_CHDIR changes the current directory while the
+ * callback functions are called; the tracked cwd can't be used
+ * during that.
+*/
+int nftw_gate(int *result_errno_ptr,
+	int (*real_nftw_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat *sb,
+			int flag, struct FTW *s),
+		int nopenfd, int flags),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat *sb,
+		int flag, struct FTW *s),
+	int nopenfd,
+	int flags)
+{
+	mapping_results_t res;
+	int	r;
+
+	if (ftw_map_dir(result_errno_ptr, realfnname, dir, &res) < 0)
+		return(-1);
+	if (flags & FTW_CHDIR) pathmapping_cache_suspend_cwd_tracking(1);
+	errno = *result_errno_ptr; /* restore to orig.value */
+#ifdef HAVE_FTS_H
+	if (res.mres_union_dir)
+		r = union_dir_nftw(dir, fn, flags);
+	else
+#endif
+		r = (*real_nftw_ptr)(res.mres_result_path, fn, nopenfd, flags);
+	*result_errno_ptr = errno;
+	if (flags & FTW_CHDIR) pathmapping_cache_suspend_cwd_tracking(0);
+	free_mapping_results(&res);
+	return(r);
+}
+
+#ifdef HAVE_NFTW64
+int nftw64_gate(int *result_errno_ptr,
+	int (*real_nftw64_ptr)(const char *dir,
+		int (*fn)(const char *file, const struct stat64 *sb,
+			int flag, struct FTW *s),
+		int nopenfd, int flags),
+	const char *realfnname,
+	const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb,
+		int flag, struct FTW *s),
+	int nopenfd,
+	int flags)
+{
+	mapping_results_t res;
+	int	r;
+
+	if (ftw_map_dir(result_errno_ptr, realfnname, dir, &res) < 0)
+		return(-1);
+	if (flags & FTW_CHDIR) pathmapping_cache_suspend_cwd_tracking(1);
+	errno = *result_errno_ptr; /* restore to orig.value */
+#ifdef HAVE_FTS_H
+	if (res.mres_union_dir)
+		r = union_dir_nftw64(dir, fn, flags);
+	else
+#endif
+		r = (*real_nftw64_ptr)(res.mres_result_path, fn, nopenfd, flags);
+	*result_errno_ptr = errno;
+	if (flags & FTW_CHDIR) pathmapping_cache_suspend_cwd_tracking(0);
+	free_mapping_results(&res);
+	return(r);
+}
 #endif
 
 char * get_current_dir_name_gate(
@@ -575,11 +781,16 @@ void exit_gate(
 {
 	(void)result_errno_ptr; /* not used */
 
+	pathmapping_cache_log_stats();
+	shared_pathcache_log_stats();
+	pathmapping_reverse_cache_publish_stats();
+
 	/* NOTE: Following LB_LOG() call is used by the log
 	 *       postprocessor script "lb-logz". Do not change
 	 *       without making a corresponding change to the script!
 	*/
 	LB_LOG(LB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	lbtrace_record(LB_TRACE_REC_EXIT, realfnname, NULL, NULL, status, 0, 0);
 	(real_exit_ptr)(status);
 }
 
@@ -590,11 +801,17 @@ void _exit_gate(
 {
 	(void)result_errno_ptr; /* not used */
 
+	pathmapping_cache_log_stats();
+	shared_pathcache_log_stats();
+	pathmapping_reverse_cache_publish_stats();
+
 	/* NOTE: Following LB_LOG() call is used by the log
 	 *       postprocessor script "lb-logz". Do not change
 	 *       without making a corresponding change to the script!
 	*/
 	LB_LOG(LB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	lbtrace_record(LB_TRACE_REC_EXIT, realfnname, NULL, NULL, status, 0, 0);
+	lblog_flush();
 	(real__exit_ptr)(status);
 }
 
@@ -611,12 +828,17 @@ void _Exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	LB_LOG(LB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	lbtrace_record(LB_TRACE_REC_EXIT, realfnname, NULL, NULL, status, 0, 0);
+	lblog_flush();
 	(real__Exit_ptr)(status);
 }
 //void _Exit_gate() __attribute__ ((noreturn));
 
 static void log_wait_result(const char *realfnname, pid_t pid, int status)
 {
+	lbtrace_record(LB_TRACE_REC_CHILD, realfnname, NULL, NULL,
+		status, (uint32_t)pid, 0);
+
 	/* NOTE: Following LB_LOG() calls are used by the log
 	 *       postprocessor script "lblogz". Do not change
 	 *       without making a corresponding changes to the script!
@@ -164,6 +164,7 @@ static int map_sockaddr_in(
 			(ldbox_binary_name ? ldbox_binary_name : "UNKNOWN"),
 			realfnname, NULL/*protocol. unknown. FIXME */,
 			addr_type, printable_dst_addr,
+			&(orig_sockaddr_in->sin_addr),
 			ntohs(orig_sockaddr_in->sin_port),
 			mapped_dst_addr, sizeof(mapped_dst_addr),
 			&mapped_port);
@@ -265,6 +266,7 @@ static int map_sockaddr_in6(
 			(ldbox_binary_name ? ldbox_binary_name : "UNKNOWN"),
 			realfnname, NULL/*protocol. unknown. FIXME */,
 			addr_type, printable_dst_addr,
+			&(orig_sockaddr_in6->sin6_addr),
 			ntohs(orig_sockaddr_in6->sin6_port),
 			mapped_dst_addr, sizeof(mapped_dst_addr),
 			&mapped_port);
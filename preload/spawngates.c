@@ -0,0 +1,647 @@
+/*
+ * spawngates -- posix_spawn() and posix_spawnp() GATEs for the
+ * 		ldbox preload library
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* posix_spawn() and posix_spawnp() of the C library call the execve
+ * system call directly, so the exec*() gates would never see the
+ * new program. Instead of that, everything that do_exec() does before
+ * the exec is done here in the parent (preprocessing, mapping,
+ * inspection and postprocessing of the file, also the path search
+ * of posix_spawnp()), and then the child is started with
+ * clone(CLONE_VM|CLONE_VFORK): The child shares the memory of
+ * the parent, so starting it does not depend on the size of the
+ * parent, and it only performs the file actions and attributes
+ * with raw system calls and executes the prepared file.
+ *
+ * The child must not call any functions of this library: those
+ * would update the parent's state (fdpathdb etc), since memory is
+ * shared. Signal handlers of the application must not be run in the
+ * child for the same reason; all signals are blocked while the child
+ * exists, and it resets caught signals to their defaults before the
+ * original signal mask is restored.
+ *
+ * Paths of the file actions (open and chdir) are mapped in the parent.
+ * Relative paths that follow a chdir action are mapped relative to the
+ * new directory.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <config.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "liblb.h"
+#include "exported.h"
+
+#if defined(HAVE_SPAWN_H) && defined(__linux__)
+
+/* A mirror of the C library's (glibc) internal "struct __spawn_action";
+ * posix_spawn_file_actions_t only has a pointer to an array of these,
+ * and there is no public interface for reading the actions. */
+struct lb_spawn_action {
+	enum {
+		lb_spawn_do_close,
+		lb_spawn_do_dup2,
+		lb_spawn_do_open,
+		lb_spawn_do_chdir,
+		lb_spawn_do_fchdir,
+		lb_spawn_do_closefrom,
+		lb_spawn_do_tcsetpgrp
+	} tag;
+
+	union {
+		struct {
+			int fd;
+		} close_action;
+		struct {
+			int fd;
+			int newfd;
+		} dup2_action;
+		struct {
+			int fd;
+			char *path;
+			int oflag;
+			mode_t mode;
+		} open_action;
+		struct {
+			char *path;
+		} chdir_action;
+		struct {
+			int fd;
+		} fchdir_action;
+		struct {
+			int from;
+		} closefrom_action;
+		struct {
+			int fd;
+		} setpgrp_action;
+	} action;
+};
+
+/* The child runs in a separate stack, on the parent's memory. */
+#define SPAWN_CHILD_STACK_SIZE	(64 * 1024)
+
+struct spawn_child_args {
+	const char	*file;
+	char *const	*argv;
+	char *const	*envp;
+
+	/* file actions, paths have been mapped */
+	struct lb_spawn_action	*actions;
+	int		num_actions;
+
+	/* attributes */
+	short		flags;
+	sigset_t	sigdefault;
+	sigset_t	sigmask;
+	pid_t		pgroup;
+	int		sched_policy;
+	struct sched_param sched_param;
+
+	/* signal mask of the parent before the spawn */
+	sigset_t	parent_sigmask;
+
+	int		restore_stack_limit;
+	struct rlimit64	stack_limit;
+
+	/* set by the child if it fails before the exec */
+	volatile int	err;
+};
+
+/* ---------- the child ---------- */
+
+static int spawn_child_dup_to(int fd, int newfd)
+{
+	if (fd == newfd) {
+		/* POSIX: the FD_CLOEXEC flag is cleared in this case */
+		long flags = syscall(SYS_fcntl, fd, F_GETFD);
+
+		if (flags < 0) return(-1);
+		return(syscall(SYS_fcntl, fd, F_SETFD, flags & ~FD_CLOEXEC) < 0 ?
+			-1 : 0);
+	}
+	return(syscall(SYS_dup3, fd, newfd, 0) < 0 ? -1 : 0);
+}
+
+static int spawn_child_closefrom(int from)
+{
+	struct rlimit64	lim;
+	long		fd;
+
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, from, ~0U, 0) == 0) return(0);
+#endif
+	if (syscall(SYS_prlimit64, 0, RLIMIT_NOFILE, NULL, &lim) < 0)
+		return(-1);
+	for (fd = from; fd < (long)lim.rlim_cur; fd++)
+		(void)syscall(SYS_close, fd);
+	return(0);
+}
+
+static int spawn_child_do_actions(struct spawn_child_args *args)
+{
+	int	i;
+
+	for (i = 0; i < args->num_actions; i++) {
+		struct lb_spawn_action *ap = &args->actions[i];
+		long	r = 0;
+
+		switch (ap->tag) {
+		case lb_spawn_do_close:
+			/* like the C library, ignore EBADF */
+			if ((syscall(SYS_close, ap->action.close_action.fd) < 0) &&
+			    (errno != EBADF)) r = -1;
+			break;
+
+		case lb_spawn_do_dup2:
+			r = spawn_child_dup_to(ap->action.dup2_action.fd,
+				ap->action.dup2_action.newfd);
+			break;
+
+		case lb_spawn_do_open:
+			(void)syscall(SYS_close, ap->action.open_action.fd);
+			r = syscall(SYS_openat, AT_FDCWD,
+				ap->action.open_action.path,
+				ap->action.open_action.oflag,
+				ap->action.open_action.mode);
+			if ((r >= 0) && (r != ap->action.open_action.fd)) {
+				int new_fd = (int)r;
+
+				r = spawn_child_dup_to(new_fd,
+					ap->action.open_action.fd);
+				(void)syscall(SYS_close, new_fd);
+			}
+			break;
+
+		case lb_spawn_do_chdir:
+			r = syscall(SYS_chdir, ap->action.chdir_action.path);
+			break;
+
+		case lb_spawn_do_fchdir:
+			r = syscall(SYS_fchdir, ap->action.fchdir_action.fd);
+			break;
+
+		case lb_spawn_do_closefrom:
+			r = spawn_child_closefrom(ap->action.closefrom_action.from);
+			break;
+
+		case lb_spawn_do_tcsetpgrp:
+			{
+				pid_t pgrp = (pid_t)syscall(SYS_getpgid, 0);
+
+				r = syscall(SYS_ioctl, ap->action.setpgrp_action.fd,
+					TIOCSPGRP, &pgrp);
+			}
+			break;
+		}
+		if (r < 0) return(-1);
+	}
+	return(0);
+}
+
+static int spawn_child(void *arg)
+{
+	struct spawn_child_args *args = arg;
+	struct sigaction sa;
+	int	sig;
+
+	/* Signal handlers of the application must not be run here. */
+	memset(&sa, 0, sizeof(sa));
+	for (sig = 1; sig < _NSIG; sig++) {
+		struct sigaction old_sa;
+
+		if ((args->flags & POSIX_SPAWN_SETSIGDEF) &&
+		    sigismember(&args->sigdefault, sig)) {
+			sa.sa_handler = SIG_DFL;
+		} else if ((sigaction(sig, NULL, &old_sa) == 0) &&
+			   (old_sa.sa_handler != SIG_IGN) &&
+			   (old_sa.sa_handler != SIG_DFL)) {
+			sa.sa_handler = SIG_DFL;
+		} else {
+			continue;
+		}
+		(void)sigaction(sig, &sa, NULL);
+	}
+
+	if (args->flags & POSIX_SPAWN_SETSCHEDULER) {
+		if (sched_setscheduler(0, args->sched_policy,
+		    &args->sched_param) < 0) goto fail;
+	} else if (args->flags & POSIX_SPAWN_SETSCHEDPARAM) {
+		if (sched_setparam(0, &args->sched_param) < 0) goto fail;
+	}
+
+#ifdef POSIX_SPAWN_SETSID
+	if ((args->flags & POSIX_SPAWN_SETSID) &&
+	    (syscall(SYS_setsid) < 0)) goto fail;
+#endif
+
+	if ((args->flags & POSIX_SPAWN_SETPGROUP) &&
+	    (syscall(SYS_setpgid, 0, args->pgroup) < 0)) goto fail;
+
+	if (args->flags & POSIX_SPAWN_RESETIDS) {
+#ifdef SYS_setresuid32
+		if ((syscall(SYS_setresgid32, -1, syscall(SYS_getgid32), -1) < 0) ||
+		    (syscall(SYS_setresuid32, -1, syscall(SYS_getuid32), -1) < 0))
+			goto fail;
+#else
+		if ((syscall(SYS_setresgid, -1, syscall(SYS_getgid), -1) < 0) ||
+		    (syscall(SYS_setresuid, -1, syscall(SYS_getuid), -1) < 0))
+			goto fail;
+#endif
+	}
+
+	if (spawn_child_do_actions(args) < 0) goto fail;
+
+	if (args->restore_stack_limit &&
+	    (syscall(SYS_prlimit64, 0, RLIMIT_STACK,
+		&args->stack_limit, NULL) < 0)) goto fail;
+
+	(void)sigprocmask(SIG_SETMASK,
+		((args->flags & POSIX_SPAWN_SETSIGMASK) ?
+			&args->sigmask : &args->parent_sigmask), NULL);
+
+	syscall(SYS_execve, args->file, args->argv, args->envp);
+
+    fail:
+	args->err = errno ? errno : ECHILD;
+	syscall(SYS_exit, 127);
+	return(127); /* not reached */
+}
+
+/* ---------- the parent ---------- */
+
+/* Returns an allocated virtual path for "path", relative to "vdir"
+ * (the virtual directory set by a chdir action) if that is known. */
+static char *spawn_virtual_path(const char *vdir, const char *path)
+{
+	char	*cp = NULL;
+
+	if (!vdir || (*path == '/')) return(strdup(path));
+	if (asprintf(&cp, "%s/%s", vdir, path) < 0) return(NULL);
+	return(cp);
+}
+
+static void free_spawn_actions(struct lb_spawn_action *actions, int num_actions)
+{
+	int	i;
+
+	if (!actions) return;
+	for (i = 0; i < num_actions; i++) {
+		switch (actions[i].tag) {
+		case lb_spawn_do_open:
+			free(actions[i].action.open_action.path);
+			break;
+		case lb_spawn_do_chdir:
+			free(actions[i].action.chdir_action.path);
+			break;
+		default:
+			break;
+		}
+	}
+	free(actions);
+}
+
+/* Copy the file actions, with mapped paths.
+ * Returns 0 or an errno value. On success, *vdirp is the
+ * virtual directory where the child will exec (or NULL if it
+ * is the current directory). */
+static int map_spawn_actions(const char *realfnname,
+	const posix_spawn_file_actions_t *file_actions,
+	struct spawn_child_args *args, char **vdirp)
+{
+	const struct lb_spawn_action *orig_actions;
+	char	*vdir = NULL;
+	int	i;
+	int	err = 0;
+
+	*vdirp = NULL;
+	if (!file_actions || (file_actions->__used <= 0)) return(0);
+
+	orig_actions = (const struct lb_spawn_action *)file_actions->__actions;
+	args->actions = calloc(file_actions->__used, sizeof(struct lb_spawn_action));
+	if (!args->actions) return(ENOMEM);
+
+	for (i = 0; i < file_actions->__used; i++) {
+		struct lb_spawn_action	*ap = &args->actions[i];
+		mapping_results_t	res;
+		char			*virtual_path;
+		char			**pathp = NULL;
+		uint32_t		classmask = 0;
+
+		*ap = orig_actions[i];
+		args->num_actions = i + 1;
+
+		switch (ap->tag) {
+		case lb_spawn_do_close:
+		case lb_spawn_do_dup2:
+		case lb_spawn_do_closefrom:
+		case lb_spawn_do_tcsetpgrp:
+			continue;
+		case lb_spawn_do_fchdir:
+			{
+				char	buf[PATH_MAX + 1];
+				const char *dir = fdpathdb_find_path(
+					ap->action.fchdir_action.fd,
+					buf, sizeof(buf));
+
+				if (vdir) free(vdir);
+				vdir = (dir ? strdup(dir) : NULL);
+				if (!dir) LB_LOG(LB_LOGLEVEL_WARNING,
+					"%s: unknown directory for fchdir "
+					"action (fd %d)", realfnname,
+					ap->action.fchdir_action.fd);
+			}
+			continue;
+		case lb_spawn_do_open:
+			pathp = &ap->action.open_action.path;
+			classmask = LB_INTERFACE_CLASS_OPEN;
+			if (ap->action.open_action.oflag & O_CREAT)
+				classmask |= LB_INTERFACE_CLASS_CREAT;
+			break;
+		case lb_spawn_do_chdir:
+			pathp = &ap->action.chdir_action.path;
+			break;
+		default:
+			LB_LOG(LB_LOGLEVEL_ERROR,
+				"%s: unknown file action %d",
+				realfnname, (int)ap->tag);
+			args->num_actions = i; /* nothing to free here */
+			err = ENOSYS;
+			goto out;
+		}
+
+		virtual_path = spawn_virtual_path(vdir, *pathp);
+		*pathp = NULL;
+		if (!virtual_path) {
+			err = ENOMEM;
+			goto out;
+		}
+		clear_mapping_results_struct(&res);
+		ldbox_map_path(realfnname, virtual_path, 0/*flags*/,
+			&res, classmask);
+		if (res.mres_errno) {
+			err = res.mres_errno;
+		} else if (!res.mres_result_path) {
+			err = ENOENT;
+		} else if (res.mres_readonly &&
+			   (ap->tag == lb_spawn_do_open) &&
+			   (ap->action.open_action.oflag &
+			    (O_WRONLY|O_RDWR|O_APPEND|O_CREAT|O_TRUNC))) {
+			err = EROFS;
+		} else {
+			*pathp = strdup(res.mres_result_path);
+			if (!*pathp) err = ENOMEM;
+		}
+		free_mapping_results(&res);
+
+		if (ap->tag == lb_spawn_do_chdir) {
+			if (vdir) free(vdir);
+			vdir = virtual_path;
+		} else {
+			free(virtual_path);
+		}
+		if (err) goto out;
+	}
+
+    out:
+	if (err) {
+		if (vdir) free(vdir);
+	} else {
+		*vdirp = vdir;
+	}
+	return(err);
+}
+
+/* posix_spawnp(): search the file from PATH, like do_execvep() does
+ * for execvp(). Returns 0 or an errno value. If mapping is disabled,
+ * the path that was found is returned in *found_pathp. */
+static int prepare_spawnp(const char *realfnname, const char *vdir,
+	const char *file, char *const argv[], char *const envp[],
+	char **new_file, char ***new_argv, char ***new_envp,
+	struct exec_arena_s **arenap, char **found_pathp)
+{
+	const char	*path = getenv("PATH");
+	const char	*p, *elem;
+	int		got_eacces = 0;
+	int		err = ENOENT;
+
+	if (!path) {
+		/* no PATH: the default search path of the C library */
+		path = "/bin:/usr/bin";
+	}
+
+	p = path;
+	do {
+		char	*candidate = NULL;
+		char	*virtual_path;
+
+		elem = p;
+		p = strchr(elem, ':');
+		if (!p) p = elem + strlen(elem);
+
+		if (p == elem) {
+			/* empty element: the current directory */
+			candidate = strdup(file);
+		} else if (asprintf(&candidate, "%.*s/%s",
+			   (int)(p - elem), elem, file) < 0) {
+			candidate = NULL;
+		}
+		if (!candidate) return(ENOMEM);
+		virtual_path = spawn_virtual_path(vdir, candidate);
+		free(candidate);
+		if (!virtual_path) return(ENOMEM);
+
+		err = do_spawn_prepare(realfnname, virtual_path, argv, envp,
+			new_file, new_argv, new_envp, arenap);
+		if (!err && !*new_file) {
+			/* mapping is disabled; the child needs the path */
+			if (access(virtual_path, X_OK) < 0) {
+				err = errno;
+				free(virtual_path);
+				do_spawn_release(*arenap);
+				*arenap = NULL;
+			} else {
+				*found_pathp = virtual_path;
+			}
+		} else {
+			free(virtual_path);
+		}
+
+		switch (err) {
+		case EACCES:
+			got_eacces = 1;
+			/* FALLTHROUGH */
+		case ENOENT:
+		case ESTALE:
+		case ENOTDIR:
+			/* try the next directory */
+			break;
+		default:
+			/* found (err==0), or failed to prepare it */
+			return(err);
+		}
+	} while (*p++ != '\0');
+
+	return(got_eacces ? EACCES : err);
+}
+
+static int do_posix_spawn(const char *realfnname, int search_path,
+	pid_t *pidp, const char *file,
+	const posix_spawn_file_actions_t *file_actions,
+	const posix_spawnattr_t *attrp,
+	char *const argv[], char *const envp[])
+{
+	struct spawn_child_args args;
+	char	*vdir = NULL;
+	char	*new_file = NULL;
+	char	**new_argv = NULL;
+	char	**new_envp = NULL;
+	struct exec_arena_s *exec_arena = NULL;
+	char	*virtual_path = NULL;
+	char	*stack = NULL;
+	sigset_t all_signals;
+	pid_t	pid;
+	int	err;
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: '%s'", realfnname, file);
+
+	if (!envp) envp = environ;
+	memset(&args, 0, sizeof(args));
+
+	if (attrp) {
+		posix_spawnattr_getflags(attrp, &args.flags);
+		posix_spawnattr_getsigdefault(attrp, &args.sigdefault);
+		posix_spawnattr_getsigmask(attrp, &args.sigmask);
+		posix_spawnattr_getpgroup(attrp, &args.pgroup);
+		posix_spawnattr_getschedpolicy(attrp, &args.sched_policy);
+		posix_spawnattr_getschedparam(attrp, &args.sched_param);
+	}
+
+	if ((err = map_spawn_actions(realfnname, file_actions,
+	    &args, &vdir)) != 0) goto out;
+
+	if (search_path && !strchr(file, '/')) {
+		if (*file == '\0') {
+			err = ENOENT;
+			goto out;
+		}
+		err = prepare_spawnp(realfnname, vdir, file, argv, envp,
+			&new_file, &new_argv, &new_envp, &exec_arena,
+			&virtual_path);
+	} else {
+		virtual_path = spawn_virtual_path(vdir, file);
+		if (!virtual_path) {
+			err = ENOMEM;
+			goto out;
+		}
+		err = do_spawn_prepare(realfnname, virtual_path, argv, envp,
+			&new_file, &new_argv, &new_envp, &exec_arena);
+	}
+	if (err) {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"%s: denied by exec preparations, %s (errno=%d)",
+			realfnname, file, err);
+		goto out;
+	}
+
+	args.file = (new_file ? new_file : virtual_path);
+	args.argv = (new_argv ? new_argv : argv);
+	args.envp = (new_envp ? new_envp : envp);
+	args.restore_stack_limit = lb_get_stack_limit_for_exec(&args.stack_limit);
+
+	stack = mmap(NULL, SPAWN_CHILD_STACK_SIZE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		stack = NULL;
+		err = errno;
+		goto out;
+	}
+
+	/* NOTE: Following LB_LOG() call is used by the log
+	 *       postprocessor script "lblogz", like the one
+	 *       in lb_next_execve(). */
+	LB_LOG(LB_LOGLEVEL_INFO, "EXEC: i_pid=%d file='%s'",
+		lb_log_initial_pid__, args.file);
+	lblog_flush();
+
+	sigfillset(&all_signals);
+	sigprocmask(SIG_BLOCK, &all_signals, &args.parent_sigmask);
+
+	/* The parent is suspended until the child has called
+	 * execve() or exited. */
+	pid = clone(spawn_child, stack + SPAWN_CHILD_STACK_SIZE,
+		CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+	if (pid < 0) {
+		err = errno;
+	} else if (args.err) {
+		/* the child failed before the exec and has exited */
+		err = args.err;
+		(void)syscall(SYS_wait4, pid, NULL, 0, NULL);
+	} else {
+		if (pidp) *pidp = pid;
+		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: started pid %d (%s)",
+			realfnname, (int)pid, args.file);
+	}
+
+	sigprocmask(SIG_SETMASK, &args.parent_sigmask, NULL);
+
+    out:
+	if (stack) munmap(stack, SPAWN_CHILD_STACK_SIZE);
+	do_spawn_release(exec_arena);
+	if (virtual_path) free(virtual_path);
+	free_spawn_actions(args.actions, args.num_actions);
+	if (vdir) free(vdir);
+	if (err) LB_LOG(LB_LOGLEVEL_DEBUG,
+		"%s failed (%s), errno=%d", realfnname, file, err);
+	return(err);
+}
+
+/* #include <spawn.h> */
+int posix_spawn_gate(
+	int *result_errno_ptr,
+	int (*real_posix_spawn_ptr)(pid_t *pid, const char *path,
+		const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp,
+		char *const argv[], char *const envp[]),
+	const char *realfnname,
+	pid_t *pid,
+	const char *path,
+	const posix_spawn_file_actions_t *file_actions,
+	const posix_spawnattr_t *attrp,
+	char *const argv[],
+	char *const envp[])
+{
+	(void)result_errno_ptr;	/* errors are returned, errno is not set */
+	(void)real_posix_spawn_ptr;	/* not used */
+	return(do_posix_spawn(realfnname, 0/*search_path*/, pid, path,
+		file_actions, attrp, argv, envp));
+}
+
+int posix_spawnp_gate(
+	int *result_errno_ptr,
+	int (*real_posix_spawnp_ptr)(pid_t *pid, const char *file,
+		const posix_spawn_file_actions_t *file_actions,
+		const posix_spawnattr_t *attrp,
+		char *const argv[], char *const envp[]),
+	const char *realfnname,
+	pid_t *pid,
+	const char *file,
+	const posix_spawn_file_actions_t *file_actions,
+	const posix_spawnattr_t *attrp,
+	char *const argv[],
+	char *const envp[])
+{
+	(void)result_errno_ptr;	/* errors are returned, errno is not set */
+	(void)real_posix_spawnp_ptr;	/* not used */
+	return(do_posix_spawn(realfnname, 1/*search_path*/, pid, file,
+		file_actions, attrp, argv, envp));
+}
+
+#endif /* HAVE_SPAWN_H && __linux__ */
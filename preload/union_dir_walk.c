@@ -0,0 +1,943 @@
+/*
+ * Directory tree walker for union directories
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* glibc's fts_*(), ftw() and nftw() read directories with internal
+ * functions that bypass the gates, so they would see only the first
+ * source directory of an union directory. Walks that start from an
+ * union directory are done here instead: This is an implementation
+ * of fts_*() which reads the directories with opendir() and readdir()
+ * and stats the entries with lstat()/stat(), all via liblb's gates.
+ * The listings come from memory (see union_dirs.c), and the paths
+ * are virtual paths, as the application expects. ftw() and nftw()
+ * are built on top of it.
+ *
+ * The walker never changes the current directory: FTS_NOCHDIR is
+ * always set, and fts_accpath is the same as fts_path. Entries are
+ * allocated and released like glibc does it, so the pointers that
+ * fts_read() and fts_children() return stay valid as long as they
+ * would with glibc.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <search.h>
+
+#include "liblb.h"
+#include "exported.h"
+
+#ifdef HAVE_FTS_H
+
+#if defined(HAVE_FTW64) || defined(HAVE_NFTW64)
+#define UNION_DIR_WALK_STAT64
+#endif
+
+/* The FTSENT must be the last member: fts_name extends past its end */
+typedef struct union_dir_walk_ent_s {
+	union {
+		struct stat	st;
+#ifdef UNION_DIR_WALK_STAT64
+		struct stat64	st64;
+#endif
+	} udwe_stat;
+	FTSENT	udwe_ent;
+} union_dir_walk_ent_t;
+
+#define UNION_DIR_WALK_ENT(p) ((union_dir_walk_ent_t *)((char *)(p) - \
+		offsetof(union_dir_walk_ent_t, udwe_ent)))
+
+typedef struct union_dir_walk_s {
+	FTS	udw_fts;	/* must be the first member */
+	struct union_dir_walk_s *udw_next;
+	int	(*udw_compar)(const FTSENT **, const FTSENT **);
+	int	udw_stat64;	/* for ftw64() and nftw64() */
+	int	udw_child_nameonly;
+} union_dir_walk_t;
+
+/* types of union_dir_walk_build() */
+#define UNION_DIR_WALK_BREAD	0	/* for fts_read() */
+#define UNION_DIR_WALK_BCHILD	1	/* for fts_children() */
+#define UNION_DIR_WALK_BNAMES	2	/* for fts_children(FTS_NAMEONLY) */
+
+#define UNION_DIR_WALK_ISDOT(a) \
+	((a)[0] == '.' && (!(a)[1] || ((a)[1] == '.' && !(a)[2])))
+
+/* handles returned by union_dir_fts_open() */
+static union_dir_walk_t *union_dir_walks = NULL;
+
+/* Read without the mutex by union_dir_fts_is_own(): the fts gates
+ * don't need to look at the list if there are no open walks. */
+static volatile int union_dir_num_walks = 0;
+
+static pthread_mutex_t	union_dir_walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void union_dir_walk_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&union_dir_walk_mutex);
+}
+static void union_dir_walk_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&union_dir_walk_mutex);
+}
+
+/* ------------ Entries ------------ */
+
+/* Allocates an entry. The path is "parent_path/name", or just
+ * "name" if "parent_path" is NULL. */
+static FTSENT *union_dir_walk_alloc_ent(const char *name, size_t namelen,
+	const char *parent_path)
+{
+	union_dir_walk_ent_t *e;
+	FTSENT	*p;
+	size_t	parentlen;
+
+	e = calloc(1, sizeof(union_dir_walk_ent_t) + namelen);
+	if (!e) return(NULL);
+	p = &e->udwe_ent;
+	memcpy(p->fts_name, name, namelen);
+	p->fts_name[namelen] = '\0';
+	p->fts_namelen = namelen;
+
+	if (parent_path) {
+		parentlen = strlen(parent_path);
+		if ((parentlen > 0) && (parent_path[parentlen-1] == '/'))
+			parentlen--;
+		p->fts_path = malloc(parentlen + 1 + namelen + 1);
+		if (p->fts_path) {
+			memcpy(p->fts_path, parent_path, parentlen);
+			p->fts_path[parentlen] = '/';
+			memcpy(p->fts_path + parentlen + 1, name, namelen + 1);
+		}
+	} else {
+		p->fts_path = strdup(p->fts_name);
+	}
+	if (!p->fts_path) {
+		free(e);
+		return(NULL);
+	}
+	p->fts_accpath = p->fts_path;
+	p->fts_pathlen = strlen(p->fts_path);
+	p->fts_statp = &e->udwe_stat.st;
+	p->fts_instr = FTS_NOINSTR;
+	return(p);
+}
+
+static void union_dir_walk_free_ent(FTSENT *p)
+{
+	free(p->fts_path);
+	free(UNION_DIR_WALK_ENT(p));
+}
+
+static void union_dir_walk_free_list(FTSENT *head)
+{
+	FTSENT	*p;
+
+	while ((p = head) != NULL) {
+		head = head->fts_link;
+		union_dir_walk_free_ent(p);
+	}
+}
+
+static int union_dir_walk_do_stat(union_dir_walk_t *udw, FTSENT *p,
+	int follow, mode_t *modep, dev_t *devp, ino_t *inop, nlink_t *nlinkp)
+{
+	union_dir_walk_ent_t *e = UNION_DIR_WALK_ENT(p);
+	int	r;
+
+#ifdef UNION_DIR_WALK_STAT64
+	if (udw->udw_stat64) {
+		r = follow ? stat64(p->fts_accpath, &e->udwe_stat.st64) :
+			lstat64(p->fts_accpath, &e->udwe_stat.st64);
+		if (r == 0) {
+			*modep = e->udwe_stat.st64.st_mode;
+			*devp = e->udwe_stat.st64.st_dev;
+			*inop = e->udwe_stat.st64.st_ino;
+			*nlinkp = e->udwe_stat.st64.st_nlink;
+		}
+		return(r);
+	}
+#endif
+	r = follow ? stat(p->fts_accpath, &e->udwe_stat.st) :
+		lstat(p->fts_accpath, &e->udwe_stat.st);
+	if (r == 0) {
+		*modep = e->udwe_stat.st.st_mode;
+		*devp = e->udwe_stat.st.st_dev;
+		*inop = e->udwe_stat.st.st_ino;
+		*nlinkp = e->udwe_stat.st.st_nlink;
+	}
+	return(r);
+}
+
+/* Stats "p" and returns the value for fts_info, like glibc's fts_stat() */
+static int union_dir_walk_stat(union_dir_walk_t *udw, FTSENT *p, int follow)
+{
+	FTSENT	*t;
+	mode_t	mode = 0;
+	dev_t	dev = 0;
+	ino_t	ino = 0;
+	nlink_t	nlink = 0;
+	int	saved_errno;
+
+	if ((udw->udw_fts.fts_options & FTS_LOGICAL) || follow) {
+		if (union_dir_walk_do_stat(udw, p, 1,
+		    &mode, &dev, &ino, &nlink) < 0) {
+			saved_errno = errno;
+			if ((errno == ENOENT) && (union_dir_walk_do_stat(udw,
+			    p, 0, &mode, &dev, &ino, &nlink) == 0)) {
+				errno = 0;
+				return(FTS_SLNONE);
+			}
+			p->fts_errno = saved_errno;
+			memset(UNION_DIR_WALK_ENT(p), 0,
+				sizeof(UNION_DIR_WALK_ENT(p)->udwe_stat));
+			return(FTS_NS);
+		}
+	} else if (union_dir_walk_do_stat(udw, p, 0,
+		   &mode, &dev, &ino, &nlink) < 0) {
+		p->fts_errno = errno;
+		memset(UNION_DIR_WALK_ENT(p), 0,
+			sizeof(UNION_DIR_WALK_ENT(p)->udwe_stat));
+		return(FTS_NS);
+	}
+
+	if (S_ISDIR(mode)) {
+		p->fts_dev = dev;
+		p->fts_ino = ino;
+		p->fts_nlink = nlink;
+		if (UNION_DIR_WALK_ISDOT(p->fts_name)) return(FTS_DOT);
+		for (t = p->fts_parent; t && (t->fts_level >= FTS_ROOTLEVEL);
+		     t = t->fts_parent) {
+			if ((t->fts_ino == ino) && (t->fts_dev == dev)) {
+				p->fts_cycle = t;
+				return(FTS_DC);
+			}
+		}
+		return(FTS_D);
+	}
+	if (S_ISLNK(mode)) return(FTS_SL);
+	if (S_ISREG(mode)) return(FTS_F);
+	return(FTS_DEFAULT);
+}
+
+static FTSENT *union_dir_walk_sort(union_dir_walk_t *udw,
+	FTSENT *head, int nitems)
+{
+	FTSENT	**array;
+	FTSENT	*p;
+	int	i;
+
+	array = malloc(nitems * sizeof(FTSENT *));
+	if (!array) return(head);	/* unsorted, then */
+	for (i = 0, p = head; p; p = p->fts_link) array[i++] = p;
+	qsort(array, nitems, sizeof(FTSENT *),
+		(int (*)(const void *, const void *))udw->udw_compar);
+	for (i = 0; i < nitems - 1; i++)
+		array[i]->fts_link = array[i+1];
+	array[nitems-1]->fts_link = NULL;
+	head = array[0];
+	free(array);
+	return(head);
+}
+
+/* Reads the current directory, returns the list of its entries */
+static FTSENT *union_dir_walk_build(union_dir_walk_t *udw, int type)
+{
+	FTSENT	*cur = udw->udw_fts.fts_cur;
+	FTSENT	*head = NULL;
+	FTSENT	*tail = NULL;
+	FTSENT	*p;
+	DIR	*dirp;
+	struct dirent *dp;
+	int	options = udw->udw_fts.fts_options;
+	int	nitems = 0;
+
+	if ((dirp = opendir(cur->fts_accpath)) == NULL) {
+		if (type == UNION_DIR_WALK_BREAD) {
+			cur->fts_info = FTS_DNR;
+			cur->fts_errno = errno;
+		}
+		return(NULL);
+	}
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!(options & FTS_SEEDOT) && UNION_DIR_WALK_ISDOT(dp->d_name))
+			continue;
+		p = union_dir_walk_alloc_ent(dp->d_name, strlen(dp->d_name),
+			cur->fts_path);
+		if (!p) {
+			union_dir_walk_free_list(head);
+			closedir(dirp);
+			cur->fts_info = FTS_ERR;
+			cur->fts_errno = ENOMEM;
+			errno = ENOMEM;
+			return(NULL);
+		}
+		p->fts_level = cur->fts_level + 1;
+		p->fts_parent = cur;
+		if (type == UNION_DIR_WALK_BNAMES) {
+			p->fts_info = FTS_NSOK;
+		} else if ((options & FTS_NOSTAT) &&
+			   (dp->d_type != DT_DIR) && (dp->d_type != DT_UNKNOWN) &&
+			   !((options & FTS_LOGICAL) && (dp->d_type == DT_LNK))) {
+			p->fts_info = FTS_NSOK;
+		} else {
+			p->fts_info = union_dir_walk_stat(udw, p, 0);
+		}
+		if (tail) tail->fts_link = p;
+		else head = p;
+		tail = p;
+		nitems++;
+	}
+	closedir(dirp);
+
+	if (!nitems) {
+		if (type == UNION_DIR_WALK_BREAD) cur->fts_info = FTS_DP;
+		errno = 0;
+		return(NULL);
+	}
+	if (udw->udw_compar && (nitems > 1))
+		head = union_dir_walk_sort(udw, head, nitems);
+	return(head);
+}
+
+/* ------------ fts_*() ------------ */
+
+static union_dir_walk_t *union_dir_walk_new(char * const *path_argv,
+	int options, int (*compar)(const FTSENT **, const FTSENT **),
+	int use_stat64)
+{
+	union_dir_walk_t *udw;
+	FTSENT	*root = NULL;
+	FTSENT	*tail = NULL;
+	FTSENT	*parent;
+	FTSENT	*p;
+	int	nitems = 0;
+
+	if (options & ~FTS_OPTIONMASK) {
+		errno = EINVAL;
+		return(NULL);
+	}
+	udw = calloc(1, sizeof(*udw));
+	if (!udw) return(NULL);
+	udw->udw_fts.fts_options = options | FTS_NOCHDIR;
+	udw->udw_fts.fts_rfd = -1;
+	udw->udw_compar = compar;
+	udw->udw_stat64 = use_stat64;
+
+	if ((parent = union_dir_walk_alloc_ent("", 0, NULL)) == NULL)
+		goto nomem;
+	parent->fts_level = FTS_ROOTPARENTLEVEL;
+
+	for (; *path_argv; path_argv++) {
+		size_t	len = strlen(*path_argv);
+
+		if (len == 0) {
+			union_dir_walk_free_list(root);
+			union_dir_walk_free_ent(parent);
+			free(udw);
+			errno = ENOENT;
+			return(NULL);
+		}
+		if ((p = union_dir_walk_alloc_ent(*path_argv, len, NULL)) == NULL) {
+			union_dir_walk_free_list(root);
+			union_dir_walk_free_ent(parent);
+			goto nomem;
+		}
+		p->fts_level = FTS_ROOTLEVEL;
+		p->fts_parent = parent;
+		p->fts_info = union_dir_walk_stat(udw, p,
+			options & FTS_COMFOLLOW);
+		if (p->fts_info == FTS_DOT) p->fts_info = FTS_D;
+		if (tail) tail->fts_link = p;
+		else root = p;
+		tail = p;
+		nitems++;
+	}
+	if (compar && (nitems > 1))
+		root = union_dir_walk_sort(udw, root, nitems);
+
+	/* a dummy current entry, so that the first fts_read()
+	 * moves to the first root */
+	if ((p = union_dir_walk_alloc_ent("", 0, NULL)) == NULL) {
+		union_dir_walk_free_list(root);
+		union_dir_walk_free_ent(parent);
+		goto nomem;
+	}
+	p->fts_level = FTS_ROOTLEVEL;
+	p->fts_parent = parent;
+	p->fts_link = root;
+	p->fts_info = FTS_INIT;
+	udw->udw_fts.fts_cur = p;
+	return(udw);
+
+    nomem:
+	free(udw);
+	errno = ENOMEM;
+	return(NULL);
+}
+
+static void union_dir_walk_free(union_dir_walk_t *udw)
+{
+	FTSENT	*p;
+	FTSENT	*freep;
+
+	/* the current entry, the rest of its siblings, and
+	 * the same for every level above it */
+	if (udw->udw_fts.fts_cur) {
+		for (p = udw->udw_fts.fts_cur; p->fts_level >= FTS_ROOTLEVEL; ) {
+			freep = p;
+			p = p->fts_link ? p->fts_link : p->fts_parent;
+			union_dir_walk_free_ent(freep);
+		}
+		union_dir_walk_free_ent(p);
+	}
+	if (udw->udw_fts.fts_child)
+		union_dir_walk_free_list(udw->udw_fts.fts_child);
+	free(udw);
+}
+
+/* When a root is visited, its name becomes the last component
+ * of the path, and its device is used for FTS_XDEV, like glibc's
+ * fts_load() does it. */
+static void union_dir_walk_load_root(FTS *ftsp, FTSENT *p)
+{
+	char	*cp = strrchr(p->fts_name, '/');
+
+	if (cp && ((cp != p->fts_name) || cp[1])) {
+		size_t	len = strlen(++cp);
+
+		memmove(p->fts_name, cp, len + 1);
+		p->fts_namelen = len;
+	}
+	ftsp->fts_dev = p->fts_dev;
+}
+
+FTS *union_dir_fts_open(char * const *path_argv, int options,
+	int (*compar)(const FTSENT **, const FTSENT **))
+{
+	union_dir_walk_t *udw;
+
+	udw = union_dir_walk_new(path_argv, options, compar, 0);
+	if (!udw) return(NULL);
+
+	union_dir_walk_mutex_lock();
+	udw->udw_next = union_dir_walks;
+	union_dir_walks = udw;
+	union_dir_num_walks++;
+	union_dir_walk_mutex_unlock();
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "union_dir_fts_open: %p", (void *)udw);
+	return(&udw->udw_fts);
+}
+
+/* Returns true if "ftsp" was returned by union_dir_fts_open() */
+int union_dir_fts_is_own(FTS *ftsp)
+{
+	union_dir_walk_t *udw;
+
+	if (!union_dir_num_walks) return(0);
+
+	union_dir_walk_mutex_lock();
+	for (udw = union_dir_walks; udw; udw = udw->udw_next) {
+		if (&udw->udw_fts == ftsp) break;
+	}
+	union_dir_walk_mutex_unlock();
+	return(udw != NULL);
+}
+
+FTSENT *union_dir_fts_read(FTS *ftsp)
+{
+	union_dir_walk_t *udw = (union_dir_walk_t *)ftsp;
+	FTSENT	*p;
+	FTSENT	*tmp;
+	int	instr;
+
+	if ((p = ftsp->fts_cur) == NULL) return(NULL);
+
+	instr = p->fts_instr;
+	p->fts_instr = FTS_NOINSTR;
+
+	if (instr == FTS_AGAIN) {
+		p->fts_info = union_dir_walk_stat(udw, p, 0);
+		return(p);
+	}
+	if ((instr == FTS_FOLLOW) &&
+	    ((p->fts_info == FTS_SL) || (p->fts_info == FTS_SLNONE))) {
+		p->fts_info = union_dir_walk_stat(udw, p, 1);
+		return(p);
+	}
+
+	/* directory in pre-order: descend, unless skipped */
+	if (p->fts_info == FTS_D) {
+		if ((instr == FTS_SKIP) ||
+		    ((ftsp->fts_options & FTS_XDEV) &&
+		     (p->fts_dev != ftsp->fts_dev))) {
+			if (ftsp->fts_child) {
+				union_dir_walk_free_list(ftsp->fts_child);
+				ftsp->fts_child = NULL;
+			}
+			p->fts_info = FTS_DP;
+			return(p);
+		}
+		if (ftsp->fts_child && udw->udw_child_nameonly) {
+			union_dir_walk_free_list(ftsp->fts_child);
+			ftsp->fts_child = NULL;
+		}
+		if (!ftsp->fts_child) {
+			ftsp->fts_child = union_dir_walk_build(udw,
+				UNION_DIR_WALK_BREAD);
+			if (!ftsp->fts_child) {
+				/* empty (FTS_DP) or unreadable (FTS_DNR) */
+				return(p);
+			}
+		}
+		p = ftsp->fts_child;
+		ftsp->fts_child = NULL;
+		return(ftsp->fts_cur = p);
+	}
+
+	/* move to the next sibling */
+    next:
+	tmp = p;
+	if ((p = p->fts_link) != NULL) {
+		union_dir_walk_free_ent(tmp);
+		if (p->fts_level == FTS_ROOTLEVEL) {
+			union_dir_walk_load_root(ftsp, p);
+			return(ftsp->fts_cur = p);
+		}
+		if (p->fts_instr == FTS_SKIP)
+			goto next;
+		if (p->fts_instr == FTS_FOLLOW) {
+			p->fts_info = union_dir_walk_stat(udw, p, 1);
+			p->fts_instr = FTS_NOINSTR;
+		}
+		return(ftsp->fts_cur = p);
+	}
+
+	/* move up to the parent, directory in post-order */
+	p = tmp->fts_parent;
+	union_dir_walk_free_ent(tmp);
+	if (p->fts_level == FTS_ROOTPARENTLEVEL) {
+		union_dir_walk_free_ent(p);
+		errno = 0;
+		return(ftsp->fts_cur = NULL);
+	}
+	p->fts_info = p->fts_errno ? FTS_ERR : FTS_DP;
+	return(ftsp->fts_cur = p);
+}
+
+FTSENT *union_dir_fts_children(FTS *ftsp, int options)
+{
+	union_dir_walk_t *udw = (union_dir_walk_t *)ftsp;
+	FTSENT	*p;
+
+	if ((options != 0) && (options != FTS_NAMEONLY)) {
+		errno = EINVAL;
+		return(NULL);
+	}
+	errno = 0;
+	if ((p = ftsp->fts_cur) == NULL) return(NULL);
+	if (p->fts_info == FTS_INIT) return(p->fts_link);
+	if (p->fts_info != FTS_D) return(NULL);
+
+	if (ftsp->fts_child) union_dir_walk_free_list(ftsp->fts_child);
+	udw->udw_child_nameonly = (options == FTS_NAMEONLY);
+	ftsp->fts_child = union_dir_walk_build(udw, udw->udw_child_nameonly ?
+		UNION_DIR_WALK_BNAMES : UNION_DIR_WALK_BCHILD);
+	return(ftsp->fts_child);
+}
+
+int union_dir_fts_set(FTS *ftsp, FTSENT *f, int instr)
+{
+	(void)ftsp;
+	if ((instr != 0) && (instr != FTS_AGAIN) && (instr != FTS_FOLLOW) &&
+	    (instr != FTS_NOINSTR) && (instr != FTS_SKIP)) {
+		errno = EINVAL;
+		return(1);
+	}
+	f->fts_instr = instr;
+	return(0);
+}
+
+int union_dir_fts_close(FTS *ftsp)
+{
+	union_dir_walk_t *udw = (union_dir_walk_t *)ftsp;
+	union_dir_walk_t **udwp;
+
+	union_dir_walk_mutex_lock();
+	for (udwp = &union_dir_walks; *udwp; udwp = &(*udwp)->udw_next) {
+		if (*udwp == udw) {
+			*udwp = udw->udw_next;
+			union_dir_num_walks--;
+			break;
+		}
+	}
+	union_dir_walk_mutex_unlock();
+
+	union_dir_walk_free(udw);
+	return(0);
+}
+
+/* ------------ ftw() and nftw() ------------ */
+
+/* exactly one of these is set */
+typedef struct union_dir_ftw_fn_s {
+	int	(*udff_ftw)(const char *file, const struct stat *sb,
+			int flag);
+	int	(*udff_nftw)(const char *file, const struct stat *sb,
+			int flag, struct FTW *s);
+#ifdef HAVE_FTW64
+	int	(*udff_ftw64)(const char *file, const struct stat64 *sb,
+			int flag);
+#endif
+#ifdef HAVE_NFTW64
+	int	(*udff_nftw64)(const char *file, const struct stat64 *sb,
+			int flag, struct FTW *s);
+#endif
+} union_dir_ftw_fn_t;
+
+/* "path" is the path that is passed to the callback function */
+static int union_dir_ftw_call(const union_dir_ftw_fn_t *fns,
+	const char *path, FTSENT *p, int flag, struct FTW *s)
+{
+	if (fns->udff_ftw)
+		return((*fns->udff_ftw)(path, p->fts_statp, flag));
+	if (fns->udff_nftw)
+		return((*fns->udff_nftw)(path, p->fts_statp, flag, s));
+#ifdef HAVE_FTW64
+	if (fns->udff_ftw64)
+		return((*fns->udff_ftw64)(path,
+			(const struct stat64 *)p->fts_statp, flag));
+#endif
+#ifdef HAVE_NFTW64
+	if (fns->udff_nftw64)
+		return((*fns->udff_nftw64)(path,
+			(const struct stat64 *)p->fts_statp, flag, s));
+#endif
+	return(0);
+}
+
+static dev_t union_dir_ftw_st_dev(union_dir_walk_t *udw, FTSENT *p)
+{
+#ifdef UNION_DIR_WALK_STAT64
+	if (udw->udw_stat64)
+		return(UNION_DIR_WALK_ENT(p)->udwe_stat.st64.st_dev);
+#endif
+	(void)udw;
+	return(UNION_DIR_WALK_ENT(p)->udwe_stat.st.st_dev);
+}
+
+/* Without FTW_PHYS, glibc doesn't enter the same directory twice */
+typedef struct union_dir_ftw_seen_s {
+	dev_t	udfs_dev;
+	ino_t	udfs_ino;
+} union_dir_ftw_seen_t;
+
+static int union_dir_ftw_cmp_seen(const void *a, const void *b)
+{
+	const union_dir_ftw_seen_t *sa = a;
+	const union_dir_ftw_seen_t *sb = b;
+
+	if (sa->udfs_dev != sb->udfs_dev)
+		return(sa->udfs_dev < sb->udfs_dev ? -1 : 1);
+	if (sa->udfs_ino != sb->udfs_ino)
+		return(sa->udfs_ino < sb->udfs_ino ? -1 : 1);
+	return(0);
+}
+
+/* Returns 1 if directory "p" has been seen already, 0 if not
+ * (and remembers it), or -1 if out of memory */
+static int union_dir_ftw_seen(void **seen_root, FTSENT *p)
+{
+	union_dir_ftw_seen_t *s;
+	void	*found;
+
+	if ((s = malloc(sizeof(*s))) == NULL) return(-1);
+	s->udfs_dev = p->fts_dev;
+	s->udfs_ino = p->fts_ino;
+	found = tsearch(s, seen_root, union_dir_ftw_cmp_seen);
+	if (!found) {
+		free(s);
+		return(-1);
+	}
+	if (*(union_dir_ftw_seen_t **)found != s) {
+		free(s);
+		return(1);
+	}
+	return(0);
+}
+
+/* FTW_CHDIR: changes to the directory, which is the first "len"
+ * characters of "dir", unless already there. */
+static int union_dir_ftw_chdir(char **cwd_dirp, const char *dir, size_t len)
+{
+	if (*cwd_dirp && (strlen(*cwd_dirp) == len) &&
+	    !strncmp(*cwd_dirp, dir, len))
+		return(0);
+	free(*cwd_dirp);
+	if ((*cwd_dirp = strndup(dir, len)) == NULL) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	return(chdir(*cwd_dirp));
+}
+
+/* Walks the tree like glibc's ftw() and nftw() do. "is_nftw" selects
+ * the flags which are passed to the callback function.
+ *
+ * With FTW_CHDIR, the callback of an entry is called in the directory
+ * which contains it. The walker reads the directories by paths, so
+ * those must not depend on the current directory: a relative "dir"
+ * is walked as an absolute path, and the callbacks get the paths
+ * without the prefix. */
+static int union_dir_ftw_walk(const char *dir, const union_dir_ftw_fn_t *fns,
+	int flags, int is_nftw, int use_stat64)
+{
+	union_dir_walk_t *udw = NULL;
+	char	*root;
+	char	*paths[2];
+	char	*cwd_dir = NULL;
+	size_t	prefix_len = 0;
+	int	orig_cwd_fd = -1;
+	dev_t	root_dev = 0;
+	void	*seen_root = NULL;
+	FTSENT	*p;
+	FTSENT	*q;
+	size_t	len;
+	int	r = 0;
+	int	saved_errno;
+
+	if (!*dir) {
+		errno = ENOENT;
+		return(-1);
+	}
+	if ((flags & FTW_CHDIR) && (*dir != '/')) {
+		char	*cwd = getcwd(NULL, 0);
+
+		if (!cwd) return(-1);
+		prefix_len = strcmp(cwd, "/") ? strlen(cwd) + 1 : 1;
+		if (asprintf(&root, "%s/%s", strcmp(cwd, "/") ? cwd : "",
+		    dir) < 0) {
+			free(cwd);
+			errno = ENOMEM;
+			return(-1);
+		}
+		free(cwd);
+	} else if ((root = strdup(dir)) == NULL) {
+		errno = ENOMEM;
+		return(-1);
+	}
+	/* trailing slashes are not part of the paths */
+	len = strlen(root);
+	while ((len > prefix_len + 1) && (root[len-1] == '/'))
+		root[--len] = '\0';
+	paths[0] = root;
+	paths[1] = NULL;
+
+	if (flags & FTW_CHDIR) {
+		orig_cwd_fd = open_nomap_nolog(".", O_RDONLY | O_DIRECTORY);
+		if (orig_cwd_fd < 0) {
+			r = -1;
+			goto out;
+		}
+	}
+
+	udw = union_dir_walk_new(paths,
+		(flags & FTW_PHYS) ? FTS_PHYSICAL : FTS_LOGICAL,
+		NULL, use_stat64);
+	if (!udw) {
+		r = -1;
+		goto out;
+	}
+
+	while ((p = union_dir_fts_read(&udw->udw_fts)) != NULL) {
+		struct FTW ftwbuf;
+		const char *path;
+		const char *cp;
+		int	flag;
+		int	cb_ret;
+
+		/* fts_number is set for directories that are skipped
+		 * silently; that applies to FTS_DP, too */
+		if (p->fts_number) continue;
+
+		switch (p->fts_info) {
+		case FTS_D:
+			if (!(flags & FTW_PHYS)) {
+				int	seen = union_dir_ftw_seen(&seen_root, p);
+
+				if (seen < 0) {
+					errno = ENOMEM;
+					r = -1;
+					goto out;
+				}
+				if (seen) {
+					p->fts_number = 1;
+					union_dir_fts_set(&udw->udw_fts,
+						p, FTS_SKIP);
+					continue;
+				}
+			}
+			if (!union_dir_fts_children(&udw->udw_fts, 0) && errno) {
+				/* fts_read() will return it as FTS_DNR */
+				flag = FTW_DNR;
+				break;
+			}
+			if (flags & FTW_DEPTH) continue;
+			flag = FTW_D;
+			break;
+		case FTS_DNR:	/* already reported at FTS_D */
+		case FTS_DC:	/* glibc doesn't enter a directory twice */
+			continue;
+		case FTS_DP:
+			if (!(flags & FTW_DEPTH)) continue;
+			flag = FTW_DP;
+			break;
+		case FTS_SL:
+			flag = is_nftw ? FTW_SL : FTW_F;
+			break;
+		case FTS_SLNONE:
+			flag = is_nftw ? FTW_SLN : FTW_NS;
+			break;
+		case FTS_NS:
+		case FTS_ERR:
+			if (p->fts_level == FTS_ROOTLEVEL) {
+				errno = p->fts_errno;
+				r = -1;
+				goto out;
+			}
+			flag = FTW_NS;
+			break;
+		default:
+			flag = FTW_F;
+			break;
+		}
+
+		if (p->fts_level == FTS_ROOTLEVEL) {
+			root_dev = union_dir_ftw_st_dev(udw, p);
+		} else if ((flags & FTW_MOUNT) && (flag != FTW_NS) &&
+			   (union_dir_ftw_st_dev(udw, p) != root_dev)) {
+			/* on another file system: skip it completely */
+			if (p->fts_info == FTS_D) {
+				p->fts_number = 1;
+				union_dir_fts_set(&udw->udw_fts, p, FTS_SKIP);
+			}
+			continue;
+		}
+
+		if (flags & FTW_CHDIR) {
+			const char *parent_path = p->fts_parent->fts_path;
+
+			if (p->fts_level == FTS_ROOTLEVEL) {
+				/* "root" is absolute */
+				parent_path = p->fts_path;
+				cp = strrchr(parent_path, '/');
+				len = (cp == parent_path) ? 1 : cp - parent_path;
+			} else {
+				len = strlen(parent_path);
+			}
+			if (union_dir_ftw_chdir(&cwd_dir, parent_path, len) < 0) {
+				r = -1;
+				goto out;
+			}
+		}
+
+		path = p->fts_path + prefix_len;
+		cp = strrchr(path, '/');
+		ftwbuf.base = cp ? (cp - path) + 1 : 0;
+		ftwbuf.level = p->fts_level;
+		cb_ret = union_dir_ftw_call(fns, path, p, flag, &ftwbuf);
+		if (cb_ret == 0) continue;
+		if (!(flags & FTW_ACTIONRETVAL)) {
+			r = cb_ret;
+			goto out;
+		}
+		switch (cb_ret) {
+		case FTW_SKIP_SUBTREE:
+			if (p->fts_info == FTS_D)
+				union_dir_fts_set(&udw->udw_fts, p, FTS_SKIP);
+			break;
+		case FTW_SKIP_SIBLINGS:
+			if (p->fts_info == FTS_D)
+				union_dir_fts_set(&udw->udw_fts, p, FTS_SKIP);
+			for (q = p->fts_link; q; q = q->fts_link)
+				q->fts_instr = FTS_SKIP;
+			break;
+		default:
+			r = cb_ret;
+			goto out;
+		}
+	}
+
+    out:
+	saved_errno = errno;
+	if (orig_cwd_fd >= 0) {
+		fchdir(orig_cwd_fd);	/* the gate forgets cached relative paths */
+		close_nomap_nolog(orig_cwd_fd);
+	}
+	if (seen_root) tdestroy(seen_root, free);
+	free(cwd_dir);
+	free(root);
+	if (udw) union_dir_walk_free(udw);
+	errno = saved_errno;
+	return(r);
+}
+
+int union_dir_ftw(const char *dir,
+	int (*fn)(const char *file, const struct stat *sb, int flag))
+{
+	union_dir_ftw_fn_t fns;
+
+	memset(&fns, 0, sizeof(fns));
+	fns.udff_ftw = fn;
+	return(union_dir_ftw_walk(dir, &fns, 0, 0, 0));
+}
+
+int union_dir_nftw(const char *dir,
+	int (*fn)(const char *file, const struct stat *sb,
+		int flag, struct FTW *s),
+	int flags)
+{
+	union_dir_ftw_fn_t fns;
+
+	memset(&fns, 0, sizeof(fns));
+	fns.udff_nftw = fn;
+	return(union_dir_ftw_walk(dir, &fns, flags, 1, 0));
+}
+
+#ifdef HAVE_FTW64
+int union_dir_ftw64(const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb, int flag))
+{
+	union_dir_ftw_fn_t fns;
+
+	memset(&fns, 0, sizeof(fns));
+	fns.udff_ftw64 = fn;
+	return(union_dir_ftw_walk(dir, &fns, 0, 0, 1));
+}
+#endif
+
+#ifdef HAVE_NFTW64
+int union_dir_nftw64(const char *dir,
+	int (*fn)(const char *file, const struct stat64 *sb,
+		int flag, struct FTW *s),
+	int flags)
+{
+	union_dir_ftw_fn_t fns;
+
+	memset(&fns, 0, sizeof(fns));
+	fns.udff_nftw64 = fn;
+	return(union_dir_ftw_walk(dir, &fns, flags, 1, 1));
+}
+#endif
+
+#endif /* HAVE_FTS_H */
@@ -6,10 +6,42 @@
  * Licensed under LGPL version 2.1, see top level LICENSE file for details.
  */
 
+/* Union directories.
+ *
+ * A union directory is a virtual directory whose listing is the
+ * union of listings of a set of real ("source") directories. The path
+ * of an union directory is mapped to the first existing source
+ * directory, so that stat(), chdir() etc. work as usual. The combined
+ * listing is kept in memory: It is built when the directory is
+ * mapped and reused as long as the source directories are not
+ * modified (same inodes and mtimes). Nothing is written to the
+ * file system.
+ *
+ * File descriptors that have been opened via the union directory
+ * (open(), opendir()) are registered here by fdpathdb.c, and the
+ * directory reading functions (readdir(), getdents64(), scandir(),
+ * etc) return entries from the combined listing for those. Other
+ * file descriptors are passed to the real functions.
+ *
+ * If the same name exists in several source directories, the
+ * entry from the first one is used.
+ *
+ * Listings are looked up by the source directories and their
+ * identities: File descriptors and scandir() find the listing
+ * through the rule tree list of source directories, which the
+ * mapping result carries in "mres_union_dir_src_list".
+ *
+ * glibc's ftw(), nftw() and fts_*() read directories with internal
+ * functions that bypass the gates. Walks that start from an union
+ * directory are done by liblb's own walker (union_dir_walk.c),
+ * which reads directories via the gates.
+*/
+
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -33,118 +65,877 @@
 
 #include "mapping.h"
 #include "lb.h"
+#include "lb_stat.h"
 #include "rule_tree.h"
 #include "liblb.h"
 #include "exported.h"
 
+/* max.number of listings that are kept in memory */
+#define UNION_DIR_CACHE_SIZE	16
+
+typedef struct union_dir_entry_s {
+	char		*ude_name;
+	ino_t		ude_ino;
+	unsigned char	ude_type;
+	int		ude_src_idx;	/* used while building the listing */
+} union_dir_entry_t;
+
+/* identity of a source directory; the listing is valid as
+ * long as these don't change. */
+typedef struct union_dir_src_stat_s {
+	int		udss_exists;
+	dev_t		udss_dev;
+	ino_t		udss_ino;
+	int64_t		udss_mtime_sec;
+	long		udss_mtime_nsec;
+} union_dir_src_stat_t;
+
+typedef struct union_dir_listing_s {
+	struct union_dir_listing_s *udl_next;	/* in the cache */
+	int		udl_cached;
+	int		udl_refcount;	/* streams and scandir() calls */
+
+	char		*udl_base_path;	/* first existing source dir */
+	int		udl_num_src_dirs;
+	char		**udl_src_paths;
+	union_dir_src_stat_t *udl_src_stats;
+
+	int		udl_num_entries;
+	union_dir_entry_t *udl_entries;	/* sorted by name */
+} union_dir_listing_t;
+
+/* Reading position of an open union directory. Shared by
+ * duplicated file descriptors, like the file offset is. */
+typedef struct union_dir_stream_s {
+	union_dir_listing_t *uds_listing;
+	int		uds_refcount;
+	int		uds_pos;
+	struct dirent	uds_dirent;	/* returned by readdir() */
+#ifdef HAVE_READDIR64
+	struct dirent64	uds_dirent64;	/* returned by readdir64() */
+#endif
+} union_dir_stream_t;
+
+typedef struct union_dir_fd_s {
+	struct union_dir_fd_s *udf_next;
+	int		udf_fd;
+	union_dir_stream_t *udf_stream;
+} union_dir_fd_t;
+
+static union_dir_listing_t *union_dir_cache = NULL;	/* MRU first */
+static union_dir_fd_t *union_dir_fds = NULL;
 
-/* returns an allocated string */
-/* FIXME: This should be somewhere else! it does not belong to this file. */
+/* Number of registered file descriptors. Read without the mutex
+ * by the directory reading gates: nothing needs to be done if
+ * there are no union directories open. */
+static volatile int union_dir_num_fds = 0;
+
+static pthread_mutex_t	union_dir_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* NO logging while the mutex is locked! */
+static void union_dir_mutex_lock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&union_dir_mutex);
+}
+static void union_dir_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&union_dir_mutex);
+}
+
+/* ------------ Listings ------------ */
+
+static void union_dir_free_listing(union_dir_listing_t *udl)
+{
+	int	i;
+
+	for (i = 0; i < udl->udl_num_entries; i++)
+		free(udl->udl_entries[i].ude_name);
+	free(udl->udl_entries);
+	for (i = 0; i < udl->udl_num_src_dirs; i++)
+		free(udl->udl_src_paths[i]);
+	free(udl->udl_src_paths);
+	free(udl->udl_src_stats);
+	free(udl->udl_base_path);
+	free(udl);
+}
+
+/* must be called while the mutex is locked */
+static void union_dir_unref_listing(union_dir_listing_t *udl)
+{
+	udl->udl_refcount--;
+	if ((udl->udl_refcount <= 0) && !udl->udl_cached)
+		union_dir_free_listing(udl);
+}
+
+static void union_dir_stat_src_dirs(const char **src_paths,
+	int num_src_dirs, union_dir_src_stat_t *stats)
+{
+	int	i;
+
+	for (i = 0; i < num_src_dirs; i++) {
+		struct stat	st;
+
+		memset(&stats[i], 0, sizeof(stats[i]));
+		if ((real_stat(src_paths[i], &st) == 0) && S_ISDIR(st.st_mode)) {
+			stats[i].udss_exists = 1;
+			stats[i].udss_dev = st.st_dev;
+			stats[i].udss_ino = st.st_ino;
+			stats[i].udss_mtime_sec = st.st_mtim.tv_sec;
+			stats[i].udss_mtime_nsec = st.st_mtim.tv_nsec;
+		}
+	}
+}
+
+static int union_dir_listing_matches(const union_dir_listing_t *udl,
+	const char **src_paths, int num_src_dirs)
+{
+	int	i;
+
+	if (udl->udl_num_src_dirs != num_src_dirs) return(0);
+	for (i = 0; i < num_src_dirs; i++) {
+		if (strcmp(udl->udl_src_paths[i], src_paths[i])) return(0);
+	}
+	return(1);
+}
+
+static int union_dir_cmp_entries(const void *a, const void *b)
+{
+	const union_dir_entry_t *ea = a;
+	const union_dir_entry_t *eb = b;
+	int	r;
+
+	r = strcmp(ea->ude_name, eb->ude_name);
+	if (r) return(r);
+	return(ea->ude_src_idx - eb->ude_src_idx);
+}
+
+/* Read all source directories and build a new listing.
+ * Returns NULL if none of the source directories can be read. */
+static union_dir_listing_t *union_dir_build_listing(
+	const char **src_paths, int num_src_dirs,
+	const union_dir_src_stat_t *stats)
+{
+	union_dir_listing_t *udl;
+	union_dir_entry_t *entries = NULL;
+	int	num_entries = 0;
+	int	max_entries = 0;
+	int	i, n;
+
+	udl = calloc(1, sizeof(*udl));
+	if (!udl) return(NULL);
+	udl->udl_num_src_dirs = num_src_dirs;
+	udl->udl_src_paths = calloc(num_src_dirs, sizeof(char *));
+	udl->udl_src_stats = calloc(num_src_dirs, sizeof(union_dir_src_stat_t));
+	if (!udl->udl_src_paths || !udl->udl_src_stats) goto error_out;
+
+	for (i = 0; i < num_src_dirs; i++) {
+		DIR	*d;
+		struct dirent *de;
+
+		udl->udl_src_paths[i] = strdup(src_paths[i]);
+		if (!udl->udl_src_paths[i]) goto error_out;
+		udl->udl_src_stats[i] = stats[i];
+
+		if (!stats[i].udss_exists) continue;
+		if ((d = opendir_nomap_nolog(src_paths[i])) == NULL) {
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"union_dir: can't open src dir '%s'",
+				src_paths[i]);
+			continue;
+		}
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"union_dir: reading src dir '%s'", src_paths[i]);
+		if (!udl->udl_base_path) {
+			udl->udl_base_path = strdup(src_paths[i]);
+			if (!udl->udl_base_path) {
+				closedir_nomap_nolog(d);
+				goto error_out;
+			}
+		}
+
+		while ((de = readdir_nomap_nolog(d)) != NULL) {
+			if (num_entries >= max_entries) {
+				union_dir_entry_t *new_entries;
+
+				max_entries = max_entries ? 2 * max_entries : 64;
+				new_entries = realloc(entries,
+					max_entries * sizeof(union_dir_entry_t));
+				if (!new_entries) {
+					closedir_nomap_nolog(d);
+					goto error_out;
+				}
+				entries = new_entries;
+			}
+			entries[num_entries].ude_name = strdup(de->d_name);
+			if (!entries[num_entries].ude_name) {
+				closedir_nomap_nolog(d);
+				goto error_out;
+			}
+			entries[num_entries].ude_ino = de->d_ino;
+			entries[num_entries].ude_type = de->d_type;
+			entries[num_entries].ude_src_idx = i;
+			num_entries++;
+		}
+		closedir_nomap_nolog(d);
+	}
+	if (!udl->udl_base_path) goto error_out;
+
+	/* sort by name, and drop duplicates: the entry from
+	 * the first source directory is kept. */
+	if (num_entries > 0)
+		qsort(entries, num_entries, sizeof(union_dir_entry_t),
+			union_dir_cmp_entries);
+	for (i = 0, n = 0; i < num_entries; i++) {
+		if ((n > 0) && !strcmp(entries[n-1].ude_name,
+		    entries[i].ude_name)) {
+			free(entries[i].ude_name);
+			continue;
+		}
+		entries[n++] = entries[i];
+	}
+	udl->udl_entries = entries;
+	udl->udl_num_entries = n;
+
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"union_dir: %d entries from %d source directories, base=%s",
+		n, num_src_dirs, udl->udl_base_path);
+	return(udl);
+
+    error_out:
+	for (i = 0; i < num_entries; i++)
+		free(entries[i].ude_name);
+	free(entries);
+	union_dir_free_listing(udl);
+	return(NULL);
+}
+
+/* Returns the listing of "src_paths": the cached one, if the source
+ * directories have not changed, otherwise a new one. The reference
+ * count is incremented. Returns NULL if none of the source
+ * directories can be read. */
+static union_dir_listing_t *union_dir_get_listing(
+	const char **src_paths, int num_src_dirs)
+{
+	union_dir_src_stat_t *stats;
+	union_dir_listing_t *udl;
+	union_dir_listing_t *new_udl;
+	union_dir_listing_t **udlp;
+	int	n;
+
+	stats = calloc(num_src_dirs, sizeof(union_dir_src_stat_t));
+	if (!stats) return(NULL);
+	union_dir_stat_src_dirs(src_paths, num_src_dirs, stats);
+
+	/* use the cached listing, if the source dirs have not changed */
+	union_dir_mutex_lock();
+	for (udlp = &union_dir_cache; (udl = *udlp) != NULL;
+	     udlp = &udl->udl_next) {
+		if (union_dir_listing_matches(udl, src_paths, num_src_dirs)) {
+			if (!memcmp(udl->udl_src_stats, stats,
+			    num_src_dirs * sizeof(union_dir_src_stat_t))) {
+				/* move to front */
+				*udlp = udl->udl_next;
+				udl->udl_next = union_dir_cache;
+				union_dir_cache = udl;
+				udl->udl_refcount++;
+				union_dir_mutex_unlock();
+				free(stats);
+				return(udl);
+			}
+			break;
+		}
+	}
+	union_dir_mutex_unlock();
+
+	new_udl = union_dir_build_listing(src_paths, num_src_dirs, stats);
+	free(stats);
+	if (!new_udl) return(NULL);
+
+	union_dir_mutex_lock();
+	/* replace the old listing, and drop the least
+	 * recently used one if the cache is full. */
+	new_udl->udl_cached = 1;
+	new_udl->udl_refcount++;
+	new_udl->udl_next = union_dir_cache;
+	union_dir_cache = new_udl;
+	for (n = 1, udlp = &new_udl->udl_next; (udl = *udlp) != NULL; ) {
+		if ((n >= UNION_DIR_CACHE_SIZE) ||
+		    union_dir_listing_matches(udl, src_paths, num_src_dirs)) {
+			*udlp = udl->udl_next;
+			udl->udl_cached = 0;
+			if (udl->udl_refcount <= 0)
+				union_dir_free_listing(udl);
+			continue;
+		}
+		n++;
+		udlp = &udl->udl_next;
+	}
+	union_dir_mutex_unlock();
+	return(new_udl);
+}
+
+/* Returns the listing of the union directory "res" (see
+ * union_dir_get_listing()), or NULL if "res" is not an union
+ * directory. */
+static union_dir_listing_t *union_dir_find_listing(
+	const mapping_results_t *res)
+{
+	union_dir_listing_t *udl;
+	const char	**src_paths;
+	int	num_src_dirs;
+	int	i;
+
+	if (!res->mres_union_dir || !res->mres_union_dir_src_list)
+		return(NULL);
+	num_src_dirs = ruletree_objectlist_get_list_size(
+		res->mres_union_dir_src_list);
+	if (num_src_dirs < 1) return(NULL);
+
+	src_paths = calloc(num_src_dirs, sizeof(char *));
+	if (!src_paths) return(NULL);
+	for (i = 0; i < num_src_dirs; i++) {
+		src_paths[i] = offset_to_ruletree_string_ptr(
+			ruletree_objectlist_get_item(
+				res->mres_union_dir_src_list, i), NULL);
+		if (!src_paths[i]) {
+			free(src_paths);
+			return(NULL);
+		}
+	}
+	udl = union_dir_get_listing(src_paths, num_src_dirs);
+	free(src_paths);
+	return(udl);
+}
+
+/* Called by the path mapping engine.
+ * Returns the host path where "dst_path" should be mapped
+ * (an allocated string), or NULL if none of the source
+ * directories exists.
+*/
 char *prep_union_dir(const char *dst_path, const char **src_paths, int num_real_dir_entries)
 {
-	DIR *d = NULL;
-	struct dirent *de;
-	int count = 0;
-	int i;
-	char *udir_name;
-	char *cp;
-	int slash_count = 0;
-	char *mod_dst_path = NULL;
-	char *result_path;
+	union_dir_listing_t *udl;
+	char	*result_path;
 
-	if (num_real_dir_entries < 1) goto error_out;
+	if (num_real_dir_entries < 1) return(NULL);
 
 	LB_LOG(LB_LOGLEVEL_DEBUG,
 		"prep_union_dir: dst=%s #%d source directories",
 		dst_path, num_real_dir_entries);
 
-	/* add number of slashes to the path. this makes it possible
-	 * to have union directories that have other union directories
-	 * as subdirectories (because the names in the directories
-	 * always refer to ordinary, empty files).
-	*/
-	mod_dst_path = strdup(dst_path);
-	cp = mod_dst_path;
-	while(*cp) {
-		if (*cp == '/') slash_count++;
-		cp++;
-	}
-	if (asprintf(&udir_name, "%s/uniondirs/%d", ldbox_session_dir, slash_count) < 0)
-		goto asprint_failed_error_out;
-	LB_LOG(LB_LOGLEVEL_DEBUG, "prep_union_dir: mkdir(%s)", udir_name);
-	mkdir_nomap_nolog(udir_name, 0700);
-	free(udir_name);
-	
-	/* this is same as mkdir -p, effectively */
-	cp = mod_dst_path;
-	while(*cp == '/') *cp++ = '@'; /* replace leading slashes */
-	do {
-		if(cp && *cp) {
-			cp = strchr(cp, '/');
-			if (cp) *cp = '\0'; /* temporarily terminate the string here */
-		}
-		if (asprintf(&udir_name, "%s/uniondirs/%d/%s",
-			 ldbox_session_dir, slash_count, mod_dst_path) < 0)
-				goto asprint_failed_error_out;
+	udl = union_dir_get_listing(src_paths, num_real_dir_entries);
+	if (!udl) {
 		LB_LOG(LB_LOGLEVEL_DEBUG,
-			"prep_union_dir: mkdir(%s)", udir_name);
-		mkdir_nomap_nolog(udir_name, 0700);
-		free(udir_name);
-		if (cp) *cp++ = '/'; /* restore the slash, if there is more */
-	} while(cp);
+			"prep_union_dir: no source directories for %s", dst_path);
+		return(NULL);
+	}
+	result_path = strdup(udl->udl_base_path);
 
-	for (i = 0; i < num_real_dir_entries; i++) {
-		const char *src_path = src_paths[i];
+	union_dir_mutex_lock();
+	union_dir_unref_listing(udl);
+	union_dir_mutex_unlock();
 
-		LB_LOG(LB_LOGLEVEL_DEBUG,
-			"prep_union_dir: src dir '%s'", src_path);
+	LB_LOG(LB_LOGLEVEL_DEBUG, "prep_union_dir: base=%s", result_path);
+	return(result_path);
+}
 
-		if ( (d = opendir_nomap_nolog(src_path)) == NULL )
-			continue;
+/* ------------ Open union directories ------------ */
 
-		LB_LOG(LB_LOGLEVEL_DEBUG,
-			"prep_union_dir: opened src dir '%s'", src_path);
+/* must be called while the mutex is locked */
+static union_dir_fd_t **union_dir_find_fd(int fd)
+{
+	union_dir_fd_t **udfp;
+
+	for (udfp = &union_dir_fds; *udfp; udfp = &(*udfp)->udf_next) {
+		if ((*udfp)->udf_fd == fd) return(udfp);
+	}
+	return(NULL);
+}
+
+/* must be called while the mutex is locked */
+static void union_dir_add_fd(int fd, union_dir_stream_t *uds)
+{
+	union_dir_fd_t *udf = malloc(sizeof(*udf));
+
+	if (!udf) return;
+	udf->udf_fd = fd;
+	udf->udf_stream = uds;
+	uds->uds_refcount++;
+	udf->udf_next = union_dir_fds;
+	union_dir_fds = udf;
+	union_dir_num_fds++;
+}
+
+/* must be called while the mutex is locked */
+static void union_dir_remove_fd(int fd)
+{
+	union_dir_fd_t **udfp = union_dir_find_fd(fd);
+	union_dir_fd_t *udf;
+
+	if (!udfp) return;
+	udf = *udfp;
+	*udfp = udf->udf_next;
+	union_dir_num_fds--;
+	if (--udf->udf_stream->uds_refcount <= 0) {
+		union_dir_unref_listing(udf->udf_stream->uds_listing);
+		free(udf->udf_stream);
+	}
+	free(udf);
+}
+
+/* must be called while the mutex is locked */
+static union_dir_stream_t *union_dir_find_stream(int fd)
+{
+	union_dir_fd_t **udfp = union_dir_find_fd(fd);
+
+	return(udfp ? (*udfp)->udf_stream : NULL);
+}
+
+/* Called by fdpathdb.c when "fd" has been opened via an union directory */
+void union_dir_register_fd(int fd, const mapping_results_t *res)
+{
+	union_dir_listing_t *udl;
+	union_dir_stream_t *uds;
+
+	if (fd < 0) return;
 
-		while ( (de = readdir(d)) != NULL) { /* get one dirent at a time */
-			int fd;
-			char *tmp_name;
+	udl = union_dir_find_listing(res);
+	uds = calloc(1, sizeof(*uds));
+
+	union_dir_mutex_lock();
+	union_dir_remove_fd(fd);
+	if (udl && uds) {
+		uds->uds_listing = udl;
+		union_dir_add_fd(fd, uds);
+	} else {
+		if (udl) union_dir_unref_listing(udl);
+		free(uds);
+	}
+	union_dir_mutex_unlock();
+
+	LB_LOG(LB_LOGLEVEL_DEBUG, "union_dir: fd %d => %s%s",
+		fd, res->mres_result_buf, (udl ? "" : " (no listing)"));
+}
+
+/* Make "new_fd" share the union directory stream of "fd", if any */
+void union_dir_dup_fd(int fd, int new_fd)
+{
+	union_dir_stream_t *uds;
+
+	if (!union_dir_num_fds) return;
+
+	union_dir_mutex_lock();
+	union_dir_remove_fd(new_fd);
+	uds = union_dir_find_stream(fd);
+	if (uds) union_dir_add_fd(new_fd, uds);
+	union_dir_mutex_unlock();
+}
 
-			if (de->d_name[0] == '.') {
-				if (de->d_name[1] == '\0') continue;
-				if ((de->d_name[1] == '.') &&
-				    (de->d_name[2] == '\0')) continue;
+/* Called by fdpathdb.c when "fd" is closed or reused */
+void union_dir_forget_fd(int fd)
+{
+	if (!union_dir_num_fds) return;
+
+	union_dir_mutex_lock();
+	union_dir_remove_fd(fd);
+	union_dir_mutex_unlock();
+}
+
+/* ------------ Gates ------------ */
+
+/* Returns the next entry of an union directory, or NULL at the end.
+ * must be called while the mutex is locked */
+static const union_dir_entry_t *union_dir_next_entry(
+	union_dir_stream_t *uds)
+{
+	if (uds->uds_pos >= uds->uds_listing->udl_num_entries) return(NULL);
+	return(&uds->uds_listing->udl_entries[uds->uds_pos++]);
+}
+
+static void union_dir_fill_dirent(struct dirent *de,
+	const union_dir_entry_t *ep, long pos)
+{
+	de->d_ino = ep->ude_ino;
+	de->d_off = pos;
+	de->d_reclen = sizeof(struct dirent);
+	de->d_type = ep->ude_type;
+	snprintf(de->d_name, sizeof(de->d_name), "%s", ep->ude_name);
+}
+
+#ifdef HAVE_READDIR64
+static void union_dir_fill_dirent64(struct dirent64 *de,
+	const union_dir_entry_t *ep, long pos)
+{
+	de->d_ino = ep->ude_ino;
+	de->d_off = pos;
+	de->d_reclen = sizeof(struct dirent64);
+	de->d_type = ep->ude_type;
+	snprintf(de->d_name, sizeof(de->d_name), "%s", ep->ude_name);
+}
+#endif
+
+struct dirent *readdir_gate(int *result_errno_ptr,
+	struct dirent *(*real_readdir_ptr)(DIR *dirp),
+	const char *realfnname, DIR *dirp)
+{
+	struct dirent *ret;
+	union_dir_stream_t *uds;
+
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds) {
+			const union_dir_entry_t *ep = union_dir_next_entry(uds);
+
+			ret = NULL;
+			if (ep) {
+				union_dir_fill_dirent(&uds->uds_dirent,
+					ep, uds->uds_pos);
+				ret = &uds->uds_dirent;
 			}
-			if (asprintf(&tmp_name, "%s/uniondirs/%d/%s/%s",
-				ldbox_session_dir, slash_count,
-				mod_dst_path, de->d_name) < 0) {
-					closedir(d);
-					goto asprint_failed_error_out;
-				}
-			LB_LOG(LB_LOGLEVEL_DEBUG,
-				"prep_union_dir: tmp=%s", tmp_name);
+			union_dir_mutex_unlock();
+			return(ret);
+		}
+		union_dir_mutex_unlock();
+	}
+	(void)realfnname;
+	ret = (*real_readdir_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
 
-			fd = creat_nomap(tmp_name, 0644);
-			LB_LOG(LB_LOGLEVEL_DEBUG,
-				"prep_union_dir: fd=%d", fd);
-			close(fd);
+#ifdef HAVE_READDIR64
+struct dirent64 *readdir64_gate(int *result_errno_ptr,
+	struct dirent64 *(*real_readdir64_ptr)(DIR *dirp),
+	const char *realfnname, DIR *dirp)
+{
+	struct dirent64 *ret;
+	union_dir_stream_t *uds;
 
-			free(tmp_name);
-			count++;
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds) {
+			const union_dir_entry_t *ep = union_dir_next_entry(uds);
+
+			ret = NULL;
+			if (ep) {
+				union_dir_fill_dirent64(&uds->uds_dirent64,
+					ep, uds->uds_pos);
+				ret = &uds->uds_dirent64;
+			}
+			union_dir_mutex_unlock();
+			return(ret);
 		}
-		closedir(d);
+		union_dir_mutex_unlock();
 	}
-	if (!count) goto error_out;
+	(void)realfnname;
+	ret = (*real_readdir64_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+#endif
+
+int readdir_r_gate(int *result_errno_ptr,
+	int (*real_readdir_r_ptr)(DIR *dirp, struct dirent *entry,
+		struct dirent **result),
+	const char *realfnname, DIR *dirp, struct dirent *entry,
+	struct dirent **result)
+{
+	int	ret;
+	union_dir_stream_t *uds;
 
-	if (asprintf(&result_path, "%s/uniondirs/%d/%s",
-		ldbox_session_dir, slash_count, mod_dst_path) < 0)
-			goto asprint_failed_error_out;
-	free(mod_dst_path);
-	return result_path;
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds) {
+			const union_dir_entry_t *ep = union_dir_next_entry(uds);
 
-    asprint_failed_error_out:
-	LB_LOG(LB_LOGLEVEL_ERROR, "asprintf failed to allocate memory");
-    error_out:
-	if(mod_dst_path) free(mod_dst_path);
-	return NULL;
+			*result = NULL;
+			if (ep) {
+				union_dir_fill_dirent(entry, ep, uds->uds_pos);
+				*result = entry;
+			}
+			union_dir_mutex_unlock();
+			return(0);
+		}
+		union_dir_mutex_unlock();
+	}
+	(void)realfnname;
+	ret = (*real_readdir_r_ptr)(dirp, entry, result);
+	*result_errno_ptr = errno;
+	return(ret);
 }
 
+#ifdef HAVE_READDIR64_R
+int readdir64_r_gate(int *result_errno_ptr,
+	int (*real_readdir64_r_ptr)(DIR *dirp, struct dirent64 *entry,
+		struct dirent64 **result),
+	const char *realfnname, DIR *dirp, struct dirent64 *entry,
+	struct dirent64 **result)
+{
+	int	ret;
+	union_dir_stream_t *uds;
+
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds) {
+			const union_dir_entry_t *ep = union_dir_next_entry(uds);
+
+			*result = NULL;
+			if (ep) {
+				union_dir_fill_dirent64(entry, ep, uds->uds_pos);
+				*result = entry;
+			}
+			union_dir_mutex_unlock();
+			return(0);
+		}
+		union_dir_mutex_unlock();
+	}
+	(void)realfnname;
+	ret = (*real_readdir64_r_ptr)(dirp, entry, result);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+#endif
+
+#ifdef HAVE_GETDENTS64
+/* Fills "buffer" with as many entries as fits. */
+ssize_t getdents64_gate(int *result_errno_ptr,
+	ssize_t (*real_getdents64_ptr)(int fd, void *buffer, size_t length),
+	const char *realfnname, int fd, void *buffer, size_t length)
+{
+	ssize_t	ret;
+	union_dir_stream_t *uds;
+
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(fd);
+		if (uds) {
+			size_t	used = 0;
+
+			while (uds->uds_pos < uds->uds_listing->udl_num_entries) {
+				const union_dir_entry_t *ep =
+					&uds->uds_listing->udl_entries[uds->uds_pos];
+				size_t	namelen = strlen(ep->ude_name);
+				size_t	reclen = (offsetof(struct dirent64, d_name) +
+					namelen + 1 + 7) & ~(size_t)7;
+				struct dirent64 *de;
+
+				if (used + reclen > length) break;
+				de = (struct dirent64 *)((char *)buffer + used);
+				de->d_ino = ep->ude_ino;
+				de->d_off = uds->uds_pos + 1;
+				de->d_reclen = reclen;
+				de->d_type = ep->ude_type;
+				memcpy(de->d_name, ep->ude_name, namelen + 1);
+				used += reclen;
+				uds->uds_pos++;
+			}
+			ret = used;
+			if ((used == 0) &&
+			    (uds->uds_pos < uds->uds_listing->udl_num_entries)) {
+				/* result buffer is too small */
+				*result_errno_ptr = EINVAL;
+				ret = -1;
+			}
+			union_dir_mutex_unlock();
+			return(ret);
+		}
+		union_dir_mutex_unlock();
+	}
+	(void)realfnname;
+	ret = (*real_getdents64_ptr)(fd, buffer, length);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+#endif
+
+void rewinddir_gate(int *result_errno_ptr,
+	void (*real_rewinddir_ptr)(DIR *dirp),
+	const char *realfnname, DIR *dirp)
+{
+	union_dir_stream_t *uds = NULL;
+
+	(void)result_errno_ptr;
+	(void)realfnname;
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds) uds->uds_pos = 0;
+		union_dir_mutex_unlock();
+	}
+	if (!uds) (*real_rewinddir_ptr)(dirp);
+}
+
+/* Positions of union directories are indexes to the listing */
+void seekdir_gate(int *result_errno_ptr,
+	void (*real_seekdir_ptr)(DIR *dirp, long loc),
+	const char *realfnname, DIR *dirp, long loc)
+{
+	union_dir_stream_t *uds = NULL;
+
+	(void)result_errno_ptr;
+	(void)realfnname;
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds && (loc >= 0)) uds->uds_pos = loc;
+		union_dir_mutex_unlock();
+	}
+	if (!uds) (*real_seekdir_ptr)(dirp, loc);
+}
+
+long telldir_gate(int *result_errno_ptr,
+	long (*real_telldir_ptr)(DIR *dirp),
+	const char *realfnname, DIR *dirp)
+{
+	long	ret;
+	union_dir_stream_t *uds;
+
+	(void)realfnname;
+	if (union_dir_num_fds) {
+		union_dir_mutex_lock();
+		uds = union_dir_find_stream(dirfd(dirp));
+		if (uds) {
+			ret = uds->uds_pos;
+			union_dir_mutex_unlock();
+			return(ret);
+		}
+		union_dir_mutex_unlock();
+	}
+	ret = (*real_telldir_ptr)(dirp);
+	*result_errno_ptr = errno;
+	return(ret);
+}
+
+#ifdef HAVE_LINUX_SCANDIR
+/* scandir() reads the directory inside the C library, so it
+ * can not use the readdir gate: use the listing directly. */
+int scandir_gate(int *result_errno_ptr,
+	int (*real_scandir_ptr)(const char *dir, struct dirent ***namelist,
+		int(*filter)(const struct dirent *),
+		int(*compar)(scandir_arg_t *, scandir_arg_t *)),
+	const char *realfnname,
+	const mapping_results_t *mapped_dir,
+	struct dirent ***namelist,
+	int(*filter)(const struct dirent *),
+	int(*compar)(scandir_arg_t *, scandir_arg_t *))
+{
+	union_dir_listing_t *udl;
+	struct dirent **list = NULL;
+	int	num = 0;
+	int	i;
+	int	ret;
+
+	(void)realfnname;
+	udl = union_dir_find_listing(mapped_dir);
+	if (!udl) {
+		ret = (*real_scandir_ptr)(mapped_dir->mres_result_path,
+			namelist, filter, compar);
+		*result_errno_ptr = errno;
+		return(ret);
+	}
+
+	/* the filter is called without holding the mutex;
+	 * the reference keeps the listing alive. */
+	if (udl->udl_num_entries > 0) {
+		list = malloc(udl->udl_num_entries * sizeof(struct dirent *));
+		if (!list) goto nomem;
+	}
+	for (i = 0; i < udl->udl_num_entries; i++) {
+		struct dirent	*de = malloc(sizeof(struct dirent));
+
+		if (!de) goto nomem;
+		union_dir_fill_dirent(de, &udl->udl_entries[i], i + 1);
+		if (filter && !(*filter)(de)) {
+			free(de);
+			continue;
+		}
+		list[num++] = de;
+	}
+	if (compar && (num > 1))
+		qsort(list, num, sizeof(struct dirent *),
+			(int (*)(const void *, const void *))compar);
+
+	union_dir_mutex_lock();
+	union_dir_unref_listing(udl);
+	union_dir_mutex_unlock();
+	*namelist = list;
+	return(num);
+
+    nomem:
+	for (i = 0; i < num; i++) free(list[i]);
+	free(list);
+	union_dir_mutex_lock();
+	union_dir_unref_listing(udl);
+	union_dir_mutex_unlock();
+	*result_errno_ptr = ENOMEM;
+	return(-1);
+}
+#endif
+
+#ifdef HAVE_SCANDIR64
+int scandir64_gate(int *result_errno_ptr,
+	int (*real_scandir64_ptr)(const char *dir, struct dirent64 ***namelist,
+		int(*filter)(const struct dirent64 *),
+		int(*compar)(scandir64_arg_t *, scandir64_arg_t *)),
+	const char *realfnname,
+	const mapping_results_t *mapped_dir,
+	struct dirent64 ***namelist,
+	int(*filter)(const struct dirent64 *),
+	int(*compar)(scandir64_arg_t *, scandir64_arg_t *))
+{
+	union_dir_listing_t *udl;
+	struct dirent64 **list = NULL;
+	int	num = 0;
+	int	i;
+	int	ret;
+
+	(void)realfnname;
+	udl = union_dir_find_listing(mapped_dir);
+	if (!udl) {
+		ret = (*real_scandir64_ptr)(mapped_dir->mres_result_path,
+			namelist, filter, compar);
+		*result_errno_ptr = errno;
+		return(ret);
+	}
+
+	if (udl->udl_num_entries > 0) {
+		list = malloc(udl->udl_num_entries * sizeof(struct dirent64 *));
+		if (!list) goto nomem;
+	}
+	for (i = 0; i < udl->udl_num_entries; i++) {
+		struct dirent64	*de = malloc(sizeof(struct dirent64));
+
+		if (!de) goto nomem;
+		union_dir_fill_dirent64(de, &udl->udl_entries[i], i + 1);
+		if (filter && !(*filter)(de)) {
+			free(de);
+			continue;
+		}
+		list[num++] = de;
+	}
+	if (compar && (num > 1))
+		qsort(list, num, sizeof(struct dirent64 *),
+			(int (*)(const void *, const void *))compar);
+
+	union_dir_mutex_lock();
+	union_dir_unref_listing(udl);
+	union_dir_mutex_unlock();
+	*namelist = list;
+	return(num);
+
+    nomem:
+	for (i = 0; i < num; i++) free(list[i]);
+	free(list);
+	union_dir_mutex_lock();
+	union_dir_unref_listing(udl);
+	union_dir_mutex_unlock();
+	*result_errno_ptr = ENOMEM;
+	return(-1);
+}
+#endif
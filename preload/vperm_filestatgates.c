@@ -238,7 +238,8 @@ int __fxstatat64_gate(int *result_errno_ptr,
 
 /* ======================= chown() variants ======================= */
 
-static void vperm_chown(
+/* Returns -1 if the change could not be sent to lbrdbd. */
+static int vperm_chown(
         const char *realfnname,
 	struct stat *statbuf,
 	uid_t owner,
@@ -248,6 +249,7 @@ static void vperm_chown(
 	int set_gid = 0;
 	int release_uid = 0;
 	int release_gid = 0;
+	int res = 0;
 
 	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: real fn=>EPERM, virtualize "
 		" (uid=%d, gid=%d)",
@@ -262,15 +264,16 @@ static void vperm_chown(
 	}
 
 	if (set_uid || set_gid) {
-		ruletree_rpc__vperm_set_ids((uint64_t)statbuf->st_dev,
-			(uint64_t)statbuf->st_ino, set_uid, owner, set_gid, group);
+		if (ruletree_rpc__vperm_set_ids((uint64_t)statbuf->st_dev,
+			(uint64_t)statbuf->st_ino, set_uid, owner, set_gid, group) < 0)
+			res = -1;
 	}
 	if (release_uid || release_gid) {
-		ruletree_rpc__vperm_release_ids((uint64_t)statbuf->st_dev,
-			(uint64_t)statbuf->st_ino, release_uid, release_gid);
+		if (ruletree_rpc__vperm_release_ids((uint64_t)statbuf->st_dev,
+			(uint64_t)statbuf->st_ino, release_uid, release_gid) < 0)
+			res = -1;
 	}
-	
-	/* Assume success. FIXME; check the result. */
+	return(res);
 }
 
 int fchownat_gate(int *result_errno_ptr,
@@ -303,8 +306,8 @@ int fchownat_gate(int *result_errno_ptr,
 
 		if (e == EPERM) {
 			if (get_stat_for_fxxat(realfnname, dirfd, mapped_filename, flags, &statbuf) == 0) {
-				vperm_chown(realfnname, &statbuf, owner, group);
-				res = 0;
+				res = vperm_chown(realfnname, &statbuf, owner, group);
+				if (res < 0) *result_errno_ptr = EPERM;
 			} else {
 				/* This should never happen */
 				*result_errno_ptr = EPERM;
@@ -346,8 +349,8 @@ int chown_gate(int *result_errno_ptr,
 
 		if (e == EPERM) {
 			res = real_stat(mapped_filename->mres_result_path, &statbuf);
-			if (res == 0) vperm_chown(realfnname, &statbuf, owner, group);
-			else {
+			if (res == 0) res = vperm_chown(realfnname, &statbuf, owner, group);
+			if (res < 0) {
 				*result_errno_ptr = EPERM;
 				res = -1;
 			}
@@ -387,8 +390,8 @@ int lchown_gate(int *result_errno_ptr,
 
 		if (e == EPERM) {
 			res = real_lstat(mapped_filename->mres_result_path, &statbuf);
-			if (res == 0) vperm_chown(realfnname, &statbuf, owner, group);
-			else {
+			if (res == 0) res = vperm_chown(realfnname, &statbuf, owner, group);
+			if (res < 0) {
 				res = -1;
 				*result_errno_ptr = EPERM;
 			}
@@ -428,8 +431,8 @@ int fchown_gate(int *result_errno_ptr,
 
 		if (e == EPERM) {
 			res = real_fstat(fd, &statbuf);
-			if (res == 0) vperm_chown(realfnname, &statbuf, owner, group);
-			else {
+			if (res == 0) res = vperm_chown(realfnname, &statbuf, owner, group);
+			if (res < 0) {
 				res = -1;
 				*result_errno_ptr = EPERM;
 			}
@@ -443,8 +446,9 @@ int fchown_gate(int *result_errno_ptr,
 
 /* ======================= chmod() variants ======================= */
 
-/* set/release st_mode virtualization */
-static void vperm_chmod(
+/* set/release st_mode virtualization. Returns -1 if the change
+ * could not be sent to lbrdbd. */
+static int vperm_chmod(
         const char *realfnname,
 	struct stat *statbuf,
 	mode_t virt_mode,
@@ -457,14 +461,12 @@ static void vperm_chmod(
 	if (((statbuf->st_mode & ~(S_IFMT | S_ISUID | S_ISGID)) !=
 		    (virt_mode & ~(S_IFMT | S_ISUID | S_ISGID))) ||
 	    ((statbuf->st_mode & (S_ISUID | S_ISGID)) != suid_sgid_bits))
-		ruletree_rpc__vperm_set_mode((uint64_t)statbuf->st_dev,
+		return(ruletree_rpc__vperm_set_mode((uint64_t)statbuf->st_dev,
 			(uint64_t)statbuf->st_ino, statbuf->st_mode,
 			virt_mode & ~(S_IFMT | S_ISUID | S_ISGID),
-			suid_sgid_bits & (S_ISUID | S_ISGID));
-	else
-		ruletree_rpc__vperm_release_mode((uint64_t)statbuf->st_dev,
-			(uint64_t)statbuf->st_ino);
-	/* Assume success. FIXME; check the result. */
+			suid_sgid_bits & (S_ISUID | S_ISGID)));
+	return(ruletree_rpc__vperm_release_mode((uint64_t)statbuf->st_dev,
+		(uint64_t)statbuf->st_ino));
 }
 
 static int vperm_chmod_if_simulated_device(
@@ -599,8 +601,10 @@ static int vperm_chmod_done_update_state(
 		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: set vperms", __func__);
 
 		if (vperm_stat_for_chmod(realfnname, fd, mapped_filename, flags, &statbuf) == 0) {
-			vperm_chmod(realfnname, &statbuf, mode, suid_sgid_bits);
-			res = 0;
+			if (vperm_chmod(realfnname, &statbuf, mode, suid_sgid_bits) == 0)
+				res = 0;
+			/* else the simulated mode was lost; keep the
+			 * result of the real function */
 		} else { /* real fn didn't work, and can't stat */
 			res = -1;
 		}
@@ -775,10 +779,10 @@ static int vperm_mknod(
 
 	res = real_fstat(dummy_dev_fd, &statbuf);
 	close_nomap_nolog(dummy_dev_fd);
-	if (res == 0) {
-		ruletree_rpc__vperm_set_dev_node((uint64_t)statbuf.st_dev,
+	if (res == 0)
+		res = ruletree_rpc__vperm_set_dev_node((uint64_t)statbuf.st_dev,
 			(uint64_t)statbuf.st_ino, mode, (uint64_t)dev);
-	} else {
+	if (res < 0) {
 		*result_errno_ptr = EPERM;
 		res = -1;
 	}
@@ -1730,6 +1734,12 @@ FTSENT *fts_read_gate(int *result_errno_ptr,
 {
 	FTSENT *res;
 
+	if (union_dir_fts_is_own(ftsp)) {
+		/* the walker stats the entries via the gates */
+		res = union_dir_fts_read(ftsp);
+		if (!res) *result_errno_ptr = errno;
+		return(res);
+	}
 	res = (*real_fts_read_ptr)(ftsp);
 	if (res && (res->fts_statp)) {
 		i_virtualize_struct_stat(realfnname, res->fts_statp, NULL);
@@ -1747,6 +1757,11 @@ FTSENT *fts_children_gate(int *result_errno_ptr,
 {
 	FTSENT *res;
 
+	if (union_dir_fts_is_own(ftsp)) {
+		res = union_dir_fts_children(ftsp, options);
+		if (!res) *result_errno_ptr = errno;
+		return(res);
+	}
 	res = (*real_fts_children_ptr)(ftsp, options);
 
 	/* FIXME: check the "options" condition from glibc */
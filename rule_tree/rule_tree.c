@@ -39,15 +39,29 @@
 #include "exported.h"
 
 #include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "rule_tree.h"
 
+/* The rule tree file grows when objects are added to it, up to
+ * rtree_max_size bytes. Address space for rtree_max_size bytes is
+ * reserved (PROT_NONE) when the tree is attached, but only the used
+ * part of the file and one segment of headroom is mapped. When the
+ * file has grown beyond the mapped area, the next segments are mapped
+ * inside the reservation with MAP_FIXED, so pointers to the rule tree
+ * remain valid.
+*/
+#define RULETREE_SEGMENT_SIZE	(1024*1024)
+
 static struct ruletree_cxt_s {
 	char		*rtree_ruletree_path;
 	int		rtree_ruletree_fd;
 	void		*rtree_ruletree_ptr;
 	ruletree_hdr_t	*rtree_ruletree_hdr_p;
-} ruletree_ctx = { NULL, -1, 0, NULL };
+	volatile size_t	rtree_mapped_size;
+	size_t		rtree_reserved_size;
+} ruletree_ctx = { NULL, -1, 0, NULL, 0, 0 };
 
 /* =================== Rule tree primitives. =================== */
 
@@ -57,12 +71,93 @@ size_t ruletree_get_file_size(void)
 	return(0);
 }
 
+uint32_t ruletree_get_generation(void)
+{
+	if (ruletree_ctx.rtree_ruletree_hdr_p) return (ruletree_ctx.rtree_ruletree_hdr_p->rtree_generation);
+	return(0);
+}
+
+static void ruletree_bump_generation(void)
+{
+	if (ruletree_ctx.rtree_ruletree_hdr_p)
+		ruletree_ctx.rtree_ruletree_hdr_p->rtree_generation++;
+}
+
+/* Size of the mapping that is needed for a file of "file_size" bytes */
+static size_t ruletree_mapping_size(uint32_t file_size, uint32_t max_size)
+{
+	size_t	size;
+	size_t	limit;
+
+	size = ((size_t)file_size + 2 * RULETREE_SEGMENT_SIZE - 1) &
+		~((size_t)RULETREE_SEGMENT_SIZE - 1);
+	limit = ((size_t)max_size + RULETREE_SEGMENT_SIZE - 1) &
+		~((size_t)RULETREE_SEGMENT_SIZE - 1);
+	if (limit && (size > limit)) size = limit;
+	return(size);
+}
+
+/* Extend the mapping to cover the whole file. No locks: Segments are
+ * always mapped to the same place in the reserved area, so if two
+ * threads do this at the same time, the later mmap() just replaces
+ * an identical mapping. The mapped size only grows.
+ * Returns 0 if the file is completely mapped. */
+static int ruletree_extend_mapping(void)
+{
+	int	retries;
+
+	for (retries = 0; retries < 100; retries++) {
+		size_t	old_size = ruletree_ctx.rtree_mapped_size;
+		size_t	new_size;
+		char	*wanted;
+		void	*p;
+		int	fd;
+
+		if (ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size <= old_size)
+			return(0);
+		new_size = ruletree_mapping_size(
+			ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size,
+			ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size);
+		if (new_size > ruletree_ctx.rtree_reserved_size)
+			new_size = ruletree_ctx.rtree_reserved_size;
+		if (new_size <= old_size) break;
+
+		/* clients close the file after attaching */
+		fd = ruletree_ctx.rtree_ruletree_fd;
+		if (fd < 0) {
+			if (!ruletree_ctx.rtree_ruletree_path) break;
+			fd = open_nomap_nolog(ruletree_ctx.rtree_ruletree_path,
+				O_CLOEXEC | O_RDWR);
+			if (fd < 0) break;
+		}
+		wanted = (char*)ruletree_ctx.rtree_ruletree_ptr + old_size;
+		p = mmap(wanted, new_size - old_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, old_size);
+		if (fd != ruletree_ctx.rtree_ruletree_fd) close_nomap_nolog(fd);
+		if (p == MAP_FAILED) break;
+
+		/* if this fails, another thread has published
+		 * a new size; check it again */
+		__sync_bool_compare_and_swap(&ruletree_ctx.rtree_mapped_size,
+			old_size, new_size);
+	}
+	LB_LOG(LB_LOGLEVEL_ERROR,
+		"Failed to extend the rule tree mapping (%u bytes mapped, file size %u)",
+		(unsigned)ruletree_ctx.rtree_mapped_size,
+		ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size);
+	return(-1);
+}
+
 /* return a pointer to the rule tree, without checking the contents */
 static void *offset_to_raw_ruletree_ptr(ruletree_object_offset_t offs)
 {
 	if (!ruletree_ctx.rtree_ruletree_ptr) return(NULL);
 	if (!ruletree_ctx.rtree_ruletree_hdr_p) return(NULL);
 	if (offs >= ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size) return(NULL);
+	if ((ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size >
+	     ruletree_ctx.rtree_mapped_size) &&
+	    (ruletree_extend_mapping() < 0) &&
+	    (offs >= ruletree_ctx.rtree_mapped_size)) return(NULL);
 
 	return(((char*)ruletree_ctx.rtree_ruletree_ptr) + offs);
 }
@@ -102,6 +197,15 @@ ruletree_object_offset_t append_struct_to_ruletree_file(void *ptr, size_t size,
 	
 	if (ruletree_ctx.rtree_ruletree_fd >= 0) {
 		location = lseek(ruletree_ctx.rtree_ruletree_fd, 0, SEEK_END); 
+		if (ruletree_ctx.rtree_ruletree_hdr_p &&
+		    ((uint64_t)location + size >
+		     ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size)) {
+			LB_LOG(LB_LOGLEVEL_ERROR,
+				"Rule tree is full (%u bytes), can't add %d bytes",
+				ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size,
+				(int)size);
+			return(0);
+		}
 		if (write(ruletree_ctx.rtree_ruletree_fd, ptr, size) < (int)size) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"Failed to append a struct (%d bytes) to the rule tree", size);
@@ -128,16 +232,36 @@ static int open_ruletree_file(int create_if_it_doesnt_exist)
 
 static int mmap_ruletree(ruletree_hdr_t *hdr)
 {
-	ruletree_ctx.rtree_ruletree_ptr = mmap(
-		(void*)(uintptr_t)(hdr->rtree_min_mmap_addr), hdr->rtree_max_size,
-		PROT_READ | PROT_WRITE, MAP_SHARED,
+	size_t	size = ruletree_mapping_size(hdr->rtree_file_size,
+			hdr->rtree_max_size);
+	size_t	reserved_size = size;
+	void	*base;
+	void	*p;
+
+	if (hdr->rtree_max_size)
+		reserved_size = ruletree_mapping_size(hdr->rtree_max_size,
+			hdr->rtree_max_size);
+
+	/* reserve the address space for all of rtree_max_size */
+	base = mmap((void*)(uintptr_t)(hdr->rtree_min_mmap_addr), reserved_size,
+		PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"Failed to reserve address space for the ruletree");
+		return(-1);
+	}
+	p = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
 		ruletree_ctx.rtree_ruletree_fd, 0);
 
-	if (!ruletree_ctx.rtree_ruletree_ptr) {
+	if (p == MAP_FAILED) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"Failed to mmap() ruletree");
+		munmap(base, reserved_size);
 		return(-1);
 	}
+	ruletree_ctx.rtree_ruletree_ptr = p;
+	ruletree_ctx.rtree_mapped_size = size;
+	ruletree_ctx.rtree_reserved_size = reserved_size;
 
 	/* use the force, otherwise offset_to_ruletree_object_ptr()
 	 * fails */
@@ -397,6 +521,7 @@ int ruletree_objectlist_set_item(
 
 	a = (ruletree_object_offset_t*)((char*)listhdr + sizeof(*listhdr));
 	a[n] = value;
+	ruletree_bump_generation();
 	return(1);
 }
 
@@ -431,14 +556,12 @@ uint32_t ruletree_objectlist_get_list_size(
 	return (listhdr->rtree_olist_size);
 }
 
-/* =================== binary trees =================== */
+/* =================== file/inode status simulation structures =================== */
 
-static ruletree_object_offset_t ruletree_create_bintree_entry(
-	uint64_t	key1,
-	uint64_t	key2,
-	ruletree_object_offset_t	value_offs)
+static ruletree_object_offset_t ruletree_create_inodestat(
+	inodesimu_t	*istat_struct)
 {
-	ruletree_bintree_t	new_entry;
+	ruletree_inodestat_t	new_entry;
 	ruletree_object_offset_t entry_location = 0;
 
 	if (!ruletree_ctx.rtree_ruletree_hdr_p) return (0);
@@ -446,202 +569,224 @@ static ruletree_object_offset_t ruletree_create_bintree_entry(
 
 	memset(&new_entry, 0, sizeof(new_entry));
 
-	new_entry.rtree_bt_key1 = key1;
-	new_entry.rtree_bt_key2 = key2;
-	new_entry.rtree_bt_value = value_offs;
+	new_entry.rtree_inode_simu = *istat_struct;
 
 	entry_location = append_struct_to_ruletree_file(&new_entry, sizeof(new_entry),
-		LB_RULETREE_OBJECT_TYPE_BINTREE);
-	LB_LOG(LB_LOGLEVEL_NOISE,
-		"ruletree_create_bintree_entry: @%d",
-		(int)entry_location);
+		LB_RULETREE_OBJECT_TYPE_INODESTAT);
 	return(entry_location);
 }
 
-static ruletree_object_offset_t ruletree_find_bintree_entry(
-	uint64_t	key1,
-	uint64_t	key2,
-	ruletree_object_offset_t	root_offs,
-	ruletree_object_offset_t	*last_visited_node,
-	int				*last_result)
+/* initial size of the inodestat hash table; must be a power of two */
+#define INODESTAT_INDEX_INITIAL_BUCKETS	1024
+
+/* Inode numbers are often allocated sequentially, and both keys
+ * have only a few significant bits. Mix all bits of both (this
+ * is the finalizer of MurmurHash3) */
+static uint32_t inodestat_hash(uint64_t dev, uint64_t ino)
 {
-	ruletree_object_offset_t	node_offs;
-	ruletree_object_offset_t	last_compared_node = 0;
-	ruletree_object_offset_t	last_direction = 0;
+	uint64_t	h = ino ^ (dev * 0x9E3779B97F4A7C15ULL);
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return((uint32_t)h);
+}
 
-	if (!ruletree_ctx.rtree_ruletree_hdr_p) return (0);
-	if (!root_offs) return(0);
+/* Create a table of "num_buckets" empty buckets */
+static ruletree_object_offset_t ruletree_create_inodestat_buckets(
+	uint32_t	num_buckets)
+{
+	ruletree_inodestat_buckets_t	*tbl;
+	size_t				size;
+	ruletree_object_offset_t	location;
 
-	LB_LOG(LB_LOGLEVEL_NOISE2,
-		"ruletree_find_bintree_entry: @%d : key1=0x%llX key2=%lld",
-		(int)root_offs, (long long)key1, (long long)key2);
+	if (!ruletree_ctx.rtree_ruletree_hdr_p) return (0);
+	if (ruletree_ctx.rtree_ruletree_fd < 0) return(0);
 
-	node_offs = root_offs;
+	size = sizeof(ruletree_inodestat_buckets_t) +
+		num_buckets * sizeof(ruletree_inodestat_bucket_t);
+	if ((uint64_t)ruletree_ctx.rtree_ruletree_hdr_p->rtree_file_size + size >
+	    ruletree_ctx.rtree_ruletree_hdr_p->rtree_max_size) return(0);
+	tbl = calloc(1, size);
+	if (!tbl) return(0);
+	tbl->rtree_isbs_num_buckets = num_buckets;
+	location = append_struct_to_ruletree_file(tbl, size,
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS);
+	free(tbl);
+	return(location);
+}
 
-	while(node_offs) {
-		ruletree_bintree_t	*bintrp;
+static ruletree_inodestat_bucket_t *inodestat_bucket_ptr(
+	ruletree_object_offset_t	table_offs,
+	uint32_t			hash)
+{
+	ruletree_inodestat_buckets_t	*tbl;
 
-		bintrp = offset_to_ruletree_object_ptr(node_offs,
-				LB_RULETREE_OBJECT_TYPE_BINTREE);
-		if (!bintrp) {
-			node_offs = 0;
-			break;
-		}
-		LB_LOG(LB_LOGLEVEL_NOISE3,
-			"ruletree_find_bintree_entry: check @%d",
-			node_offs);
-		
-		if ((bintrp->rtree_bt_key1 == key1) &&
-		    (bintrp->rtree_bt_key2 == key2)) {
-			LB_LOG(LB_LOGLEVEL_NOISE3,
-				"ruletree_find_bintree_entry: FOUND");
-			last_direction = 0;
-			return(node_offs);
-		}
-		last_compared_node = node_offs;
-		if ((key1 < bintrp->rtree_bt_key1) ||
-		    ((key1 == bintrp->rtree_bt_key1) &&
-		     (key2 <  bintrp->rtree_bt_key2))) {
-			LB_LOG(LB_LOGLEVEL_NOISE3,
-				"ruletree_find_bintree_entry: less");
-			last_direction = -1;
-			node_offs = bintrp->rtree_bt_link_less;
-		} else {
-			LB_LOG(LB_LOGLEVEL_NOISE3,
-				"ruletree_find_bintree_entry: more");
-			last_direction = +1;
-			node_offs = bintrp->rtree_bt_link_more;
-		}
-	}
-	LB_LOG(LB_LOGLEVEL_NOISE3,
-		"ruletree_find_bintree_entry: Not found.");
-	if(last_visited_node) *last_visited_node = last_compared_node;
-	if(last_result) *last_result = last_direction;
-	return(node_offs);
+	tbl = offset_to_ruletree_object_ptr(table_offs,
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS);
+	if (!tbl || !tbl->rtree_isbs_num_buckets) return(NULL);
+	return((ruletree_inodestat_bucket_t*)(tbl + 1) +
+		(hash & (tbl->rtree_isbs_num_buckets - 1)));
 }
 
-/* returns 0 or offset to new root. */
-static ruletree_object_offset_t ruletree_add_to_bintree_entry(
-	ruletree_object_offset_t value_node_offs,
-	uint64_t key1,
-	uint64_t key2,
-	ruletree_object_offset_t last_compared_node,
-	ruletree_object_offset_t last_direction)
+/* returns the inodestat object offset, or 0 if not found */
+static ruletree_object_offset_t inodestat_index_lookup(
+	ruletree_object_offset_t	table_offs,
+	uint64_t			dev,
+	uint64_t			ino)
 {
-	ruletree_bintree_t	*parent_bintrp;
-	ruletree_object_offset_t new_bintree_node_offs;
+	ruletree_inodestat_bucket_t	*bp;
 
-	LB_LOG(LB_LOGLEVEL_NOISE2,
-		"ruletree_add_to_bintree_entry: @%d",
-		(int)value_node_offs);
+	bp = inodestat_bucket_ptr(table_offs, inodestat_hash(dev, ino));
+	while (bp) {
+		int	i;
 
-	if (last_compared_node == 0) {
-		/* no root - add first node. */
-		LB_LOG(LB_LOGLEVEL_DEBUG,
-			"ruletree_add_to_bintree_entry: First node");
-		new_bintree_node_offs = ruletree_create_bintree_entry(
-			key1, key2, value_node_offs);
-		return(new_bintree_node_offs);
-	}
+		for (i = 0; i < RULETREE_INODESTAT_BUCKET_ENTRIES; i++) {
+			ruletree_object_offset_t value = bp->rtree_isb_value[i];
 
-	parent_bintrp = offset_to_ruletree_object_ptr(last_compared_node,
-				LB_RULETREE_OBJECT_TYPE_BINTREE);
-
-	if (!parent_bintrp) {
-		LB_LOG(LB_LOGLEVEL_DEBUG,
-			"ruletree_add_to_bintree_entry: invalid parent");
-		return(0);
+			if (!value) return(0); /* entries are never removed */
+			__sync_synchronize(); /* keys were written before value */
+			if ((bp->rtree_isb_ino[i] == ino) &&
+			    (bp->rtree_isb_dev[i] == dev))
+				return(value);
+		}
+		if (!bp->rtree_isb_overflow) break;
+		bp = inodestat_bucket_ptr(bp->rtree_isb_overflow, 0);
 	}
+	return(0);
+}
 
-	new_bintree_node_offs = ruletree_create_bintree_entry(
-		key1, key2, value_node_offs);
-	switch (last_direction) {
-	case -1:
-		if ((key1 < parent_bintrp->rtree_bt_key1) ||
-		    ((key1 == parent_bintrp->rtree_bt_key1) &&
-		     (key2 <  parent_bintrp->rtree_bt_key2))) {
-			LB_LOG(LB_LOGLEVEL_NOISE3,
-				"ruletree_add_to_bintree_entry: less");
-			if (parent_bintrp->rtree_bt_link_less) {
-				LB_LOG(LB_LOGLEVEL_DEBUG,
-					"ruletree_add_to_bintree_entry: less already exits!");
-			} else {
-				parent_bintrp->rtree_bt_link_less = new_bintree_node_offs;
-			}
-		} else {
-			LB_LOG(LB_LOGLEVEL_DEBUG,
-				"ruletree_add_to_bintree_entry: invalid direction (-1)");
-		}
-		break;
-	case 1:
-		if ((key1 < parent_bintrp->rtree_bt_key1) ||
-		    ((key1 == parent_bintrp->rtree_bt_key1) &&
-		     (key2 <  parent_bintrp->rtree_bt_key2))) {
-			LB_LOG(LB_LOGLEVEL_DEBUG,
-				"ruletree_add_to_bintree_entry: invalid direction (+1)");
-		} else {
-			LB_LOG(LB_LOGLEVEL_NOISE3,
-				"ruletree_add_to_bintree_entry: more");
-			if (parent_bintrp->rtree_bt_link_more) {
-				LB_LOG(LB_LOGLEVEL_DEBUG,
-					"ruletree_add_to_bintree_entry: more already exits!");
-			} else {
-				parent_bintrp->rtree_bt_link_more = new_bintree_node_offs;
+/* Add an entry to a table. For the writer only. The keys are written
+ * before the value, and a new overflow bucket is filled before it
+ * is linked, so that concurrent readers see consistent entries.
+ * returns 0 if OK */
+static int inodestat_index_insert(
+	ruletree_inodestat_index_t	*idx,
+	ruletree_object_offset_t	table_offs,
+	uint64_t			dev,
+	uint64_t			ino,
+	ruletree_object_offset_t	value)
+{
+	ruletree_inodestat_bucket_t	*bp;
+	ruletree_object_offset_t	overflow_offs;
+
+	bp = inodestat_bucket_ptr(table_offs, inodestat_hash(dev, ino));
+	while (bp) {
+		int	i;
+
+		for (i = 0; i < RULETREE_INODESTAT_BUCKET_ENTRIES; i++) {
+			if (!bp->rtree_isb_value[i]) {
+				bp->rtree_isb_ino[i] = ino;
+				bp->rtree_isb_dev[i] = dev;
+				__sync_synchronize();
+				bp->rtree_isb_value[i] = value;
+				return(0);
 			}
 		}
-		break;
-	default:
-		LB_LOG(LB_LOGLEVEL_DEBUG,
-			"ruletree_add_to_bintree_entry: invalid direction(%d)!",
-			last_direction);
-		break;
+		if (!bp->rtree_isb_overflow) break;
+		bp = inodestat_bucket_ptr(bp->rtree_isb_overflow, 0);
 	}
+	if (!bp) return(-1);
+
+	/* bucket chain is full, add an overflow bucket */
+	overflow_offs = ruletree_create_inodestat_buckets(1);
+	if (!overflow_offs) return(-1);
+	{
+		ruletree_inodestat_bucket_t *ovp =
+			inodestat_bucket_ptr(overflow_offs, 0);
+
+		if (!ovp) return(-1);
+		ovp->rtree_isb_ino[0] = ino;
+		ovp->rtree_isb_dev[0] = dev;
+		ovp->rtree_isb_value[0] = value;
+	}
+	__sync_synchronize();
+	bp->rtree_isb_overflow = overflow_offs;
+	if (idx) idx->rtree_isi_num_overflow_buckets++;
 	return(0);
 }
 
-/* =================== file/inode status simulation structures =================== */
+/* Copy all entries to a table which has twice as many buckets,
+ * and make that the current table. */
+static void inodestat_index_grow(ruletree_inodestat_index_t *idx)
+{
+	ruletree_inodestat_buckets_t	*old_tbl;
+	ruletree_object_offset_t	old_offs = idx->rtree_isi_buckets;
+	ruletree_object_offset_t	new_offs;
+	uint32_t			num_buckets;
+	uint32_t			b;
+
+	old_tbl = offset_to_ruletree_object_ptr(old_offs,
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS);
+	if (!old_tbl) return;
+	num_buckets = old_tbl->rtree_isbs_num_buckets;
+
+	new_offs = ruletree_create_inodestat_buckets(num_buckets * 2);
+	if (!new_offs) {
+		LB_LOG(LB_LOGLEVEL_WARNING,
+			"Failed to grow the inodestat index (%u buckets)",
+			num_buckets * 2);
+		return;
+	}
+	/* The new table is not visible to readers yet, and the old one
+	 * is not modified: Readers may use either one. */
+	idx->rtree_isi_num_overflow_buckets = 0;
+	for (b = 0; b < num_buckets; b++) {
+		ruletree_inodestat_bucket_t *bp = inodestat_bucket_ptr(old_offs, b);
+
+		while (bp) {
+			int	i;
+
+			for (i = 0; i < RULETREE_INODESTAT_BUCKET_ENTRIES; i++) {
+				if (!bp->rtree_isb_value[i]) break;
+				inodestat_index_insert(idx, new_offs,
+					bp->rtree_isb_dev[i],
+					bp->rtree_isb_ino[i],
+					bp->rtree_isb_value[i]);
+			}
+			if (!bp->rtree_isb_overflow) break;
+			bp = inodestat_bucket_ptr(bp->rtree_isb_overflow, 0);
+		}
+	}
+	__sync_synchronize();
+	idx->rtree_isi_buckets = new_offs;
+	idx->rtree_isi_num_resizes++;
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"inodestat index: %u entries, grown to %u buckets",
+		idx->rtree_isi_num_entries, num_buckets * 2);
+}
 
-static ruletree_object_offset_t ruletree_create_inodestat(
-	inodesimu_t	*istat_struct)
+/* Create the index (done when the first inodestat is added) */
+static ruletree_object_offset_t ruletree_create_inodestat_index(void)
 {
-	ruletree_inodestat_t	new_entry;
-	ruletree_object_offset_t entry_location = 0;
+	ruletree_inodestat_index_t	new_idx;
 
 	if (!ruletree_ctx.rtree_ruletree_hdr_p) return (0);
 	if (ruletree_ctx.rtree_ruletree_fd < 0) return(0);
 
-	memset(&new_entry, 0, sizeof(new_entry));
-
-	new_entry.rtree_inode_simu = *istat_struct;
-
-	entry_location = append_struct_to_ruletree_file(&new_entry, sizeof(new_entry),
-		LB_RULETREE_OBJECT_TYPE_INODESTAT);
-	return(entry_location);
+	memset(&new_idx, 0, sizeof(new_idx));
+	new_idx.rtree_isi_buckets = ruletree_create_inodestat_buckets(
+		INODESTAT_INDEX_INITIAL_BUCKETS);
+	if (!new_idx.rtree_isi_buckets) return(0);
+	return(append_struct_to_ruletree_file(&new_idx, sizeof(new_idx),
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_INDEX));
 }
 
-/* Inode number is the primary key to the bintree
- * (device number is the secondary key), but
- * sometimes inode allocation may be done somewhat
- * sequentially. For a slightly better balancing 
- * of the tree, reverse some bits of the key:
- * This algorithm takes the lowest 8 bits, reverses
- * them, and the result will be in bits 32..39 or
- * "k" below (rest of bits in "k" are copies of the
- * original bits or zero, those cause no harm here)
- *
- * For detailed explanation, see 
- * http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith64Bits
-*/
-static uint64_t ino_to_key(uint64_t ino)
-{
-	uint64_t	k;
+static ruletree_object_offset_t	inodestats_index_offs = 0;
 
-	k = ((((ino & 0xFF) * 0x80200802ULL) & 0x0884422110ULL) * 0x0101010101ULL) << 24;
-	return(k ^ ino);
+static ruletree_inodestat_index_t *get_inodestats_index(void)
+{
+	if (!inodestats_index_offs) {
+		inodestats_index_offs = ruletree_catalog_get(
+			"vperm", "inodestats");
+		if (!inodestats_index_offs) return(NULL);
+	}
+	return(offset_to_ruletree_object_ptr(inodestats_index_offs,
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_INDEX));
 }
 
-static ruletree_object_offset_t	inodestats_bintree_root = 0;
-
 /* in: "handle" contains the keys
  * out: istat_struct has been filled, if a matching node was found.
  *	in any case, "handle" has been updated so that 
@@ -652,73 +797,58 @@ int ruletree_find_inodestat(
 	ruletree_inodestat_handle_t	*handle,
 	inodesimu_t			*istat_struct)
 {
-	ruletree_bintree_t	*bintrp;
+	ruletree_inodestat_index_t	*idx;
 	ruletree_inodestat_t	*fsptr;
 
 	LB_LOG(LB_LOGLEVEL_NOISE,
-		"ruletree_find_inodestat (dev=%lld,ino=%lld,key=%llX)",
+		"ruletree_find_inodestat (dev=%lld,ino=%lld)",
 			(long long)handle->rfh_dev,
-			(long long)handle->rfh_ino,
-			ino_to_key(handle->rfh_ino));
-	handle->rfh_last_visited_node = 0;
-	handle->rfh_last_result = 0;
+			(long long)handle->rfh_ino);
+	handle->rfh_offs = 0;
 
 	if (!ruletree_ctx.rtree_ruletree_path) ruletree_to_memory();
 
-	if (!inodestats_bintree_root) {
-		inodestats_bintree_root = ruletree_catalog_get(
-			"vperm", "inodestats");
-		if (!inodestats_bintree_root) return(-1);
-	}
-	handle->rfh_offs = ruletree_find_bintree_entry(
-		ino_to_key(handle->rfh_ino), handle->rfh_dev,
-		inodestats_bintree_root, &handle->rfh_last_visited_node,
-		&handle->rfh_last_result);
+	idx = get_inodestats_index();
+	if (!idx) return(-1);
+
+	handle->rfh_offs = inodestat_index_lookup(idx->rtree_isi_buckets,
+		handle->rfh_dev, handle->rfh_ino);
 	if (!handle->rfh_offs) return(-1);
 		
-	bintrp = offset_to_ruletree_object_ptr(handle->rfh_offs,
-			LB_RULETREE_OBJECT_TYPE_BINTREE);
-	if (!bintrp) return(-1);
-	fsptr = offset_to_ruletree_object_ptr(bintrp->rtree_bt_value,
+	fsptr = offset_to_ruletree_object_ptr(handle->rfh_offs,
 			LB_RULETREE_OBJECT_TYPE_INODESTAT);
-	if (!fsptr) return(-1);
+	if (!fsptr) {
+		handle->rfh_offs = 0;
+		return(-1);
+	}
 
 	*istat_struct = fsptr->rtree_inode_simu;
 
 	return(0);
 }
 
-/* set/add a inodestat structure to the binary tree.
+/* set/add a inodestat structure to the index.
  * ruletree_find_inodestat() must be called beforehand to 
  * fill "handle" (unless adding the very first node)
  *
- * returns 0 or offset to new binary tree root. */
+ * returns 0 or offset to a new index. */
 ruletree_object_offset_t ruletree_set_inodestat(
 	ruletree_inodestat_handle_t	*handle,
 	inodesimu_t			*istat_struct)
 {
 	LB_LOG(LB_LOGLEVEL_NOISE,
-		"ruletree_set_inodestat (dev=%lld,ino=%lld,key=%llX))",
+		"ruletree_set_inodestat (dev=%lld,ino=%lld))",
 			(long long)handle->rfh_dev,
-			(long long)handle->rfh_ino,
-			ino_to_key(handle->rfh_ino));
+			(long long)handle->rfh_ino);
 	if (handle->rfh_offs) {
-		/* Node is already in the tree. Update it */
+		/* Node is already in the index. Update it */
 		ruletree_inodestat_t	*fsptr;
-		ruletree_bintree_t	*bintrp;
 
-		bintrp = offset_to_ruletree_object_ptr(handle->rfh_offs,
-				LB_RULETREE_OBJECT_TYPE_BINTREE);
-		if (!bintrp) {
-			LB_LOG(LB_LOGLEVEL_ERROR,
-				"ruletree_set_inodestat: Internal error: Invalid handle");
-			return(0);
-		}
-		fsptr = offset_to_ruletree_object_ptr(bintrp->rtree_bt_value,
+		fsptr = offset_to_ruletree_object_ptr(handle->rfh_offs,
 				LB_RULETREE_OBJECT_TYPE_INODESTAT);
 		if (!fsptr) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
-				"ruletree_set_inodestat: Internal error: Invalid bintree");
+				"ruletree_set_inodestat: Internal error: Invalid handle");
 			return(0);
 		}
 		LB_LOG(LB_LOGLEVEL_NOISE,
@@ -726,18 +856,41 @@ ruletree_object_offset_t ruletree_set_inodestat(
 		fsptr->rtree_inode_simu = *istat_struct;
 		return(0);
 	} else {
-		/* Add to the tree. */
-		ruletree_object_offset_t	bt_root;
+		/* Add to the index. */
+		ruletree_inodestat_index_t	*idx;
+		ruletree_object_offset_t	new_idx_offs = 0;
+		ruletree_inodestat_buckets_t	*tbl;
 
 		LB_LOG(LB_LOGLEVEL_NOISE,
-			"ruletree_set_inodestat: add to tree");
+			"ruletree_set_inodestat: add to index");
+		idx = get_inodestats_index();
+		if (!idx) {
+			LB_LOG(LB_LOGLEVEL_DEBUG,
+				"ruletree_set_inodestat: First node");
+			new_idx_offs = ruletree_create_inodestat_index();
+			if (!new_idx_offs) return(0);
+			ruletree_catalog_set("vperm", "inodestats", new_idx_offs);
+			inodestats_index_offs = new_idx_offs;
+			idx = get_inodestats_index();
+			if (!idx) return(0);
+		}
 		handle->rfh_offs = ruletree_create_inodestat(istat_struct);
-		bt_root = ruletree_add_to_bintree_entry(handle->rfh_offs,
-			ino_to_key(handle->rfh_ino), handle->rfh_dev,
-			handle->rfh_last_visited_node, handle->rfh_last_result);
-		if (bt_root)
-			ruletree_catalog_set("vperm", "inodestats", bt_root);
-		return (bt_root);
+		if (!handle->rfh_offs) return(0);
+		if (inodestat_index_insert(idx, idx->rtree_isi_buckets,
+		    handle->rfh_dev, handle->rfh_ino, handle->rfh_offs) < 0) {
+			LB_LOG(LB_LOGLEVEL_ERROR,
+				"ruletree_set_inodestat: Failed to add to the index");
+			return(0);
+		}
+		idx->rtree_isi_num_entries++;
+
+		/* grow when 2/3 of the entries are used */
+		tbl = offset_to_ruletree_object_ptr(idx->rtree_isi_buckets,
+			LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS);
+		if (tbl && (idx->rtree_isi_num_entries >
+			    2 * tbl->rtree_isbs_num_buckets))
+			inodestat_index_grow(idx);
+		return (new_idx_offs);
 	}
 }
 
@@ -1157,6 +1310,7 @@ int ruletree_catalog_set(
 		catalog_entry_ptr_in_root_catalog);
 	if (object_cat_entry) {
 		object_cat_entry->rtree_cat_value_offs = value_offset;
+		ruletree_bump_generation();
 		return(1);
 	}
 	return (0);
@@ -1189,6 +1343,7 @@ int ruletree_catalog_vset(
 	if (catptr) {
 		LB_LOG(LB_LOGLEVEL_NOISE2, "%s Found, set to %d", __func__, (int)value_offset);
 		catptr->rtree_cat_value_offs = value_offset;
+		ruletree_bump_generation();
 		return(1);
 	}
 	return (0);
@@ -1238,6 +1393,172 @@ ruletree_object_offset_t add_net_rule_to_ruletree(
         return(rule_location);
 }
 
+/* Convert an address pattern of a net rule to binary address and mask:
+ * - "1.2.3.4" and "3fff:ffff::8:9" require an exact match,
+ * - "1.2.3.0/24" and "3fff:ffff::/32" require that the network
+ *   part matches (the address is compared to the prefix as is,
+ *   host bits of the prefix are not cleared),
+ * - "INADDR_ANY" and "IN6ADDR_ANY" match only INADDR_ANY and
+ *   IN6ADDR_ANY, exactly.
+ * Anything else will never match. */
+static void compile_net_rule_address(const char *pattern,
+	ruletree_net_rule_match_t *mp)
+{
+	char	buf[INET6_ADDRSTRLEN + 8];
+	char	*s_mask;
+	int	addr_len;
+	int	mask_bits;
+	int	i;
+
+	memset(mp->rtree_nrm_addr, 0, sizeof(mp->rtree_nrm_addr));
+	memset(mp->rtree_nrm_mask, 0, sizeof(mp->rtree_nrm_mask));
+	mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_NONE;
+
+	if (!strcmp(pattern, "INADDR_ANY")) {
+		mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_IPV4;
+		memset(mp->rtree_nrm_mask, 0xFF, 4);
+		return;
+	}
+	if (!strcmp(pattern, "IN6ADDR_ANY")) {
+		mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_IPV6;
+		memset(mp->rtree_nrm_mask, 0xFF, 16);
+		return;
+	}
+	if (strlen(pattern) >= sizeof(buf)) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"Address in a network rule is too long (%s)", pattern);
+		return;
+	}
+	strcpy(buf, pattern);
+	s_mask = strchr(buf, '/');
+	if (s_mask) *s_mask++ = '\0';
+
+	if (inet_pton(AF_INET, buf, mp->rtree_nrm_addr) == 1) {
+		mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_IPV4;
+		addr_len = 4;
+	} else if (inet_pton(AF_INET6, buf, mp->rtree_nrm_addr) == 1) {
+		mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_IPV6;
+		addr_len = 16;
+	} else {
+		LB_LOG(LB_LOGLEVEL_WARNING,
+			"Address in a network rule is not numeric (%s)", pattern);
+		return;
+	}
+
+	mask_bits = (s_mask ? atoi(s_mask) : addr_len * 8);
+	if ((mask_bits <= 0) || (mask_bits > addr_len * 8)) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"incorrect number of bits in subnet mask (%s)", pattern);
+		mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_NONE;
+		return;
+	}
+	for (i = 0; mask_bits >= 8; i++, mask_bits -= 8)
+		mp->rtree_nrm_mask[i] = 0xFF;
+	if (mask_bits > 0)
+		mp->rtree_nrm_mask[i] = (0xFF << (8 - mask_bits)) & 0xFF;
+}
+
+/* Create the precompiled form of a list of net rules (and of the
+ * lists of subrules), and add it to the "net_rule_index" catalog.
+ * This must be called after the list is complete.
+ * Returns location of the index, or 0 if there is no index.
+*/
+ruletree_object_offset_t ruletree_compile_net_rule_index(
+	ruletree_object_offset_t rule_list_offs)
+{
+	uint32_t	rule_list_size;
+	uint32_t	i;
+	size_t		index_size;
+	char		*buf;
+	ruletree_net_rule_index_t *idx;
+	ruletree_net_rule_match_t *matches;
+	ruletree_object_offset_t index_offs = 0;
+	char		index_name[32];
+
+	if (!rule_list_offs) return(0);
+	rule_list_size = ruletree_objectlist_get_list_size(rule_list_offs);
+	if (rule_list_size == 0) return(0);
+
+	snprintf(index_name, sizeof(index_name), "%u", rule_list_offs);
+	index_offs = ruletree_catalog_get("net_rule_index", index_name);
+	if (index_offs) return(index_offs); /* already done */
+
+	index_size = sizeof(ruletree_net_rule_index_t) +
+		rule_list_size * sizeof(ruletree_net_rule_match_t);
+	buf = calloc(1, index_size);
+	if (!buf) return(0);
+	idx = (ruletree_net_rule_index_t*)buf;
+	matches = (ruletree_net_rule_match_t*)(buf + sizeof(*idx));
+
+	idx->rtree_nri_rule_list_offs = rule_list_offs;
+	idx->rtree_nri_rule_list_size = rule_list_size;
+
+	for (i = 0; i < rule_list_size; i++) {
+		ruletree_object_offset_t rule_offs;
+		ruletree_net_rule_t	*rule;
+		ruletree_net_rule_match_t *mp = &matches[i];
+		const char	*str;
+
+		rule_offs = ruletree_objectlist_get_item(rule_list_offs, i);
+		if (!rule_offs) continue;
+		rule = offset_to_ruletree_object_ptr(rule_offs,
+			LB_RULETREE_OBJECT_TYPE_NET_RULE);
+		if (!rule) continue;
+
+		mp->rtree_nrm_rule_offs = rule_offs;
+		mp->rtree_nrm_port = rule->rtree_net_port;
+		if (rule->rtree_net_func_name) {
+			str = offset_to_ruletree_string_ptr(
+				rule->rtree_net_func_name, NULL);
+			mp->rtree_nrm_func_name = rule->rtree_net_func_name;
+			mp->rtree_nrm_func_name_hash =
+				str ? ruletree_net_rule_hash_name(str) : 0;
+		}
+		if (rule->rtree_net_binary_name) {
+			str = offset_to_ruletree_string_ptr(
+				rule->rtree_net_binary_name, NULL);
+			mp->rtree_nrm_binary_name = rule->rtree_net_binary_name;
+			mp->rtree_nrm_binary_name_hash =
+				str ? ruletree_net_rule_hash_name(str) : 0;
+		}
+		if (rule->rtree_net_address) {
+			str = offset_to_ruletree_string_ptr(
+				rule->rtree_net_address, NULL);
+			if (str) {
+				compile_net_rule_address(str, mp);
+			} else {
+				mp->rtree_nrm_addr_match =
+					LB_RULETREE_NET_ADDR_MATCH_NONE;
+			}
+		} else {
+			mp->rtree_nrm_addr_match = LB_RULETREE_NET_ADDR_MATCH_ANY;
+		}
+		if (rule->rtree_net_rules) {
+			mp->rtree_nrm_subrules_index =
+				ruletree_compile_net_rule_index(
+					rule->rtree_net_rules);
+		}
+	}
+
+	/* "append_struct_to_ruletree_file" will fill the magic & type */
+	index_offs = append_struct_to_ruletree_file(buf, index_size,
+		LB_RULETREE_OBJECT_TYPE_NET_RULE_INDEX);
+	free(buf);
+
+	if (!index_offs) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"Failed to create index for net rules @%u",
+			rule_list_offs);
+		return(0);
+	}
+	ruletree_catalog_set("net_rule_index", index_name, index_offs);
+
+	LB_LOG(LB_LOGLEVEL_DEBUG,
+		"net rules @%u (%u rules): index @%u",
+		rule_list_offs, rule_list_size, index_offs);
+	return(index_offs);
+}
+
 /* =================== map "standard" ruletree to memory, if not yet mapped =================== */
 
 /* ensure that the rule tree has been mapped. */
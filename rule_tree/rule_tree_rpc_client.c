@@ -43,46 +43,65 @@
 
 #include "exported.h"
 
+/* The server has two sockets: "csock" accepts SOCK_SEQPACKET
+ * connections, which are used normally. "ssock" is a datagram
+ * socket; if connecting fails, the client binds its own socket and
+ * sends datagrams to "ssock". */
 static struct sockaddr_un server_address;
 static socklen_t	server_addr_len;
+static struct sockaddr_un server_conn_address;
+static socklen_t	server_conn_addr_len;
 static struct sockaddr_un client_address;
 static char *client_socket_path = NULL;
 
 static int client_socket = -1;
+static int client_socket_is_connected = 0;
 static pid_t client_pid = 0;
 static int server_address_initialized = 0;
 
-static int initialize_server_address(void)
+static int set_server_address(const char *sock_name,
+	struct sockaddr_un *addr, socklen_t *addr_len)
 {
 	char	*sock_path = NULL;
 	size_t	sock_path_len;
 
-	if (server_address_initialized) return(0);
-
-	if (!ldbox_session_dir) {
-		LB_LOG(LB_LOGLEVEL_ERROR,
-			"ruletree_rpc: session directory is missing.");
-		return(-1);
-	}
-	if (asprintf(&sock_path, "%s/lbrdbd-sock.d/ssock", ldbox_session_dir) < 0) {
+	if (asprintf(&sock_path, "%s/lbrdbd-sock.d/%s",
+	    ldbox_session_dir, sock_name) < 0) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"ruletree_rpc: asprintf failed");
 		return(-1);
 	}
 	sock_path_len = strlen(sock_path);
-	if (sock_path_len >= sizeof(server_address.sun_path)-1) {
+	if (sock_path_len >= sizeof(addr->sun_path)-1) {
 		/* This should never happen, server should not start
 		 * if address would be too long
 		 * (and session creation should fail), but check anyways */
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"ruletree_rpc: server socket address is too long (%s)",
 			sock_path);
+		free(sock_path);
 		return(-1);
 	}
-	server_address.sun_family = AF_UNIX;
-	strcpy(server_address.sun_path, sock_path); /* it fits. */
-	server_addr_len = sizeof(sa_family_t) + sock_path_len + 1;
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, sock_path); /* it fits. */
+	*addr_len = sizeof(sa_family_t) + sock_path_len + 1;
 	free(sock_path);
+	return(0);
+}
+
+static int initialize_server_address(void)
+{
+	if (server_address_initialized) return(0);
+
+	if (!ldbox_session_dir) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"ruletree_rpc: session directory is missing.");
+		return(-1);
+	}
+	if ((set_server_address("ssock", &server_address, &server_addr_len) < 0) ||
+	    (set_server_address("csock", &server_conn_address,
+		&server_conn_addr_len) < 0))
+		return(-1);
 
 	server_address_initialized = 1;
 	return(0);
@@ -114,7 +133,16 @@ static int create_client_socket(void)
 	size_t		sock_path_len;
 	int		min_fd;
 
-	client_socket = socket(PF_UNIX, SOCK_DGRAM, 0);
+	client_socket_is_connected = 0;
+	client_socket = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if ((client_socket >= 0) &&
+	    (connect_nomap_nolog(client_socket,
+		(struct sockaddr*)&server_conn_address, server_conn_addr_len) == 0)) {
+		client_socket_is_connected = 1;
+	} else {
+		if (client_socket >= 0) close(client_socket);
+		client_socket = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	}
 	if (client_socket < 0) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"ruletree_rpc: Failed to create client socket");
@@ -123,7 +151,7 @@ static int create_client_socket(void)
 	min_fd = ruletree_get_min_client_socket_fd();
 	if (client_socket < min_fd) {
 		/* find lowest free fd above min_fd */
-		int new_fd = fcntl(client_socket, F_DUPFD, (long)min_fd);
+		int new_fd = fcntl(client_socket, F_DUPFD_CLOEXEC, (long)min_fd);
 		if (new_fd < 0) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"ruletree_rpc: failed to move socket FD > %d",
@@ -137,6 +165,11 @@ static int create_client_socket(void)
 		}
 	}
 	client_pid = getpid();
+	if (client_socket_is_connected) {
+		LB_LOG(LB_LOGLEVEL_DEBUG,
+			"ruletree_rpc: connected to server, fd=%d", client_socket);
+		return(0);
+	}
 	if (asprintf(&client_socket_path, "%s/sock/%d", ldbox_session_dir, (int)client_pid) < 0) {
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"ruletree_rpc: asprintf failed");
@@ -189,25 +222,28 @@ static int create_client_socket(void)
 */
 static pthread_mutex_t	client_socket_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static int send_command_receive_reply(
-	ruletree_rpc_msg_command_t	*command,
-	ruletree_rpc_msg_reply_t	*reply)
+static void client_socket_mutex_lock(void)
 {
-	ssize_t	sent_msg_size;
-	ssize_t	received_msg_size;
-	int use_locking = 0;
-
-	if (pthread_library_is_available) {
-		use_locking = 1;
-		LB_LOG(LB_LOGLEVEL_NOISE, "Going to lock client_socket_mutex");
+	if (pthread_library_is_available)
 		(*pthread_mutex_lock_fnptr)(&client_socket_mutex);
-	}
+}
+static void client_socket_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&client_socket_mutex);
+}
+
+/* Send a message to the server. client_socket_mutex must be locked. */
+static int send_message_to_server(void *msg, size_t msg_size)
+{
+	ssize_t	sent_msg_size;
+	int	retries = 0;
 
 	if (server_address_initialized == 0) {
 		if (initialize_server_address() < 0) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"Failed to initialize server socket address (ruletree_rpc)");
-			goto error_out;
+			return(-1);
 		}
 	}
 
@@ -223,14 +259,17 @@ static int send_command_receive_reply(
 		if (create_client_socket() < 0) {
 			LB_LOG(LB_LOGLEVEL_ERROR,
 				"Failed to create client socket (ruletree_rpc)");
-			goto error_out;
+			return(-1);
 		}
 	}
 
-	command->rimc_message_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
-	/* FIXME: fill serial */
-	sent_msg_size = sendto_nomap_nolog(client_socket, command, sizeof(*command), 0,
-		(struct sockaddr*)&server_address, server_addr_len);
+	if (client_socket_is_connected)
+		sent_msg_size = sendto_nomap_nolog(client_socket, msg, msg_size,
+			MSG_NOSIGNAL, NULL, 0);
+	else
+		sent_msg_size = sendto_nomap_nolog(client_socket, msg, msg_size,
+			MSG_NOSIGNAL,
+			(struct sockaddr*)&server_address, server_addr_len);
 	if (sent_msg_size < 0) {
 		switch (errno) {
 		case ENOTSOCK:
@@ -239,22 +278,56 @@ static int send_command_receive_reply(
 			 * it; because it might be open for another use already,
 			 * we don't attempt to close it here. */
 			client_socket = -1;
-			goto reopen_socket;
+			if (retries++ < 2) goto reopen_socket;
+			break;
+		case EPIPE:
+		case ECONNRESET:
+		case ENOTCONN:
+			/* the server has closed the connection */
+			close(client_socket);
+			client_socket = -1;
+			if (retries++ < 2) goto reopen_socket;
+			break;
 		}
 
 		LB_LOG(LB_LOGLEVEL_ERROR,
 			"Failed to send command to server (ruletree_rpc)");
-		goto error_out;
+		return(-1);
 	}
 
 	LB_LOG(LB_LOGLEVEL_DEBUG, "ruletree_rpc: sendto => %d", (int)sent_msg_size);
-		
+	return(0);
+}
+
+static int send_command_receive_reply(
+	ruletree_rpc_msg_command_t	*command,
+	ruletree_rpc_msg_reply_t	*reply)
+{
+	ssize_t	received_msg_size;
+	int use_locking = 0;
+
+	if (pthread_library_is_available) {
+		use_locking = 1;
+		LB_LOG(LB_LOGLEVEL_NOISE, "Going to lock client_socket_mutex");
+		(*pthread_mutex_lock_fnptr)(&client_socket_mutex);
+	}
+
+	command->rimc_message_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
+	/* FIXME: fill serial */
+	if (send_message_to_server(command, sizeof(*command)) < 0)
+		goto error_out;
+
 	received_msg_size = recvfrom_nomap_nolog(client_socket, reply, sizeof(*reply), 0,
 		(struct sockaddr*)NULL, (socklen_t*)NULL);
 	LB_LOG(LB_LOGLEVEL_DEBUG, "ruletree_rpc: recvfrom => %d", (int)received_msg_size);
 	/* FIXME: check serial */
 	/* FIXME: check sender address? */
 	if (received_msg_size <= 0) {
+		if (client_socket_is_connected) {
+			/* connection was closed, reconnect next time */
+			close(client_socket);
+			client_socket = -1;
+		}
 		goto error_out;
 	}
 	/* FIXME: If message is too small... */
@@ -274,6 +347,31 @@ static int send_command_receive_reply(
 	return(-1);
 }
 
+/* SETFILEINFO, RELEASEFILEINFO and CLEARFILEINFO are sent without
+ * waiting for a reply (programs like "tar x", "cp -a" and dpkg change
+ * the simulated owners and modes of thousands of files in a row).
+ * lbrdbd answers a GETFILEINFO only after it has executed everything
+ * that was sent before it, see ruletree_server().
+ * Returns 0 if the command was sent, -1 if it was lost.
+*/
+static int send_oneway_command(ruletree_rpc_msg_command_t *command)
+{
+	int	res;
+
+	client_socket_mutex_lock();
+	command->rimc_message_protocol_version = RULETREE_RPC_PROTOCOL_VERSION;
+	res = send_message_to_server(command, sizeof(*command));
+	client_socket_mutex_unlock();
+	if (res < 0) {
+		LB_LOG(LB_LOGLEVEL_ERROR,
+			"ruletree_rpc: Failed to send command %u (dev=%llu ino=%llu)",
+			command->rimc_message_type,
+			(unsigned long long)command->rim_message.rimm_fileinfo.inodesimu_dev,
+			(unsigned long long)command->rim_message.rimm_fileinfo.inodesimu_ino);
+	}
+	return(res);
+}
+
 void ruletree_rpc__ping(void)
 {
 	ruletree_rpc_msg_command_t	command;
@@ -329,24 +427,45 @@ char *lb__ruletree_rpc__init2__(void)
 	return(ruletree_rpc__init2());
 }
 
-/* clear vperm info completely. */
-void ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino)
+/* Get server statistics (a string) */
+char *ruletree_rpc__stats(void)
 {
 	ruletree_rpc_msg_command_t	command;
 	ruletree_rpc_msg_reply_t	reply;
 
+	memset(&command, 0, sizeof(command));
+	memset(&reply, 0, sizeof(reply));
+	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__STATS;
+	if (send_command_receive_reply(&command, &reply) < 0)
+		return(NULL);
+	if (reply.hdr.rimr_message_type != RULETREE_RPC_MESSAGE_REPLY__MESSAGE)
+		return(NULL);
+	reply.msg.rimr_str[sizeof(reply.msg.rimr_str)-1] = '\0';
+	return(strdup(reply.msg.rimr_str));
+}
+
+/* called from lbrdbdctl */
+char *lb__ruletree_rpc__stats__(void)
+{
+	return(ruletree_rpc__stats());
+}
+
+/* clear vperm info completely. */
+int ruletree_rpc__vperm_clear(uint64_t dev, uint64_t ino)
+{
+	ruletree_rpc_msg_command_t	command;
+
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__CLEARFILEINFO;
 	command.rim_message.rimm_fileinfo.inodesimu_dev = dev;
 	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
-	send_command_receive_reply(&command, &reply);
+	return(send_oneway_command(&command));
 }
 
-void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
+int ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
 	int set_uid, uint32_t uid, int set_gid, uint32_t gid)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	if (set_uid) 
 		LB_LOG(LB_LOGLEVEL_DEBUG, "%s: uid=%d", __func__, uid);
@@ -361,14 +480,13 @@ void ruletree_rpc__vperm_set_ids(uint64_t dev, uint64_t ino,
 		(set_gid ? RULETREE_INODESTAT_SIM_GID : 0);
 	command.rim_message.rimm_fileinfo.inodesimu_uid = uid;
 	command.rim_message.rimm_fileinfo.inodesimu_gid = gid;
-	send_command_receive_reply(&command, &reply);
+	return(send_oneway_command(&command));
 }
 
-void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
+int ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	int release_uid, int release_gid)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	LB_LOG(LB_LOGLEVEL_DEBUG, "%s: %s %s", __func__,
 		(release_uid?"rel.uid":""), (release_gid?"rel.gid":""));
@@ -379,14 +497,13 @@ void ruletree_rpc__vperm_release_ids(uint64_t dev, uint64_t ino,
 	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
 		(release_uid ? RULETREE_INODESTAT_SIM_UID : 0) |
 		(release_gid ? RULETREE_INODESTAT_SIM_GID : 0);
-	send_command_receive_reply(&command, &reply);
+	return(send_oneway_command(&command));
 }
 
-void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
+int ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
 	mode_t real_mode, mode_t virt_mode, mode_t suid_sgid_bits)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
@@ -405,13 +522,12 @@ void ruletree_rpc__vperm_set_mode(uint64_t dev, uint64_t ino,
 		command.rim_message.rimm_fileinfo.inodesimu_active_fields |=
 			RULETREE_INODESTAT_SIM_SUIDSGID;
 	}
-	send_command_receive_reply(&command, &reply);
+	return(send_oneway_command(&command));
 }
 
-void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino)
+int ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__RELEASEFILEINFO;
@@ -419,14 +535,13 @@ void ruletree_rpc__vperm_release_mode(uint64_t dev, uint64_t ino)
 	command.rim_message.rimm_fileinfo.inodesimu_ino = ino;
 	command.rim_message.rimm_fileinfo.inodesimu_active_fields =
 		RULETREE_INODESTAT_SIM_MODE | RULETREE_INODESTAT_SIM_SUIDSGID;
-	send_command_receive_reply(&command, &reply);
+	return(send_oneway_command(&command));
 }
 
-void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
+int ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
         mode_t mode, uint64_t rdev)
 {
 	ruletree_rpc_msg_command_t	command;
-	ruletree_rpc_msg_reply_t	reply;
 
 	memset(&command, 0, sizeof(command));
 	command.rimc_message_type = RULETREE_RPC_MESSAGE_COMMAND__SETFILEINFO;
@@ -437,7 +552,7 @@ void ruletree_rpc__vperm_set_dev_node(uint64_t dev, uint64_t ino,
 	command.rim_message.rimm_fileinfo.inodesimu_mode = mode & (~S_IFMT);
 	command.rim_message.rimm_fileinfo.inodesimu_devmode = mode & S_IFMT;
 	command.rim_message.rimm_fileinfo.inodesimu_rdev = rdev;
-	send_command_receive_reply(&command, &reply);
+	return(send_oneway_command(&command));
 }
 
 int ruletree_rpc__get_inodestat(uint64_t dev, uint64_t ino,
@@ -0,0 +1,52 @@
+# posix_spawn() and posix_spawnp() can start the same binary repeatedly
+set -e
+
+SBIN=test-spawn
+TRUE=/bin/true
+if [ ! -x $TRUE ]; then
+	TRUE=/usr/bin/true
+fi
+
+cat > $SBIN.c <<EOF
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+int main(int argc, char **argv) {
+	posix_spawn_file_actions_t fa;
+	char *args[] = { argv[2], NULL };
+	pid_t pid;
+	int i, status;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addclose(&fa, 0);
+	for (i = 0; i < 2; i++) {
+		if (!strcmp(argv[1], "posix_spawnp")) {
+			if (posix_spawnp(&pid, argv[2], &fa, NULL,
+				args, environ)) return(1);
+		} else {
+			if (posix_spawn(&pid, argv[2], &fa, NULL,
+				args, environ)) return(1);
+		}
+		if (waitpid(pid, &status, 0) != pid) return(2);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) return(3);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	return(0);
+}
+EOF
+
+function failwith {
+echo Failure in: $*
+return 1
+}
+
+gcc -w -o $SBIN $SBIN.c
+
+./$SBIN posix_spawn $TRUE || failwith 'Spawning a binary twice with posix_spawn'
+./$SBIN posix_spawnp true || failwith 'Spawning a binary twice with posix_spawnp'
@@ -0,0 +1,106 @@
+# Union directories look the same to all directory readers
+set -e
+
+UDIR=/usr/share/aclocal
+UBIN=test-uniondir
+
+if [ ! -d $UDIR ]; then
+	echo "$UDIR is not available" >&2
+	exit 66
+fi
+
+cat > $UBIN.c <<EOF
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <glob.h>
+#include <ftw.h>
+#include <fts.h>
+
+/* prints the last component, dot files are skipped like glob() does */
+static void print_name(const char *path) {
+	const char *cp = strrchr(path, '/');
+	if (cp) cp++;
+	else cp = path;
+	if (*cp != '.') printf("%s\n", cp);
+}
+
+static int nftw_fn(const char *file, const struct stat *sb,
+	int flag, struct FTW *s) {
+	if (s->level == 1) print_name(file);
+	return(0);
+}
+
+/* ftw() has no level, the first call is for the directory itself */
+static char *ftw_root = NULL;
+
+static int ftw_fn(const char *file, const struct stat *sb, int flag) {
+	if (!ftw_root) ftw_root = strdup(file);
+	else if (!strchr(file + strlen(ftw_root) + 1, '/')) print_name(file);
+	return(0);
+}
+
+int main(int argc, char **argv) {
+	const char *method = argv[1];
+	char *dir = argv[2];
+	char pattern[PATH_MAX];
+	DIR *d;
+	struct dirent *de, entry;
+	glob_t g;
+	size_t i;
+
+	if (!strcmp(method, "readdir")) {
+		if (!(d = opendir(dir))) return(1);
+		while ((de = readdir(d)) != NULL) print_name(de->d_name);
+		closedir(d);
+	} else if (!strcmp(method, "readdir_r")) {
+		if (!(d = opendir(dir))) return(1);
+		while (!readdir_r(d, &entry, &de) && de)
+			print_name(de->d_name);
+		closedir(d);
+	} else if (!strcmp(method, "glob")) {
+		snprintf(pattern, sizeof(pattern), "%s/*", dir);
+		if (glob(pattern, 0, NULL, &g)) return(1);
+		for (i = 0; i < g.gl_pathc; i++)
+			print_name(g.gl_pathv[i]);
+	} else if (!strcmp(method, "nftw")) {
+		if (nftw(dir, nftw_fn, 4, FTW_PHYS)) return(1);
+	} else if (!strcmp(method, "ftw")) {
+		if (ftw(dir, ftw_fn, 4)) return(1);
+	} else if (!strcmp(method, "fts")) {
+		char *paths[2] = { dir, NULL };
+		FTS *f = fts_open(paths, FTS_PHYSICAL, NULL);
+		FTSENT *fe;
+
+		if (!f) return(1);
+		while ((fe = fts_read(f)) != NULL) {
+			if (fe->fts_level == 1) {
+				print_name(fe->fts_name);
+				fts_set(f, fe, FTS_SKIP);
+			}
+		}
+		fts_close(f);
+	} else {
+		return(1);
+	}
+	return(0);
+}
+EOF
+
+function failwith {
+echo Failure in: $*
+return 1
+}
+
+gcc -w -o $UBIN $UBIN.c
+
+./$UBIN readdir $UDIR | sort > expected
+test -s expected || failwith 'Listing of union directory with readdir'
+
+for method in readdir_r glob nftw ftw fts; do
+	./$UBIN $method $UDIR | sort > $method.out
+	cmp -s expected $method.out || failwith "Listing of union directory with $method"
+done
@@ -0,0 +1,408 @@
+/* lb-bench:
+ * Micro-benchmarks for the hot paths of liblb: path mapping,
+ * reverse mapping, rule lookup, exec policy selection, exec
+ * preparation, network address mapping and the lbrdbd RPC.
+ *
+ * The mapping code of liblb is linked statically to this program
+ * (instead of using liblb.so via LD_PRELOAD), so that the internal
+ * functions can be called directly. Consequently this program must
+ * NOT be started inside an ldbox session; it only needs the session
+ * directory of an existing session (see lb -S), which provides the
+ * real RuleTree.bin and (if the session is still alive) lbrdbd.
+ *
+ * Results are printed one line per benchmark, tab-separated:
+ *	name  iterations  total_ns  ns_per_op  status
+ * Lines starting with '#' are comments.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <link.h>
+#include <config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/vfs.h>
+#include <sys/statvfs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "lb.h"
+#include "mapping.h"
+#include "rule_tree.h"
+#include "rule_tree_rpc.h"
+#include "lb_network.h"
+#include "lb_stat.h"
+#include "exported.h"
+#include "pathmapping.h"
+#include "lb_execs.h"
+
+static const char *progname = "lb-bench";
+static const char *binary_name = "lb-bench";
+static long iterations = 10000;
+
+/* Paths used when none are given on the command line. These should hit
+ * the common rules of all modes: tools, libraries, headers, /etc, /tmp
+ * and the paths that are usually left unmapped. */
+static const char *default_paths[] = {
+	"/usr/bin/gcc",
+	"/usr/bin/make",
+	"/bin/sh",
+	"/usr/lib/libc.so",
+	"/usr/include/stdio.h",
+	"/etc/passwd",
+	"/tmp/lb-bench.tmp",
+	"/home",
+	"/proc/self/exe",
+	"/dev/null",
+	"/usr/share/locale/locale.alias",
+	NULL
+};
+
+typedef struct bench_path_s {
+	const char		*bp_virtual;
+	char			*bp_mapped;
+	struct path_entry_list	bp_path_list;
+} bench_path_t;
+
+static bench_path_t *bench_paths = NULL;
+static int num_bench_paths = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static void report(const char *name, long n, uint64_t total_ns)
+{
+	printf("%s\t%ld\t%llu\t%.1f\tok\n", name, n,
+		(unsigned long long)total_ns,
+		(n > 0 ? (double)total_ns / (double)n : 0.0));
+}
+
+static void report_skipped(const char *name, const char *reason)
+{
+	printf("%s\t0\t0\t-\tskipped: %s\n", name, reason);
+}
+
+/* Run 'fn' first 'iterations/10' times to warm up caches, then
+ * 'iterations' times with the clock running. 'fn' gets the
+ * iteration number, it is expected to cycle through the paths. */
+static void run_bench(const char *name, void (*fn)(long i))
+{
+	long		i;
+	uint64_t	t0, t1;
+
+	for (i = 0; i < iterations / 10; i++) fn(i);
+	t0 = now_ns();
+	for (i = 0; i < iterations; i++) fn(i);
+	t1 = now_ns();
+	report(name, iterations, t1 - t0);
+}
+
+/* ---------- benchmarked operations ---------- */
+
+static struct lbcontext *bench_lbctx = NULL;
+
+static void bench_map_path(long i)
+{
+	mapping_results_t	res;
+
+	clear_mapping_results_struct(&res);
+	ldbox_map_path_internal__c_engine(bench_lbctx, binary_name, "open",
+		bench_paths[i % num_bench_paths].bp_virtual,
+		0/*flags*/, 0/*process_path_for_exec*/,
+		LB_INTERFACE_CLASS_OPEN, &res, 0);
+	free_mapping_results(&res);
+}
+
+static void bench_reverse_path(long i)
+{
+	path_mapping_context_t	ctx;
+	bench_path_t		*bp = &bench_paths[i % num_bench_paths];
+	char			*virtual_path;
+
+	if (!bp->bp_mapped) return;
+	clear_path_mapping_context(&ctx);
+	ctx.pmc_binary_name = binary_name;
+	ctx.pmc_func_name = "realpath";
+	ctx.pmc_fn_class = LB_INTERFACE_CLASS_OPEN;
+	ctx.pmc_virtual_orig_path = "";
+	ctx.pmc_lbctx = bench_lbctx;
+	virtual_path = ldbox_reverse_path_internal__c_engine(&ctx,
+		bp->bp_mapped, 1/*drop_chroot_prefix*/);
+	if (virtual_path) free(virtual_path);
+}
+
+/* ruletree_find_rule() is static; ruletree_get_mapping_requirements()
+ * is the thinnest public layer on top of it. */
+static ruletree_object_offset_t fwd_rule_list_offs = 0;
+
+static void bench_find_rule(long i)
+{
+	path_mapping_context_t	ctx;
+	bench_path_t		*bp = &bench_paths[i % num_bench_paths];
+	int			min_path_len = 0;
+
+	clear_path_mapping_context(&ctx);
+	ctx.pmc_binary_name = binary_name;
+	ctx.pmc_func_name = "open";
+	ctx.pmc_fn_class = LB_INTERFACE_CLASS_OPEN;
+	ctx.pmc_virtual_orig_path = bp->bp_virtual;
+	ctx.pmc_lbctx = bench_lbctx;
+	(void)ruletree_get_mapping_requirements(fwd_rule_list_offs, &ctx,
+		&bp->bp_path_list, &min_path_len, NULL,
+		LB_INTERFACE_CLASS_OPEN);
+}
+
+static void bench_exec_policy_name(long i)
+{
+	bench_path_t	*bp = &bench_paths[i % num_bench_paths];
+
+	if (!bp->bp_mapped) return;
+	(void)find_exec_policy_name(bp->bp_mapped, bp->bp_virtual);
+}
+
+/* prepare_exec() is static; lbshow__execve_mods__() runs the
+ * same sequence (prepare_envp_for_do_exec + prepare_exec) that
+ * the execve() gate does, without the final exec. */
+static char *exec_argv[] = { "true", NULL };
+
+static void bench_prepare_exec(long i)
+{
+	char	*new_file = NULL;
+	char	**new_argv = NULL;
+	char	**new_envp = NULL;
+
+	(void)i;
+	if (lbshow__execve_mods__("/bin/true", exec_argv, environ,
+	    &new_file, &new_argv, &new_envp) == 0) {
+		if (new_file) free(new_file);
+		if (new_argv) free(new_argv);
+		if (new_envp) free(new_envp);
+	}
+}
+
+/* find_net_rule() is static; lb_map_network_addr() is the
+ * function that the connect() etc. gates call. */
+static struct in_addr net_addrs[2];
+static const char *net_addr_strs[2] = { "127.0.0.1", "192.0.2.1" };
+
+static void bench_net_rule(long i)
+{
+	char	buf[200];
+	int	port = 0;
+	int	n = i & 1;
+
+	(void)lb_map_network_addr(binary_name, "connect", NULL, "ipv4_out",
+		net_addr_strs[n], &net_addrs[n], 80,
+		buf, sizeof(buf), &port);
+}
+
+static void bench_rpc_ping(long i)
+{
+	(void)i;
+	ruletree_rpc__ping();
+}
+
+static struct stat rpc_stat_target;
+
+static void bench_rpc_get_inodestat(long i)
+{
+	inodesimu_t	istat;
+
+	(void)i;
+	(void)ruletree_rpc__get_inodestat(rpc_stat_target.st_dev,
+		rpc_stat_target.st_ino, &istat);
+}
+
+/* ---------- setup ---------- */
+
+static int find_liblb_cb(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void)size; /* not used */
+	if (info->dlpi_name && strstr(info->dlpi_name, "liblb.")) {
+		*(int *)data = 1;
+		return(1);
+	}
+	return(0);
+}
+
+static char *read_session_dir_from_file(const char *filename)
+{
+	FILE	*f;
+	char	line[PATH_MAX + 100];
+	char	*result = NULL;
+
+	if ((f = fopen(filename, "r")) == NULL) return(NULL);
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "LDBOX_SESSION_DIR=", 18)) {
+			line[strcspn(line, "\n")] = '\0';
+			result = strdup(line + 18);
+			break;
+		}
+	}
+	fclose(f);
+	return(result);
+}
+
+static void usage_exit(int exitstatus)
+{
+	fprintf(stderr,
+		"Usage:\n\t%s [options] [path...]\n"
+		"Options:\n"
+		"    -J file         read the session directory from a session\n"
+		"                    information file (see lb -S)\n"
+		"    -s session_dir  use 'session_dir'\n"
+		"                    (default: $LDBOX_SESSION_DIR)\n"
+		"    -n iterations   number of iterations per benchmark\n"
+		"                    (default: %ld)\n"
+		"    -b binary_name  binary name used for mapping\n"
+		"    -m mode         mapping mode (default: the session's default)\n"
+		"    -h              print this help\n"
+		"The paths given as arguments replace the default set of paths.\n",
+		progname, iterations);
+	exit(exitstatus);
+}
+
+int main(int argc, char *argv[])
+{
+	int		opt, i;
+	int		liblb_is_preloaded = 0;
+	const char	*session_dir = getenv("LDBOX_SESSION_DIR");
+	const char	*mode = NULL;
+	const char	*errormsg = NULL;
+	char		*rpc_status;
+
+	progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "J:s:n:b:m:h")) != -1) {
+		switch (opt) {
+		case 'J':
+			session_dir = read_session_dir_from_file(optarg);
+			if (!session_dir) {
+				fprintf(stderr, "%s: Failed to read session "
+					"directory from %s\n", progname, optarg);
+				exit(1);
+			}
+			break;
+		case 's': session_dir = optarg; break;
+		case 'n':
+			iterations = atol(optarg);
+			if (iterations < 1) usage_exit(1);
+			break;
+		case 'b': binary_name = optarg; break;
+		case 'm': mode = optarg; break;
+		case 'h': usage_exit(0); break;
+		default: usage_exit(1); break;
+		}
+	}
+
+	dl_iterate_phdr(find_liblb_cb, &liblb_is_preloaded);
+	if (liblb_is_preloaded) {
+		fprintf(stderr, "%s: must be started outside of ldbox "
+			"(use -J or -s to select the session)\n", progname);
+		exit(1);
+	}
+	if (!session_dir) {
+		fprintf(stderr, "%s: No session directory (use -J or -s)\n",
+			progname);
+		exit(1);
+	}
+
+	/* lb_initialize_global_variables() takes these from
+	 * the environment, as in a real session: */
+	setenv("LDBOX_SESSION_DIR", session_dir, 1);
+	if (mode) setenv("LDBOX_SESSION_MODE", mode, 1);
+	setenv("__LB_BINARYNAME", binary_name, 1);
+	lb_initialize_global_variables();
+
+	if (ruletree_to_memory() < 0) {
+		fprintf(stderr, "%s: Failed to attach %s/RuleTree.bin\n",
+			progname, session_dir);
+		exit(1);
+	}
+	fwd_rule_list_offs = ruletree_get_rule_list_offs(1, &errormsg);
+	if (!fwd_rule_list_offs) {
+		fprintf(stderr, "%s: No rules for mode '%s' (%s)\n", progname,
+			(ldbox_session_mode ? ldbox_session_mode : "default"),
+			(errormsg ? errormsg : "no error message"));
+		exit(1);
+	}
+
+	bench_lbctx = get_lbcontext();
+
+	if (optind < argc) {
+		num_bench_paths = argc - optind;
+	} else {
+		while (default_paths[num_bench_paths]) num_bench_paths++;
+	}
+	bench_paths = calloc(num_bench_paths, sizeof(bench_path_t));
+	for (i = 0; i < num_bench_paths; i++) {
+		bench_path_t		*bp = &bench_paths[i];
+		mapping_results_t	res;
+
+		bp->bp_virtual = (optind < argc ?
+			argv[optind + i] : default_paths[i]);
+		split_path_to_path_list(bp->bp_virtual, &bp->bp_path_list);
+
+		/* the reverse mapping and exec policy benchmarks
+		 * need the forward mapping results */
+		clear_mapping_results_struct(&res);
+		ldbox_map_path_internal__c_engine(bench_lbctx, binary_name,
+			"open", bp->bp_virtual, 0, 0,
+			LB_INTERFACE_CLASS_OPEN, &res, 0);
+		if (res.mres_result_path && !res.mres_errormsg)
+			bp->bp_mapped = strdup(res.mres_result_path);
+		free_mapping_results(&res);
+	}
+
+	inet_pton(AF_INET, net_addr_strs[0], &net_addrs[0]);
+	inet_pton(AF_INET, net_addr_strs[1], &net_addrs[1]);
+
+	printf("# lb-bench: session=%s mode=%s net_mode=%s paths=%d\n",
+		session_dir,
+		(ldbox_session_mode ? ldbox_session_mode : "default"),
+		(ldbox_network_mode ? ldbox_network_mode : "default"),
+		num_bench_paths);
+	printf("# name\titerations\ttotal_ns\tns_per_op\tstatus\n");
+
+	run_bench("map_path_c_engine", bench_map_path);
+	run_bench("reverse_path_c_engine", bench_reverse_path);
+	run_bench("ruletree_find_rule", bench_find_rule);
+	run_bench("find_exec_policy_name", bench_exec_policy_name);
+	run_bench("prepare_exec", bench_prepare_exec);
+	run_bench("find_net_rule", bench_net_rule);
+
+	/* RPC benchmarks need a running lbrdbd; the stats
+	 * command is used as a probe, it fails cleanly. */
+	rpc_status = ruletree_rpc__stats();
+	if (!rpc_status) {
+		report_skipped("rpc_ping", "lbrdbd is not running");
+		report_skipped("rpc_vperm_get_inodestat",
+			"lbrdbd is not running");
+	} else {
+		free(rpc_status);
+		run_bench("rpc_ping", bench_rpc_ping);
+		if (real_stat(session_dir, &rpc_stat_target) == 0)
+			run_bench("rpc_vperm_get_inodestat",
+				bench_rpc_get_inodestat);
+		else
+			report_skipped("rpc_vperm_get_inodestat",
+				"stat failed");
+	}
+
+	release_lbcontext(bench_lbctx);
+	return(0);
+}
@@ -54,6 +54,13 @@ int open_nomap_nolog(const char *pathname, int flags, mode_t mode)
 	return open(pathname, flags, mode);
 }
 
+extern int close_nomap_nolog(int fd);
+
+int close_nomap_nolog(int fd)
+{
+	return close(fd);
+}
+
 char *ldbox_session_dir = NULL; /* Fake var, referenced by the library=>must have something*/
 
 /* -------------------- */
@@ -600,6 +607,61 @@ static void dump_bintree(ruletree_object_offset_t tree_offs, int indent,
 	printf("}\n");
 }
 
+static void dump_inodestat_index(ruletree_object_offset_t idx_offs, int indent)
+{
+	ruletree_inodestat_index_t	*idx;
+	ruletree_inodestat_buckets_t	*tbl;
+	ruletree_inodestat_buckets_t	*ovtbl;
+	uint32_t	b;
+	int		max_chain = 0;
+
+	idx = offset_to_ruletree_object_ptr(idx_offs,
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_INDEX);
+	tbl = idx ? offset_to_ruletree_object_ptr(idx->rtree_isi_buckets,
+		LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS) : NULL;
+
+	print_indent(indent);
+	if (!tbl) {
+		printf("{ INVALID, not an inodestat index [%u]}\n", (unsigned)idx_offs);
+		return;
+	}
+	printf("{ inodestat index");
+	if (print_ruletree_offsets) {
+		printf("[%u]", (unsigned)idx_offs);
+	}
+	printf("\n");
+	for (b = 0; b < tbl->rtree_isbs_num_buckets; b++) {
+		ruletree_inodestat_bucket_t *bp =
+			(ruletree_inodestat_bucket_t*)(tbl + 1) + b;
+		int	chain = 0;
+
+		while (bp) {
+			int	i;
+
+			chain++;
+			for (i = 0; i < RULETREE_INODESTAT_BUCKET_ENTRIES; i++) {
+				if (!bp->rtree_isb_value[i]) break;
+				print_indent(indent+1);
+				print_ruletree_object_type(bp->rtree_isb_value[i]);
+				printf("\n");
+			}
+			if (!bp->rtree_isb_overflow) break;
+			ovtbl = offset_to_ruletree_object_ptr(bp->rtree_isb_overflow,
+				LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS);
+			bp = ovtbl ? (ruletree_inodestat_bucket_t*)(ovtbl + 1) : NULL;
+		}
+		if (max_chain < chain) max_chain = chain;
+	}
+	print_indent(indent);
+	printf("  Index entries = %u, buckets = %u, overflow buckets = %u,"
+		" longest chain = %d, resizes = %u\n",
+		idx->rtree_isi_num_entries, tbl->rtree_isbs_num_buckets,
+		idx->rtree_isi_num_overflow_buckets, max_chain,
+		idx->rtree_isi_num_resizes);
+	print_indent(indent);
+	printf("}\n");
+}
+
 static void print_ruletree_object_type(ruletree_object_offset_t obj_offs)
 {
 	ruletree_object_hdr_t *hdr;
@@ -635,6 +697,45 @@ static void print_ruletree_object_type(ruletree_object_offset_t obj_offs)
 		case LB_RULETREE_OBJECT_TYPE_BINTREE:
 			printf("BINTREE");
 			break;
+		case LB_RULETREE_OBJECT_TYPE_INODESTAT_INDEX:
+			printf("INODESTAT_INDEX");
+			break;
+		case LB_RULETREE_OBJECT_TYPE_INODESTAT_BUCKETS:
+			printf("INODESTAT_BUCKETS");
+			break;
+		case LB_RULETREE_OBJECT_TYPE_FSRULE_INDEX:
+			{
+				ruletree_fsrule_index_t *idx;
+
+				idx = (ruletree_fsrule_index_t*)hdr;
+				printf("FSRULE_INDEX: list=%u (%u rules) nodes=%u refs=%u",
+					idx->rtree_fri_rule_list_offs,
+					idx->rtree_fri_rule_list_size,
+					idx->rtree_fri_num_nodes,
+					idx->rtree_fri_num_refs);
+			}
+			break;
+		case LB_RULETREE_OBJECT_TYPE_EXEC_PP_HASH:
+			{
+				ruletree_exec_pp_hash_t *hp;
+
+				hp = (ruletree_exec_pp_hash_t*)hdr;
+				printf("EXEC_PP_HASH: list=%u (%u rules) slots=%u",
+					hp->rtree_xph_rule_list_offs,
+					hp->rtree_xph_rule_list_size,
+					hp->rtree_xph_num_slots);
+			}
+			break;
+		case LB_RULETREE_OBJECT_TYPE_NET_RULE_INDEX:
+			{
+				ruletree_net_rule_index_t *idx;
+
+				idx = (ruletree_net_rule_index_t*)hdr;
+				printf("NET_RULE_INDEX: list=%u (%u rules)",
+					idx->rtree_nri_rule_list_offs,
+					idx->rtree_nri_rule_list_size);
+			}
+			break;
 		case LB_RULETREE_OBJECT_TYPE_INODESTAT:
 			{
 				ruletree_inodestat_t *fsp;
@@ -712,6 +813,9 @@ static void print_ruletree_object_recurse(int indent, const char *name, ruletree
 		case LB_RULETREE_OBJECT_TYPE_BINTREE:
 			dump_bintree(obj_offs, indent, 1, NULL, NULL);
 			break;
+		case LB_RULETREE_OBJECT_TYPE_INODESTAT_INDEX:
+			dump_inodestat_index(obj_offs, indent);
+			break;
 		default:
 			/* ignore it. */
 			break;
@@ -15,9 +15,14 @@
 #include <sys/time.h>
 #include <sys/vfs.h>
 #include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include "exported.h"
 #include "lb.h"
+#include "lb_gatestats.h"
 #include "ldbox_version.h"
 
 #ifdef HAVE_CRT_EXTERNS_H
@@ -83,6 +88,12 @@ LIBLB_CALLER(char *, lbshow__reverse_path__,
 	(func_name, abs_path, classmask),
 	NULL)
 
+/* create call_lbshow__reverse_cache_stats__() */
+LIBLB_CALLER(int, lbshow__reverse_cache_stats__,
+	(uint64_t *hits, uint64_t *misses),
+	(hits, misses),
+	-1)
+
 /* create call_lbshow__execve_mods__() */
 LIBLB_CALLER(int, lbshow__execve_mods__,
 	(char *file, char *const *orig_argv, char *const *orig_envp,
@@ -596,6 +607,233 @@ static int cmd_reverse(const command_table_t *cmdp, const cmdline_options_t *opt
 	return(0);
 }
 
+static int cmd_cachestats(const command_table_t *cmdp, const cmdline_options_t *opts,
+			int cmd_argc, char *cmd_argv[])
+{
+	uint64_t	hits = 0;
+	uint64_t	misses = 0;
+
+	(void)cmdp;
+	(void)opts;
+	(void)cmd_argc;
+	(void)cmd_argv;
+	if (call_lbshow__reverse_cache_stats__(&hits, &misses) < 0) {
+		fprintf(stderr, "lb-show: Cache statistics are not available\n");
+		return(1);
+	}
+	/* processes add their counters when they exit */
+	printf("reverse mapping cache: hits=%llu misses=%llu",
+		(unsigned long long)hits, (unsigned long long)misses);
+	if (hits + misses)
+		printf(" hit rate=%.1f%%",
+			(100.0 * hits) / (double)(hits + misses));
+	printf("\n");
+	return(0);
+}
+
+/* ---------- "stats": per-gate counters ---------- */
+
+typedef struct gatestats_sum_s {
+	char			*gss_name;
+	lb_gatestats_counters_t	gss_c;
+} gatestats_sum_t;
+
+static gatestats_sum_t *gatestats_find_sum(gatestats_sum_t **sums,
+	int *num_sums, const char *name)
+{
+	gatestats_sum_t	*gs;
+	int		i;
+
+	for (i = 0; i < *num_sums; i++)
+		if (!strcmp((*sums)[i].gss_name, name)) return(&(*sums)[i]);
+	*sums = realloc(*sums, (*num_sums + 1) * sizeof(gatestats_sum_t));
+	gs = &(*sums)[(*num_sums)++];
+	memset(gs, 0, sizeof(*gs));
+	gs->gss_name = strdup(name);
+	return(gs);
+}
+
+/* Add counters of one GateStats file to "sums".
+ * The file is read-only mapped; the counters are live. */
+static int gatestats_add_file(const char *path,
+	gatestats_sum_t **sums, int *num_sums)
+{
+	const lb_gatestats_header_t *hdr;
+	struct stat	st;
+	const char	*name, *names_end;
+	unsigned int	gate, slot;
+	int		fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return(-1);
+	if ((fstat(fd, &st) < 0) ||
+	    (st.st_size < LB_GATESTATS_HEADER_SIZE)) {
+		close(fd);
+		return(-1);
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) return(-1);
+
+	if ((hdr->lbgh_magic != LB_GATESTATS_MAGIC) ||
+	    (hdr->lbgh_version != LB_GATESTATS_VERSION) ||
+	    (hdr->lbgh_counters_size != sizeof(lb_gatestats_counters_t)) ||
+	    (hdr->lbgh_file_size != (uint64_t)st.st_size) ||
+	    (hdr->lbgh_names_offs > hdr->lbgh_counters_offs) ||
+	    (hdr->lbgh_counters_offs + (uint64_t)hdr->lbgh_num_slots *
+		hdr->lbgh_num_gates * sizeof(lb_gatestats_counters_t) >
+		(uint64_t)st.st_size)) {
+		fprintf(stderr, "lb-show: %s: unknown format\n", path);
+		munmap((void *)hdr, st.st_size);
+		return(-1);
+	}
+
+	name = (const char *)hdr + hdr->lbgh_names_offs;
+	names_end = (const char *)hdr + hdr->lbgh_counters_offs;
+	for (gate = 0; gate < hdr->lbgh_num_gates; gate++) {
+		gatestats_sum_t	*gs;
+
+		if (!memchr(name, '\0', names_end - name)) break;
+		gs = gatestats_find_sum(sums, num_sums, name);
+		for (slot = 0; slot < hdr->lbgh_num_slots; slot++) {
+			const lb_gatestats_counters_t *c =
+				lb_gatestats_counters(hdr, slot, gate);
+
+			gs->gss_c.lbgc_calls += c->lbgc_calls;
+			gs->gss_c.lbgc_mapped += c->lbgc_mapped;
+			gs->gss_c.lbgc_unmapped += c->lbgc_unmapped;
+			gs->gss_c.lbgc_errors += c->lbgc_errors;
+			gs->gss_c.lbgc_total_ns += c->lbgc_total_ns;
+			for (i = 0; i < LB_GATESTATS_HIST_BUCKETS; i++)
+				gs->gss_c.lbgc_hist[i] += c->lbgc_hist[i];
+		}
+		name += strlen(name) + 1;
+	}
+	munmap((void *)hdr, st.st_size);
+	return(0);
+}
+
+static int compar_gatestats_sums(const void *e1, const void *e2)
+{
+	const gatestats_sum_t *gs1 = e1;
+	const gatestats_sum_t *gs2 = e2;
+
+	if (gs1->gss_c.lbgc_total_ns != gs2->gss_c.lbgc_total_ns)
+		return(gs1->gss_c.lbgc_total_ns < gs2->gss_c.lbgc_total_ns ?
+			1 : -1);
+	return(strcmp(gs1->gss_name, gs2->gss_name));
+}
+
+/* Upper limit of the histogram bucket where percentile "pct" is reached */
+static uint64_t gatestats_percentile(const lb_gatestats_counters_t *c,
+	unsigned int pct)
+{
+	uint64_t	limit = (c->lbgc_calls * pct + 99) / 100;
+	uint64_t	n = 0;
+	int		i;
+
+	for (i = 0; i < LB_GATESTATS_HIST_BUCKETS; i++) {
+		n += c->lbgc_hist[i];
+		if (n >= limit) break;
+	}
+	if (i >= LB_GATESTATS_HIST_BUCKETS) i = LB_GATESTATS_HIST_BUCKETS - 1;
+	return(2ULL << i);
+}
+
+static void gatestats_print_histogram(const gatestats_sum_t *gs)
+{
+	int	i;
+
+	printf("\n%s: %llu calls\n", gs->gss_name,
+		(unsigned long long)gs->gss_c.lbgc_calls);
+	for (i = 0; i < LB_GATESTATS_HIST_BUCKETS; i++) {
+		if (!gs->gss_c.lbgc_hist[i]) continue;
+		if (i == LB_GATESTATS_HIST_BUCKETS - 1)
+			printf("  >= %12llu ns", 1ULL << i);
+		else
+			printf("  < %13llu ns", 2ULL << i);
+		printf(" %12llu %5.1f%%\n",
+			(unsigned long long)gs->gss_c.lbgc_hist[i],
+			(100.0 * gs->gss_c.lbgc_hist[i]) /
+				(double)gs->gss_c.lbgc_calls);
+	}
+}
+
+static int cmd_stats(const command_table_t *cmdp, const cmdline_options_t *opts,
+			int cmd_argc, char *cmd_argv[])
+{
+	const char	*session_dir = getenv("LDBOX_SESSION_DIR");
+	gatestats_sum_t	*sums = NULL;
+	int		num_sums = 0;
+	int		num_files = 0;
+	DIR		*dir;
+	struct dirent	*de;
+	int		i;
+
+	(void)cmdp;
+	(void)opts;
+	if (!session_dir || !(dir = opendir(session_dir))) {
+		fprintf(stderr, "lb-show: Can't open the session directory\n");
+		return(1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		char	*path = NULL;
+		size_t	len = strlen(de->d_name);
+
+		if (strncmp(de->d_name, "GateStats-", 10) || (len < 4) ||
+		    strcmp(de->d_name + len - 4, ".bin"))
+			continue;
+		if (asprintf(&path, "%s/%s", session_dir, de->d_name) < 0)
+			continue;
+		if (gatestats_add_file(path, &sums, &num_sums) == 0)
+			num_files++;
+		free(path);
+	}
+	closedir(dir);
+	if (!num_files) {
+		fprintf(stderr, "lb-show: Gate statistics are not available\n");
+		return(1);
+	}
+	if (num_sums > 0)
+		qsort(sums, num_sums, sizeof(gatestats_sum_t),
+			compar_gatestats_sums);
+
+	/* p50 and p99 are upper limits of histogram buckets */
+	printf("%-24s %10s %10s %10s %8s %11s %9s %9s %9s\n",
+		"gate", "calls", "mapped", "unmapped", "errno",
+		"total_ms", "avg_ns", "p50_ns", "p99_ns");
+	for (i = 0; i < num_sums; i++) {
+		const lb_gatestats_counters_t *c = &sums[i].gss_c;
+
+		if (!c->lbgc_calls) continue;
+		printf("%-24s %10llu %10llu %10llu %8llu %11.3f %9llu %9llu %9llu\n",
+			sums[i].gss_name,
+			(unsigned long long)c->lbgc_calls,
+			(unsigned long long)c->lbgc_mapped,
+			(unsigned long long)c->lbgc_unmapped,
+			(unsigned long long)c->lbgc_errors,
+			c->lbgc_total_ns / 1000000.0,
+			(unsigned long long)(c->lbgc_total_ns / c->lbgc_calls),
+			(unsigned long long)gatestats_percentile(c, 50),
+			(unsigned long long)gatestats_percentile(c, 99));
+	}
+
+	/* histograms of the named gates */
+	while (--cmd_argc > 0) {
+		cmd_argv++;
+		for (i = 0; i < num_sums; i++)
+			if (!strcmp(sums[i].gss_name, *cmd_argv)) break;
+		if ((i >= num_sums) || !sums[i].gss_c.lbgc_calls)
+			printf("\n%s: no calls\n", *cmd_argv);
+		else
+			gatestats_print_histogram(&sums[i]);
+	}
+
+	for (i = 0; i < num_sums; i++) free(sums[i].gss_name);
+	free(sums);
+	return(0);
+}
+
 static int cmd_binarytype(const command_table_t *cmdp, const cmdline_options_t *opts,
 			int cmd_argc, char *cmd_argv[])
 {
@@ -943,6 +1181,10 @@ const command_table_t commands[] = {
 	{ "binarytype",	1,		1,	9999,	cmd_binarytype,
 	  "\tbinarytype realpath    detect & show type of program at\n"
 	  "\t                       'realpath' (already mapped path)"},
+	{ "cachestats",	1,		1,	1,	cmd_cachestats,
+	  "\tcachestats             show hit rate of the reverse mapping\n"
+	  "\t                       caches (session totals of exited\n"
+	  "\t                       processes)"},
 	{ "exec",	1,		1,	9999,	cmd_exec,
 	  "\texec file [argv1] [argv2]..\n"
 	  "\t                       show execve() modifications"},
@@ -979,6 +1221,10 @@ const command_table_t commands[] = {
 	{ "start", 	1,		2,	9999,	cmd_start,
 	  "\tstart command [params] Execute 'command' (this is used internally\n"
 	  "\t                       during session startup)"},
+	{ "stats", 	1,		1,	9999,	cmd_stats,
+	  "\tstats [gate1] [gate2].. show call counts and latencies of\n"
+	  "\t                       the gates (all processes of the\n"
+	  "\t                       session); histograms of named gates"},
 	{ "var",	1,		2,	2,	cmd_var,
 	  "\tvar variablename       show value of a string variable"},
 	{ "verify-pathlist-mappings",1,	2,	9999,	cmd_verify_pathlist_mappings,
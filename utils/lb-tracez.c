@@ -0,0 +1,591 @@
+/*
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+/* lb-tracez, Trace Analyzer.
+ *
+ * Reads a binary trace ring (see include/lb_trace.h and option -Y
+ * of lb) and writes the same summaries that lb-logz produces from
+ * a text log: mapped, passed and disabled paths and process
+ * statistics. Strings are interned in the trace, so everything
+ * is collected by string ids and strings are needed only for output.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "lb_trace.h"
+
+static const char *progname = NULL;
+
+static const lb_trace_header_t *trace_hdr = NULL;
+
+static int opt_verbose = 0;
+static int opt_print_mapped_paths = 0;
+static int opt_print_revmap_paths = 0;
+static int opt_print_passed_paths = 0;
+static int opt_print_disabled_paths = 0;
+static int opt_print_full_details = 0;
+static int opt_print_process_statistics = 0;
+
+/* functions that should be ignored unless -b is specified: */
+static const char *default_blacklist[] = {
+	"__xstat", "__xstat64", "__lxstat", "__lxstat64", NULL
+};
+static const char **blacklist = default_blacklist;
+
+/* ---------- Sets and maps of string ids ---------- */
+
+typedef struct {
+	uint32_t	*ids_ids;
+	uint32_t	ids_num;
+	uint32_t	ids_max;
+} id_set_t;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(1);
+	}
+	return(ptr);
+}
+
+static void id_set_append(id_set_t *set, uint32_t id)
+{
+	if (set->ids_num >= set->ids_max) {
+		set->ids_max = set->ids_max ? set->ids_max * 2 : 4;
+		set->ids_ids = xrealloc(set->ids_ids,
+			set->ids_max * sizeof(uint32_t));
+	}
+	set->ids_ids[set->ids_num++] = id;
+}
+
+/* These sets are small (functions and processes of one path) */
+static void id_set_add(id_set_t *set, uint32_t id)
+{
+	uint32_t	i;
+
+	for (i = 0; i < set->ids_num; i++)
+		if (set->ids_ids[i] == id) return;
+	id_set_append(set, id);
+}
+
+/* map from an id to a value, open addressing; key 0 is not allowed */
+typedef struct {
+	uint32_t	*idm_keys;
+	uint32_t	*idm_values;
+	uint32_t	idm_num;
+	uint32_t	idm_size;	/* a power of two */
+} id_map_t;
+
+static uint32_t *id_map_get(id_map_t *map, uint32_t key, int create)
+{
+	uint32_t	i;
+
+	if (create && (map->idm_num * 2 >= map->idm_size)) {
+		id_map_t	old = *map;
+
+		map->idm_size = old.idm_size ? old.idm_size * 2 : 1024;
+		map->idm_keys = calloc(map->idm_size, sizeof(uint32_t));
+		map->idm_values = calloc(map->idm_size, sizeof(uint32_t));
+		if (!map->idm_keys || !map->idm_values) xrealloc(NULL, 0);
+		map->idm_num = 0;
+		for (i = 0; i < old.idm_size; i++)
+			if (old.idm_keys[i])
+				*id_map_get(map, old.idm_keys[i], 1) =
+					old.idm_values[i];
+		free(old.idm_keys);
+		free(old.idm_values);
+	}
+	if (!map->idm_size) return(NULL);
+	i = (key * 2654435761U) & (map->idm_size - 1);
+	while (map->idm_keys[i]) {
+		if (map->idm_keys[i] == key) return(&map->idm_values[i]);
+		i = (i + 1) & (map->idm_size - 1);
+	}
+	if (!create) return(NULL);
+	map->idm_keys[i] = key;
+	map->idm_num++;
+	return(&map->idm_values[i]);
+}
+
+/* ---------- Path statistics ---------- */
+
+typedef struct {
+	uint32_t	ps_path;
+	uint32_t	ps_count;
+	id_set_t	ps_procs;
+	id_set_t	ps_fn_names;
+	id_set_t	ps_refs;
+} path_stats_t;
+
+typedef struct {
+	id_map_t	pt_index;	/* path id -> index+1 */
+	path_stats_t	*pt_paths;
+	uint32_t	pt_num;
+	uint32_t	pt_max;
+} path_table_t;
+
+static path_table_t mapped_src_paths;
+static path_table_t mapped_dest_paths;
+static path_table_t passed_paths;
+static path_table_t disabled_paths;
+
+static void path_accessed(path_table_t *tbl, uint32_t fn_name,
+	uint32_t procname, uint32_t path, uint32_t reference)
+{
+	uint32_t	*idxp;
+	path_stats_t	*ps;
+
+	if (!path) return; /* string table was full */
+	idxp = id_map_get(&tbl->pt_index, path, 1);
+
+	if (!*idxp) {
+		if (tbl->pt_num >= tbl->pt_max) {
+			tbl->pt_max = tbl->pt_max ? tbl->pt_max * 2 : 1024;
+			tbl->pt_paths = xrealloc(tbl->pt_paths,
+				tbl->pt_max * sizeof(path_stats_t));
+		}
+		ps = &tbl->pt_paths[tbl->pt_num++];
+		memset(ps, 0, sizeof(*ps));
+		ps->ps_path = path;
+		*idxp = tbl->pt_num;
+	} else {
+		ps = &tbl->pt_paths[*idxp - 1];
+	}
+	ps->ps_count++;
+	id_set_add(&ps->ps_procs, procname);
+	id_set_add(&ps->ps_fn_names, fn_name);
+	if (reference) id_set_add(&ps->ps_refs, reference);
+}
+
+static const char *str(uint32_t id)
+{
+	const char *cp = lb_trace_string(trace_hdr, id);
+
+	return(cp ? cp : "");
+}
+
+static int compare_path_stats(const void *a, const void *b)
+{
+	return(strcmp(str(((const path_stats_t *)a)->ps_path),
+		str(((const path_stats_t *)b)->ps_path)));
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+	return(strcmp(str(*(const uint32_t *)a), str(*(const uint32_t *)b)));
+}
+
+static void sort_path_table(path_table_t *tbl)
+{
+	/* the index is not needed anymore after sorting */
+	qsort(tbl->pt_paths, tbl->pt_num, sizeof(path_stats_t),
+		compare_path_stats);
+}
+
+static void print_id_set(const char *prefix, id_set_t *set,
+	const char *separator, const char *suffix)
+{
+	uint32_t	i;
+
+	qsort(set->ids_ids, set->ids_num, sizeof(uint32_t), compare_ids);
+	printf("%s", prefix);
+	for (i = 0; i < set->ids_num; i++)
+		printf("%s%s", (i ? separator : ""), str(set->ids_ids[i]));
+	printf("%s", suffix);
+}
+
+/* print references and refering function names */
+static void print_details(path_stats_t *ps, const char *arrow)
+{
+	uint32_t	i;
+
+	qsort(ps->ps_refs.ids_ids, ps->ps_refs.ids_num, sizeof(uint32_t),
+		compare_ids);
+	for (i = 0; i < ps->ps_refs.ids_num; i++)
+		printf("    %2s\t%s\n", arrow, str(ps->ps_refs.ids_ids[i]));
+	print_id_set("\t[", &ps->ps_fn_names, ",", "]\n");
+	print_id_set("\t[", &ps->ps_procs, ",", "]\n");
+}
+
+static void check_multiple_refs(path_table_t *tbl, const char *name_txt,
+	const char *ref_txt, const char *arrow)
+{
+	uint32_t	i;
+	int		header_printed = 0;
+
+	for (i = 0; i < tbl->pt_num; i++) {
+		path_stats_t *ps = &tbl->pt_paths[i];
+
+		if (ps->ps_refs.ids_num <= 1) continue;
+		if (!header_printed) {
+			printf("\nNOTICE: Following %s have been mapped %s:\n",
+				name_txt, ref_txt);
+			header_printed = 1;
+		}
+		printf("\t%s\n", str(ps->ps_path));
+		if (opt_print_full_details) {
+			print_details(ps, arrow);
+			printf("\n");
+		}
+	}
+}
+
+static void print_all_paths(path_table_t *tbl, const char *name_txt,
+	const char *arrow)
+{
+	uint32_t	i;
+
+	printf("\n%s (#used, pathname):\n", name_txt);
+	for (i = 0; i < tbl->pt_num; i++) {
+		path_stats_t *ps = &tbl->pt_paths[i];
+
+		printf("%u\t%s\n", ps->ps_count, str(ps->ps_path));
+		if (opt_print_full_details) {
+			print_details(ps, arrow);
+			printf("\n");
+		}
+	}
+}
+
+/* ---------- Processes ---------- */
+
+static id_map_t argv0_counters;	/* process name -> count */
+static id_set_t process_names;	/* keys of argv0_counters */
+static id_map_t active_processes; /* pid -> process name */
+static uint32_t num_processes = 0;
+static int first_process_seen = 0;
+static uint32_t mapping_mode = 0;
+
+static int is_internal_process(const char *procname,
+	const char *exec_policy_name)
+{
+	size_t	len = strlen(procname);
+
+	/* lb's internal, initialization-phase processes */
+	if (!strncmp(procname, "lb:", 3) &&
+	    procname[3] >= 'A' && procname[3] <= 'Z')
+		return(1);
+	/* the "trampoline" shell started in the beginning */
+	if ((len >= 2) && !strcmp(procname + len - 2, "sh") &&
+	    !*exec_policy_name)
+		return(1);
+	return(0);
+}
+
+static void process_started(const lb_trace_record_t *rec)
+{
+	uint32_t	*countp;
+
+	if (!first_process_seen) {
+		if (is_internal_process(str(rec->lbtr_proc),
+				str(rec->lbtr_vpath)))
+			return;
+		first_process_seen = 1;
+	}
+	if (!mapping_mode) mapping_mode = rec->lbtr_mpath;
+	num_processes++;
+	if (rec->lbtr_proc) {
+		countp = id_map_get(&argv0_counters, rec->lbtr_proc, 1);
+		if (!*countp) id_set_append(&process_names, rec->lbtr_proc);
+		(*countp)++;
+	}
+	if (rec->lbtr_pid)
+		*id_map_get(&active_processes, rec->lbtr_pid, 1) =
+			rec->lbtr_proc ? rec->lbtr_proc : (uint32_t)-1;
+}
+
+static void process_exited(uint32_t pid)
+{
+	uint32_t	*p = id_map_get(&active_processes, pid, 0);
+
+	if (p) *p = 0;
+}
+
+/* ---------- Main ---------- */
+
+static id_map_t blacklisted_fns; /* function name -> 1=ignore, 2=use */
+
+static int fn_is_blacklisted(uint32_t fn_name)
+{
+	uint32_t	*p = id_map_get(&blacklisted_fns, fn_name ? fn_name : ~0U, 1);
+
+	if (!*p) {
+		const char	**bl;
+
+		*p = 2;
+		for (bl = blacklist; *bl; bl++)
+			if (!strcmp(*bl, str(fn_name))) *p = 1;
+	}
+	return(*p == 1);
+}
+
+static void print_timestamp(uint64_t time_us)
+{
+	printf("%u.%03u", (unsigned int)(time_us / 1000000),
+		(unsigned int)((time_us % 1000000) / 1000));
+}
+
+static void usage_exit(int status)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"\t%s [options] [trace-file]\n"
+		"(default trace-file is $LDBOX_TRACE_RING, which is\n"
+		"set by option '-Y' of lb)\n"
+		"Options:\n"
+		"\t-b\tno blacklist: do not ignore records from __xstat etc\n"
+		"\t-B fn1,fn2,..\tblacklist funcions fn1,..: ignore their records\n"
+		"\t-h\tdisplay this help text\n"
+		"\t-i\tprint details about 'disabled' pathnames\n"
+		"\t\t(unmodifed paths, because mapping was disabled)\n"
+		"\t-l\tprint long details (affect output of -i,-m,-r,-p)\n"
+		"\t-m\tprint details about mapped pathnames (src->dest)\n"
+		"\t-p\tprint details about passed pathnames\n"
+		"\t\t('passed' path = not mapped)\n"
+		"\t-r\tprint reversed mappings (dest->src)\n"
+		"\t-s\tprint process statistics\n"
+		"\t-v\tverbose mode, prints statistics of the trace itself\n",
+		progname);
+	exit(status);
+}
+
+static const char **parse_blacklist(char *list)
+{
+	const char	**bl;
+	char		*cp;
+	int		n = 1;
+
+	for (cp = list; *cp; cp++)
+		if (*cp == ',') n++;
+	bl = xrealloc(NULL, (n + 1) * sizeof(char *));
+	n = 0;
+	for (cp = strtok(list, ","); cp; cp = strtok(NULL, ","))
+		bl[n++] = cp;
+	bl[n] = NULL;
+	return(bl);
+}
+
+int main(int argc, char *argv[])
+{
+	int		opt;
+	const char	*trace_file = NULL;
+	int		fd;
+	struct stat	st;
+	const lb_trace_record_t *records;
+	uint64_t	next, first, idx;
+	uint64_t	num_read = 0, num_skipped = 0;
+	uint64_t	first_time = 0, last_time = 0;
+	uint32_t	mask;
+	uint32_t	i;
+	static const char *no_blacklist[] = { NULL };
+
+	progname = argv[0];
+
+	while ((opt = getopt(argc, argv, "bB:hilmprsv")) != -1) {
+		switch (opt) {
+		case 'b': blacklist = no_blacklist; break;
+		case 'B': blacklist = parse_blacklist(optarg); break;
+		case 'h': usage_exit(0); break;
+		case 'i': opt_print_disabled_paths = 1; break;
+		case 'l': opt_print_full_details = 1; break;
+		case 'm': opt_print_mapped_paths = 1; break;
+		case 'p': opt_print_passed_paths = 1; break;
+		case 'r': opt_print_revmap_paths = 1; break;
+		case 's': opt_print_process_statistics = 1; break;
+		case 'v': opt_verbose = 1; break;
+		default: usage_exit(1); break;
+		}
+	}
+	if (optind < argc) {
+		trace_file = argv[optind];
+	} else if (getenv("LDBOX_TRACE_RING")) {
+		trace_file = getenv("LDBOX_TRACE_RING");
+	} else {
+		usage_exit(1);
+	}
+
+	fd = open(trace_file, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		fprintf(stderr, "%s: Can't open %s\n", progname, trace_file);
+		exit(1);
+	}
+	if (st.st_size < LB_TRACE_HEADER_SIZE) {
+		fprintf(stderr, "%s: %s is not a trace file\n",
+			progname, trace_file);
+		exit(1);
+	}
+	trace_hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (trace_hdr == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(%s) failed\n", progname, trace_file);
+		exit(1);
+	}
+	close(fd);
+	if ((trace_hdr->lbth_magic != LB_TRACE_MAGIC) ||
+	    (trace_hdr->lbth_version != LB_TRACE_VERSION) ||
+	    (trace_hdr->lbth_record_size != sizeof(lb_trace_record_t)) ||
+	    (trace_hdr->lbth_file_size != (uint64_t)st.st_size)) {
+		fprintf(stderr, "%s: %s is not a trace file, or has"
+			" a wrong version\n", progname, trace_file);
+		exit(1);
+	}
+
+	/* Read the records that are still in the ring. Records that are
+	 * being written (by processes that are still running) or have
+	 * been overwritten while we read them are skipped. */
+	records = lb_trace_records(trace_hdr);
+	mask = trace_hdr->lbth_num_records - 1;
+	next = trace_hdr->lbth_next_record;
+	first = (next > trace_hdr->lbth_num_records) ?
+		next - trace_hdr->lbth_num_records : 0;
+	for (idx = first; idx < next; idx++) {
+		const lb_trace_record_t *rec = &records[idx & mask];
+
+		if (rec->lbtr_seq != idx + 1) {
+			num_skipped++;
+			continue;
+		}
+		num_read++;
+		if (!first_time || rec->lbtr_time_us < first_time)
+			first_time = rec->lbtr_time_us;
+		if (rec->lbtr_time_us > last_time)
+			last_time = rec->lbtr_time_us;
+
+		switch (rec->lbtr_type) {
+		case LB_TRACE_REC_START:
+			process_started(rec);
+			break;
+		case LB_TRACE_REC_MAPPED:
+			if (fn_is_blacklisted(rec->lbtr_func)) break;
+			path_accessed(&mapped_src_paths, rec->lbtr_func,
+				rec->lbtr_proc, rec->lbtr_vpath, rec->lbtr_mpath);
+			path_accessed(&mapped_dest_paths, rec->lbtr_func,
+				rec->lbtr_proc, rec->lbtr_mpath, rec->lbtr_vpath);
+			break;
+		case LB_TRACE_REC_PASS:
+			if (fn_is_blacklisted(rec->lbtr_func)) break;
+			path_accessed(&passed_paths, rec->lbtr_func,
+				rec->lbtr_proc, rec->lbtr_vpath, 0);
+			break;
+		case LB_TRACE_REC_DISABLED:
+			if (fn_is_blacklisted(rec->lbtr_func)) break;
+			path_accessed(&disabled_paths, rec->lbtr_func,
+				rec->lbtr_proc, rec->lbtr_vpath, 0);
+			break;
+		case LB_TRACE_REC_EXIT:
+			process_exited(rec->lbtr_pid);
+			break;
+		case LB_TRACE_REC_CHILD:
+			process_exited(rec->lbtr_arg);
+			break;
+		}
+	}
+
+	if (opt_verbose) {
+		printf("Read %llu records", (unsigned long long)num_read);
+		if (first)
+			printf(", %llu older records were overwritten",
+				(unsigned long long)first);
+		if (num_skipped)
+			printf(", %llu incomplete records skipped",
+				(unsigned long long)num_skipped);
+		printf(".\n");
+		if (trace_hdr->lbth_strings_dropped)
+			printf("%u strings were dropped (string table was full)\n",
+				trace_hdr->lbth_strings_dropped);
+	}
+
+	sort_path_table(&mapped_src_paths);
+	sort_path_table(&mapped_dest_paths);
+	sort_path_table(&passed_paths);
+	sort_path_table(&disabled_paths);
+
+	printf("\nMapping mode = %s,\n\tTimeframe: ",
+		mapping_mode ? str(mapping_mode) : "UNKNOWN");
+	print_timestamp(first_time);
+	printf(" ... ");
+	print_timestamp(last_time);
+	printf(",\n");
+	printf("Number of processes: %u\n", num_processes);
+
+	if (opt_print_process_statistics) {
+		uint32_t	num_unknown = 0;
+
+		printf("\tNumber of instances, process name:\n");
+		qsort(process_names.ids_ids, process_names.ids_num,
+			sizeof(uint32_t), compare_ids);
+		for (i = 0; i < process_names.ids_num; i++)
+			printf("\t\t%u\t%s\n",
+				*id_map_get(&argv0_counters,
+					process_names.ids_ids[i], 0),
+				str(process_names.ids_ids[i]));
+		for (i = 0; i < active_processes.idm_size; i++)
+			if (active_processes.idm_keys[i] &&
+			    active_processes.idm_values[i])
+				num_unknown++;
+		if (num_unknown > 0) {
+			printf("\t%u processes with unknown exit status"
+				" (or still active):\n", num_unknown);
+			for (i = 0; i < active_processes.idm_size; i++)
+				if (active_processes.idm_keys[i] &&
+				    active_processes.idm_values[i])
+					printf("\t\t%u\t%s\n",
+						active_processes.idm_keys[i],
+						str(active_processes.idm_values[i]));
+		}
+	}
+
+	printf("Number of pathnames:\n"
+		"\tMapped %u to %u destinations\n"
+		"\tPassed %u pathnames without modifications\n"
+		"\tPassed %u because mapping was disabled\n",
+		mapped_src_paths.pt_num, mapped_dest_paths.pt_num,
+		passed_paths.pt_num, disabled_paths.pt_num);
+
+	if (*blacklist) {
+		const char	**bl;
+
+		printf("Records from following functions were ignored:\n\t");
+		for (bl = blacklist; *bl; bl++)
+			printf("%s%s", (bl == blacklist ? "" : ","), *bl);
+		printf("\n");
+	}
+
+	/* First, check if there are potentially problematic paths: */
+	check_multiple_refs(&mapped_src_paths, "source paths",
+		"to multiple destinations", "->");
+	check_multiple_refs(&mapped_dest_paths, "destination paths",
+		"from multiple sources", "<-");
+
+	if (opt_print_mapped_paths)
+		print_all_paths(&mapped_src_paths,
+			"Mapped pathnames, by source path", "->");
+	if (opt_print_revmap_paths)
+		print_all_paths(&mapped_dest_paths,
+			"Mapped pathnames, by destination path", "<-");
+	if (opt_print_passed_paths)
+		print_all_paths(&passed_paths, "Passed pathnames", "");
+	if (opt_print_disabled_paths)
+		print_all_paths(&disabled_paths,
+			"Mapping disabled => passed pathnames", "");
+
+	if (!opt_print_mapped_paths && !opt_print_revmap_paths &&
+	    !opt_print_passed_paths && !opt_print_disabled_paths)
+		printf("\n(use options -m, -r, -p and/or -i to print more"
+			" information about\nprocessed paths, and -l to"
+			" get full details)\n");
+
+	return(0);
+}
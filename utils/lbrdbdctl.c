@@ -46,6 +46,11 @@ LIBLB_CALLER(char *, lb__ruletree_rpc__init2__,
 	(void), (),
 	NULL)
 
+/* create call_lb__ruletree_rpc__stats__() */
+LIBLB_CALLER(char *, lb__ruletree_rpc__stats__,
+	(void), (),
+	NULL)
+
 /* create call_lb__ruletree_rpc__ping__() */
 LIBLB_VOID_CALLER(lb__ruletree_rpc__ping__,
 	(void), ())
@@ -112,7 +117,8 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Usage:\n\t%s command\n", argv[0]);
 		fprintf(stderr, "commands\n"
 				"   ping     Send a 'ping' to lbrdbd\n"
-				"   init2    Send a 'init2' to lbrdbd, wait and print the reply\n");
+				"   init2    Send a 'init2' to lbrdbd, wait and print the reply\n"
+				"   stats    Print statistics of lbrdbd\n");
 		exit(1);
 	}
 
@@ -135,6 +141,19 @@ int main(int argc, char *argv[])
 		} else {
 			exit(1);
 		}
+	} else if (!strcmp(cmd, "stats")) {
+		char *msg;
+		if (liblb_handle) {
+			msg = call_lb__ruletree_rpc__stats__();
+		} else {
+			msg = ruletree_rpc__stats();
+		}
+		if (msg) {
+			printf("%s\n", msg);
+			free(msg);
+		} else {
+			exit(1);
+		}
 	} else {
 		fprintf(stderr, "Unknown command %s\n", cmd);
 		exit(1);
@@ -171,6 +190,11 @@ int bind_nomap_nolog(int sockfd, const struct sockaddr *my_addr, socklen_t addrl
 	return(bind(sockfd, my_addr, addrlen));
 }
 
+int connect_nomap_nolog(int sockfd, const struct sockaddr *serv_addr, socklen_t addrlen)
+{
+	return(connect(sockfd, serv_addr, addrlen));
+}
+
 int chmod_nomap_nolog(const char *path, mode_t mode)
 {
 	return(chmod(path, mode));